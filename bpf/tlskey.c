@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ */
+#include <linux/bpf.h>
+#include <stdint.h>
+#include <bpf-helpers.h>
+
+#ifndef noinline
+# define noinline	__attribute__((noinline))
+#endif
+
+extern uint64_t NCPUS;
+
+/*
+ * Return the TLS key for the current task execution context.
+ *
+ * The lower 60 bits hold an adjusted thread id.  All per-cpu idle threads
+ * share thread id 0, so for them the CPU id is used instead.  For all other
+ * tasks, the number of possible CPUs is added to the thread id, so that their
+ * key can never conflict with the key of an idle thread.
+ *
+ * The upper 4 bits are reserved for the hardirq nesting level.  There is no
+ * way (yet) to determine that level from BPF code, so they are always 0.
+ */
+noinline uint64_t dt_tlskey(void)
+{
+	uint64_t	key;
+
+	key = bpf_get_current_pid_tgid() & 0x00000000ffffffffUL;
+	if (key == 0)
+		key = bpf_get_smp_processor_id();
+	else
+		key += (uint64_t)&NCPUS;
+
+	return key & 0x0fffffffffffffffUL;
+}
@@ -49,7 +49,7 @@ typedef struct dtrace_cmd {
 #define	E_USAGE		2
 
 static const char DTRACE_OPTSTR[] =
-	"+3:6:aAb:Bc:CD:ef:FGhHi:I:lL:m:n:o:p:P:qs:SU:vVwx:X:Z";
+	"+3:6:aAb:Bc:CD:ef:FGhHi:I:lL:m:n:o:p:P:qR:s:SU:vVwW:x:X:Z";
 
 static char **g_argv;
 static int g_argc;
@@ -75,8 +75,13 @@ static int g_exec = 1;
 static int g_mode = DMODE_EXEC;
 static int g_status = E_SUCCESS;
 static const char *g_ofile = NULL;
+static const char *g_rfile = NULL;
+static const char *g_wfile = NULL;
 static FILE *g_ofp = NULL;
+static FILE *g_wfp = NULL;
 static dtrace_hdl_t *g_dtp;
+static hrtime_t g_statsrate;
+static hrtime_t g_laststats;
 
 static int
 usage(FILE *fp)
@@ -85,8 +90,8 @@ usage(FILE *fp)
 
 	(void) fprintf(fp, "Usage: %s [-32|-64] [-CeFGhHlqSvVwZ] "
 	    "[-b bufsz] [-c cmd] [-D name[=def]]\n\t[-I path] [-L path] "
-	    "[-o output] [-p pid] [-s script] [-U name]\n\t"
-	    "[-x opt[=val]] [-X a|c|s|t]\n\n"
+	    "[-o output] [-p pid] [-R file] [-s script] [-U name]\n\t"
+	    "[-W file] [-x opt[=val]] [-X a|c|s|t]\n\n"
 	    "\t[-P provider %s]\n"
 	    "\t[-m [ provider: ] module %s]\n"
 	    "\t[-f [[ provider: ] module: ] func %s]\n"
@@ -120,12 +125,14 @@ usage(FILE *fp)
 	    "\t-p  grab specified process-ID and cache its symbol tables\n"
 	    "\t-P  enable or list probes matching the specified provider name\n"
 	    "\t-q  set quiet mode (only output explicitly traced data)\n"
+	    "\t-R  process the trace data in the specified trace file\n"
 	    "\t-s  enable or list probes according to the specified D script\n"
 	    "\t-S  print D compiler intermediate code\n"
 	    "\t-U  undefine symbol when invoking preprocessor\n"
 	    "\t-v  set verbose mode (report stability attributes, arguments)\n"
 	    "\t-V  report DTrace API version\n"
 	    "\t-w  permit destructive actions\n"
+	    "\t-W  write trace data to the specified trace file\n"
 	    "\t-x  enable or modify compiler and tracing options\n"
 	    "\t-X  specify ISO C conformance settings for preprocessor\n"
 	    "\t-Z  permit probe descriptions that match zero probes\n");
@@ -799,6 +806,166 @@ chew(const dtrace_probedata_t *data, void *arg)
 	return (DTRACE_CONSUME_THIS);
 }
 
+/*
+ * Process the trace data in a trace file (-R) as if it were being consumed.
+ */
+static void
+replay(void)
+{
+	if (g_ofile != NULL && (g_ofp = fopen(g_ofile, "a")) == NULL)
+		fatal("failed to open output file '%s'", g_ofile);
+
+	if (dtrace_tracefile_consume(g_dtp, g_ofp, chew, chewrec,
+	    NULL) == DTRACE_WORKSTATUS_ERROR)
+		dfatal("processing aborted");
+
+	oprintf("\n");
+
+	if (g_ofp != NULL && fflush(g_ofp) == EOF)
+		clearerr(g_ofp);
+}
+
+typedef struct probestat {
+	char *name;
+	dtrace_probestats_t ps;
+} probestat_t;
+
+typedef struct probestats {
+	probestat_t *stats;
+	int nstats;
+	hrtime_t total;
+} probestats_t;
+
+static int
+probestat(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp,
+    const dtrace_probestats_t *psp, void *arg)
+{
+	probestats_t *pss = arg;
+	probestat_t *stats;
+	size_t len;
+
+	stats = realloc(pss->stats, (pss->nstats + 1) * sizeof(probestat_t));
+	if (stats == NULL)
+		return -1;
+	pss->stats = stats;
+
+	len = strlen(pdp->prv) + strlen(pdp->mod) + strlen(pdp->fun) +
+	    strlen(pdp->prb) + 4;
+	if ((stats[pss->nstats].name = malloc(len)) == NULL)
+		return -1;
+
+	(void) snprintf(stats[pss->nstats].name, len, "%s:%s:%s:%s",
+	    pdp->prv, pdp->mod, pdp->fun, pdp->prb);
+	stats[pss->nstats].ps = *psp;
+	pss->nstats++;
+	pss->total += psp->dtps_runtime;
+
+	return 0;
+}
+
+static int
+probestat_cmp(const void *lp, const void *rp)
+{
+	const probestat_t *lhs = lp;
+	const probestat_t *rhs = rp;
+
+	if (lhs->ps.dtps_runtime != rhs->ps.dtps_runtime)
+		return lhs->ps.dtps_runtime > rhs->ps.dtps_runtime ? -1 : 1;
+
+	return strcmp(lhs->name, rhs->name);
+}
+
+/*
+ * Report the time spent in the BPF program of each enabled probe, starting
+ * with the most expensive one.  Times are reported in nanoseconds, except for
+ * the time spent loading and attaching the program (in microseconds).
+ */
+static void
+probestats(void)
+{
+	probestats_t pss;
+	int i;
+
+	memset(&pss, 0, sizeof(pss));
+	if (dtrace_probestats_iter(g_dtp, probestat, &pss) == 0) {
+		qsort(pss.stats, pss.nstats, sizeof(probestat_t),
+		    probestat_cmp);
+
+		for (i = 0; i < pss.nstats; i++) {
+			probestat_t *st = &pss.stats[i];
+			uint64_t cnt = st->ps.dtps_runcnt;
+
+			error("stats: probe %s: %llu clauses, %llu firings, "
+			    "%lld ns/firing, %lld ns total (%lld%%), "
+			    "loading %lld us, attaching %lld us\n",
+			    st->name, (unsigned long long)st->ps.dtps_nclauses,
+			    (unsigned long long)cnt,
+			    cnt ? (long long)(st->ps.dtps_runtime / cnt) : 0LL,
+			    (long long)st->ps.dtps_runtime,
+			    pss.total ? (long long)st->ps.dtps_runtime * 100 /
+			    pss.total : 0LL,
+			    (long long)st->ps.dtps_load_time /
+			    (NANOSEC / MICROSEC),
+			    (long long)st->ps.dtps_attach_time /
+			    (NANOSEC / MICROSEC));
+		}
+	}
+
+	for (i = 0; i < pss.nstats; i++)
+		free(pss.stats[i].name);
+	free(pss.stats);
+}
+
+/*
+ * Report the consumer statistics (-x stats).  Times are reported in
+ * microseconds.
+ */
+static void
+stats(int final)
+{
+	dtrace_stats_t st;
+	dtrace_cpustats_t cst;
+	processorid_t cpu;
+
+	if (dtrace_stats(g_dtp, &st) == -1)
+		return;
+
+	error("stats: %llu records, %llu bytes, %llu drops, "
+	    "%llu wrap copies\n", (unsigned long long)st.dtsts_nrecs,
+	    (unsigned long long)st.dtsts_bytes,
+	    (unsigned long long)st.dtsts_drops,
+	    (unsigned long long)st.dtsts_wraps);
+	error("stats: %llu rounds (%llu wakeups), consuming %lld us, "
+	    "formatting %lld us\n", (unsigned long long)st.dtsts_rounds,
+	    (unsigned long long)st.dtsts_wakeups,
+	    (long long)st.dtsts_consume_time / (NANOSEC / MICROSEC),
+	    (long long)st.dtsts_format_time / (NANOSEC / MICROSEC));
+	error("stats: %llu aggregation snapshots, %lld us\n",
+	    (unsigned long long)st.dtsts_aggsnaps,
+	    (long long)st.dtsts_aggsnap_time / (NANOSEC / MICROSEC));
+
+	if (!final)
+		return;
+
+	error("stats: %llu programs, loading %lld us, attaching %lld us\n",
+	    (unsigned long long)st.dtsts_nprogs,
+	    (long long)st.dtsts_load_time / (NANOSEC / MICROSEC),
+	    (long long)st.dtsts_attach_time / (NANOSEC / MICROSEC));
+
+	for (cpu = 0; dtrace_cpustats(g_dtp, cpu, &cst) == 0; cpu++) {
+		if (cst.dtcs_nrecs == 0)
+			continue;
+
+		error("stats: cpu %d: %llu records, %llu bytes, "
+		    "%llu wrap copies\n", cpu,
+		    (unsigned long long)cst.dtcs_nrecs,
+		    (unsigned long long)cst.dtcs_bytes,
+		    (unsigned long long)cst.dtcs_wraps);
+	}
+
+	probestats();
+}
+
 static void
 go(void)
 {
@@ -1100,6 +1267,7 @@ main(int argc, char *argv[])
 	 */
 	dtrace_setopt(g_dtp, "bufsize", "4m");
 	dtrace_setopt(g_dtp, "aggsize", "4m");
+	dtrace_setopt(g_dtp, "dynvarsize", "1m");
 	dtrace_setopt(g_dtp, "switchrate", "1s");
 
 	/*
@@ -1238,11 +1406,19 @@ main(int argc, char *argv[])
 					dfatal("failed to set -U %s", optarg);
 				break;
 
+			case 'R':
+				g_rfile = optarg;
+				break;
+
 			case 'w':
 				if (dtrace_setopt(g_dtp, "destructive", 0) != 0)
 					dfatal("failed to set -w");
 				break;
 
+			case 'W':
+				g_wfile = optarg;
+				break;
+
 			case 'x':
 				if ((p = strchr(optarg, '=')) != NULL)
 					*p++ = '\0';
@@ -1279,6 +1455,14 @@ main(int argc, char *argv[])
 		return (E_USAGE);
 	}
 
+	if (g_rfile != NULL && (g_mode != DMODE_EXEC || g_cmdc != 0 ||
+	    g_wfile != NULL)) {
+		(void) fprintf(stderr, "%s: -R not valid in combination"
+		    " with [-GhlW] options or probe specifications\n",
+		    g_pname);
+		return (E_USAGE);
+	}
+
 	/*
 	 * Turn on testing mode if requested.  This only affects dtrace.c, so is
 	 * not controlled by a dtrace option.  This quiesces a variety of
@@ -1359,12 +1543,24 @@ main(int argc, char *argv[])
 			dfatal("failed to establish buffered handler");
 	}
 
+	/*
+	 * A trace file provides the options it was recorded with, so it needs
+	 * to be opened before we look at the options.
+	 */
+	if (g_rfile != NULL && dtrace_tracefile_open(g_dtp, g_rfile) == -1)
+		dfatal("failed to open trace file %s", g_rfile);
+
 	(void) dtrace_getopt(g_dtp, "flowindent", &opt);
 	g_flowindent = opt != DTRACEOPT_UNSET;
 
 	(void) dtrace_getopt(g_dtp, "quiet", &opt);
 	g_quiet = opt != DTRACEOPT_UNSET;
 
+	if (g_rfile != NULL) {
+		replay();
+		goto out;
+	}
+
 	/*
 	 * Now make a fifth and final pass over the options that have been
 	 * turned into programs and saved in g_cmdv[], performing any mode-
@@ -1494,6 +1690,19 @@ main(int argc, char *argv[])
 	 */
 	if (g_intr)
 		goto out;
+	if (g_wfile != NULL && dtrace_tracefile_create(g_dtp, g_wfile) == -1)
+		dfatal("failed to create trace file %s", g_wfile);
+
+	/*
+	 * If requested, output is written by a separate writer thread.
+	 */
+	(void) dtrace_getopt(g_dtp, "outqueue", &opt);
+	if (opt != DTRACEOPT_UNSET && g_ofp != NULL) {
+		if ((g_wfp = dtrace_writer_open(g_dtp, g_ofp)) == NULL)
+			dfatal("failed to start output writer");
+		g_ofp = g_wfp;
+	}
+
 	go();
 
 	(void) dtrace_getopt(g_dtp, "flowindent", &opt);
@@ -1506,6 +1715,16 @@ main(int argc, char *argv[])
 	if (opt != DTRACEOPT_UNSET)
 		notice("allowing destructive actions\n");
 
+	/*
+	 * If statistics are kept, they are reported at the status rate.
+	 */
+	(void) dtrace_getopt(g_dtp, "stats", &opt);
+	if (opt != DTRACEOPT_UNSET) {
+		(void) dtrace_getopt(g_dtp, "statusrate", &opt);
+		g_statsrate = opt != DTRACEOPT_UNSET ? opt : NANOSEC;
+		g_laststats = gethrtime();
+	}
+
 	/*
 	 * Now that tracing is active and we are ready to consume trace data,
 	 * continue any grabbed or created processes, setting them running
@@ -1552,23 +1771,36 @@ main(int argc, char *argv[])
 
 		if (g_ofp != NULL && fflush(g_ofp) == EOF)
 			clearerr(g_ofp);
+
+		if (g_statsrate != 0 && done != DONE_SAW_END &&
+		    gethrtime() - g_laststats >= g_statsrate) {
+			g_laststats = gethrtime();
+			stats(0);
+		}
 	} while (done != DONE_SAW_END);
 
 	oprintf("\n");
 
-#if 0
 	if (!g_impatient) {
 		if (dtrace_aggregate_print(g_dtp, g_ofp, NULL) == -1 &&
 		    dtrace_errno(g_dtp) != EINTR)
 			dfatal("failed to print aggregations");
 	}
-#endif
+
+	if (g_statsrate != 0) {
+		if (g_ofp != NULL && fflush(g_ofp) == EOF)
+			clearerr(g_ofp);
+		stats(1);
+	}
 
 release_procs:
 	for (i = 0; i < g_psc; i++)
 		dtrace_proc_release(g_dtp, g_psv[i]);
 
 out:
+	if (g_wfp != NULL && fclose(g_wfp) == EOF)
+		error("failed to write output: %s\n", strerror(errno));
+
 	dtrace_close(g_dtp);
 
 	free(g_argv);
@@ -2,7 +2,7 @@
  * Licensed under the Universal Permissive License v 1.0 as shown at
  * http://oss.oracle.com/licenses/upl.
  *
- * Copyright (c) 2009, 2019, Oracle and/or its affiliates. All rights reserved.
+ * Copyright (c) 2009, 2026, Oracle and/or its affiliates. All rights reserved.
  */
 
 /*
@@ -22,6 +22,7 @@ typedef struct cpuinfo {
 	chipid_t	cpu_chip;
 	lgrp_id_t	cpu_lgrp;
 	void		*cpu_info;
+	uint64_t	buf_drops;		/* records dropped (ring buffer) */
 } cpuinfo_t;
 
 typedef struct dtrace_conf {
@@ -48,6 +48,7 @@ typedef struct dtrace_datadesc {
 	int dtdd_nrecs;				/* number of records */
 	dtrace_recdesc_t *dtdd_recs;		/* records themselves */
 	int dtdd_refcnt;			/* reference count */
+	void *dtdd_plan;			/* decode plan, if any */
 } dtrace_datadesc_t;
 
 typedef struct dtrace_aggdesc {
@@ -57,7 +57,19 @@
 #define	DTRACEOPT_QUIETRESIZE	27      /* quieten buffer-resize messages */
 #define	DTRACEOPT_NORESOLVE	28      /* prevent resolution of symbols */
 #define	DTRACEOPT_PCAPSIZE	29	/* number of bytes to be captured */
-#define	DTRACEOPT_MAX		30      /* number of options */
+#define	DTRACEOPT_LOADTHREADS	30	/* threads for loading programs */
+#define	DTRACEOPT_BUFBACKEND	31	/* output buffer implementation */
+#define	DTRACEOPT_WAKEUP	32	/* consumer wakeup policy */
+#define	DTRACEOPT_WAKEUPEVENTS	33	/* events per consumer wakeup */
+#define	DTRACEOPT_WAKEUPWMARK	34	/* consumer wakeup watermark */
+#define	DTRACEOPT_CONSUMETHREADS 35	/* threads for consuming trace data */
+#define	DTRACEOPT_UNORDERED	36	/* do not order trace data by time */
+#define	DTRACEOPT_OUTQUEUE	37	/* output batches that can be queued */
+#define	DTRACEOPT_OUTBATCH	38	/* size of an output batch */
+#define	DTRACEOPT_TAILRELEASE	39	/* consumed data released per chunk */
+#define	DTRACEOPT_OFORMAT	40	/* output format */
+#define	DTRACEOPT_STATS		41	/* keep consumer statistics */
+#define	DTRACEOPT_MAX		42      /* number of options */
 
 #define	DTRACEOPT_UNSET		(dtrace_optval_t)-2	/* unset option */
 
@@ -68,4 +80,17 @@
 #define	DTRACEOPT_BUFRESIZE_AUTO	0	/* automatic resizing */
 #define	DTRACEOPT_BUFRESIZE_MANUAL	1	/* manual resizing */
 
+#define	DTRACEOPT_BUFBACKEND_AUTO	0	/* ringbuf if available */
+#define	DTRACEOPT_BUFBACKEND_PERF	1	/* per-CPU perf event buffers */
+#define	DTRACEOPT_BUFBACKEND_RINGBUF	2	/* shared BPF ring buffer */
+
+#define	DTRACEOPT_WAKEUP_ADAPTIVE	0	/* adapt to the event rate */
+#define	DTRACEOPT_WAKEUP_EVENTS		1	/* wake up every n events */
+#define	DTRACEOPT_WAKEUP_WATERMARK	2	/* wake up at n bytes */
+#define	DTRACEOPT_WAKEUP_TIMER		3	/* poll at the switch rate */
+
+#define	DTRACEOPT_OFORMAT_TEXT		0	/* human-readable text */
+#define	DTRACEOPT_OFORMAT_JSON		1	/* JSON object per line */
+#define	DTRACEOPT_OFORMAT_CSV		2	/* comma-separated values */
+
 #endif /* _DTRACE_OPTIONS_DEFINES_H */
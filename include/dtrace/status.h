@@ -22,6 +22,9 @@
  * drops (including capacity dynamic drops, rinsing drops and dirty drops), and
  * speculative drops (including capacity speculative drops, drops due to busy
  * speculative buffers and drops due to unavailable speculative buffers).
+ * The total number of principal buffer drops (records lost because a trace
+ * buffer was full) is also provided, for consumers that do not process drops
+ * on a per-CPU basis.
  * Additionally, the status structure contains a field to indicate the number
  * of "fill"-policy buffers have been filled and a boolean field to indicate
  * that exit() has been called.  If the dtst_exiting field is non-zero, no
@@ -41,6 +44,7 @@ typedef struct dtrace_status {
 	uint64_t dtst_filled;			/* number of filled bufs */
 	uint64_t dtst_stkstroverflows;		/* stack string tab overflows */
 	uint64_t dtst_dblerrors;		/* errors in ERROR probes */
+	uint64_t dtst_drops;			/* principal buffer drops */
 	char dtst_killed;			/* non-zero if killed */
 	char dtst_exiting;			/* non-zero if exit() called */
 	char dtst_pad[6];			/* pad out to 64-bit align */
@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <dt_impl.h>
+#include <dt_bpf.h>
+#include <dt_oformat.h>
 #include <dtrace.h>
 #include <assert.h>
 #include <alloca.h>
@@ -18,6 +20,11 @@
 #include <port.h>
 
 #define	DTRACE_AHASHSIZE	32779		/* big 'ol prime */
+#define	DT_AGG_BATCHSZ		(256 * 1024)	/* batched snapshot size */
+
+#ifndef ENOTSUPP
+#define	ENOTSUPP		524		/* kernel-internal errno */
+#endif
 
 /*
  * Because qsort(3C) does not allow an argument to be passed to a comparison
@@ -466,280 +473,564 @@ dt_aggregate_aggvarid(dt_ahashent_t *ent)
 }
 
 
+/*
+ * Return the fd of the BPF map (buffer 0 or 1) that holds the data for the
+ * given aggregation, or -1 if there is no such map.
+ */
 static int
-dt_aggregate_snap_cpu(dtrace_hdl_t *dtp, processorid_t cpu)
+dt_aggregate_mapfd(dtrace_hdl_t *dtp, const dtrace_aggdesc_t *agg, int buf)
 {
-	dtrace_epid_t id;
-	uint64_t hashval;
-	size_t offs, roffs, size, ndx;
-	int i, j, rval;
-	caddr_t addr, data;
-	dtrace_recdesc_t *rec;
-	dt_aggregate_t *agp = &dtp->dt_aggregate;
-	dtrace_aggdesc_t *agg;
-	dt_ahash_t *hash = &agp->dtat_hash;
-	dt_ahashent_t *h;
-	dtrace_bufdesc_t b = agp->dtat_buf, *buf = &b;
-	dtrace_aggdata_t *aggdata;
-	int flags = agp->dtat_flags;
+	char		name[BPF_OBJ_NAME_LEN];
+	dt_ident_t	*idp;
 
-	buf->dtbd_cpu = cpu;
+	snprintf(name, sizeof(name), buf ? DT_AGG_MAPNAME_ALT : DT_AGG_MAPNAME,
+		 agg->dtagd_id);
+	idp = dt_dlib_get_map(dtp, name);
+	if (idp == NULL || idp->di_id == DT_IDENT_UNDEF)
+		return -1;
 
-	if (dt_ioctl(dtp, DTRACEIOC_AGGSNAP, buf) == -1) {
-		if (errno == ENOENT) {
-			/*
-			 * If that failed with ENOENT, it may be because the
-			 * CPU was unconfigured.  This is okay; we'll just
-			 * do nothing but return success.
-			 */
+	return idp->di_id;
+}
+
+/*
+ * Remember the raw kernel key (before normalization by sym(), mod(), ...) that
+ * contributed to the given hash entry, so that the kernel copy of the data can
+ * be removed later.  Multiple kernel keys may map to the same hash entry.
+ */
+static int
+dt_aggregate_kkey_add(dtrace_hdl_t *dtp, dt_ahashent_t *h, const char *kkey,
+		      size_t ksz)
+{
+	char	*kkeys;
+	uint_t	i;
+
+	for (i = 0; i < h->dtahe_nkkeys; i++) {
+		if (memcmp(h->dtahe_kkeys + i * ksz, kkey, ksz) == 0)
 			return (0);
-		}
+	}
 
-		return (dt_set_errno(dtp, errno));
+	kkeys = realloc(h->dtahe_kkeys, (h->dtahe_nkkeys + 1) * ksz);
+	if (kkeys == NULL)
+		return (dt_set_errno(dtp, EDT_NOMEM));
+
+	memcpy(kkeys + h->dtahe_nkkeys * ksz, kkey, ksz);
+	h->dtahe_kkeys = kkeys;
+	h->dtahe_nkkeys++;
+
+	return (0);
+}
+
+/*
+ * Remove the kernel copy of the aggregation data for the given hash entry, so
+ * that it does not resurface in the next snapshot.  The entry holds the key
+ * as normalized by the consumer, so we delete every raw kernel key that was
+ * merged into it instead.
+ *
+ * Double-buffered aggregation maps only hold the data that was recorded since
+ * the last snapshot, so there is nothing to remove.
+ */
+static void
+dt_aggregate_kdelete(dtrace_hdl_t *dtp, dt_ahashent_t *h)
+{
+	dtrace_aggdesc_t	*agg = h->dtahe_data.dtada_desc;
+	dtrace_recdesc_t	*rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
+	size_t			ksz = rec->dtrd_offset -
+				      sizeof(dtrace_aggvarid_t);
+	uint64_t		zero = 0;
+	uint_t			i;
+	int			fd;
+
+	if (dtp->dt_aggregate.dtat_flags & DTRACE_A_DBUF)
+		return;
+
+	if ((fd = dt_aggregate_mapfd(dtp, agg, 0)) == -1)
+		return;
+
+	if (ksz == 0)
+		dt_bpf_map_delete(fd, &zero);
+	else {
+		for (i = 0; i < h->dtahe_nkkeys; i++)
+			dt_bpf_map_delete(fd, h->dtahe_kkeys + i * ksz);
 	}
 
-	if (buf->dtbd_drops != 0) {
-		if (dt_handle_cpudrop(dtp, cpu,
-		    DTRACEDROP_AGGREGATION, buf->dtbd_drops) == -1)
-			return (-1);
+	free(h->dtahe_kkeys);
+	h->dtahe_kkeys = NULL;
+	h->dtahe_nkkeys = 0;
+}
+
+/*
+ * Merge the data for a single aggregation key into the aggregation hash.  The
+ * record (addr) holds the aggregation variable ID and the key, followed by
+ * room for the aggregation data.  The values buffer holds the map value (the
+ * update counter and the aggregation data) for each possible CPU, each vsz
+ * bytes in size.
+ *
+ * The map values are cumulative, so the first time an entry is encountered
+ * during a snapshot its data is replaced rather than aggregated into (except
+ * for double-buffered aggregations, where the map values are deltas).  Entries
+ * can be encountered more than once during a snapshot if key normalization
+ * (e.g. sym()) maps multiple kernel keys to the same key.
+ */
+static int
+dt_aggregate_snap_one(dtrace_hdl_t *dtp, dtrace_aggdesc_t *agg, caddr_t addr,
+		      caddr_t vals, size_t vsz)
+{
+	uint64_t		hashval;
+	size_t			roffs, size, ndx;
+	int			i, j, fresh, pfresh;
+	caddr_t			data;
+	dtrace_recdesc_t	*rec;
+	dt_aggregate_t		*agp = &dtp->dt_aggregate;
+	dt_ahash_t		*hash = &agp->dtat_hash;
+	dt_ahashent_t		*h;
+	dtrace_aggdata_t	*aggdata;
+	int			flags = agp->dtat_flags;
+	int			max_cpus = agp->dtat_maxcpu;
+	size_t			ksz;
+	char			*kkey = NULL;
+
+	size = agg->dtagd_size;
+	hashval = 0;
+
+	/*
+	 * Save the raw kernel key before it gets normalized, so that the
+	 * kernel copy of the data can be deleted by trunc() and clear().
+	 */
+	rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
+	ksz = rec->dtrd_offset - sizeof(dtrace_aggvarid_t);
+	if (ksz > 0 && !(flags & DTRACE_A_DBUF)) {
+		kkey = alloca(ksz);
+		memcpy(kkey, addr + sizeof(dtrace_aggvarid_t), ksz);
 	}
 
-	if (buf->dtbd_size == 0)
-		return (0);
+	for (j = 0; j < agg->dtagd_nrecs - 1; j++) {
+		rec = &agg->dtagd_rec[j];
+		roffs = rec->dtrd_offset;
 
-	if (hash->dtah_hash == NULL) {
-		size_t size;
+		switch (rec->dtrd_action) {
+		case DTRACEACT_USYM:
+			dt_aggregate_usym(dtp,
+			    /* LINTED - alignment */
+			    (uint64_t *)&addr[roffs]);
+			break;
 
-		hash->dtah_size = DTRACE_AHASHSIZE;
-		size = hash->dtah_size * sizeof (dt_ahashent_t *);
+		case DTRACEACT_UMOD:
+			dt_aggregate_umod(dtp,
+			    /* LINTED - alignment */
+			    (uint64_t *)&addr[roffs]);
+			break;
 
-		if ((hash->dtah_hash = malloc(size)) == NULL)
-			return (dt_set_errno(dtp, EDT_NOMEM));
+		case DTRACEACT_SYM:
+			/* LINTED - alignment */
+			dt_aggregate_sym(dtp, (uint64_t *)&addr[roffs]);
+			break;
 
-		memset(hash->dtah_hash, 0, size);
+		case DTRACEACT_MOD:
+			/* LINTED - alignment */
+			dt_aggregate_mod(dtp, (uint64_t *)&addr[roffs]);
+			break;
+
+		default:
+			break;
+		}
+
+		for (i = 0; i < rec->dtrd_size; i++)
+			hashval += addr[roffs + i];
 	}
 
-	for (offs = 0; offs < buf->dtbd_size; ) {
-		/*
-		 * We're guaranteed to have an ID.
-		 */
-		id = *((dtrace_epid_t *)((uintptr_t)buf->dtbd_data +
-		    (uintptr_t)offs));
+	rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
+	roffs = rec->dtrd_offset;
+	ndx = hashval % hash->dtah_size;
 
-		if (id == DTRACE_AGGIDNONE) {
-			/*
-			 * This is filler to assure proper alignment of the
-			 * next record; we simply ignore it.
-			 */
-			offs += sizeof (id);
+	for (h = hash->dtah_hash[ndx]; h != NULL; h = h->dtahe_next) {
+		if (h->dtahe_hashval != hashval)
 			continue;
-		}
 
-		if ((rval = dt_aggid_lookup(dtp, id, &agg)) != 0)
-			return (rval);
+		if (h->dtahe_size != size)
+			continue;
 
-		addr = buf->dtbd_data + offs;
-		size = agg->dtagd_size;
-		hashval = 0;
+		aggdata = &h->dtahe_data;
+		data = aggdata->dtada_data;
 
 		for (j = 0; j < agg->dtagd_nrecs - 1; j++) {
-			rec = &agg->dtagd_rec[j];
-			roffs = rec->dtrd_offset;
+			dtrace_recdesc_t	*krec = &agg->dtagd_rec[j];
+			size_t			koffs = krec->dtrd_offset;
 
-			switch (rec->dtrd_action) {
-			case DTRACEACT_USYM:
-				dt_aggregate_usym(dtp,
-				    /* LINTED - alignment */
-				    (uint64_t *)&addr[roffs]);
-				break;
+			for (i = 0; i < krec->dtrd_size; i++)
+				if (addr[koffs + i] != data[koffs + i])
+					goto hashnext;
+		}
 
-			case DTRACEACT_UMOD:
-				dt_aggregate_umod(dtp,
-				    /* LINTED - alignment */
-				    (uint64_t *)&addr[roffs]);
-				break;
+		goto found;
+hashnext:
+		continue;
+	}
 
-			case DTRACEACT_SYM:
-				/* LINTED - alignment */
-				dt_aggregate_sym(dtp, (uint64_t *)&addr[roffs]);
-				break;
+	/*
+	 * If we're here, we couldn't find an entry for this record.
+	 */
+	if ((h = malloc(sizeof (dt_ahashent_t))) == NULL)
+		return (dt_set_errno(dtp, EDT_NOMEM));
+	memset(h, 0, sizeof (dt_ahashent_t));
+	aggdata = &h->dtahe_data;
 
-			case DTRACEACT_MOD:
-				/* LINTED - alignment */
-				dt_aggregate_mod(dtp, (uint64_t *)&addr[roffs]);
-				break;
+	if ((aggdata->dtada_data = malloc(size)) == NULL) {
+		free(h);
+		return (dt_set_errno(dtp, EDT_NOMEM));
+	}
 
-			default:
-				break;
-			}
+	memcpy(aggdata->dtada_data, addr, size);
+	aggdata->dtada_size = size;
+	aggdata->dtada_desc = agg;
+	aggdata->dtada_handle = dtp;
+	aggdata->dtada_ddesc = NULL;
+	aggdata->dtada_pdesc = NULL;
+	aggdata->dtada_normal = 1;
+
+	h->dtahe_hashval = hashval;
+	h->dtahe_size = size;
+	(void) dt_aggregate_aggvarid(h);
 
-			for (i = 0; i < rec->dtrd_size; i++)
-				hashval += addr[roffs + i];
+	if (flags & DTRACE_A_PERCPU) {
+		caddr_t *percpu = calloc(max_cpus, sizeof (caddr_t));
+
+		if (percpu == NULL) {
+			free(aggdata->dtada_data);
+			free(h);
+			return (dt_set_errno(dtp, EDT_NOMEM));
 		}
 
-		ndx = hashval % hash->dtah_size;
+		for (j = 0; j < max_cpus; j++) {
+			percpu[j] = calloc(1, rec->dtrd_size);
 
-		for (h = hash->dtah_hash[ndx]; h != NULL; h = h->dtahe_next) {
-			if (h->dtahe_hashval != hashval)
-				continue;
+			if (percpu[j] == NULL) {
+				while (--j >= 0)
+					free(percpu[j]);
 
-			if (h->dtahe_size != size)
-				continue;
+				free(percpu);
+				free(aggdata->dtada_data);
+				free(h);
+				return (dt_set_errno(dtp, EDT_NOMEM));
+			}
+		}
 
-			aggdata = &h->dtahe_data;
-			data = aggdata->dtada_data;
+		aggdata->dtada_percpu = percpu;
+	}
 
-			for (j = 0; j < agg->dtagd_nrecs - 1; j++) {
-				rec = &agg->dtagd_rec[j];
-				roffs = rec->dtrd_offset;
+	switch (rec->dtrd_action) {
+	case DTRACEAGG_MIN:
+		h->dtahe_aggregate = dt_aggregate_min;
+		break;
 
-				for (i = 0; i < rec->dtrd_size; i++)
-					if (addr[roffs + i] != data[roffs + i])
-						goto hashnext;
-			}
+	case DTRACEAGG_MAX:
+		h->dtahe_aggregate = dt_aggregate_max;
+		break;
 
-			/*
-			 * We found it.  Now we need to apply the aggregating
-			 * action on the data here.
-			 */
-			rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
-			roffs = rec->dtrd_offset;
-			/* LINTED - alignment */
-			h->dtahe_aggregate((int64_t *)&data[roffs],
-			    /* LINTED - alignment */
-			    (int64_t *)&addr[roffs], rec->dtrd_size);
+	case DTRACEAGG_LQUANTIZE:
+		h->dtahe_aggregate = dt_aggregate_lquantize;
+		break;
 
-			/*
-			 * If we're keeping per CPU data, apply the aggregating
-			 * action there as well.
-			 */
-			if (aggdata->dtada_percpu != NULL) {
-				data = aggdata->dtada_percpu[cpu];
+	case DTRACEAGG_LLQUANTIZE:
+		h->dtahe_aggregate = dt_aggregate_llquantize;
+		break;
 
-				/* LINTED - alignment */
-				h->dtahe_aggregate((int64_t *)data,
-				    /* LINTED - alignment */
-				    (int64_t *)&addr[roffs], rec->dtrd_size);
-			}
+	case DTRACEAGG_COUNT:
+	case DTRACEAGG_SUM:
+	case DTRACEAGG_AVG:
+	case DTRACEAGG_STDDEV:
+	case DTRACEAGG_QUANTIZE:
+		h->dtahe_aggregate = dt_aggregate_count;
+		break;
 
-			goto bufnext;
-hashnext:
-			continue;
+	default:
+		if (aggdata->dtada_percpu != NULL) {
+			for (j = 0; j < max_cpus; j++)
+				free(aggdata->dtada_percpu[j]);
+			free(aggdata->dtada_percpu);
 		}
+		free(aggdata->dtada_data);
+		free(h);
+		return (dt_set_errno(dtp, EDT_BADAGG));
+	}
+
+	if (hash->dtah_hash[ndx] != NULL)
+		hash->dtah_hash[ndx]->dtahe_prev = h;
+
+	h->dtahe_next = hash->dtah_hash[ndx];
+	hash->dtah_hash[ndx] = h;
+
+	if (hash->dtah_all != NULL)
+		hash->dtah_all->dtahe_prevall = h;
+
+	h->dtahe_nextall = hash->dtah_all;
+	hash->dtah_all = h;
+
+found:
+	if (kkey != NULL && dt_aggregate_kkey_add(dtp, h, kkey, ksz) != 0)
+		return (-1);
+
+	/*
+	 * Apply the data for each CPU that updated this element.  CPUs that
+	 * never updated it have a zero update counter.
+	 *
+	 * Double-buffered aggregation maps are drained by every snapshot, so
+	 * their data is a delta that is aggregated into the existing data
+	 * (unless the element is new).
+	 */
+	aggdata = &h->dtahe_data;
+	data = &aggdata->dtada_data[roffs];
+	pfresh = h->dtahe_gen == 0 || !(flags & DTRACE_A_DBUF);
+	fresh = pfresh && h->dtahe_gen != agp->dtat_gen;
+	h->dtahe_gen = agp->dtat_gen;
+
+	if (fresh)
+		memset(data, 0, rec->dtrd_size);
+
+	for (i = 0; i < max_cpus; i++) {
+		caddr_t	val = vals + i * vsz;
+
+		/* LINTED - alignment */
+		if (*(uint64_t *)val == 0)
+			continue;
+
+		val += DT_AGG_HDRSZ;
 
 		/*
-		 * If we're here, we couldn't find an entry for this record.
+		 * The lquantize() argument is not stored in the kernel, but
+		 * it is needed to interpret the data.
 		 */
-		if ((h = malloc(sizeof (dt_ahashent_t))) == NULL)
-			return (dt_set_errno(dtp, EDT_NOMEM));
-		memset(h, 0, sizeof (dt_ahashent_t));
-		aggdata = &h->dtahe_data;
+		if (rec->dtrd_action == DTRACEAGG_LQUANTIZE)
+			/* LINTED - alignment */
+			*(int64_t *)val = rec->dtrd_arg;
 
-		if ((aggdata->dtada_data = malloc(size)) == NULL) {
-			free(h);
-			return (dt_set_errno(dtp, EDT_NOMEM));
+		if (fresh)
+			memcpy(data, val, rec->dtrd_size);
+		else
+			/* LINTED - alignment */
+			h->dtahe_aggregate((int64_t *)data, (int64_t *)val,
+			    rec->dtrd_size);
+
+		if (aggdata->dtada_percpu != NULL) {
+			caddr_t	pdata = aggdata->dtada_percpu[i];
+
+			if (pfresh)
+				memcpy(pdata, val, rec->dtrd_size);
+			else
+				/* LINTED - alignment */
+				h->dtahe_aggregate((int64_t *)pdata,
+				    (int64_t *)val, rec->dtrd_size);
 		}
 
-		memcpy(aggdata->dtada_data, addr, size);
-		aggdata->dtada_size = size;
-		aggdata->dtada_desc = agg;
-		aggdata->dtada_handle = dtp;
-		dt_epid_lookup(dtp, agg->dtagd_epid, &aggdata->dtada_ddesc,
-			       &aggdata->dtada_pdesc);
-		aggdata->dtada_normal = 1;
+		fresh = 0;
+	}
 
-		h->dtahe_hashval = hashval;
-		h->dtahe_size = size;
-		(void) dt_aggregate_aggvarid(h);
+	if (rec->dtrd_action == DTRACEAGG_LQUANTIZE)
+		/* LINTED - alignment */
+		*(int64_t *)data = rec->dtrd_arg;
 
-		rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
+	return (0);
+}
 
-		if (flags & DTRACE_A_PERCPU) {
-			int max_cpus = agp->dtat_maxcpu;
-			caddr_t *percpu = malloc(max_cpus * sizeof (caddr_t));
+/*
+ * Retrieve the data for the given aggregation from one of its BPF maps, one
+ * element at a time.  This is used when the kernel does not support batched
+ * map operations.  If del is set, elements are deleted as they are retrieved.
+ */
+static int
+dt_aggregate_snap_keys(dtrace_hdl_t *dtp, dtrace_aggdesc_t *agg, int fd,
+		       int del)
+{
+	dt_aggregate_t		*agp = &dtp->dt_aggregate;
+	dtrace_recdesc_t	*rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
+	size_t			ksz, mksz, vsz, dsz;
+	caddr_t			key, nxt, vals, addr;
+	int			rval;
 
-			if (percpu == NULL) {
-				free(aggdata->dtada_data);
-				free(h);
-				return (dt_set_errno(dtp, EDT_NOMEM));
-			}
+	/*
+	 * The kernel key consists of the key records (which follow the
+	 * aggregation variable ID), or a single 64-bit 0 if there are none.
+	 * Per-CPU values are returned with their size rounded up to a multiple
+	 * of 8 bytes.
+	 */
+	ksz = rec->dtrd_offset - sizeof(dtrace_aggvarid_t);
+	mksz = ksz ? ksz : sizeof(uint64_t);
+	vsz = P2ROUNDUP(DT_AGG_HDRSZ + rec->dtrd_size, sizeof(uint64_t));
+	dsz = 2 * mksz + agp->dtat_maxcpu * vsz + agg->dtagd_size;
 
-			for (j = 0; j < max_cpus; j++) {
-				percpu[j] = malloc(rec->dtrd_size);
+	if ((key = dt_zalloc(dtp, dsz)) == NULL)
+		return (dt_set_errno(dtp, EDT_NOMEM));
 
-				if (percpu[j] == NULL) {
-					while (--j >= 0)
-						free(percpu[j]);
+	nxt = key + mksz;
+	vals = nxt + mksz;
+	addr = vals + agp->dtat_maxcpu * vsz;
 
-					free(aggdata->dtada_data);
-					free(h);
-					return (dt_set_errno(dtp, EDT_NOMEM));
-				}
+	/*
+	 * When elements are being deleted, we always continue with the first
+	 * remaining element.
+	 */
+	for (rval = dt_bpf_map_next_key(fd, NULL, nxt); rval == 0;
+	     rval = dt_bpf_map_next_key(fd, del ? NULL : key, nxt)) {
+		memcpy(key, nxt, mksz);
 
-				if (j == cpu) {
-					memcpy(percpu[j],
-					    &addr[rec->dtrd_offset],
-					    rec->dtrd_size);
-				} else {
-					memset(percpu[j], 0, rec->dtrd_size);
-				}
-			}
+		/*
+		 * The element may have been deleted since we retrieved its
+		 * key.  That is fine.
+		 */
+		if (dt_bpf_map_lookup(fd, key, vals) == -1)
+			continue;
 
-			aggdata->dtada_percpu = percpu;
+		if (del && dt_bpf_map_delete(fd, key) == -1) {
+			dt_free(dtp, key);
+			return (dt_set_errno(dtp, errno));
 		}
 
-		switch (rec->dtrd_action) {
-		case DTRACEAGG_MIN:
-			h->dtahe_aggregate = dt_aggregate_min;
-			break;
+		/* LINTED - alignment */
+		*(dtrace_aggvarid_t *)addr = agg->dtagd_varid;
+		memcpy(addr + sizeof(dtrace_aggvarid_t), key, ksz);
+		memset(addr + rec->dtrd_offset, 0, rec->dtrd_size);
 
-		case DTRACEAGG_MAX:
-			h->dtahe_aggregate = dt_aggregate_max;
-			break;
+		if (dt_aggregate_snap_one(dtp, agg, addr, vals, vsz) != 0) {
+			dt_free(dtp, key);
+			return (-1);
+		}
+	}
 
-		case DTRACEAGG_LQUANTIZE:
-			h->dtahe_aggregate = dt_aggregate_lquantize;
-			break;
+	dt_free(dtp, key);
 
-		case DTRACEAGG_LLQUANTIZE:
-			h->dtahe_aggregate = dt_aggregate_llquantize;
-			break;
+	if (errno != ENOENT)
+		return (dt_set_errno(dtp, errno));
 
-		case DTRACEAGG_COUNT:
-		case DTRACEAGG_SUM:
-		case DTRACEAGG_AVG:
-		case DTRACEAGG_STDDEV:
-		case DTRACEAGG_QUANTIZE:
-			h->dtahe_aggregate = dt_aggregate_count;
-			break;
+	return (0);
+}
 
-		default:
-			return (dt_set_errno(dtp, EDT_BADAGG));
-		}
+/*
+ * Retrieve the data for the given aggregation from one of its BPF maps (buffer
+ * 0 or 1), and merge it into the aggregation hash.  Elements are retrieved in
+ * batches of (at most) DT_AGG_BATCHSZ bytes, so the cost of a snapshot is
+ * determined by the number of batches rather than the number of keys.  If del
+ * is set, elements are deleted from the map as they are retrieved.
+ */
+static int
+dt_aggregate_snap_agg(dtrace_hdl_t *dtp, dtrace_aggdesc_t *agg, int buf,
+		      int del)
+{
+	dt_aggregate_t		*agp = &dtp->dt_aggregate;
+	dtrace_recdesc_t	*rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
+	size_t			ksz, mksz, vsz, esz;
+	uint32_t		i, cnt, nbatch;
+	caddr_t			addr, keys = NULL, vals = NULL;
+	uint64_t		in, out;
+	int			fd, rval, first = 1;
+
+	if ((fd = dt_aggregate_mapfd(dtp, agg, buf)) == -1)
+		return (0);
+
+	if (agp->dtat_nobatch)
+		return (dt_aggregate_snap_keys(dtp, agg, fd, del));
 
-		if (hash->dtah_hash[ndx] != NULL)
-			hash->dtah_hash[ndx]->dtahe_prev = h;
+	/*
+	 * See dt_aggregate_snap_keys() for the key and value layout.  The
+	 * batch tokens are opaque to us, but they are no larger than 64 bits.
+	 */
+	ksz = rec->dtrd_offset - sizeof(dtrace_aggvarid_t);
+	mksz = ksz ? ksz : sizeof(uint64_t);
+	vsz = P2ROUNDUP(DT_AGG_HDRSZ + rec->dtrd_size, sizeof(uint64_t));
+	esz = mksz + agp->dtat_maxcpu * vsz;
+	nbatch = DT_AGG_BATCHSZ / esz;
+	if (nbatch == 0)
+		nbatch = 1;
+
+	if ((addr = dt_zalloc(dtp, agg->dtagd_size)) == NULL)
+		return (dt_set_errno(dtp, EDT_NOMEM));
 
-		h->dtahe_next = hash->dtah_hash[ndx];
-		hash->dtah_hash[ndx] = h;
+grow:
+	dt_free(dtp, keys);
+	dt_free(dtp, vals);
+	keys = dt_alloc(dtp, nbatch * mksz);
+	vals = dt_alloc(dtp, nbatch * agp->dtat_maxcpu * vsz);
+	if (keys == NULL || vals == NULL) {
+		rval = dt_set_errno(dtp, EDT_NOMEM);
+		goto out;
+	}
 
-		if (hash->dtah_all != NULL)
-			hash->dtah_all->dtahe_prevall = h;
+	for (;;) {
+		cnt = nbatch;
+		if (del)
+			rval = dt_bpf_map_lookup_and_delete_batch(
+					fd, first ? NULL : &in, &out, keys,
+					vals, &cnt);
+		else
+			rval = dt_bpf_map_lookup_batch(
+					fd, first ? NULL : &in, &out, keys,
+					vals, &cnt);
+
+		if (rval == -1 && errno != ENOENT) {
+			/*
+			 * A hash bucket holds more elements than fit in the
+			 * buffers: try again with larger buffers.
+			 */
+			if (errno == ENOSPC && cnt == 0) {
+				nbatch *= 2;
+				goto grow;
+			}
 
-		h->dtahe_nextall = hash->dtah_all;
-		hash->dtah_all = h;
-bufnext:
-		offs += agg->dtagd_size;
+			/*
+			 * Fall back to retrieving elements one at a time if
+			 * the kernel does not support batched operations.
+			 */
+			if (first && (errno == EINVAL || errno == ENOTSUP ||
+				      errno == ENOTSUPP)) {
+				agp->dtat_nobatch = 1;
+				rval = dt_aggregate_snap_keys(dtp, agg, fd, del);
+				goto out;
+			}
+
+			rval = dt_set_errno(dtp, errno);
+			goto out;
+		}
+
+		for (i = 0; i < cnt; i++) {
+			/* LINTED - alignment */
+			*(dtrace_aggvarid_t *)addr = agg->dtagd_varid;
+			memcpy(addr + sizeof(dtrace_aggvarid_t),
+			       keys + i * mksz, ksz);
+			memset(addr + rec->dtrd_offset, 0, rec->dtrd_size);
+
+			if (dt_aggregate_snap_one(
+					dtp, agg, addr,
+					vals + i * agp->dtat_maxcpu * vsz,
+					vsz) != 0) {
+				rval = -1;
+				goto out;
+			}
+		}
+
+		/*
+		 * ENOENT indicates that we reached the end of the map.
+		 */
+		if (rval == -1) {
+			rval = 0;
+			break;
+		}
+
+		in = out;
+		first = 0;
 	}
 
-	return (0);
+out:
+	dt_free(dtp, keys);
+	dt_free(dtp, vals);
+	dt_free(dtp, addr);
+
+	return (rval);
 }
 
 int
 dtrace_aggregate_snap(dtrace_hdl_t *dtp)
 {
-	int i, rval;
+	int i, rval, buf = 0, del = 0;
 	dt_aggregate_t *agp = &dtp->dt_aggregate;
+	dt_ahash_t *hash = &agp->dtat_hash;
 	hrtime_t now = gethrtime();
 	dtrace_optval_t interval = dtp->dt_options[DTRACEOPT_AGGRATE];
 
@@ -755,12 +1046,71 @@ dtrace_aggregate_snap(dtrace_hdl_t *dtp)
 	if (!dtp->dt_active)
 		return (dt_set_errno(dtp, EINVAL));
 
-	if (agp->dtat_buf.dtbd_size == 0)
+	if (dtp->dt_maxagg == 0)
 		return (0);
 
-	for (i = 0; i < agp->dtat_ncpus; i++) {
-		if ((rval = dt_aggregate_snap_cpu(dtp, agp->dtat_cpus[i])) != 0)
+	if (hash->dtah_hash == NULL) {
+		size_t size;
+
+		hash->dtah_size = DTRACE_AHASHSIZE;
+		size = hash->dtah_size * sizeof (dt_ahashent_t *);
+
+		if ((hash->dtah_hash = malloc(size)) == NULL)
+			return (dt_set_errno(dtp, EDT_NOMEM));
+
+		memset(hash->dtah_hash, 0, size);
+	}
+
+	agp->dtat_gen++;
+
+	/*
+	 * For double-buffered aggregations, switch the BPF programs over to
+	 * the other set of maps, and drain the maps they were updating.  BPF
+	 * programs that read the selector before the switch may still be
+	 * updating those maps, so we wait for them to complete first.  If we
+	 * cannot wait, the maps are left alone: they will be drained once they
+	 * are no longer selected after a later switch (their data is merged
+	 * as deltas, so nothing is lost).  Once tracing has stopped, both sets
+	 * of maps are drained regardless.
+	 */
+	if (agp->dtat_flags & DTRACE_A_DBUF) {
+		dt_ident_t	*idp = dt_dlib_get_map(dtp, "aggsel");
+		uint32_t	key = 0;
+		uint64_t	sel = agp->dtat_gen & 1;
+
+		if (idp == NULL || idp->di_id == DT_IDENT_UNDEF)
+			return (0);
+
+		if (dt_bpf_map_update(idp->di_id, &key, &sel) == -1)
+			return (dt_set_errno(dtp, errno));
+
+		if (dt_bpf_prog_sync() == -1 && !dtp->dt_stopped) {
+			dt_dprintf("cannot wait for BPF programs to complete: "
+				   "%s\n", strerror(errno));
+			return (0);
+		}
+
+		buf = sel ^ 1;
+		del = 1;
+	}
+
+	for (i = 0; i < dtp->dt_maxagg; i++) {
+		dtrace_aggdesc_t *agg = dtp->dt_aggdesc[i];
+
+		if (agg == NULL)
+			continue;
+
+		if ((rval = dt_aggregate_snap_agg(dtp, agg, buf, del)) != 0)
 			return (rval);
+
+		if (del && dtp->dt_stopped &&
+		    (rval = dt_aggregate_snap_agg(dtp, agg, buf ^ 1, del)) != 0)
+			return (rval);
+	}
+
+	if (dtp->dt_cpustats != NULL) {
+		dtp->dt_stats.dtsts_aggsnaps++;
+		dtp->dt_stats.dtsts_aggsnap_time += gethrtime() - now;
 	}
 
 	return (0);
@@ -1129,58 +1479,13 @@ int
 dt_aggregate_go(dtrace_hdl_t *dtp)
 {
 	dt_aggregate_t *agp = &dtp->dt_aggregate;
-	dtrace_optval_t size, cpu;
-	dtrace_bufdesc_t *buf = &agp->dtat_buf;
-	int rval, i;
 
 	assert(agp->dtat_maxcpu == 0);
-	assert(agp->dtat_ncpu == 0);
-	assert(agp->dtat_cpus == NULL);
-
-	agp->dtat_maxcpu = dtp->dt_conf.dtc_maxbufs;
-	agp->dtat_ncpu = dtp->dt_conf.dtc_maxbufs;
-	agp->dtat_cpus = malloc(agp->dtat_ncpu * sizeof (processorid_t));
-
-	if (agp->dtat_cpus == NULL)
-		return (dt_set_errno(dtp, EDT_NOMEM));
-
-	/*
-	 * Use the aggregation buffer size as reloaded from the kernel.
-	 */
-	size = dtp->dt_options[DTRACEOPT_AGGSIZE];
-
-	rval = dtrace_getopt(dtp, "aggsize", &size);
-	assert(rval == 0);
-
-	if (size == 0 || size == DTRACEOPT_UNSET)
-		return (0);
-
-	buf = &agp->dtat_buf;
-	buf->dtbd_size = size;
-
-	if ((buf->dtbd_data = malloc(buf->dtbd_size)) == NULL)
-		return (dt_set_errno(dtp, EDT_NOMEM));
 
 	/*
-	 * Now query for the CPUs enabled.
+	 * The BPF aggregation maps hold a value for each possible CPU.
 	 */
-	rval = dtrace_getopt(dtp, "cpu", &cpu);
-	assert(rval == 0 && cpu != DTRACEOPT_UNSET);
-
-	if (cpu != DTRACE_CPUALL) {
-		assert(cpu < agp->dtat_ncpu);
-		agp->dtat_cpus[agp->dtat_ncpus++] = (processorid_t)cpu;
-
-		return (0);
-	}
-
-	agp->dtat_ncpus = 0;
-	for (i = 0; i < agp->dtat_maxcpu; i++) {
-		if (dt_cpu_status(dtp, i) == -1)
-			continue;
-
-		agp->dtat_cpus[agp->dtat_ncpus++] = i;
-	}
+	agp->dtat_maxcpu = dtp->dt_conf.num_possible_cpus;
 
 	return (0);
 }
@@ -1201,6 +1506,8 @@ dt_aggwalk_rval(dtrace_hdl_t *dtp, dt_ahashent_t *h, int rval)
 	case DTRACE_AGGWALK_CLEAR: {
 		uint32_t size, offs = 0;
 
+		dt_aggregate_kdelete(dtp, h);
+
 		aggdesc = h->dtahe_data.dtada_desc;
 		rec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
 		size = rec->dtrd_size;
@@ -1247,8 +1554,11 @@ dt_aggwalk_rval(dtrace_hdl_t *dtp, dt_ahashent_t *h, int rval)
 		int i, max_cpus = agp->dtat_maxcpu;
 
 		/*
-		 * First, remove this hash entry from its hash chain.
+		 * First, remove the kernel copy of the data, and remove this
+		 * hash entry from its hash chain.
 		 */
+		dt_aggregate_kdelete(dtp, h);
+
 		if (h->dtahe_prev != NULL) {
 			h->dtahe_prev->dtahe_next = h->dtahe_next;
 		} else {
@@ -1286,6 +1596,7 @@ dt_aggwalk_rval(dtrace_hdl_t *dtp, dt_ahashent_t *h, int rval)
 			free(aggdata->dtada_percpu);
 		}
 
+		free(h->dtahe_kkeys);
 		free(aggdata->dtada_data);
 		free(h);
 
@@ -1613,12 +1924,13 @@ dtrace_aggregate_walk_joined(dtrace_hdl_t *dtp, dtrace_aggvarid_t *aggvars,
 			aggvar = aggvars[(i - sortpos + naggvars) % naggvars];
 			assert(zaggdata[i].dtahe_data.dtada_data == NULL);
 
-			for (j = DTRACE_AGGIDNONE + 1; ; j++) {
+			for (j = DTRACE_AGGIDNONE + 1; j < dtp->dt_maxagg;
+			     j++) {
 				dtrace_aggdesc_t *agg;
 				dtrace_aggdata_t *aggdata;
 
 				if (dt_aggid_lookup(dtp, j, &agg) != 0)
-					break;
+					continue;
 
 				if (agg->dtagd_varid != aggvar)
 					continue;
@@ -1631,9 +1943,8 @@ dtrace_aggregate_walk_joined(dtrace_hdl_t *dtp, dtrace_aggvarid_t *aggvars,
 				aggdata->dtada_size = agg->dtagd_size;
 				aggdata->dtada_desc = agg;
 				aggdata->dtada_handle = dtp;
-				dt_epid_lookup(dtp, agg->dtagd_epid,
-					       &aggdata->dtada_ddesc,
-					       &aggdata->dtada_pdesc);
+				aggdata->dtada_ddesc = NULL;
+				aggdata->dtada_pdesc = NULL;
 				aggdata->dtada_normal = 1;
 				zaggdata[i].dtahe_hashval = 0;
 				zaggdata[i].dtahe_size = agg->dtagd_size;
@@ -1927,7 +2238,8 @@ dtrace_aggregate_print(dtrace_hdl_t *dtp, FILE *fp,
 	if (func == NULL)
 		func = dtrace_aggregate_walk_sorted;
 
-	if ((*func)(dtp, dt_print_agg, &pd) == -1)
+	if ((*func)(dtp, dt_oformat_enabled(dtp) ? dt_oformat_agg :
+	    dt_print_agg, &pd) == -1)
 		return (dt_set_errno(dtp, dtp->dt_errno));
 
 	return (0);
@@ -1944,6 +2256,28 @@ dtrace_aggregate_clear(dtrace_hdl_t *dtp)
 	dtrace_recdesc_t *rec;
 	int i, max_cpus = agp->dtat_maxcpu;
 
+	/*
+	 * Remove all elements from the kernel aggregation maps.  This is not
+	 * needed for double-buffered aggregations, because their maps only
+	 * hold the data that was recorded since the last snapshot.
+	 */
+	for (i = 0; !(agp->dtat_flags & DTRACE_A_DBUF) &&
+		    i < dtp->dt_maxagg; i++) {
+		char	key[DT_STK_SCRATCH_SZ], nxt[DT_STK_SCRATCH_SZ];
+		int	fd, rval;
+
+		aggdesc = dtp->dt_aggdesc[i];
+		if (aggdesc == NULL ||
+		    (fd = dt_aggregate_mapfd(dtp, aggdesc, 0)) == -1)
+			continue;
+
+		for (rval = dt_bpf_map_next_key(fd, NULL, key); rval == 0;
+		     memcpy(key, nxt, sizeof(key))) {
+			rval = dt_bpf_map_next_key(fd, key, nxt);
+			dt_bpf_map_delete(fd, key);
+		}
+	}
+
 	for (h = hash->dtah_all; h != NULL; h = h->dtahe_nextall) {
 		aggdesc = h->dtahe_data.dtada_desc;
 		rec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
@@ -1984,6 +2318,7 @@ dt_aggregate_destroy(dtrace_hdl_t *dtp)
 				free(aggdata->dtada_percpu);
 			}
 
+			free(h->dtahe_kkeys);
 			free(aggdata->dtada_data);
 			free(h);
 		}
@@ -1993,6 +2328,4 @@ dt_aggregate_destroy(dtrace_hdl_t *dtp)
 		hash->dtah_size = 0;
 	}
 
-	free(agp->dtat_buf.dtbd_data);
-	free(agp->dtat_cpus);
 }
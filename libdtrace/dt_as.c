@@ -232,6 +232,13 @@ dt_as(dt_pcb_t *pcb)
 		    dtp->dt_linkmode);
 	}
 
+	/*
+	 * Optimize the instruction list before it gets assembled (unless the
+	 * noopt option is set).
+	 */
+	if (!(pcb->pcb_cflags & DTRACE_C_NOOPT))
+		dt_peephole(dlp);
+
 	assert(pcb->pcb_difo == NULL);
 	pcb->pcb_difo = dt_zalloc(dtp, sizeof (dtrace_difo_t));
 
@@ -476,6 +483,9 @@ fail:
 			else if (dip->di_instr.code ==
 					(BPF_ALU64 | BPF_MOV | BPF_K))
 				rp->dofr_type = R_BPF_64_32;
+			else if (dip->di_instr.code ==
+					(BPF_ALU64 | BPF_ADD | BPF_K))
+				rp->dofr_type = R_BPF_64_32;
 			else if (dip->di_instr.code ==
 					(BPF_JMP | BPF_CALL) &&
 				 dip->di_instr.src_reg == BPF_PSEUDO_CALL)
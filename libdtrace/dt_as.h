@@ -36,6 +36,8 @@ extern void dt_irlist_destroy(dt_irlist_t *);
 extern void dt_irlist_append(dt_irlist_t *, dt_irnode_t *);
 extern uint_t dt_irlist_label(dt_irlist_t *);
 
+extern void dt_peephole(dt_irlist_t *);
+
 #ifdef	__cplusplus
 }
 #endif
@@ -7,14 +7,19 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
+#include <linux/membarrier.h>
 #include <dtrace.h>
 #include <dt_impl.h>
 #include <dt_probe.h>
 #include <dt_bpf.h>
+#include <dt_ringbuf.h>
 #include <port.h>
 
 #include <bpf.h>
@@ -82,12 +87,135 @@ create_gmap(dtrace_hdl_t *dtp, const char *name, enum bpf_map_type type,
 	return fd;
 }
 
+/*
+ * Create the map for a global associative array or a thread-local variable,
+ * provided that it is used by the compiled programs.  The key consists of the
+ * tuple of array indices (each stored as a 64-bit value), followed by the TLS
+ * key for thread-local variables.
+ */
+static int
+dt_bpf_dvarmap_create(dt_idhash_t *dhp, dt_ident_t *idp, void *arg)
+{
+	dtrace_hdl_t	*dtp = arg;
+	dtrace_optval_t	dvarsize = dtp->dt_options[DTRACEOPT_DYNVARSIZE];
+	const char	*fmt;
+	char		name[BPF_OBJ_NAME_LEN];
+	uint32_t	ksz = 0, vsz = sizeof(uint64_t);
+	int		size;
+
+	if (idp->di_flags & DT_IDFLG_TLS)
+		fmt = DT_TVAR_MAPNAME;
+	else if (idp->di_kind == DT_IDENT_ARRAY &&
+		 idp->di_id > DIF_VAR_ARRAY_MAX)
+		fmt = DT_ASSOC_MAPNAME;
+	else
+		return 0;
+
+	snprintf(name, sizeof(name), fmt, idp->di_id - DIF_VAR_OTHER_UBASE);
+	if (dt_dlib_get_map(dtp, name) == NULL)
+		return 0;
+
+	if (idp->di_kind == DT_IDENT_ARRAY)
+		ksz = ((dt_idsig_t *)idp->di_data)->dis_argc *
+		      sizeof(uint64_t);
+	if (idp->di_flags & DT_IDFLG_TLS)
+		ksz += sizeof(uint64_t);
+
+	if (dvarsize == DTRACEOPT_UNSET)
+		dvarsize = _dtrace_dynvarsize;
+
+	if (dvarsize < ksz + vsz)
+		size = 1;
+	else
+		size = dvarsize / (ksz + vsz);
+
+	if (create_gmap(dtp, name, BPF_MAP_TYPE_HASH, ksz, vsz, size) == -1)
+		return -1;	/* dt_errno is set for us */
+
+	return 0;
+}
+
+/*
+ * Create the aggregation maps (one per aggregation, or two if aggregations are
+ * double-buffered), and the 'aggzero' map that provides a zero-filled value to
+ * initialize new elements with.  Double-buffered aggregations also use the
+ * 'aggsel' map to select the map that BPF programs write to.
+ */
+static int
+dt_bpf_aggmap_create(dtrace_hdl_t *dtp)
+{
+	dtrace_optval_t	aggsize = dtp->dt_options[DTRACEOPT_AGGSIZE];
+	uint32_t	maxvsz = 0;
+	int		i;
+
+	if (aggsize == DTRACEOPT_UNSET)
+		aggsize = _dtrace_aggsize;
+
+	for (i = 0; i < dtp->dt_maxagg; i++) {
+		dtrace_aggdesc_t	*agg = dtp->dt_aggdesc[i];
+		dtrace_recdesc_t	*rec;
+		uint32_t		ksz, vsz;
+		int			size;
+		char			name[BPF_OBJ_NAME_LEN];
+
+		if (agg == NULL)
+			continue;
+
+		/*
+		 * The key starts after the aggregation variable ID, and it
+		 * ends where the aggregation data starts.
+		 */
+		rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
+		ksz = rec->dtrd_offset - sizeof(dtrace_aggvarid_t);
+		if (ksz == 0)
+			ksz = sizeof(uint64_t);
+		vsz = DT_AGG_HDRSZ + rec->dtrd_size;
+
+		if (aggsize < ksz + vsz)
+			size = 1;
+		else
+			size = aggsize / (ksz + vsz);
+
+		snprintf(name, sizeof(name), DT_AGG_MAPNAME, agg->dtagd_id);
+		if (create_gmap(dtp, name, BPF_MAP_TYPE_PERCPU_HASH,
+				ksz, vsz, size) == -1)
+			return -1;	/* dt_errno is set for us */
+
+		snprintf(name, sizeof(name), DT_AGG_MAPNAME_ALT,
+			 agg->dtagd_id);
+		if ((dtp->dt_aggregate.dtat_flags & DTRACE_A_DBUF) &&
+		    create_gmap(dtp, name, BPF_MAP_TYPE_PERCPU_HASH,
+				ksz, vsz, size) == -1)
+			return -1;	/* dt_errno is set for us */
+
+		if (vsz > maxvsz)
+			maxvsz = vsz;
+	}
+
+	if (maxvsz > 0 &&
+	    create_gmap(dtp, "aggzero", BPF_MAP_TYPE_ARRAY,
+			sizeof(uint32_t), maxvsz, 1) == -1)
+		return -1;	/* dt_errno is set for us */
+
+	if (maxvsz > 0 && (dtp->dt_aggregate.dtat_flags & DTRACE_A_DBUF) &&
+	    create_gmap(dtp, "aggsel", BPF_MAP_TYPE_ARRAY,
+			sizeof(uint32_t), sizeof(uint64_t), 1) == -1)
+		return -1;	/* dt_errno is set for us */
+
+	return 0;
+}
+
 /*
  * Create the global BPF maps that are shared between all BPF programs in a
  * single tracing session:
  *
  * - buffers:	Perf event output buffer map, associating a perf event output
- *		buffer with each CPU.  The map is indexed by CPU id.
+ *		buffer with each CPU.  The map is indexed by CPU id.  It is
+ *		only created when the perf event buffer backend is used.
+ * - ringbuf:	BPF ring buffer that is shared between all CPUs.  It is only
+ *		created when the ring buffer backend is used (see the
+ *		bufbackend option), and it replaces the perf event output
+ *		buffers.  Its size is determined by the bufsize option.
  * - cpuinfo:	CPU information map, associating a cpuinfo_t structure with
  *		each online CPU on the system.
  * - mem:	Scratch memory.  This is implemented as a global per-CPU map
@@ -107,33 +235,47 @@ create_gmap(dtrace_hdl_t *dtp, const char *name, enum bpf_map_type type,
  *		concatenation of all unique strings (each terminated with a
  *		NUL byte).  The string table size is taken from the DTrace
  *		consumer handle (dt_strlen).
- * - gvars:	Global variables map, associating a 64-bit value with each
- *		global variable.  The map is indexed by global variable id.
- *		The amount of global variables is the next-to--be-assigned
- *		global variable id minus the base id.
- *
- * FIXME: TLS variable storage is still being designed further so this is just
- *	  a temporary placeholder and will most likely be replaced by something
- *	  else.  If we stick to the legacy DTrace approach, we will need to
- *	  determine the maximum overall key size for TLS variables *and* the
- *	  maximum value size.  Based on these values, the legacy code would
- *	  take the memory size set aside for dynamic variables, and divide it by
- *	  the storage size needed for the largest dynamic variable (associative
- *	  array element or TLS variable).
- *
- * - tvars:	Thread-local (TLS) variables map, associating a 64-bit value
- *		with each thread-local variable.  The map is indexed by a value
- *		computed based on the thread-local variable id and execution
- *		thread information to ensure each thread has its own copy of a
- *		given thread-local variable.  The amount of TLS variable space
- *		to allocate for these dynamic variables is calculated based on
- *		the number of uniquely named TLS variables (next-to-be-assigned
- *		id minus the base id).
+ * - gvars:	Global variables map.  This is a global map with a singleton
+ *		element (key 0) that holds an array of 64-bit values, one for
+ *		each global variable (indexed by global variable id minus the
+ *		base id).  The amount of global variables is the
+ *		next-to--be-assigned global variable id minus the base id.
+ *		BPF programs access global variables directly by their
+ *		address in the map value (BPF_PSEUDO_MAP_VALUE), which
+ *		requires an array map with a single element.
+ * - assoc_<n>:	Associative array map for the global associative array with
+ *		id <n>.  This is a hash map, indexed by the tuple of array
+ *		indices (each stored as a 64-bit value), associating a 64-bit
+ *		value with each array element.
+ * - tvar_<n>:	Thread-local variable map for the thread-local variable with
+ *		id <n>.  This is a hash map, indexed by the tuple of array
+ *		indices (for thread-local associative arrays) followed by the
+ *		64-bit TLS key (see dt_tlskey()), associating a 64-bit value
+ *		with each element.
+ *		The number of elements in the dynamic variable maps is
+ *		determined by dividing the dynamic variable space size
+ *		(dynvarsize) by the size of an element.
+ * - agg_<n>:	Aggregation map for the aggregation with id <n>.  This is a
+ *		per-CPU hash map, indexed by the aggregation key tuple.  The
+ *		value is a 64-bit update counter followed by the aggregation
+ *		data (see dt_cg_agg()).  The number of elements is determined
+ *		by dividing the aggregation buffer size (aggsize) by the size
+ *		of an element.
+ * - agg_<n>_1:	Second aggregation map for the aggregation with id <n>, only
+ *		created when aggregations are double-buffered (aggdbuf).
+ * - aggsel:	Aggregation map selector, only created when aggregations are
+ *		double-buffered.  This is a global map with a singleton element
+ *		(key 0) that holds the index (0 or 1) of the aggregation maps
+ *		that BPF programs update.  The consumer flips it, and drains
+ *		the maps that are no longer being updated.
+ * - aggzero:	Zero-filled value used to initialize new aggregation map
+ *		elements.  This is a global map with a singleton element (key
+ *		0), sized to hold the largest aggregation map value.
  */
 int
 dt_bpf_gmap_create(dtrace_hdl_t *dtp)
 {
-	int		gvarc, tvarc;
+	int		gvarc;
 	int		ci_mapfd;
 	uint32_t	key = 0;
 
@@ -144,14 +286,17 @@ dt_bpf_gmap_create(dtrace_hdl_t *dtp)
 	/* Mark global maps creation as completed. */
 	dt_gmap_done = 1;
 
-	/* Determine the number of global and TLS variables. */
+	/* Determine the number of global variables. */
 	gvarc = dt_idhash_peekid(dtp->dt_globals) - DIF_VAR_OTHER_UBASE;
-	tvarc = dt_idhash_peekid(dtp->dt_tls) - DIF_VAR_OTHER_UBASE;
 
 	/* Create global maps as long as there are no errors. */
-	if (create_gmap(dtp, "buffers", BPF_MAP_TYPE_PERF_EVENT_ARRAY,
-			sizeof(uint32_t), sizeof(uint32_t),
-			dtp->dt_conf.num_online_cpus) == -1)
+	if (dt_ringbuf_enabled(dtp)) {
+		if (create_gmap(dtp, "ringbuf", BPF_MAP_TYPE_RINGBUF, 0, 0,
+				dt_ringbuf_size(dtp)) == -1)
+			return -1;	/* dt_errno is set for us */
+	} else if (create_gmap(dtp, "buffers", BPF_MAP_TYPE_PERF_EVENT_ARRAY,
+			       sizeof(uint32_t), sizeof(uint32_t),
+			       dtp->dt_conf.num_online_cpus) == -1)
 		return -1;	/* dt_errno is set for us */
 
 	ci_mapfd = create_gmap(dtp, "cpuinfo", BPF_MAP_TYPE_PERCPU_ARRAY,
@@ -169,14 +314,16 @@ dt_bpf_gmap_create(dtrace_hdl_t *dtp)
 			sizeof(uint32_t), dtp->dt_strlen, 1) == -1)
 		return -1;	/* dt_errno is set for us */
 
-	if (gvarc > 0 &&
-	    create_gmap(dtp, "gvars", BPF_MAP_TYPE_ARRAY,
-			sizeof(uint32_t), sizeof(uint64_t), gvarc) == -1)
+	if (create_gmap(dtp, "gvars", BPF_MAP_TYPE_ARRAY,
+			sizeof(uint32_t),
+			MAX(gvarc, 1) * sizeof(uint64_t), 1) == -1)
+		return -1;	/* dt_errno is set for us */
+
+	if (dt_idhash_iter(dtp->dt_globals, dt_bpf_dvarmap_create, dtp) != 0 ||
+	    dt_idhash_iter(dtp->dt_tls, dt_bpf_dvarmap_create, dtp) != 0)
 		return -1;	/* dt_errno is set for us */
 
-	if (tvarc > 0 &&
-	    create_gmap(dtp, "tvars", BPF_MAP_TYPE_ARRAY,
-			sizeof(uint32_t), sizeof(uint64_t), tvarc) == -1)
+	if (dt_bpf_aggmap_create(dtp) == -1)
 		return -1;	/* dt_errno is set for us */
 
 	/* Populate the 'cpuinfo' map. */
@@ -185,6 +332,39 @@ dt_bpf_gmap_create(dtrace_hdl_t *dtp)
 	return 0;
 }
 
+/*
+ * Retrieve the value for the given key in the map referenced by the given fd.
+ * For per-CPU maps, the value buffer must hold a (8-byte aligned) value for
+ * each possible CPU.
+ */
+int dt_bpf_map_lookup(int fd, const void *key, void *val)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uint64_t)(unsigned long)key;
+	attr.value = (uint64_t)(unsigned long)val;
+
+	return bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+/*
+ * Retrieve the key that follows the given key in the map referenced by the
+ * given fd.  If key is NULL, the first key in the map is retrieved.
+ */
+int dt_bpf_map_next_key(int fd, const void *key, void *nxt)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uint64_t)(unsigned long)key;
+	attr.next_key = (uint64_t)(unsigned long)nxt;
+
+	return bpf(BPF_MAP_GET_NEXT_KEY, &attr);
+}
+
 /*
  * Store the (key, value) pair in the map referenced by the given fd.
  */
@@ -201,6 +381,68 @@ int dt_bpf_map_update(int fd, const void *key, const void *val)
 	return bpf(BPF_MAP_UPDATE_ELEM, &attr);
 }
 
+/*
+ * Delete the element with the given key from the map referenced by the given
+ * fd.
+ */
+int dt_bpf_map_delete(int fd, const void *key)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uint64_t)(unsigned long)key;
+
+	return bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static int
+dt_bpf_map_batch(enum bpf_cmd cmd, int fd, const void *in, void *out,
+		 void *keys, void *vals, uint32_t *cnt)
+{
+	union bpf_attr	attr;
+	int		rc;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.batch.map_fd = fd;
+	attr.batch.in_batch = (uint64_t)(unsigned long)in;
+	attr.batch.out_batch = (uint64_t)(unsigned long)out;
+	attr.batch.keys = (uint64_t)(unsigned long)keys;
+	attr.batch.values = (uint64_t)(unsigned long)vals;
+	attr.batch.count = *cnt;
+
+	rc = bpf(cmd, &attr);
+	*cnt = attr.batch.count;
+
+	return rc;
+}
+
+/*
+ * Retrieve up to *cnt elements from the map referenced by the given fd,
+ * starting at the position described by the opaque batch token in (NULL to
+ * start at the beginning of the map).  The token for the next batch is stored
+ * in out, and *cnt is set to the number of elements retrieved.  When the end
+ * of the map is reached, -1 is returned with errno set to ENOENT (and *cnt
+ * elements were still retrieved).
+ */
+int dt_bpf_map_lookup_batch(int fd, const void *in, void *out, void *keys,
+			    void *vals, uint32_t *cnt)
+{
+	return dt_bpf_map_batch(BPF_MAP_LOOKUP_BATCH, fd, in, out, keys, vals,
+				cnt);
+}
+
+/*
+ * Like dt_bpf_map_lookup_batch(), but also delete the elements that were
+ * retrieved from the map.
+ */
+int dt_bpf_map_lookup_and_delete_batch(int fd, const void *in, void *out,
+				       void *keys, void *vals, uint32_t *cnt)
+{
+	return dt_bpf_map_batch(BPF_MAP_LOOKUP_AND_DELETE_BATCH, fd, in, out,
+				keys, vals, cnt);
+}
+
 /*
  * Perform relocation processing on a program.
  */
@@ -220,17 +462,20 @@ dt_bpf_reloc_prog(dtrace_hdl_t *dtp, const dt_probe_t *prp,
 		uint32_t	val = 0;
 
 		/*
-		 * If the relocation is for a BPF map, fill in its fd.
+		 * If the relocation is for a BPF map, fill in its fd.  A
+		 * reference to a map value (BPF_PSEUDO_MAP_VALUE) keeps the
+		 * offset into the value in the upper half of the lddw.
 		 */
 		if (idp->di_kind == DT_IDENT_PTR) {
-			if (rp->dofr_type == R_BPF_64_64)
-				text[ioff].src_reg = BPF_PSEUDO_MAP_FD;
-
 			val = idp->di_id;
 
 			if (rp->dofr_type == R_BPF_64_64) {
+				if (text[ioff].src_reg !=
+				    BPF_PSEUDO_MAP_VALUE) {
+					text[ioff].src_reg = BPF_PSEUDO_MAP_FD;
+					text[ioff + 1].imm = 0;
+				}
 				text[ioff].imm = val;
-				text[ioff + 1].imm = 0;
 			} else if (rp->dofr_type == R_BPF_64_32)
 				text[ioff].imm = val;
 		}
@@ -238,18 +483,138 @@ dt_bpf_reloc_prog(dtrace_hdl_t *dtp, const dt_probe_t *prp,
 }
 
 /*
- * Load a BPF program into the kernel.
+ * Determine the attributes of the BPF program for the given probe.
+ */
+void
+dt_bpf_prog_attr(dtrace_hdl_t *dtp, const dt_probe_t *prp,
+		 dt_progattr_t *attr)
+{
+	const dt_provimpl_t	*impl = prp->prov->impl;
+
+	memset(attr, 0, sizeof(dt_progattr_t));
+	attr->prog_type = impl->prog_type;
+
+	if (impl->prog_attr)
+		impl->prog_attr(dtp, prp, attr);
+}
+
+/*
+ * Attributes for BPF_PROG_LOAD, up to and including attach_btf_id (Linux 5.5).
+ * The bundled libbpf cannot pass the BTF id of the attach target, which is
+ * needed to load fentry/fexit programs.
+ */
+struct dt_bpf_prog_load_attr {
+	uint32_t	prog_type;
+	uint32_t	insn_cnt;
+	uint64_t	insns;
+	uint64_t	license;
+	uint32_t	log_level;
+	uint32_t	log_size;
+	uint64_t	log_buf;
+	uint32_t	kern_version;
+	uint32_t	prog_flags;
+	char		prog_name[BPF_OBJ_NAME_LEN];
+	uint32_t	prog_ifindex;
+	uint32_t	expected_attach_type;
+	uint32_t	prog_btf_fd;
+	uint32_t	func_info_rec_size;
+	uint64_t	func_info;
+	uint32_t	func_info_cnt;
+	uint32_t	line_info_rec_size;
+	uint64_t	line_info;
+	uint32_t	line_info_cnt;
+	uint32_t	attach_btf_id;
+};
+
+/*
+ * Load the given instructions as a BPF program with the given attributes.  If
+ * the verifier rejects the program, its output is stored in the log buffer.
+ *
+ * This function does not touch any state in the DTrace handle, so it can be
+ * called from multiple threads at once.
  *
  * Note that DTrace generates BPF programs that are licensed under the GPL.
  */
-int
-dt_bpf_load_prog(dtrace_hdl_t *dtp, const dt_probe_t *prp,
-		 const dtrace_difo_t *dp)
+static int
+dt_bpf_prog_load(const dt_progattr_t *pattr, const struct bpf_insn *insns,
+		 uint_t insns_cnt, char *log, size_t logsz)
 {
 	struct bpf_load_program_attr	attr;
+	struct dt_bpf_prog_load_attr	battr;
+
+	if (pattr->btf_id == 0) {
+		memset(&attr, 0, sizeof(struct bpf_load_program_attr));
+
+		attr.prog_type = pattr->prog_type;
+		attr.expected_attach_type = pattr->attach_type;
+		attr.name = NULL;
+		attr.insns = insns;
+		attr.insns_cnt = insns_cnt;
+		attr.license = BPF_CG_LICENSE;
+		attr.log_level = 4 | 2 | 1;
+
+		return bpf_load_program_xattr(&attr, log, logsz);
+	}
+
+	memset(&battr, 0, sizeof(struct dt_bpf_prog_load_attr));
+
+	battr.prog_type = pattr->prog_type;
+	battr.expected_attach_type = pattr->attach_type;
+	battr.attach_btf_id = pattr->btf_id;
+	battr.insns = (uintptr_t)insns;
+	battr.insn_cnt = insns_cnt;
+	battr.license = (uintptr_t)BPF_CG_LICENSE;
+	battr.log_level = 4 | 2 | 1;
+	battr.log_buf = (uintptr_t)log;
+	battr.log_size = logsz;
+
+	return syscall(__NR_bpf, BPF_PROG_LOAD, &battr, sizeof(battr));
+}
+
+/*
+ * Report a failure to load the BPF program for the given probe.
+ */
+static int
+dt_bpf_prog_error(dtrace_hdl_t *dtp, const dt_probe_t *prp, int err,
+		  char *log)
+{
+	const dtrace_probedesc_t	*pdp = prp->desc;
+	char				*p, *q;
+	int				rc;
+
+	rc = dt_bpf_error(dtp,
+			  "BPF program load for '%s:%s:%s:%s' failed: %s\n",
+			  pdp->prv, pdp->mod, pdp->fun, pdp->prb,
+			  strerror(err));
+
+	/*
+	 * If there is BPF verifier output, print it with a "BPF: " prefix so
+	 * it is easier to distinguish.
+	 */
+	for (p = log; p && *p; p = q) {
+		q = strchr(p, '\n');
+
+		if (q)
+			*q++ = '\0';
+
+		fprintf(stderr, "BPF: %s\n", p);
+	}
+
+	return rc;
+}
+
+/*
+ * Try to load a BPF program into the kernel.  On failure, errno is set and the
+ * BPF verifier output is returned in logp (to be freed by the caller).
+ */
+static int
+dt_bpf_try_load_prog(dtrace_hdl_t *dtp, const dt_probe_t *prp,
+		     const dtrace_difo_t *dp, char **logp)
+{
 	int				logsz = BPF_LOG_BUF_SIZE;
 	char				*log;
-	int				rc;
+	dt_progattr_t			attr;
+	int				fd;
 
 	/*
 	 * Check whether there are any probe-specific relocations to be
@@ -262,74 +627,794 @@ dt_bpf_load_prog(dtrace_hdl_t *dtp, const dt_probe_t *prp,
 	if (dp->dtdo_brelen)
 		dt_bpf_reloc_prog(dtp, prp, dp);
 
-	memset(&attr, 0, sizeof(struct bpf_load_program_attr));
-
 	log = dt_zalloc(dtp, logsz);
 	assert(log != NULL);
 
-	attr.prog_type = prp->prov->impl->prog_type;
-	attr.name = NULL;
-	attr.insns = dp->dtdo_buf;
-	attr.insns_cnt = dp->dtdo_len;
-	attr.license = BPF_CG_LICENSE;
-	attr.log_level = 4 | 2 | 1;
+	dt_bpf_prog_attr(dtp, prp, &attr);
+	fd = dt_bpf_prog_load(&attr, dp->dtdo_buf, dp->dtdo_len, log, logsz);
+	if (fd < 0)
+		*logp = log;
+	else
+		dt_free(dtp, log);
 
-	rc = bpf_load_program_xattr(&attr, log, logsz);
+	return fd;
+}
+
+/*
+ * Load a BPF program into the kernel.
+ */
+int
+dt_bpf_load_prog(dtrace_hdl_t *dtp, const dt_probe_t *prp,
+		 const dtrace_difo_t *dp)
+{
+	char	*log;
+	int	rc;
+
+	rc = dt_bpf_try_load_prog(dtp, prp, dp, &log);
 	if (rc < 0) {
-		const dtrace_probedesc_t	*pdp = prp->desc;
-		char				*p, *q;
+		rc = dt_bpf_prog_error(dtp, prp, errno, log);
+		dt_free(dtp, log);
+	}
 
-		rc = dt_bpf_error(dtp,
-				  "BPF program load for '%s:%s:%s:%s' failed: "
-				  "%s\n",
-				  pdp->prv, pdp->mod, pdp->fun, pdp->prb,
-				  strerror(errno));
+	return rc;
+}
 
-		/*
-		 * If there is BPF verifier output, print it with a "BPF: "
-		 * prefix so it is easier to distinguish.
-		 */
-		for (p = log; p && *p; p = q) {
-			q = strchr(p, '\n');
+/*
+ * Enable the collection of run-time statistics for BPF programs by the kernel.
+ * BPF_ENABLE_STATS (Linux 5.8) keeps them enabled for as long as the returned
+ * fd is open.  Older kernels only collect them if the kernel.bpf_stats_enabled
+ * sysctl is set, which we leave up to the administrator.
+ */
+#define DT_BPF_ENABLE_STATS	32	/* BPF_ENABLE_STATS command */
+#define DT_BPF_STATS_RUN_TIME	0	/* BPF_STATS_RUN_TIME type */
+
+void
+dt_bpf_stats_enable(dtrace_hdl_t *dtp)
+{
+	struct {
+		uint32_t	type;
+	} attr = { DT_BPF_STATS_RUN_TIME };
+
+	if (dtp->dt_bpfstats_fd != -1)
+		return;
+
+	dtp->dt_bpfstats_fd = syscall(__NR_bpf, DT_BPF_ENABLE_STATS, &attr,
+				      sizeof(attr));
+	if (dtp->dt_bpfstats_fd == -1)
+		dt_dprintf("cannot enable BPF run-time stats: %s\n",
+			   strerror(errno));
+}
+
+/*
+ * Return whether the kernel is collecting BPF program run-time statistics.
+ */
+int
+dt_bpf_stats_enabled(dtrace_hdl_t *dtp)
+{
+	FILE	*fp;
+	int	val = 0;
+
+	if (dtp->dt_bpfstats_fd != -1)
+		return 1;
+
+	fp = fopen("/proc/sys/kernel/bpf_stats_enabled", "r");
+	if (fp == NULL)
+		return 0;
+
+	if (fscanf(fp, "%d", &val) != 1)
+		val = 0;
+	fclose(fp);
+
+	return val != 0;
+}
+
+/*
+ * Retrieve the number of runs of the given BPF program, and the total time
+ * spent in it.
+ */
+int
+dt_bpf_prog_stats(int fd, uint64_t *cntp, uint64_t *timep)
+{
+	struct bpf_prog_info	info;
+	uint32_t		len = sizeof(info);
+
+	memset(&info, 0, sizeof(info));
+	if (bpf_obj_get_info_by_fd(fd, &info, &len) != 0)
+		return -1;
+
+	*cntp = info.run_cnt;
+	*timep = info.run_time_ns;
+
+	return 0;
+}
+
+/*
+ * Wait for all BPF programs that are currently running to complete.  They run
+ * in RCU read-side critical sections, and membarrier(MEMBARRIER_CMD_GLOBAL)
+ * waits for an RCU grace period.  Returns 0 on success, or -1 (with errno set)
+ * if the wait is not possible.
+ */
+int
+dt_bpf_prog_sync(void)
+{
+	return syscall(__NR_membarrier, MEMBARRIER_CMD_GLOBAL, 0);
+}
+
+/*
+ * Support for BPF cookies on perf event attachments (Linux 5.15) is determined
+ * once, by loading a trivial tracepoint program that retrieves its cookie.
+ * Kernels that do not provide the bpf_get_attach_cookie() helper reject it.
+ */
+static pthread_once_t	dt_bpf_cookie_once = PTHREAD_ONCE_INIT;
+static int		dt_bpf_cookie_supported;
+
+static void
+dt_bpf_cookie_init(void)
+{
+	struct bpf_insn	insns[] = {
+		BPF_CALL_HELPER(DT_BPF_FUNC_GET_ATTACH_COOKIE),
+		BPF_MOV_IMM(BPF_REG_0, 0),
+		BPF_RETURN(),
+	};
+	union bpf_attr	attr;
+	int		fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_TRACEPOINT;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = ARRAY_SIZE(insns);
+	attr.license = (uintptr_t)"GPL";
+
+	fd = bpf(BPF_PROG_LOAD, &attr);
+	dt_bpf_cookie_supported = fd >= 0;
+	if (fd >= 0)
+		close(fd);
+
+	dt_dprintf("BPF attach cookies are%s supported\n",
+		   dt_bpf_cookie_supported ? "" : " not");
+}
+
+/*
+ * Return whether BPF programs can be attached to perf events with a BPF
+ * cookie, and retrieve it with bpf_get_attach_cookie().
+ */
+int
+dt_bpf_have_attach_cookie(void)
+{
+	pthread_once(&dt_bpf_cookie_once, dt_bpf_cookie_init);
+
+	return dt_bpf_cookie_supported;
+}
+
+/*
+ * Account for the time it took to load and attach the program for a probe.
+ */
+static void
+dt_bpf_load_stats(dtrace_hdl_t *dtp, dt_probe_t *prp, hrtime_t load,
+		  hrtime_t attach)
+{
+	dtrace_stats_t	*stp = &dtp->dt_stats;
+
+	prp->load_time = load;
+	prp->attach_time = attach;
+
+	stp->dtsts_nprogs++;
+	stp->dtsts_load_time += load;
+	stp->dtsts_attach_time += attach;
+}
+
+/*
+ * Programs that are shared by multiple probes (see dt_progattr_t) are loaded
+ * once, after all other programs, and then attached to all their probes at
+ * once.  Until then, the probes that use each shared program are collected.
+ */
+typedef struct dt_bpf_shared {
+	dt_list_t		list;		/* next/prev shared program */
+	const dtrace_difo_t	*dp;		/* program (in program cache) */
+	dt_probe_t		**prpv;		/* probes that use the program */
+	uint64_t		*epoffv;	/* EPID offset for each probe */
+	uint_t			prpc;		/* number of probes */
+	uint_t			prpmax;		/* size of prpv and epoffv */
+} dt_bpf_shared_t;
+
+static void
+dt_bpf_shared_free(dtrace_hdl_t *dtp, dt_list_t *lst)
+{
+	dt_bpf_shared_t	*shp;
+
+	while ((shp = dt_list_next(lst)) != NULL) {
+		dt_list_delete(lst, shp);
+		dt_free(dtp, shp->prpv);
+		dt_free(dtp, shp->epoffv);
+		dt_free(dtp, shp);
+	}
+}
+
+/*
+ * Record that the given probe uses the given shared program.
+ */
+static int
+dt_bpf_shared_add(dtrace_hdl_t *dtp, dt_list_t *lst, const dtrace_difo_t *dp,
+		  dt_probe_t *prp, uint64_t epoff)
+{
+	dt_bpf_shared_t	*shp;
+
+	for (shp = dt_list_next(lst); shp != NULL; shp = dt_list_next(shp)) {
+		if (shp->dp == dp)
+			break;
+	}
 
-			if (q)
-				*q++ = '\0';
+	if (shp == NULL) {
+		shp = dt_zalloc(dtp, sizeof(dt_bpf_shared_t));
+		if (shp == NULL)
+			return dt_set_errno(dtp, EDT_NOMEM);
 
-			fprintf(stderr, "BPF: %s\n", p);
+		shp->dp = dp;
+		dt_list_append(lst, shp);
+	}
+
+	if (shp->prpc == shp->prpmax) {
+		uint_t		max = shp->prpmax ? shp->prpmax * 2 : 64;
+		dt_probe_t	**prpv;
+		uint64_t	*epoffv;
+
+		prpv = dt_calloc(dtp, max, sizeof(dt_probe_t *));
+		epoffv = dt_calloc(dtp, max, sizeof(uint64_t));
+		if (prpv == NULL || epoffv == NULL) {
+			dt_free(dtp, prpv);
+			dt_free(dtp, epoffv);
+			return dt_set_errno(dtp, EDT_NOMEM);
 		}
+
+		if (shp->prpc > 0) {
+			memcpy(prpv, shp->prpv,
+			       shp->prpc * sizeof(dt_probe_t *));
+			memcpy(epoffv, shp->epoffv,
+			       shp->prpc * sizeof(uint64_t));
+		}
+
+		dt_free(dtp, shp->prpv);
+		dt_free(dtp, shp->epoffv);
+		shp->prpv = prpv;
+		shp->epoffv = epoffv;
+		shp->prpmax = max;
 	}
 
-	dt_free(dtp, log);
+	shp->prpv[shp->prpc] = prp;
+	shp->epoffv[shp->prpc] = epoff;
+	shp->prpc++;
 
-	return rc;
+	return 0;
 }
 
-int
-dt_bpf_load_progs(dtrace_hdl_t *dtp, uint_t cflags)
+/*
+ * If the program for a probe cannot be loaded or attached, its provider may be
+ * able to implement the probe in another way (with a different trampoline).
+ * Return whether the probe should be tried again.
+ */
+static int
+dt_bpf_fallback(dtrace_hdl_t *dtp, dt_probe_t *prp)
 {
-	dt_probe_t	*prp;
+	const dt_provimpl_t	*impl = prp->prov->impl;
 
-	for (prp = dt_list_next(&dtp->dt_enablings); prp != NULL;
-	     prp = dt_list_next(prp)) {
-		dtrace_difo_t	*dp;
-		int		fd, rc;
+	if (impl->fallback == NULL || impl->fallback(dtp, prp) != 0)
+		return 0;
 
-		dp = dt_program_construct(dtp, prp, cflags);
-		if (dp == NULL)
-			return -1;
+	if (prp->prog_fd != -1) {
+		close(prp->prog_fd);
+		prp->prog_fd = -1;
+	}
 
-		fd = dt_bpf_load_prog(dtp, prp, dp);
-		if (fd < 0)
-			return fd;
+	return 1;
+}
 
-		dt_difo_free(dtp, dp);
+static int dt_bpf_load_attach(dtrace_hdl_t *dtp, dt_probe_t *prp,
+			      uint_t cflags, dt_list_t *shared);
 
-		if (!prp->prov->impl->attach)
-			return -1;
-		rc = prp->prov->impl->attach(dtp, prp, fd);
+/*
+ * If a shared program cannot be loaded or attached, and its provider falls back
+ * to another implementation for the first probe that uses it, all its probes
+ * are loaded and attached again, one by one.  Probes that share a program again
+ * are added to the list of shared programs (to be loaded after this one).
+ */
+static int
+dt_bpf_shared_fallback(dtrace_hdl_t *dtp, dt_list_t *lst, dt_bpf_shared_t *shp,
+		       uint_t cflags, int err)
+{
+	uint_t	i;
+	int	rc;
+
+	for (i = 1; i < shp->prpc; i++) {
+		if (!dt_bpf_fallback(dtp, shp->prpv[i]))
+			return dt_set_errno(dtp, err);
+	}
+
+	for (i = 0; i < shp->prpc; i++) {
+		rc = dt_bpf_load_attach(dtp, shp->prpv[i], cflags, lst);
 		if (rc < 0)
 			return rc;
 	}
 
 	return 0;
 }
+
+/*
+ * Load each shared program, and attach it to all the probes that use it.
+ *
+ * The run-time statistics and the load and attach times of a shared program
+ * cover all its probes, so they are only reported for the first one.
+ */
+static int
+dt_bpf_shared_load_attach(dtrace_hdl_t *dtp, dt_list_t *lst, uint_t cflags)
+{
+	dt_bpf_shared_t	*shp;
+	hrtime_t	start, loaded;
+	char		*log;
+	int		fd, rc = 0;
+
+	for (shp = dt_list_next(lst); shp != NULL; shp = dt_list_next(shp)) {
+		dt_probe_t	*prp = shp->prpv[0];
+
+		if (!prp->prov->impl->attach_shared) {
+			rc = dt_set_errno(dtp, EINVAL);
+			break;
+		}
+
+		start = gethrtime();
+		fd = dt_bpf_try_load_prog(dtp, prp, shp->dp, &log);
+		if (fd < 0) {
+			int	err = errno;
+
+			if (dt_bpf_fallback(dtp, prp)) {
+				dt_free(dtp, log);
+				rc = dt_bpf_shared_fallback(dtp, lst, shp,
+							    cflags, err);
+				if (rc < 0)
+					break;
+
+				continue;
+			}
+
+			rc = dt_bpf_prog_error(dtp, prp, err, log);
+			dt_free(dtp, log);
+			break;
+		}
+
+		prp->prog_fd = fd;
+
+		loaded = gethrtime();
+		rc = prp->prov->impl->attach_shared(dtp, shp->prpv,
+						    shp->epoffv, shp->prpc, fd);
+		if (rc < 0 && dt_bpf_fallback(dtp, prp)) {
+			rc = dt_bpf_shared_fallback(dtp, lst, shp, cflags,
+						    -rc);
+			if (rc < 0)
+				break;
+
+			continue;
+		}
+
+		dt_bpf_load_stats(dtp, prp, loaded - start,
+				  gethrtime() - loaded);
+		if (rc < 0) {
+			rc = dt_set_errno(dtp, -rc);
+			break;
+		}
+	}
+
+	dt_bpf_shared_free(dtp, lst);
+
+	return rc;
+}
+
+/*
+ * Load and attach the program for a single probe.  If the program is shared by
+ * multiple probes, the probe is only added to the list of its users.
+ *
+ * If the provider falls back to another implementation of the probe, the
+ * program is constructed again.  The EPIDs that were assigned to the program
+ * that failed are never used.
+ */
+static int
+dt_bpf_load_attach(dtrace_hdl_t *dtp, dt_probe_t *prp, uint_t cflags,
+		   dt_list_t *shared)
+{
+	dtrace_difo_t	*dp;
+	dt_progattr_t	attr;
+	uint64_t	epoff;
+	hrtime_t	start, loaded;
+	char		*log;
+	int		fd, rc;
+
+	dp = dt_program_construct(dtp, prp, cflags, &epoff);
+	if (dp == NULL)
+		return -1;
+
+	dt_bpf_prog_attr(dtp, prp, &attr);
+	if (attr.shared)
+		return dt_bpf_shared_add(dtp, shared, dp, prp, epoff);
+
+	if (!prp->prov->impl->attach)
+		return dt_set_errno(dtp, EINVAL);
+
+	start = gethrtime();
+	fd = dt_bpf_try_load_prog(dtp, prp, dp, &log);
+	if (fd < 0) {
+		int	err = errno;
+
+		if (dt_bpf_fallback(dtp, prp)) {
+			dt_free(dtp, log);
+			return dt_bpf_load_attach(dtp, prp, cflags, shared);
+		}
+
+		rc = dt_bpf_prog_error(dtp, prp, err, log);
+		dt_free(dtp, log);
+
+		return rc;
+	}
+
+	prp->prog_fd = fd;
+
+	loaded = gethrtime();
+	rc = prp->prov->impl->attach(dtp, prp, fd);
+	if (rc < 0 && dt_bpf_fallback(dtp, prp))
+		return dt_bpf_load_attach(dtp, prp, cflags, shared);
+
+	dt_bpf_load_stats(dtp, prp, loaded - start, gethrtime() - loaded);
+	if (rc < 0)
+		return dt_set_errno(dtp, -rc);
+
+	return 0;
+}
+
+/*
+ * Parallel program loading.
+ *
+ * Program construction uses the (non-reentrant) compiler, and assigns EPIDs,
+ * so it is always done by the calling thread.  The constructed programs are
+ * handed to a pool of worker threads through a bounded queue, and the workers
+ * load them into the kernel (where most of the time is spent in the BPF
+ * verifier) and attach them to their probe.
+ *
+ * Workers never report errors themselves.  The outcome of each job is recorded
+ * instead, and once all workers are done, the first failure (in the order the
+ * probes were enabled) is reported just like in the serial case.  After a
+ * failure no new jobs are queued, but jobs that are already queued are still
+ * processed.  Since jobs are queued in order, the first failure is therefore
+ * always the same one that serial loading would have reported.
+ */
+typedef struct dt_bpf_loadjob {
+	dt_probe_t	*prp;		/* probe to load the program for */
+	dt_progattr_t	attr;		/* program attributes */
+	struct bpf_insn	*insns;		/* program instructions */
+	uint_t		insns_cnt;	/* number of instructions */
+	int		rc;		/* 0, or negative value on failure */
+	int		err;		/* errno value on failure */
+	char		*log;		/* verifier log on load failure */
+	hrtime_t	load_time;	/* time spent loading the program */
+	hrtime_t	attach_time;	/* time spent attaching the program */
+} dt_bpf_loadjob_t;
+
+typedef struct dt_bpf_loadpool {
+	dtrace_hdl_t		*dtp;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cv;		/* queue state changed */
+	dt_bpf_loadjob_t	**queue;	/* circular queue of jobs */
+	uint_t			qsize;		/* queue size */
+	uint_t			qhead;		/* first queued job */
+	uint_t			qcnt;		/* number of queued jobs */
+	int			done;		/* no more jobs will be queued */
+	int			failed;		/* a job has failed */
+} dt_bpf_loadpool_t;
+
+static void
+dt_bpf_loadjob_run(dtrace_hdl_t *dtp, dt_bpf_loadjob_t *job)
+{
+	dt_probe_t	*prp = job->prp;
+	int		logsz = BPF_LOG_BUF_SIZE;
+	char		*log;
+	int		fd;
+	hrtime_t	start;
+
+	log = malloc(logsz);
+	if (log == NULL) {
+		job->rc = -1;
+		job->err = EDT_NOMEM;
+		return;
+	}
+	log[0] = '\0';
+
+	start = gethrtime();
+	fd = dt_bpf_prog_load(&job->attr, job->insns, job->insns_cnt, log,
+			      logsz);
+	job->load_time = gethrtime() - start;
+	if (fd < 0) {
+		job->rc = fd;
+		job->err = errno;
+		job->log = log;
+		return;
+	}
+
+	free(log);
+
+	prp->prog_fd = fd;
+
+	start = gethrtime();
+	job->rc = prp->prov->impl->attach(dtp, prp, fd);
+	job->attach_time = gethrtime() - start;
+	if (job->rc < 0) {
+		job->err = -job->rc;
+		job->rc = -1;
+	}
+}
+
+static void *
+dt_bpf_loadpool_worker(void *arg)
+{
+	dt_bpf_loadpool_t	*pool = arg;
+	dt_bpf_loadjob_t	*job;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->qcnt == 0 && !pool->done)
+			pthread_cond_wait(&pool->cv, &pool->lock);
+
+		if (pool->qcnt == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		job = pool->queue[pool->qhead];
+		pool->qhead = (pool->qhead + 1) % pool->qsize;
+		pool->qcnt--;
+		pthread_cond_broadcast(&pool->cv);
+		pthread_mutex_unlock(&pool->lock);
+
+		dt_bpf_loadjob_run(pool->dtp, job);
+
+		free(job->insns);
+		job->insns = NULL;
+
+		if (job->rc < 0) {
+			pthread_mutex_lock(&pool->lock);
+			pool->failed = 1;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Queue a job, waiting for room in the queue if needed.  Returns -1 (without
+ * queueing the job) if a job has failed.
+ */
+static int
+dt_bpf_loadpool_queue(dt_bpf_loadpool_t *pool, dt_bpf_loadjob_t *job)
+{
+	int	rc = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->qcnt == pool->qsize && !pool->failed)
+		pthread_cond_wait(&pool->cv, &pool->lock);
+
+	if (pool->failed)
+		rc = -1;
+	else {
+		pool->queue[(pool->qhead + pool->qcnt) % pool->qsize] = job;
+		pool->qcnt++;
+		pthread_cond_broadcast(&pool->cv);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return rc;
+}
+
+static int
+dt_bpf_load_progs_parallel(dtrace_hdl_t *dtp, uint_t cflags, uint_t nthreads,
+			   dt_list_t *shared)
+{
+	dt_bpf_loadpool_t	pool;
+	dt_bpf_loadjob_t	*jobs = NULL;
+	pthread_t		*tids = NULL;
+	sigset_t		nset, oset;
+	dt_probe_t		*prp;
+	uint_t			i, njobs = 0, nprobes = 0, ntids = 0;
+	int			err, rc = 0;
+
+	for (prp = dt_list_next(&dtp->dt_enablings); prp != NULL;
+	     prp = dt_list_next(prp))
+		nprobes++;
+
+	if (nprobes == 0)
+		return 0;
+	if (nthreads > nprobes)
+		nthreads = nprobes;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.dtp = dtp;
+	pool.qsize = 2 * nthreads;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cv, NULL);
+
+	jobs = dt_calloc(dtp, nprobes, sizeof(dt_bpf_loadjob_t));
+	tids = dt_calloc(dtp, nthreads, sizeof(pthread_t));
+	pool.queue = dt_calloc(dtp, pool.qsize, sizeof(dt_bpf_loadjob_t *));
+	if (jobs == NULL || tids == NULL || pool.queue == NULL) {
+		rc = -1;
+		goto out;
+	}
+
+	/*
+	 * Block all signals in the worker threads, so they get delivered to
+	 * the main thread.
+	 */
+	sigfillset(&nset);
+	pthread_sigmask(SIG_SETMASK, &nset, &oset);
+	for (ntids = 0; ntids < nthreads; ntids++) {
+		err = pthread_create(&tids[ntids], NULL, dt_bpf_loadpool_worker,
+				     &pool);
+		if (err != 0)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	if (ntids == 0) {
+		rc = dt_set_errno(dtp, err);
+		goto out;
+	}
+
+	for (prp = dt_list_next(&dtp->dt_enablings); prp != NULL;
+	     prp = dt_list_next(prp)) {
+		dt_bpf_loadjob_t	*job = &jobs[njobs];
+		dtrace_difo_t		*dp;
+		uint64_t		epoff;
+
+		dp = dt_program_construct(dtp, prp, cflags, &epoff);
+		if (dp == NULL) {
+			rc = -1;
+			break;
+		}
+
+		/*
+		 * Shared programs are loaded and attached once all other
+		 * programs are done.
+		 */
+		dt_bpf_prog_attr(dtp, prp, &job->attr);
+		if (job->attr.shared) {
+			rc = dt_bpf_shared_add(dtp, shared, dp, prp, epoff);
+			if (rc < 0)
+				break;
+
+			continue;
+		}
+
+		if (!prp->prov->impl->attach) {
+			rc = dt_set_errno(dtp, EINVAL);
+			break;
+		}
+
+		/*
+		 * Perform the probe-specific relocations, and give the job its
+		 * own copy of the program because the next probe may reuse the
+		 * same (cached) program.
+		 */
+		if (dp->dtdo_brelen)
+			dt_bpf_reloc_prog(dtp, prp, dp);
+
+		job->prp = prp;
+		job->insns_cnt = dp->dtdo_len;
+		job->insns = dt_alloc(dtp, dp->dtdo_len *
+					   sizeof(struct bpf_insn));
+		if (job->insns == NULL) {
+			rc = -1;
+			break;
+		}
+		memcpy(job->insns, dp->dtdo_buf,
+		       dp->dtdo_len * sizeof(struct bpf_insn));
+
+		if (dt_bpf_loadpool_queue(&pool, job) != 0) {
+			dt_free(dtp, job->insns);
+			break;
+		}
+
+		njobs++;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.done = 1;
+	pthread_cond_broadcast(&pool.cv);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < ntids; i++)
+		pthread_join(tids[i], NULL);
+
+	for (i = 0; i < njobs; i++)
+		dt_bpf_load_stats(dtp, jobs[i].prp, jobs[i].load_time,
+				  jobs[i].attach_time);
+
+	/*
+	 * Report the first failed job (if any).  A failure in constructing
+	 * a program applies to a probe after all queued jobs, so it is only
+	 * reported if none of the jobs failed.
+	 *
+	 * If the provider of a probe for a failed job falls back to another
+	 * implementation of the probe, it is loaded and attached again (by
+	 * this thread).
+	 */
+	for (i = 0; i < njobs; i++) {
+		dt_bpf_loadjob_t	*job = &jobs[i];
+
+		if (job->rc >= 0)
+			continue;
+
+		if (dt_bpf_fallback(dtp, job->prp)) {
+			if (dt_bpf_load_attach(dtp, job->prp, cflags,
+					       shared) == 0)
+				continue;
+
+			rc = -1;
+			break;
+		}
+
+		if (job->log != NULL)
+			rc = dt_bpf_prog_error(dtp, job->prp, job->err,
+					       job->log);
+		else
+			rc = dt_set_errno(dtp, job->err);
+
+		break;
+	}
+
+out:
+	if (jobs != NULL) {
+		for (i = 0; i < njobs; i++)
+			free(jobs[i].log);
+	}
+
+	dt_free(dtp, pool.queue);
+	dt_free(dtp, tids);
+	dt_free(dtp, jobs);
+	pthread_cond_destroy(&pool.cv);
+	pthread_mutex_destroy(&pool.lock);
+
+	return rc;
+}
+
+/*
+ * Load and attach the programs for all enabled probes.  Probes that share the
+ * same program (see dt_program_construct()) only cause it to be constructed
+ * once.  If their provider supports it, it is also only loaded once.
+ *
+ * If the 'loadthreads' option is set to a value greater than 1, programs are
+ * loaded and attached using a pool of that many worker threads.
+ */
+int
+dt_bpf_load_progs(dtrace_hdl_t *dtp, uint_t cflags)
+{
+	dtrace_optval_t	nthreads = dtp->dt_options[DTRACEOPT_LOADTHREADS];
+	dt_list_t	shared = { NULL, };
+	dt_probe_t	*prp;
+	int		rc = 0;
+
+	if (nthreads != DTRACEOPT_UNSET && nthreads > 1)
+		rc = dt_bpf_load_progs_parallel(dtp, cflags, nthreads,
+						&shared);
+	else {
+		for (prp = dt_list_next(&dtp->dt_enablings); prp != NULL;
+		     prp = dt_list_next(prp)) {
+			rc = dt_bpf_load_attach(dtp, prp, cflags, &shared);
+			if (rc < 0)
+				break;
+		}
+	}
+
+	if (rc < 0)
+		dt_bpf_shared_free(dtp, &shared);
+	else
+		rc = dt_bpf_shared_load_attach(dtp, &shared, cflags);
+
+	dt_program_cache_destroy(dtp);
+
+	return rc < 0 ? rc : 0;
+}
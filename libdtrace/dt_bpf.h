@@ -10,6 +10,7 @@
 
 #include <linux/perf_event.h>
 #include <dt_impl.h>
+#include <dt_provider.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -17,14 +18,55 @@ extern "C" {
 
 #define DT_CONST_EPID	1
 #define DT_CONST_ARGC	2
+#define DT_CONST_NCPUS	3
+#define DT_CONST_RBWMARK	4
+
+/*
+ * BPF helper that returns the BPF cookie of the attachment that a program was
+ * triggered through (Linux 5.15).
+ */
+#define DT_BPF_FUNC_GET_ATTACH_COOKIE	174	/* BPF_FUNC_get_attach_cookie */
+
+/*
+ * Each associative array and each thread-local variable is stored in its own
+ * BPF hash map, named after the variable ID.
+ */
+#define DT_ASSOC_MAPNAME	"assoc_%u"
+#define DT_TVAR_MAPNAME		"tvar_%u"
+
+/*
+ * Each aggregation is stored in its own per-CPU BPF hash map, named after the
+ * aggregation ID.  Map values consist of a 64-bit update counter followed by
+ * the aggregation data.  When aggregations are double-buffered (aggdbuf), each
+ * aggregation has a second map, and the 'aggsel' map holds the index of the
+ * map that BPF programs currently write to.
+ */
+#define DT_AGG_MAPNAME	"agg_%u"
+#define DT_AGG_MAPNAME_ALT	"agg_%u_1"
+#define DT_AGG_HDRSZ	sizeof(uint64_t)
 
 extern int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
 			   int group_fd, unsigned long flags);
 extern int bpf(enum bpf_cmd cmd, union bpf_attr *attr);
 
 extern int dt_bpf_gmap_create(dtrace_hdl_t *);
+extern int dt_bpf_map_lookup(int fd, const void *key, void *val);
+extern int dt_bpf_map_next_key(int fd, const void *key, void *nxt);
 extern int dt_bpf_map_update(int fd, const void *key, const void *val);
+extern int dt_bpf_map_delete(int fd, const void *key);
+extern int dt_bpf_map_lookup_batch(int fd, const void *in, void *out,
+				   void *keys, void *vals, uint32_t *cnt);
+extern int dt_bpf_map_lookup_and_delete_batch(int fd, const void *in,
+					      void *out, void *keys,
+					      void *vals, uint32_t *cnt);
 extern int dt_bpf_load_progs(dtrace_hdl_t *, uint_t);
+extern void dt_bpf_prog_attr(dtrace_hdl_t *, const struct dt_probe *,
+			     dt_progattr_t *);
+extern void dt_bpf_stats_enable(dtrace_hdl_t *);
+extern int dt_bpf_stats_enabled(dtrace_hdl_t *);
+extern int dt_bpf_prog_stats(int fd, uint64_t *cntp, uint64_t *timep);
+extern int dt_bpf_prog_sync(void);
+extern int dt_bpf_have_attach_cookie(void);
 
 #ifdef	__cplusplus
 }
@@ -15,13 +15,10 @@ extern "C" {
 
 #define DT_BPF_MAP_BUILTINS(FN) \
 	FN(get_bvar), \
-	FN(get_gvar), \
 	FN(get_string), \
-	FN(get_tvar), \
 	FN(memcpy), \
-	FN(set_gvar), \
-	FN(set_tvar), \
-	FN(strnlen)
+	FN(strnlen), \
+	FN(tlskey)
 
 #define DT_BPF_ENUM_FN(x, y)	DT_BPF_ ## x
 enum dt_bpf_builtin_ids {
@@ -0,0 +1,461 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/btf.h>
+
+#include <dt_impl.h>
+#include <dt_btf.h>
+
+#define BTF_VMLINUX	"/sys/kernel/btf/vmlinux"
+
+/*
+ * Type kinds that were added after BTF was first introduced.  We only need to
+ * know how large their descriptions are.
+ */
+#ifndef BTF_KIND_FLOAT
+#define BTF_KIND_FLOAT		16
+#endif
+#ifndef BTF_KIND_DECL_TAG
+#define BTF_KIND_DECL_TAG	17
+#endif
+#ifndef BTF_KIND_TYPE_TAG
+#define BTF_KIND_TYPE_TAG	18
+#endif
+#ifndef BTF_KIND_ENUM64
+#define BTF_KIND_ENUM64		19
+#endif
+
+/*
+ * Return the size of the description of the given type (including any data
+ * that follows the type header), or -1 if the type kind is not known.
+ */
+static int
+dt_btf_type_size(const struct btf_type *t)
+{
+	int	vlen = BTF_INFO_VLEN(t->info);
+
+	switch (BTF_INFO_KIND(t->info)) {
+	case BTF_KIND_PTR:
+	case BTF_KIND_FWD:
+	case BTF_KIND_TYPEDEF:
+	case BTF_KIND_VOLATILE:
+	case BTF_KIND_CONST:
+	case BTF_KIND_RESTRICT:
+	case BTF_KIND_FUNC:
+	case BTF_KIND_FLOAT:
+	case BTF_KIND_TYPE_TAG:
+		return sizeof(struct btf_type);
+	case BTF_KIND_INT:
+	case BTF_KIND_DECL_TAG:
+		return sizeof(struct btf_type) + sizeof(uint32_t);
+	case BTF_KIND_ARRAY:
+		return sizeof(struct btf_type) + sizeof(struct btf_array);
+	case BTF_KIND_STRUCT:
+	case BTF_KIND_UNION:
+		return sizeof(struct btf_type) +
+		       vlen * sizeof(struct btf_member);
+	case BTF_KIND_ENUM:
+		return sizeof(struct btf_type) + vlen * sizeof(struct btf_enum);
+	case BTF_KIND_ENUM64:
+		return sizeof(struct btf_type) + vlen * 3 * sizeof(uint32_t);
+	case BTF_KIND_FUNC_PROTO:
+		return sizeof(struct btf_type) +
+		       vlen * sizeof(struct btf_param);
+	case BTF_KIND_VAR:
+		return sizeof(struct btf_type) + sizeof(uint32_t);
+	case BTF_KIND_DATASEC:
+		return sizeof(struct btf_type) + vlen * 3 * sizeof(uint32_t);
+	default:
+		return -1;
+	}
+}
+
+static const char *
+dt_btf_name(const dt_btf_t *btf, uint32_t off)
+{
+	return off < btf->strsz ? btf->strtab + off : NULL;
+}
+
+static const struct btf_type *
+dt_btf_type(const dt_btf_t *btf, uint32_t id)
+{
+	return id < btf->ntypes ? btf->types[id] : NULL;
+}
+
+/*
+ * Skip type modifiers and (optionally) typedefs.
+ */
+static const struct btf_type *
+dt_btf_skip(const dt_btf_t *btf, uint32_t *idp, int typedefs)
+{
+	const struct btf_type	*t;
+
+	while ((t = dt_btf_type(btf, *idp)) != NULL) {
+		switch (BTF_INFO_KIND(t->info)) {
+		case BTF_KIND_TYPEDEF:
+			if (!typedefs)
+				return t;
+			/* fallthrough */
+		case BTF_KIND_VOLATILE:
+		case BTF_KIND_CONST:
+		case BTF_KIND_RESTRICT:
+		case BTF_KIND_TYPE_TAG:
+			*idp = t->type;
+			continue;
+		default:
+			return t;
+		}
+	}
+
+	return NULL;
+}
+
+static const dt_btf_t	*dt_btf_sort;
+
+static int
+dt_btf_func_cmp(const void *lp, const void *rp)
+{
+	const dt_btf_t	*btf = dt_btf_sort;
+
+	return strcmp(dt_btf_name(btf, btf->types[*(uint32_t *)lp]->name_off),
+		      dt_btf_name(btf, btf->types[*(uint32_t *)rp]->name_off));
+}
+
+/*
+ * Index the types in the BTF data, and build a list of functions sorted by
+ * name.
+ */
+static int
+dt_btf_index(dtrace_hdl_t *dtp, dt_btf_t *btf)
+{
+	const struct btf_header	*hdr = (struct btf_header *)btf->data;
+	const char		*p, *end;
+	uint32_t		n;
+
+	if (btf->size < sizeof(struct btf_header) ||
+	    hdr->magic != BTF_MAGIC || hdr->version != BTF_VERSION ||
+	    hdr->hdr_len > btf->size ||
+	    hdr->type_off + hdr->type_len > btf->size - hdr->hdr_len ||
+	    hdr->str_off + hdr->str_len > btf->size - hdr->hdr_len)
+		return -1;
+
+	btf->strtab = btf->data + hdr->hdr_len + hdr->str_off;
+	btf->strsz = hdr->str_len;
+
+	/*
+	 * Count the types first.  Type id 0 is void, and it is not described
+	 * in the type section.
+	 */
+	p = btf->data + hdr->hdr_len + hdr->type_off;
+	end = p + hdr->type_len;
+	for (n = 1; p < end; n++) {
+		int	sz = dt_btf_type_size((struct btf_type *)p);
+
+		if (sz < 0 || p + sz > end)
+			return -1;
+
+		p += sz;
+	}
+
+	btf->ntypes = n;
+	btf->types = dt_calloc(dtp, n, sizeof(struct btf_type *));
+	if (btf->types == NULL)
+		return -1;
+
+	p = btf->data + hdr->hdr_len + hdr->type_off;
+	for (n = 1; n < btf->ntypes; n++) {
+		const struct btf_type	*t = (struct btf_type *)p;
+
+		btf->types[n] = t;
+		if (BTF_INFO_KIND(t->info) == BTF_KIND_FUNC &&
+		    dt_btf_name(btf, t->name_off) != NULL)
+			btf->nfuncs++;
+
+		p += dt_btf_type_size(t);
+	}
+
+	btf->funcs = dt_calloc(dtp, btf->nfuncs, sizeof(uint32_t));
+	if (btf->funcs == NULL)
+		return -1;
+
+	btf->nfuncs = 0;
+	for (n = 1; n < btf->ntypes; n++) {
+		const struct btf_type	*t = btf->types[n];
+
+		if (BTF_INFO_KIND(t->info) == BTF_KIND_FUNC &&
+		    dt_btf_name(btf, t->name_off) != NULL)
+			btf->funcs[btf->nfuncs++] = n;
+	}
+
+	dt_btf_sort = btf;
+	qsort(btf->funcs, btf->nfuncs, sizeof(uint32_t), dt_btf_func_cmp);
+	dt_btf_sort = NULL;
+
+	return 0;
+}
+
+static dt_btf_t *
+dt_btf_load(dtrace_hdl_t *dtp, const char *path)
+{
+	dt_btf_t	*btf;
+	struct stat	st;
+	ssize_t		len;
+	size_t		off = 0;
+	int		fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	btf = dt_zalloc(dtp, sizeof(dt_btf_t));
+	if (btf == NULL || fstat(fd, &st) == -1 || st.st_size <= 0)
+		goto fail;
+
+	/*
+	 * Files in sysfs report their actual size.
+	 */
+	btf->size = st.st_size;
+	btf->data = dt_alloc(dtp, btf->size);
+	if (btf->data == NULL)
+		goto fail;
+
+	while (off < btf->size) {
+		len = read(fd, btf->data + off, btf->size - off);
+		if (len <= 0)
+			goto fail;
+
+		off += len;
+	}
+
+	if (dt_btf_index(dtp, btf) != 0)
+		goto fail;
+
+	close(fd);
+
+	dt_dprintf("loaded BTF from %s (%u types, %u functions)\n", path,
+		   btf->ntypes, btf->nfuncs);
+
+	return btf;
+
+fail:
+	dt_dprintf("cannot load BTF from %s\n", path);
+	close(fd);
+	dt_btf_destroy(dtp, btf);
+
+	return NULL;
+}
+
+/*
+ * Return the BTF data for the core kernel, or NULL if it is not available.
+ * It is only loaded once, when it is first needed.
+ */
+dt_btf_t *
+dt_btf_load_vmlinux(dtrace_hdl_t *dtp)
+{
+	if (dtp->dt_btf == NULL && !dtp->dt_btf_loaded) {
+		dtp->dt_btf_loaded = 1;
+		dtp->dt_btf = dt_btf_load(dtp, BTF_VMLINUX);
+	}
+
+	return dtp->dt_btf;
+}
+
+void
+dt_btf_destroy(dtrace_hdl_t *dtp, dt_btf_t *btf)
+{
+	if (btf == NULL)
+		return;
+
+	dt_free(dtp, btf->funcs);
+	dt_free(dtp, btf->types);
+	dt_free(dtp, btf->data);
+	dt_free(dtp, btf);
+}
+
+/*
+ * Return whether a value of the given type can be passed in a register (i.e.
+ * it is not a struct or union passed by value).
+ */
+static int
+dt_btf_scalar(const dt_btf_t *btf, uint32_t id)
+{
+	const struct btf_type	*t = dt_btf_skip(btf, &id, 1);
+
+	if (t == NULL)
+		return id == 0;
+
+	switch (BTF_INFO_KIND(t->info)) {
+	case BTF_KIND_INT:
+	case BTF_KIND_PTR:
+	case BTF_KIND_ENUM:
+	case BTF_KIND_ENUM64:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Look up the function with the given name, and describe it for the purpose
+ * of attaching fentry/fexit programs.  Functions that appear more than once
+ * (static functions in different compilation units), that take a variable
+ * number of arguments or too many arguments, and that pass structs by value
+ * are not supported.
+ */
+int
+dt_btf_func(const dt_btf_t *btf, const char *name, dt_btf_func_t *fp)
+{
+	const struct btf_type	*t;
+	const struct btf_param	*parm;
+	uint32_t		lo = 0, hi = btf->nfuncs;
+	uint32_t		id;
+	int			i, argc;
+
+	while (lo < hi) {
+		uint32_t	mid = (lo + hi) / 2;
+		int		cmp;
+
+		t = btf->types[btf->funcs[mid]];
+		cmp = strcmp(name, dt_btf_name(btf, t->name_off));
+		if (cmp == 0) {
+			lo = mid;
+			break;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	if (lo >= hi)
+		return -1;
+
+	if ((lo > 0 && strcmp(name, dt_btf_name(btf,
+			btf->types[btf->funcs[lo - 1]]->name_off)) == 0) ||
+	    (lo + 1 < btf->nfuncs && strcmp(name, dt_btf_name(btf,
+			btf->types[btf->funcs[lo + 1]]->name_off)) == 0))
+		return -1;
+
+	id = btf->funcs[lo];
+	t = dt_btf_type(btf, btf->types[id]->type);
+	if (t == NULL || BTF_INFO_KIND(t->info) != BTF_KIND_FUNC_PROTO)
+		return -1;
+
+	argc = BTF_INFO_VLEN(t->info);
+	parm = (const struct btf_param *)(t + 1);
+	if (argc > DT_BTF_MAX_ARGS ||
+	    (argc > 0 && parm[argc - 1].type == 0))
+		return -1;
+
+	for (i = 0; i < argc; i++) {
+		if (!dt_btf_scalar(btf, parm[i].type))
+			return -1;
+	}
+
+	if (t->type != 0 && !dt_btf_scalar(btf, t->type))
+		return -1;
+
+	fp->id = id;
+	fp->argc = argc;
+	fp->retval = t->type != 0;
+
+	return 0;
+}
+
+/*
+ * Write the C declaration of the given type (without qualifiers) into the
+ * given buffer.  Returns -1 for types that cannot be named, e.g. anonymous
+ * structs and function pointers.
+ */
+static int
+dt_btf_type_name(const dt_btf_t *btf, uint32_t id, char *buf, size_t len)
+{
+	const struct btf_type	*t = dt_btf_skip(btf, &id, 0);
+	const char		*name, *tag = "";
+	int			n;
+
+	if (id == 0) {
+		n = snprintf(buf, len, "void");
+		return n >= 0 && (size_t)n < len ? 0 : -1;
+	}
+
+	if (t == NULL)
+		return -1;
+
+	name = dt_btf_name(btf, t->name_off);
+
+	switch (BTF_INFO_KIND(t->info)) {
+	case BTF_KIND_PTR:
+		/*
+		 * Pointers to types that cannot be named become void pointers.
+		 */
+		if (dt_btf_type_name(btf, t->type, buf, len) != 0 &&
+		    dt_btf_type_name(btf, 0, buf, len) != 0)
+			return -1;
+
+		if (strlen(buf) + 2 >= len)
+			return -1;
+
+		strcat(buf, " *");
+		return 0;
+	case BTF_KIND_STRUCT:
+		tag = "struct ";
+		break;
+	case BTF_KIND_UNION:
+		tag = "union ";
+		break;
+	case BTF_KIND_ENUM:
+	case BTF_KIND_ENUM64:
+		tag = "enum ";
+		break;
+	case BTF_KIND_FWD:
+		tag = BTF_INFO_KFLAG(t->info) ? "union " : "struct ";
+		break;
+	case BTF_KIND_INT:
+	case BTF_KIND_TYPEDEF:
+		break;
+	default:
+		return -1;
+	}
+
+	if (name == NULL || *name == '\0')
+		return -1;
+
+	n = snprintf(buf, len, "%s%s", tag, name);
+
+	return n >= 0 && (size_t)n < len ? 0 : -1;
+}
+
+/*
+ * Write the type of the given argument of a function (or its return type if
+ * 'argn' is -1) into the given buffer.  Types that cannot be named are
+ * reported as 64-bit integers, and pointers to such types as void pointers.
+ */
+int
+dt_btf_func_type(const dt_btf_t *btf, const dt_btf_func_t *fp, int argn,
+		 char *buf, size_t len)
+{
+	const struct btf_type	*t = btf->types[btf->types[fp->id]->type];
+	const struct btf_param	*parm = (const struct btf_param *)(t + 1);
+	uint32_t		id;
+
+	if (argn >= fp->argc)
+		return -1;
+
+	id = argn < 0 ? t->type : parm[argn].type;
+	if (dt_btf_type_name(btf, id, buf, len) == 0)
+		return 0;
+
+	return snprintf(buf, len, "uint64_t") < (int)len ? 0 : -1;
+}
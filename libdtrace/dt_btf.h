@@ -0,0 +1,63 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#ifndef	_DT_BTF_H
+#define	_DT_BTF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <dt_impl.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * BTF type information, as exposed by the kernel in /sys/kernel/btf/vmlinux.
+ * Only functions and their prototypes are of interest: they identify the
+ * attach target of fentry/fexit programs, and describe the arguments those
+ * programs can access.
+ */
+typedef struct dt_btf {
+	char		*data;		/* raw BTF data */
+	size_t		size;		/* size of the raw BTF data */
+	const char	*strtab;	/* string section */
+	uint32_t	strsz;		/* size of the string section */
+	uint32_t	ntypes;		/* number of types (including void) */
+	const struct btf_type **types;	/* types, indexed by type id */
+	uint32_t	nfuncs;		/* number of functions */
+	uint32_t	*funcs;		/* function type ids, sorted by name */
+} dt_btf_t;
+
+/*
+ * The maximum number of arguments that fentry/fexit programs can access.
+ */
+#define DT_BTF_MAX_ARGS		6
+
+/*
+ * Description of a function that fentry/fexit programs can be attached to.
+ * Arguments are accessed as an array of 64-bit values; for fexit programs the
+ * return value (if any) follows the arguments.
+ */
+typedef struct dt_btf_func {
+	int32_t		id;		/* BTF type id of the function */
+	int		argc;		/* number of arguments */
+	int		retval;		/* whether there is a return value */
+} dt_btf_func_t;
+
+extern dt_btf_t *dt_btf_load_vmlinux(dtrace_hdl_t *);
+extern void dt_btf_destroy(dtrace_hdl_t *, dt_btf_t *);
+extern int dt_btf_func(const dt_btf_t *, const char *, dt_btf_func_t *);
+extern int dt_btf_func_type(const dt_btf_t *, const dt_btf_func_t *, int,
+			    char *, size_t);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _DT_BTF_H */
@@ -89,6 +89,7 @@
 #include <dt_string.h>
 #include <dt_impl.h>
 #include <dt_bpf.h>
+#include <dt_ringbuf.h>
 #include <bpf_asm.h>
 
 extern int yylineno;
@@ -2290,9 +2291,28 @@ out:
 	return err ? NULL : dp;
 }
 
+/*
+ * Cached program, constructed and linked for a given provider trampoline
+ * (and variant), probe argument count, and list of clauses.
+ */
+typedef struct dt_progcache {
+	dt_list_t		pce_list;	/* next/prev cached program */
+	dt_hentry_t		pce_he;		/* htab links */
+	const dt_provimpl_t	*pce_impl;	/* provider implementation */
+	int			pce_variant;	/* trampoline variant */
+	int			pce_shared;	/* program shared by probes */
+	dtrace_epid_t		pce_epbase;	/* first EPID (if shared) */
+	int			pce_argc;	/* probe argument count */
+	uint_t			pce_clausec;	/* number of clauses */
+	dt_ident_t		**pce_clausev;	/* clauses */
+	uint_t			pce_ddescc;	/* number of data descs */
+	dtrace_datadesc_t	**pce_ddescv;	/* data descriptions */
+	dtrace_difo_t		*pce_difo;	/* linked program */
+} dt_progcache_t;
+
 static int
 dt_link_layout(dtrace_hdl_t *dtp, const dtrace_difo_t *dp, uint_t *pcp,
-	       uint_t *rcp, uint_t *vcp)
+	       uint_t *rcp, uint_t *vcp, uint_t *dcp)
 {
 	uint_t			pc = *pcp;
 	uint_t			len = dp->dtdo_brelen;
@@ -2317,7 +2337,9 @@ dt_link_layout(dtrace_hdl_t *dtp, const dtrace_difo_t *dp, uint_t *pcp,
 		rdp = dt_dlib_get_func_difo(dtp, idp);
 		if (rdp == NULL)
 			return -1;
-		ipc = dt_link_layout(dtp, rdp, pcp, rcp, vcp);
+		if (rdp->dtdo_ddesc != NULL)
+			(*dcp)++;
+		ipc = dt_link_layout(dtp, rdp, pcp, rcp, vcp, dcp);
 		if (ipc == -1)
 			return -1;
 		idp->di_id = ipc;
@@ -2326,10 +2348,21 @@ dt_link_layout(dtrace_hdl_t *dtp, const dtrace_difo_t *dp, uint_t *pcp,
 	return pc;
 }
 
+/*
+ * Copy the executable code for a function (and recursively, for the functions
+ * it calls) into the final program.
+ *
+ * Functions that have a data description (i.e. clauses) are recorded in ddv[]
+ * in the order they are linked in.  EPIDs are probe-specific, so relocations
+ * against EPID are not resolved here.  Instead, their value is set to the
+ * (1-based) index of the data description of the function they appear in, or
+ * 0 if there is none.  See dt_program_reloc().
+ */
 static int
-dt_link_construct(dtrace_hdl_t *dtp, const dt_probe_t *prp, dtrace_difo_t *dp,
+dt_link_construct(dtrace_hdl_t *dtp, dtrace_difo_t *dp,
 		  const dtrace_difo_t *sdp, dt_strtab_t *stab,
-		  uint_t *pcp, uint_t *rcp, uint_t *vcp, dtrace_epid_t epid)
+		  uint_t *pcp, uint_t *rcp, uint_t *vcp,
+		  dtrace_datadesc_t **ddv, uint_t *dcp, uint_t didx)
 {
 	uint_t			pc = *pcp;
 	uint_t			rc = *rcp;
@@ -2402,7 +2435,7 @@ dt_link_construct(dtrace_hdl_t *dtp, const dt_probe_t *prp, dtrace_difo_t *dp,
 		const char	*name = &sdp->dtdo_strtab[rp->dofr_name];
 		dt_ident_t	*idp = dt_dlib_get_sym(dtp, name);
 		dtrace_difo_t	*rdp;
-		dtrace_epid_t	nepid;
+		uint_t		ndidx;
 		int		ipc;
 
 		if (idp == NULL)			/* not found */
@@ -2412,11 +2445,18 @@ dt_link_construct(dtrace_hdl_t *dtp, const dt_probe_t *prp, dtrace_difo_t *dp,
 		case DT_IDENT_SCALAR:			/* constant */
 			switch (idp->di_id) {
 			case DT_CONST_EPID:
-				nrp->dofr_data = epid;	/* set vakue */
+				nrp->dofr_data = didx;	/* resolved later */
 				break;
 			case DT_CONST_ARGC:
 				nrp->dofr_data = 0;	/* FIXME */
 				break;
+			case DT_CONST_NCPUS:
+				nrp->dofr_data =
+					dtp->dt_conf.num_possible_cpus;
+				break;
+			case DT_CONST_RBWMARK:
+				nrp->dofr_data = dt_ringbuf_wmark(dtp);
+				break;
 			}
 
 			break;
@@ -2429,13 +2469,13 @@ dt_link_construct(dtrace_hdl_t *dtp, const dt_probe_t *prp, dtrace_difo_t *dp,
 			rdp = dt_dlib_get_func_difo(dtp, idp);
 			if (rdp == NULL)
 				return -1;
-			if (rdp->dtdo_ddesc != NULL)
-				nepid = dt_epid_add(dtp, rdp->dtdo_ddesc,
-						    prp->desc->id);
-			else
-				nepid = 0;
-			ipc = dt_link_construct(dtp, prp, dp, rdp, stab,
-						pcp, rcp, vcp, nepid);
+			if (rdp->dtdo_ddesc != NULL) {
+				ddv[(*dcp)++] = rdp->dtdo_ddesc;
+				ndidx = *dcp;
+			} else
+				ndidx = 0;
+			ipc = dt_link_construct(dtp, dp, rdp, stab, pcp, rcp,
+						vcp, ddv, dcp, ndidx);
 			if (ipc == -1)
 				return -1;
 
@@ -2469,11 +2509,15 @@ dt_link_resolve(dtrace_hdl_t *dtp, dtrace_difo_t *dp)
 			continue;
 
 		/*
-		 * We are only relocating constants (EPID and ARGC) and call
-		 * instructions to functions that have been linked in.
+		 * We are only relocating constants (ARGC, NCPUS) and call
+		 * instructions to functions that have been linked in.  The EPID
+		 * is probe-specific (see dt_program_reloc()).
 		 */
 		switch (idp->di_kind) {
 		case DT_IDENT_SCALAR:
+			if (idp->di_id == DT_CONST_EPID)
+				continue;
+
 			val = rp->dofr_data;
 			break;
 		case DT_IDENT_SYMBOL:
@@ -2494,24 +2538,34 @@ dt_link_resolve(dtrace_hdl_t *dtp, dtrace_difo_t *dp)
 }
 
 static int
-dt_link(dtrace_hdl_t *dtp, const dt_probe_t *prp, dtrace_difo_t *dp)
+dt_link(dtrace_hdl_t *dtp, dt_progcache_t *pce)
 {
+	dtrace_difo_t	*dp = pce->pce_difo;
 	uint_t		insc = 0;
 	uint_t		relc = 0;
 	uint_t		varc = 0;
+	uint_t		ddc = 0;
 	dtrace_difo_t	*fdp = NULL;
 	dt_strtab_t	*stab;
 	int		rc;
 
 	/*
 	 * Determine the layout of the final (linked) DIFO, and calculate the
-	 * total instruction, relocation record, and variable table counts.
+	 * total instruction, relocation record, variable table, and data
+	 * description counts.
 	 */
-	rc = dt_link_layout(dtp, dp, &insc, &relc, &varc);
+	rc = dt_link_layout(dtp, dp, &insc, &relc, &varc, &ddc);
 	dt_dlib_reset(dtp, B_TRUE);
 	if (rc == -1)
 		goto fail;
 
+	if (ddc) {
+		pce->pce_ddescv = dt_calloc(dtp, ddc,
+					    sizeof(dtrace_datadesc_t *));
+		if (pce->pce_ddescv == NULL)
+			goto nomem;
+	}
+
 	/*
 	 * Allocate memory for constructing the final DIFO.
 	 */
@@ -2545,10 +2599,12 @@ dt_link(dtrace_hdl_t *dtp, const dt_probe_t *prp, dtrace_difo_t *dp)
 	if (stab == NULL)
 		goto nomem;
 
-	rc = dt_link_construct(dtp, prp, fdp, dp, stab, &insc, &relc, &varc, 0);
+	rc = dt_link_construct(dtp, fdp, dp, stab, &insc, &relc, &varc,
+			       pce->pce_ddescv, &pce->pce_ddescc, 0);
 	dt_dlib_reset(dtp, B_FALSE);
 	if (rc == -1)
 		goto fail;
+	assert(pce->pce_ddescc == ddc);
 
 	/*
 	 * Replace the program DIFO instruction buffer, BPF relocation table,
@@ -2604,29 +2660,306 @@ nomem:
 	goto fail;
 }
 
-dtrace_difo_t *
-dt_program_construct(dtrace_hdl_t *dtp, dt_probe_t *prp, uint_t cflags)
+static int
+dt_progcache_count(dtrace_hdl_t *dtp, dt_ident_t *idp, uint_t *np)
 {
-	dtrace_difo_t *dp;
+	(*np)++;
 
-	assert(prp != NULL);
+	return 0;
+}
 
-	dp = dt_construct(dtp, prp, cflags);
-	if (dp == NULL)
+static int
+dt_progcache_add(dtrace_hdl_t *dtp, dt_ident_t *idp, dt_progcache_t *pce)
+{
+	pce->pce_clausev[pce->pce_clausec++] = idp;
+
+	return 0;
+}
+
+/*
+ * The program cache is indexed by a hashtable, keyed by the provider
+ * trampoline (and variant), the probe argument count, and the list of clauses.
+ */
+static uint32_t
+dt_progcache_hval(const dt_progcache_t *pce)
+{
+	uint32_t	hval = (uintptr_t)pce->pce_impl >> 4;
+	uint_t		i;
+
+	hval = hval * 31 + pce->pce_variant;
+	hval = hval * 31 + pce->pce_shared;
+	hval = hval * 31 + pce->pce_argc;
+	for (i = 0; i < pce->pce_clausec; i++)
+		hval = hval * 31 + ((uintptr_t)pce->pce_clausev[i] >> 4);
+
+	return hval;
+}
+
+static int
+dt_progcache_cmp(const dt_progcache_t *p, const dt_progcache_t *q)
+{
+	if (p->pce_impl != q->pce_impl || p->pce_variant != q->pce_variant ||
+	    p->pce_shared != q->pce_shared || p->pce_argc != q->pce_argc ||
+	    p->pce_clausec != q->pce_clausec)
+		return 1;
+
+	if (p->pce_clausec == 0)
+		return 0;
+
+	return memcmp(p->pce_clausev, q->pce_clausev,
+		      p->pce_clausec * sizeof(dt_ident_t *)) != 0;
+}
+
+static dt_progcache_t *
+dt_progcache_hadd(dt_progcache_t *head, dt_progcache_t *new)
+{
+	if (head == NULL)
+		return new;
+
+	new->pce_he.next = head;
+	head->pce_he.prev = new;
+
+	return new;
+}
+
+static dt_progcache_t *
+dt_progcache_hdel(dt_progcache_t *head, dt_progcache_t *pce)
+{
+	dt_progcache_t	*prev = pce->pce_he.prev;
+	dt_progcache_t	*next = pce->pce_he.next;
+
+	if (prev != NULL)
+		prev->pce_he.next = next;
+	else
+		head = next;
+	if (next != NULL)
+		next->pce_he.prev = prev;
+
+	pce->pce_he.prev = pce->pce_he.next = NULL;
+
+	return head;
+}
+
+static dt_htab_ops_t	dt_progcache_htab_ops = {
+	.hval = (htab_hval_fn)dt_progcache_hval,
+	.cmp = (htab_cmp_fn)dt_progcache_cmp,
+	.add = (htab_add_fn)dt_progcache_hadd,
+	.del = (htab_del_fn)dt_progcache_hdel,
+};
+
+static void
+dt_progcache_free(dtrace_hdl_t *dtp, dt_progcache_t *pce)
+{
+	dt_difo_free(dtp, pce->pce_difo);
+	dt_free(dtp, pce->pce_clausev);
+	dt_free(dtp, pce->pce_ddescv);
+	dt_free(dtp, pce);
+}
+
+/*
+ * Fill in the lookup key for the program of a probe: its provider trampoline
+ * (and variant), its argument count, and the list of its clauses.
+ */
+static int
+dt_progcache_key(dtrace_hdl_t *dtp, dt_progcache_t *key, dt_probe_t *prp,
+		 const dt_progattr_t *attr)
+{
+	uint_t	n = 0;
+
+	memset(key, 0, sizeof(dt_progcache_t));
+	key->pce_impl = prp->prov->impl;
+	key->pce_variant = attr->variant;
+	key->pce_shared = attr->shared;
+	key->pce_argc = prp->argc;
+
+	dt_probe_clause_iter(dtp, prp, (dt_clause_f *)dt_progcache_count, &n);
+	if (n) {
+		key->pce_clausev = dt_calloc(dtp, n, sizeof(dt_ident_t *));
+		if (key->pce_clausev == NULL)
+			return -1;
+	}
+	dt_probe_clause_iter(dtp, prp, (dt_clause_f *)dt_progcache_add, key);
+
+	return 0;
+}
+
+/*
+ * Construct and link the program for a probe, and add it to the program
+ * cache.  The lookup key for the probe becomes the cache entry.
+ */
+static dt_progcache_t *
+dt_progcache_create(dtrace_hdl_t *dtp, dt_probe_t *prp,
+		    const dt_progcache_t *key, uint_t cflags)
+{
+	dt_progcache_t	*pce;
+
+	pce = dt_alloc(dtp, sizeof(dt_progcache_t));
+	if (pce == NULL) {
+		dt_free(dtp, key->pce_clausev);
 		return NULL;
+	}
+
+	*pce = *key;
+
+	pce->pce_difo = dt_construct(dtp, prp, cflags);
+	if (pce->pce_difo == NULL)
+		goto fail;
 
 	if (cflags & DTRACE_C_DIFV && DT_DISASM(dtp, 2))
-		dt_dis_difo(dp, stderr);
+		dt_dis_difo(pce->pce_difo, stderr);
 
-	if (dt_link(dtp, prp, dp) != 0) {
-		dt_difo_free(dtp, dp);
+	if (dt_link(dtp, pce) != 0)
+		goto fail;
+
+	if (dt_htab_insert(dtp->dt_proghash, pce) != 0) {
+		dt_set_errno(dtp, EDT_NOMEM);
+		goto fail;
+	}
+	dt_list_append(&dtp->dt_progcache, pce);
+
+	return pce;
+
+fail:
+	dt_progcache_free(dtp, pce);
+	return NULL;
+}
+
+/*
+ * Perform the probe-specific relocations on a cached program: assign an EPID
+ * to each clause for the given probe, and store it in the instructions that
+ * reference it.  Program loading is serialized, so this can be done in place.
+ *
+ * A shared program is only relocated for the first probe that uses it.  The
+ * EPIDs for a probe are assigned consecutively, so the EPIDs of any other probe
+ * are those of the first probe plus a fixed offset, which is returned in
+ * epoffp.  The probe is attached with this offset as BPF cookie, and the
+ * trampoline prologue retrieves it at runtime (see dt_cg_tramp_prologue()).
+ */
+static int
+dt_program_reloc(dtrace_hdl_t *dtp, dt_progcache_t *pce, dt_probe_t *prp,
+		 uint64_t *epoffp)
+{
+	dtrace_difo_t		*dp = pce->pce_difo;
+	struct bpf_insn		*buf = dp->dtdo_buf;
+	uint_t			len = dp->dtdo_brelen;
+	const dof_relodesc_t	*rp = dp->dtdo_breltab;
+	dtrace_epid_t		*epidv;
+	uint_t			i;
+
+	epidv = dt_calloc(dtp, pce->pce_ddescc + 1, sizeof(dtrace_epid_t));
+	if (epidv == NULL)
+		return dt_set_errno(dtp, EDT_NOMEM);
+
+	for (i = 0; i < pce->pce_ddescc; i++) {
+		epidv[i + 1] = dt_epid_add(dtp, pce->pce_ddescv[i],
+					   prp->desc->id);
+		if (epidv[i + 1] == (dtrace_epid_t)-1) {
+			dt_free(dtp, epidv);
+			return -1;
+		}
+	}
+
+	*epoffp = 0;
+	if (pce->pce_shared && pce->pce_ddescc > 0) {
+		if (pce->pce_epbase != 0) {
+			*epoffp = epidv[1] - pce->pce_epbase;
+			dt_free(dtp, epidv);
+			return 0;
+		}
+
+		pce->pce_epbase = epidv[1];
+	}
+
+	for (; len != 0; len--, rp++) {
+		const char	*name = &dp->dtdo_strtab[rp->dofr_name];
+		dt_ident_t	*idp = dt_dlib_get_sym(dtp, name);
+		uint_t		ioff = rp->dofr_offset /
+				       sizeof(struct bpf_insn);
+
+		if (idp == NULL || idp->di_kind != DT_IDENT_SCALAR ||
+		    idp->di_id != DT_CONST_EPID)
+			continue;
+
+		assert(rp->dofr_data <= pce->pce_ddescc);
+
+		if (rp->dofr_type == R_BPF_64_64) {
+			buf[ioff].imm = epidv[rp->dofr_data];
+			buf[ioff + 1].imm = 0;
+		} else if (rp->dofr_type == R_BPF_64_32)
+			buf[ioff].imm = epidv[rp->dofr_data];
+	}
+
+	dt_free(dtp, epidv);
+
+	return 0;
+}
+
+/*
+ * Return the program for the given probe.
+ *
+ * The program for a probe is determined by the provider trampoline (and the
+ * variant of it that the provider uses for the probe), the probe argument
+ * count, and the clauses that are enabled for the probe, except for
+ * the EPIDs (which are probe-specific).  Programs are therefore constructed and
+ * linked only once for all probes that share those properties, and the EPIDs
+ * are filled in for each probe.  If the provider shares a single loaded program
+ * between probes, the EPIDs are filled in once, and the EPID offset for the
+ * probe is stored in epoffp (see dt_program_reloc()).
+ *
+ * The returned DIFO is owned by the program cache, and it is only valid until
+ * the next call to this function, or to dt_program_cache_destroy().
+ */
+dtrace_difo_t *
+dt_program_construct(dtrace_hdl_t *dtp, dt_probe_t *prp, uint_t cflags,
+		     uint64_t *epoffp)
+{
+	dt_progcache_t	*pce;
+	dt_progcache_t	key;
+	dt_progattr_t	attr;
+
+	assert(prp != NULL);
+
+	if (dtp->dt_proghash == NULL) {
+		dtp->dt_proghash = dt_htab_create(dtp, &dt_progcache_htab_ops);
+		if (dtp->dt_proghash == NULL)
+			return NULL;
+	}
+
+	dt_bpf_prog_attr(dtp, prp, &attr);
+	if (dt_progcache_key(dtp, &key, prp, &attr) != 0)
 		return NULL;
+
+	pce = dt_htab_lookup(dtp->dt_proghash, &key);
+	if (pce != NULL)
+		dt_free(dtp, key.pce_clausev);
+	else {
+		pce = dt_progcache_create(dtp, prp, &key, cflags);
+		if (pce == NULL)
+			return NULL;
 	}
 
+	if (dt_program_reloc(dtp, pce, prp, epoffp) != 0)
+		return NULL;
+
 	if (cflags & DTRACE_C_DIFV && DT_DISASM(dtp, 3))
-		dt_dis_difo(dp, stderr);
+		dt_dis_difo(pce->pce_difo, stderr);
+
+	return pce->pce_difo;
+}
+
+void
+dt_program_cache_destroy(dtrace_hdl_t *dtp)
+{
+	dt_progcache_t	*pce;
+
+	while ((pce = dt_list_next(&dtp->dt_progcache)) != NULL) {
+		dt_list_delete(&dtp->dt_progcache, pce);
+		dt_htab_delete(dtp->dt_proghash, pce);
+		dt_progcache_free(dtp, pce);
+	}
 
-	return dp;
+	dt_htab_destroy(dtp, dtp->dt_proghash);
+	dtp->dt_proghash = NULL;
 }
 
 dtrace_prog_t *
@@ -7,10 +7,12 @@
 
 #include <sys/types.h>
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <setjmp.h>
 #include <assert.h>
 #include <errno.h>
+#include <alloca.h>
 
 #include <dt_impl.h>
 #include <dt_grammar.h>
@@ -19,10 +21,16 @@
 #include <dt_provider.h>
 #include <dt_probe.h>
 #include <dt_bpf_builtins.h>
+#include <dt_bpf.h>
+#include <dt_ringbuf.h>
 #include <bpf_asm.h>
 
 static void dt_cg_xsetx(dt_irlist_t *, dt_ident_t *, uint_t, int, uint64_t);
 static void dt_cg_node(dt_node_t *, dt_irlist_t *, dt_regset_t *);
+static void dt_cg_dvar_load(dt_node_t *, dt_irlist_t *, dt_regset_t *,
+			    dt_ident_t *);
+static void dt_cg_dvar_store(dt_node_t *, dt_irlist_t *, dt_regset_t *,
+			     dt_ident_t *);
 
 /*
  * Generate the generic prologue of the trampoline BPF program.
@@ -44,6 +52,7 @@ dt_cg_tramp_prologue(dt_pcb_t *pcb, uint_t lbl_exit)
 	dt_irlist_t	*dlp = &pcb->pcb_ir;
 	dt_ident_t	*mem = dt_dlib_get_map(pcb->pcb_hdl, "mem");
 	struct bpf_insn	instr;
+	dt_progattr_t	attr;
 
 	assert(mem != NULL);
 
@@ -75,6 +84,7 @@ dt_cg_tramp_prologue(dt_pcb_t *pcb, uint_t lbl_exit)
 	 *		goto exit;
 	 *				//     (%r0 = pointer to dt_mstate_t)
 	 *	dctx.mst = rc;          // stdw [%fp + DCTX_FP(DCTX_MST)], %r0
+	 *	dctx.mst->epoff = 0;	// stdw [%r0 + DMST_EPOFF], 0
 	 */
 	instr = BPF_STORE_IMM(BPF_W, BPF_REG_FP, DCTX_FP(DCTX_MST), 0);
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
@@ -89,6 +99,35 @@ dt_cg_tramp_prologue(dt_pcb_t *pcb, uint_t lbl_exit)
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
 	instr = BPF_STORE(BPF_DW, BPF_REG_FP, DCTX_FP(DCTX_MST), BPF_REG_0);
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_STORE_IMM(BPF_DW, BPF_REG_0, DMST_EPOFF, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	/*
+	 * A program that is shared by multiple probes is attached to each of
+	 * them with the EPID offset for that probe as BPF cookie.
+	 *
+	 *	dctx.mst->epoff = bpf_get_attach_cookie(ctx);
+	 *				// lddw %r1, [%fp + DCTX_FP(DCTX_CTX)]
+	 *				// call bpf_get_attach_cookie
+	 *				// lddw %r1, [%fp + DCTX_FP(DCTX_MST)]
+	 *				// stdw [%r1 + DMST_EPOFF], %r0
+	 *				// mov %r0, %r1
+	 */
+	dt_bpf_prog_attr(pcb->pcb_hdl, pcb->pcb_probe, &attr);
+	if (attr.shared) {
+		instr = BPF_LOAD(BPF_DW, BPF_REG_1, BPF_REG_FP,
+				 DCTX_FP(DCTX_CTX));
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_CALL_HELPER(DT_BPF_FUNC_GET_ATTACH_COOKIE);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_LOAD(BPF_DW, BPF_REG_1, BPF_REG_FP,
+				 DCTX_FP(DCTX_MST));
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_STORE(BPF_DW, BPF_REG_1, DMST_EPOFF, BPF_REG_0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_MOV_REG(BPF_REG_0, BPF_REG_1);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	}
 
 	/*
 	 *      buf = rc + roundup(sizeof(dt_mstate_t), 8);
@@ -154,6 +193,220 @@ dt_cg_tramp_epilogue(dt_pcb_t *pcb, uint_t lbl_exit)
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
 }
 
+/*
+ * Reserve a record in the BPF ring buffer, and use it as output data buffer.
+ * The record starts with the ID of the CPU the program is running on and 4
+ * bytes of padding (see dt_ringbuf.h), followed by the data buffer.  Its size
+ * is not known until all actions in the clause have been processed, so it is
+ * filled in by dt_cg_ringbuf_submit().
+ *
+ *	buf = bpf_ringbuf_reserve(&ringbuf, size, 0);
+ *				// lddw %r1, &ringbuf
+ *				// mov %r2, size
+ *				// mov %r3, 0
+ *				// call bpf_ringbuf_reserve
+ *	if (buf == 0) {		// jne %r0, 0, lbl_ok
+ *		key = 0;	// stw [%fp + DT_STK_SCRATCH_BASE], 0
+ *		ci = bpf_map_lookup_elem(&cpuinfo, &key);
+ *				// lddw %r1, &cpuinfo
+ *				// mov %r2, %fp
+ *				// add %r2, DT_STK_SCRATCH_BASE
+ *				// call bpf_map_lookup_elem
+ *		if (ci == 0)	// jeq %r0, 0, pcb->pcb_exitlbl
+ *			goto exit;
+ *		ci->buf_drops++;
+ *				// lddw %r1, [%r0 + buf_drops]
+ *				// add %r1, 1
+ *				// stdw [%r0 + buf_drops], %r1
+ *		goto exit;	// ja pcb->pcb_exitlbl
+ *	}
+ *				// lbl_ok:
+ *				// mov %r9, %r0
+ *	*((uint32_t *)&buf[0]) = bpf_get_smp_processor_id();
+ *				// call bpf_get_smp_processor_id
+ *				// stw [%r9 + 0], %r0
+ *	*((uint32_t *)&buf[4]) = 0;
+ *				// stw [%r9 + 4], 0
+ *	buf += DT_RINGBUF_HDRSZ;
+ *				// add %r9, DT_RINGBUF_HDRSZ
+ *	*((uint32_t *)&buf[0]) = dctx->mst->epid;
+ *				// lddw %r1, [%fp + DT_STK_DCTX]
+ *				// lddw %r1, [%r1 + DCTX_MST]
+ *				// ldw %r1, [%r1 + DMST_EPID]
+ *				// stw [%r9 + 0], %r1
+ *	*((uint32_t *)&buf[4]) = 0;
+ *				// stw [%r9 + 4], 0
+ *
+ * If the ring buffer is full, the record is dropped.  Drops are counted in the
+ * per-CPU 'cpuinfo' map (the buf_drops member of cpuinfo_t), so the consumer
+ * can report them (see dt_consume_ringbuf_drops()).
+ *
+ * The verifier requires that the record is either submitted or discarded on
+ * every path through the program, so from here on pcb->pcb_exitlbl refers to
+ * code that discards the record (pcb->pcb_retlbl is the plain return).
+ */
+static void
+dt_cg_ringbuf_reserve(dt_pcb_t *pcb)
+{
+	dt_irlist_t	*dlp = &pcb->pcb_ir;
+	dt_ident_t	*ringbuf = dt_dlib_get_map(pcb->pcb_hdl, "ringbuf");
+	dt_ident_t	*cpuinfo = dt_dlib_get_map(pcb->pcb_hdl, "cpuinfo");
+	uint_t		lbl_ok = dt_irlist_label(dlp);
+	struct bpf_insn	instr;
+
+	assert(ringbuf != NULL);
+	assert(cpuinfo != NULL);
+
+	dt_cg_xsetx(dlp, ringbuf, DT_LBL_NONE, BPF_REG_1, ringbuf->di_id);
+	instr = BPF_MOV_IMM(BPF_REG_2, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	pcb->pcb_rbresv = dlp->dl_last;
+	instr = BPF_MOV_IMM(BPF_REG_3, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_ringbuf_reserve);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JNE, BPF_REG_0, 0, lbl_ok);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	instr = BPF_STORE_IMM(BPF_W, BPF_REG_FP, DT_STK_SCRATCH_BASE, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_cg_xsetx(dlp, cpuinfo, DT_LBL_NONE, BPF_REG_1, cpuinfo->di_id);
+	instr = BPF_MOV_REG(BPF_REG_2, BPF_REG_FP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, DT_STK_SCRATCH_BASE);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_map_lookup_elem);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JEQ, BPF_REG_0, 0, pcb->pcb_exitlbl);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_LOAD(BPF_DW, BPF_REG_1, BPF_REG_0,
+			 offsetof(cpuinfo_t, buf_drops));
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, 1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_STORE(BPF_DW, BPF_REG_0, offsetof(cpuinfo_t, buf_drops),
+			  BPF_REG_1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_JUMP(pcb->pcb_exitlbl);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	instr = BPF_MOV_REG(BPF_REG_9, BPF_REG_0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_ok, instr));
+
+	instr = BPF_CALL_HELPER(BPF_FUNC_get_smp_processor_id);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_STORE(BPF_W, BPF_REG_9, 0, BPF_REG_0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_STORE_IMM(BPF_W, BPF_REG_9, 4, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_9, DT_RINGBUF_HDRSZ);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	instr = BPF_LOAD(BPF_DW, BPF_REG_1, BPF_REG_FP, DT_STK_DCTX);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_LOAD(BPF_DW, BPF_REG_1, BPF_REG_1, DCTX_MST);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_LOAD(BPF_W, BPF_REG_1, BPF_REG_1, DMST_EPID);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_STORE(BPF_W, BPF_REG_9, 0, BPF_REG_1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_STORE_IMM(BPF_W, BPF_REG_9, 4, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	pcb->pcb_retlbl = pcb->pcb_exitlbl;
+	pcb->pcb_exitlbl = dt_irlist_label(dlp);
+}
+
+/*
+ * Submit the record that was reserved in the BPF ring buffer by
+ * dt_cg_ringbuf_reserve().  The consumer is only woken up when the amount of
+ * data in the ring buffer reaches the watermark (RBWMARK).
+ *
+ *	flags = BPF_RB_NO_WAKEUP;
+ *	if (bpf_ringbuf_query(&ringbuf, BPF_RB_AVAIL_DATA) >= RBWMARK)
+ *		flags = BPF_RB_FORCE_WAKEUP;
+ *				// lddw %r1, &ringbuf
+ *				// mov %r2, BPF_RB_AVAIL_DATA
+ *				// call bpf_ringbuf_query
+ *				// mov %r1, RBWMARK
+ *				// mov %r2, BPF_RB_NO_WAKEUP
+ *				// jlt %r0, %r1, lbl_submit
+ *				// mov %r2, BPF_RB_FORCE_WAKEUP
+ *	bpf_ringbuf_submit(buf - DT_RINGBUF_HDRSZ, flags);
+ *				// lbl_submit:
+ *				// mov %r1, %r9
+ *				// add %r1, -DT_RINGBUF_HDRSZ
+ *				// call bpf_ringbuf_submit
+ *	return 0;		// mov %r0, 0
+ *				// exit
+ *
+ * exit:
+ *	bpf_ringbuf_discard(buf - DT_RINGBUF_HDRSZ, BPF_RB_NO_WAKEUP);
+ *				// mov %r1, %r9
+ *				// add %r1, -DT_RINGBUF_HDRSZ
+ *				// mov %r2, BPF_RB_NO_WAKEUP
+ *				// call bpf_ringbuf_discard
+ * ret:
+ *	return 0;		// mov %r0, 0
+ *				// exit
+ * }
+ */
+static void
+dt_cg_ringbuf_submit(dt_pcb_t *pcb)
+{
+	dt_irlist_t	*dlp = &pcb->pcb_ir;
+	dt_ident_t	*ringbuf = dt_dlib_get_map(pcb->pcb_hdl, "ringbuf");
+	dt_ident_t	*wmark = dt_dlib_get_var(pcb->pcb_hdl, "RBWMARK");
+	uint_t		lbl_submit = dt_irlist_label(dlp);
+	struct bpf_insn	instr;
+
+	assert(ringbuf != NULL);
+	assert(wmark != NULL);
+	assert(pcb->pcb_rbresv != NULL);
+
+	pcb->pcb_rbresv->di_instr.imm = pcb->pcb_bufoff + DT_RINGBUF_HDRSZ;
+	pcb->pcb_rbresv = NULL;
+
+	dt_cg_xsetx(dlp, ringbuf, DT_LBL_NONE, BPF_REG_1, ringbuf->di_id);
+	instr = BPF_MOV_IMM(BPF_REG_2, BPF_RB_AVAIL_DATA);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_ringbuf_query);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_IMM(BPF_REG_1, -1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dlp->dl_last->di_extern = wmark;
+	instr = BPF_MOV_IMM(BPF_REG_2, BPF_RB_NO_WAKEUP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_REG(BPF_JLT, BPF_REG_0, BPF_REG_1, lbl_submit);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_IMM(BPF_REG_2, BPF_RB_FORCE_WAKEUP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	instr = BPF_MOV_REG(BPF_REG_1, BPF_REG_9);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_submit, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, -(int)DT_RINGBUF_HDRSZ);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_ringbuf_submit);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_IMM(BPF_REG_0, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_RETURN();
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	instr = BPF_MOV_REG(BPF_REG_1, BPF_REG_9);
+	dt_irlist_append(dlp, dt_cg_node_alloc(pcb->pcb_exitlbl, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, -(int)DT_RINGBUF_HDRSZ);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_IMM(BPF_REG_2, BPF_RB_NO_WAKEUP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_ringbuf_discard);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_IMM(BPF_REG_0, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(pcb->pcb_retlbl, instr));
+	instr = BPF_RETURN();
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+}
+
 /*
  * Generate the function prologue.
  *
@@ -168,13 +421,19 @@ dt_cg_tramp_epilogue(dt_pcb_t *pcb, uint_t lbl_exit)
  *	3. Store the epid and tag at [%r9 + 0] and [%r9 + 4] respectively.
  *	4. Evaluate the predicate expression and return if false.
  *
+ * If trace data is written to the BPF ring buffer, the output data buffer is
+ * a record that gets reserved in the ring buffer, so steps 1 and 3 are done
+ * after the predicate has been evaluated (see dt_cg_ringbuf_reserve()).  If
+ * the clause does not produce any output, no record is reserved.
+ *
  * The dt_program() function will always return 0.
  */
 static void
-dt_cg_prologue(dt_pcb_t *pcb, dt_node_t *pred)
+dt_cg_prologue(dt_pcb_t *pcb, dt_node_t *pred, int output)
 {
 	dt_irlist_t	*dlp = &pcb->pcb_ir;
 	dt_ident_t	*epid = dt_dlib_get_var(pcb->pcb_hdl, "EPID");
+	int		rb = output && dt_ringbuf_enabled(pcb->pcb_hdl);
 	struct bpf_insn	instr;
 
 	assert(epid != NULL);
@@ -198,16 +457,24 @@ dt_cg_prologue(dt_pcb_t *pcb, dt_node_t *pred)
 	 */
 	instr = BPF_LOAD(BPF_DW, BPF_REG_0, BPF_REG_FP, DT_STK_DCTX);
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-	instr = BPF_LOAD(BPF_DW, BPF_REG_9, BPF_REG_0, DCTX_BUF);
-	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	if (!rb) {
+		instr = BPF_LOAD(BPF_DW, BPF_REG_9, BPF_REG_0, DCTX_BUF);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	}
 
 	/*
 	 *	dctx->mst->fault = 0;	// lddw %r0, [%r0 + DCTX_MST]
 	 *				// stdw [%r0 + DMST_FAULT], 0
 	 *	dctx->mst->tstamp = 0;	// stdw [%r0 + DMST_TSTAMP], 0
-	 *	dctx->mst->epid = EPID;	// stw [%r0 + DMST_EPID], EPID
-	 *	*((uint32_t *)&buf[0]) = EPID;
-	 *				// stw [%r9 + 0], EPID
+	 *	dctx->mst->epid = dctx->mst->epoff + EPID;
+	 *				// lddw %r1, [%r0 + DMST_EPOFF]
+	 *				// add %r1, EPID
+	 *				// stw [%r0 + DMST_EPID], %r1
+	 *	*((uint32_t *)&buf[0]) = dctx->mst->epid;
+	 *				// stw [%r9 + 0], %r1
+	 *
+	 * The EPID offset is 0 unless the program is shared by multiple probes
+	 * (see dt_program_construct()).
 	 */
 	instr = BPF_LOAD(BPF_DW, BPF_REG_0, BPF_REG_0, DCTX_MST);
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
@@ -215,12 +482,17 @@ dt_cg_prologue(dt_pcb_t *pcb, dt_node_t *pred)
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
 	instr = BPF_STORE_IMM(BPF_DW, BPF_REG_0, DMST_TSTAMP, 0);
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-	instr = BPF_STORE_IMM(BPF_W, BPF_REG_0, DMST_EPID, -1);
+	instr = BPF_LOAD(BPF_DW, BPF_REG_1, BPF_REG_0, DMST_EPOFF);
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-	dlp->dl_last->di_extern = epid;
-	instr = BPF_STORE_IMM(BPF_W, BPF_REG_9, 0, -1);
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, -1);
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
 	dlp->dl_last->di_extern = epid;
+	instr = BPF_STORE(BPF_W, BPF_REG_0, DMST_EPID, BPF_REG_1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	if (!rb) {
+		instr = BPF_STORE(BPF_W, BPF_REG_9, 0, BPF_REG_1);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	}
 
 	/*
 	 *	dctx->mst->tag = 0;	// stw [%r0 + DMST_TAG], 0
@@ -229,8 +501,10 @@ dt_cg_prologue(dt_pcb_t *pcb, dt_node_t *pred)
 	 */
 	instr = BPF_STORE_IMM(BPF_W, BPF_REG_0, DMST_TAG, 0);
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-	instr = BPF_STORE_IMM(BPF_W, BPF_REG_9, 4, 0);
-	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	if (!rb) {
+		instr = BPF_STORE_IMM(BPF_W, BPF_REG_9, 4, 0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	}
 
 	/*
 	 * If there is a predicate:
@@ -250,6 +524,9 @@ dt_cg_prologue(dt_pcb_t *pcb, dt_node_t *pred)
 		TRACE_REGSET("    Pred: End  ");
 	}
 
+	if (rb)
+		dt_cg_ringbuf_reserve(pcb);
+
 	TRACE_REGSET("Prologue: End  ");
 
 	/*
@@ -265,9 +542,15 @@ dt_cg_prologue(dt_pcb_t *pcb, dt_node_t *pred)
  *	   cpu.
  *	6. Return 0
  * }
+ *
+ * If the clause does not produce any output (i.e. all its actions are
+ * aggregations), steps 4 and 5 are omitted.
+ *
+ * If trace data is written to the BPF ring buffer, the reserved record is
+ * submitted in step 5 instead (see dt_cg_ringbuf_submit()).
  */
 static void
-dt_cg_epilogue(dt_pcb_t *pcb)
+dt_cg_epilogue(dt_pcb_t *pcb, int output)
 {
 	dt_irlist_t	*dlp = &pcb->pcb_ir;
 	dt_ident_t	*buffers = dt_dlib_get_map(pcb->pcb_hdl, "buffers");
@@ -275,6 +558,16 @@ dt_cg_epilogue(dt_pcb_t *pcb)
 
 	assert(buffers != NULL);
 
+	if (!output) {
+		TRACE_REGSET("Epilogue: Begin");
+		instr = BPF_MOV_IMM(BPF_REG_0, 0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(pcb->pcb_exitlbl, instr));
+		instr = BPF_RETURN();
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		TRACE_REGSET("Epilogue: End  ");
+		return;
+	}
+
 	/*
 	 *	rc = dctx->mst->fault;	// lddw %r0, [%fp + DT_STK_DCTX]
 	 *				// lddw %r0, [%r0 + DCTX_MST]
@@ -292,6 +585,12 @@ dt_cg_epilogue(dt_pcb_t *pcb)
 	instr = BPF_BRANCH_IMM(BPF_JNE, BPF_REG_0, 0, pcb->pcb_exitlbl);
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
 
+	if (dt_ringbuf_enabled(pcb->pcb_hdl)) {
+		dt_cg_ringbuf_submit(pcb);
+		TRACE_REGSET("Epilogue: End  ");
+		return;
+	}
+
 	/*
 	 *	bpf_perf_event_output(dctx->ctx, &buffers, BPF_F_CURRENT_CPU,
 	 *			      buf - 4, bufoff + 4);
@@ -973,7 +1272,7 @@ dt_cg_xsetx(dt_irlist_t *dlp, dt_ident_t *idp, uint_t lbl, int reg, uint64_t x)
 	dt_irlist_append(dlp, dt_cg_node_alloc(lbl, instr[0]));
 	if (idp != NULL)
 		dlp->dl_last->di_extern = idp;
-	dt_irlist_append(dlp, dt_cg_node_alloc(lbl, instr[1]));
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr[1]));
 }
 
 static void
@@ -1082,6 +1381,31 @@ dt_cg_load(dt_node_t *dnp, ctf_file_t *ctfp, ctf_id_t type)
 #endif
 }
 
+/*
+ * Generate code to load the address of a global variable into the given
+ * register.  The global variables array is the value of the singleton element
+ * of the 'gvars' map, so its address is filled in when the program is loaded
+ * (BPF_PSEUDO_MAP_VALUE, with the offset of the variable in the upper half of
+ * the lddw).  The variable can then be accessed with a single load or store.
+ *
+ *	reg = &gvars[off];	// lddw %reg, &gvars + off
+ */
+static void
+dt_cg_gvar_addr(dt_irlist_t *dlp, int reg, dt_ident_t *idp)
+{
+	dt_ident_t	*gvars = dt_dlib_get_map(yypcb->pcb_hdl, "gvars");
+	struct bpf_insn	instr[2] = { BPF_LDDW(reg, 0) };
+
+	assert(gvars != NULL);
+
+	instr[0].src_reg = BPF_PSEUDO_MAP_VALUE;
+	instr[0].imm = gvars->di_id;
+	instr[1].imm = DT_GVAR_OFF(idp->di_id);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr[0]));
+	dlp->dl_last->di_extern = gvars;
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr[1]));
+}
+
 static void
 dt_cg_load_var(dt_node_t *dst, dt_irlist_t *dlp, dt_regset_t *drp)
 {
@@ -1106,12 +1430,17 @@ dt_cg_load_var(dt_node_t *dst, dt_irlist_t *dlp, dt_regset_t *drp)
 
 		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
 	} else if (idp->di_flags & DT_IDFLG_TLS) {	/* TLS var */
+		dt_cg_dvar_load(dst, dlp, drp, idp);
+	} else if (idp->di_id < DIF_VAR_OTHER_UBASE) {	/* built-in var */
 		if (dt_regset_xalloc_args(drp) == -1)
 			longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
-		instr = BPF_MOV_IMM(BPF_REG_1,
-				    idp->di_id - DIF_VAR_OTHER_UBASE);
+		instr = BPF_LOAD(BPF_DW, BPF_REG_1, BPF_REG_FP, DT_STK_DCTX);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_LOAD(BPF_DW, BPF_REG_1, BPF_REG_1, DCTX_MST);
 		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		idp = dt_dlib_get_func(yypcb->pcb_hdl, "dt_get_tvar");
+		instr = BPF_MOV_IMM(BPF_REG_2, idp->di_id);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		idp = dt_dlib_get_func(yypcb->pcb_hdl, "dt_get_bvar");
 		assert(idp != NULL);
 		dt_regset_xalloc(drp, BPF_REG_0);
 		instr = BPF_CALL_FUNC(idp->di_id);
@@ -1126,41 +1455,12 @@ dt_cg_load_var(dt_node_t *dst, dt_irlist_t *dlp, dt_regset_t *drp)
 		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
 		dt_regset_free(drp, BPF_REG_0);
 	} else {					/* global var */
-		if (dt_regset_xalloc_args(drp) == -1)
-			longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
-		if (idp->di_id < DIF_VAR_OTHER_UBASE) {	/* built-in var */
-			instr = BPF_LOAD(BPF_DW, BPF_REG_1,
-					 BPF_REG_FP, DT_STK_DCTX);
-			dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE,
-					 instr));
-			instr = BPF_LOAD(BPF_DW, BPF_REG_1,
-					 BPF_REG_1, DCTX_MST);
-			dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE,
-					 instr));
-			instr = BPF_MOV_IMM(BPF_REG_2, idp->di_id);
-			dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE,
-					 instr));
-			idp = dt_dlib_get_func(yypcb->pcb_hdl, "dt_get_bvar");
-		} else {
-			instr = BPF_MOV_IMM(BPF_REG_1,
-					    idp->di_id - DIF_VAR_OTHER_UBASE);
-			dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE,
-					 instr));
-			idp = dt_dlib_get_func(yypcb->pcb_hdl, "dt_get_gvar");
-		}
-		assert(idp != NULL);
-		dt_regset_xalloc(drp, BPF_REG_0);
-		instr = BPF_CALL_FUNC(idp->di_id);
-		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		dlp->dl_last->di_extern = idp;
-		dt_regset_free_args(drp);
-
 		if ((dst->dn_reg = dt_regset_alloc(drp)) == -1)
 			longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
 
-		instr = BPF_MOV_REG(dst->dn_reg, BPF_REG_0);
+		dt_cg_gvar_addr(dlp, dst->dn_reg, idp);
+		instr = BPF_LOAD(BPF_DW, dst->dn_reg, dst->dn_reg, 0);
 		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		dt_regset_free(drp, BPF_REG_0);
 	}
 }
 
@@ -1439,38 +1739,19 @@ dt_cg_store_var(dt_node_t *src, dt_irlist_t *dlp, dt_regset_t *drp,
 		instr = BPF_STORE(BPF_DW, BPF_REG_FP, DT_STK_LVAR(idp->di_id),
 				  src->dn_reg);
 		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-	} else if (idp->di_flags & DT_IDFLG_TLS) {	/* TLS var */
-		if (dt_regset_xalloc_args(drp) == -1)
-			longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
-		instr = BPF_MOV_REG(BPF_REG_2, src->dn_reg);
-		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		instr = BPF_MOV_IMM(BPF_REG_1,
-				    idp->di_id - DIF_VAR_OTHER_UBASE);
-		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		idp = dt_dlib_get_func(yypcb->pcb_hdl, "dt_set_tvar");
-		assert(idp != NULL);
-		dt_regset_xalloc(drp, BPF_REG_0);
-		instr = BPF_CALL_FUNC(idp->di_id);
-		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		dlp->dl_last->di_extern = idp;
-		dt_regset_free(drp, BPF_REG_0);
-		dt_regset_free_args(drp);
+	} else if (idp->di_flags & DT_IDFLG_TLS ||	/* TLS var */
+		   idp->di_kind == DT_IDENT_ARRAY) {	/* assoc array */
+		dt_cg_dvar_store(src, dlp, drp, idp);
 	} else {					/* global var */
-		if (dt_regset_xalloc_args(drp) == -1)
+		int	reg;
+
+		if ((reg = dt_regset_alloc(drp)) == -1)
 			longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
-		instr = BPF_MOV_REG(BPF_REG_2, src->dn_reg);
-		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		instr = BPF_MOV_IMM(BPF_REG_1,
-				    idp->di_id - DIF_VAR_OTHER_UBASE);
-		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		idp = dt_dlib_get_func(yypcb->pcb_hdl, "dt_set_gvar");
-		assert(idp != NULL);
-		dt_regset_xalloc(drp, BPF_REG_0);
-		instr = BPF_CALL_FUNC(idp->di_id);
+
+		dt_cg_gvar_addr(dlp, reg, idp);
+		instr = BPF_STORE(BPF_DW, reg, 0, src->dn_reg);
 		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		dlp->dl_last->di_extern = idp;
-		dt_regset_free(drp, BPF_REG_0);
-		dt_regset_free_args(drp);
+		dt_regset_free(drp, reg);
 	}
 }
 
@@ -1579,64 +1860,294 @@ dt_cg_arglist(dt_ident_t *idp, dt_node_t *args,
 		longjmp(yypcb->pcb_jmpbuf, EDT_NOTUPREG);
 }
 
+/*
+ * Associative arrays and thread-local variables (dynamic variables) are stored
+ * in BPF hash maps, one map per variable (see dt_bpf.c).  The key of an
+ * element is a tuple of 64-bit values that is packed in the scratch area on
+ * the stack:
+ *
+ *	[ index 0 | index 1 | ... | index n-1 | TLS key ] value
+ *
+ * The TLS key (see dt_tlskey() in bpf/tlskey.c) is only present for
+ * thread-local variables, and a thread-local scalar has no indices.  The slot
+ * right past the key is used to pass the value when storing an element.
+ *
+ * As in legacy DTrace, assigning 0 to a dynamic variable deletes the element,
+ * and loading an element that does not exist yields 0.
+ */
+static dt_ident_t *
+dt_cg_dvar_map(dt_ident_t *idp)
+{
+	dtrace_hdl_t	*dtp = yypcb->pcb_hdl;
+	dt_ident_t	*mid;
+	char		n[DT_TYPE_NAMELEN];
+
+	snprintf(n, sizeof(n), idp->di_flags & DT_IDFLG_TLS ? DT_TVAR_MAPNAME
+							    : DT_ASSOC_MAPNAME,
+		 idp->di_id - DIF_VAR_OTHER_UBASE);
+	mid = dt_dlib_get_map(dtp, n);
+	if (mid == NULL)
+		mid = dt_dlib_add_map(dtp, n);
+	if (mid == NULL)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOMEM);
+
+	return mid;
+}
+
+/*
+ * Return the size of the index tuple for a dynamic variable.
+ */
+static uint_t
+dt_cg_dvar_ksz(const dt_ident_t *idp)
+{
+	if (idp->di_kind != DT_IDENT_ARRAY)
+		return 0;
+
+	return ((dt_idsig_t *)idp->di_data)->dis_argc * sizeof(uint64_t);
+}
+
+/*
+ * Generate code to store the index tuple of an associative array element in
+ * the scratch area.  All indices are evaluated before anything is stored,
+ * because the evaluation of an index may use the scratch area itself (e.g. for
+ * a nested associative array lookup).
+ */
 static void
-dt_cg_arithmetic_op(dt_node_t *dnp, dt_irlist_t *dlp, dt_regset_t *drp,
-		    uint_t op)
+dt_cg_dvar_tuple(dt_ident_t *idp, dt_node_t *args, dt_irlist_t *dlp,
+		 dt_regset_t *drp)
 {
-	int is_ptr_op = (dnp->dn_op == DT_TOK_ADD || dnp->dn_op == DT_TOK_SUB ||
-	    dnp->dn_op == DT_TOK_ADD_EQ || dnp->dn_op == DT_TOK_SUB_EQ);
+	const dt_idsig_t	*isp = idp->di_data;
+	dt_node_t		*dnp;
+	struct bpf_insn		instr;
+	char			n[DT_TYPE_NAMELEN];
+	int			i;
 
-	int lp_is_ptr = dt_node_is_pointer(dnp->dn_left);
-	int rp_is_ptr = dt_node_is_pointer(dnp->dn_right);
+	for (dnp = args; dnp != NULL; dnp = dnp->dn_list)
+		dt_cg_node(dnp, dlp, drp);
 
-	struct bpf_insn instr;
+	for (dnp = args, i = 0; dnp != NULL; dnp = dnp->dn_list, i++) {
+		if (!dt_node_is_scalar(dnp))
+			dnerror(dnp, D_KEY_TYPE, "associative array key of "
+				"type %s is not supported (yet)\n",
+				dt_node_type_name(dnp, n, sizeof(n)));
 
-	if (lp_is_ptr && rp_is_ptr) {
-		assert(dnp->dn_op == DT_TOK_SUB);
-		is_ptr_op = 0;
+		isp->dis_args[i].dn_reg = dnp->dn_reg; /* re-use register */
+		dt_cg_typecast(dnp, &isp->dis_args[i], dlp, drp);
+		isp->dis_args[i].dn_reg = -1;
+
+		instr = BPF_STORE(BPF_DW, BPF_REG_FP,
+				  DT_STK_SCRATCH_BASE + i * sizeof(uint64_t),
+				  dnp->dn_reg);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		dt_regset_free(drp, dnp->dn_reg);
 	}
 
-	dt_cg_node(dnp->dn_left, dlp, drp);
-	if (is_ptr_op && rp_is_ptr)
-		dt_cg_ptrsize(dnp, dlp, drp, BPF_MUL, dnp->dn_left->dn_reg);
+	if (i > yypcb->pcb_hdl->dt_conf.dtc_diftupregs)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOTUPREG);
+}
 
-	dt_cg_node(dnp->dn_right, dlp, drp);
-	if (is_ptr_op && lp_is_ptr)
-		dt_cg_ptrsize(dnp, dlp, drp, BPF_MUL, dnp->dn_right->dn_reg);
+/*
+ * Generate code to complete the key of a dynamic variable element (by storing
+ * the TLS key for thread-local variables), and to load the map pointer and
+ * the key pointer in %r1 and %r2.  The caller must have reserved the argument
+ * registers and %r0.
+ */
+static void
+dt_cg_dvar_key(dt_ident_t *idp, dt_irlist_t *dlp)
+{
+	dt_ident_t	*mid = dt_cg_dvar_map(idp);
+	uint_t		ksz = dt_cg_dvar_ksz(idp);
+	struct bpf_insn	instr;
 
-	if ((op == BPF_MOD || op == BPF_DIV) &&
-	    (dnp->dn_flags & DT_NF_SIGNED)) {
-		/*
-		 * BPF_DIV and BPF_MOD are only for unsigned arguments.
-		 * For signed arguments, use the following algorithm.
-		 * The four right columns indicate the flow of steps.
-		 *
-		 *                   l > 0   l > 0   l < 0   l < 0
-		 *                   r > 0   r < 0   r > 0   r < 0
-		 *     jslt %rl,0,L3   1       1       1       1
-		 *     jslt %rr,0,L1   2       2
-		 *     ja   L4         3
-		 * L1: neg  %rr                3
-		 * L2: <op> %rl,%rr            4       4
-		 *     neg  %rl                5       5
-		 *     ja   L5                 6       6
-		 * L3: neg  %rl                        2       2
-		 *     jsge %rr,0,L2                   3       3
-		 *     neg  %rr                                4
-		 * L4: <op> %rl,%rr    4                       5
-		 * L5: nop
-		 */
-		uint_t	lbl_L1 = dt_irlist_label(dlp);
-		uint_t	lbl_L2 = dt_irlist_label(dlp);
-		uint_t	lbl_L3 = dt_irlist_label(dlp);
-		uint_t	lbl_L4 = dt_irlist_label(dlp);
-		uint_t	lbl_L5 = dt_irlist_label(dlp);
+	if (idp->di_flags & DT_IDFLG_TLS) {
+		dt_ident_t	*fnp;
 
-		instr = BPF_BRANCH_IMM(BPF_JSLT, dnp->dn_left->dn_reg, 0, lbl_L3);
-		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		instr = BPF_BRANCH_IMM(BPF_JSLT, dnp->dn_right->dn_reg, 0, lbl_L1);
+		fnp = dt_dlib_get_func(yypcb->pcb_hdl, "dt_tlskey");
+		assert(fnp != NULL);
+		instr = BPF_CALL_FUNC(fnp->di_id);
 		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
-		instr = BPF_JUMP(lbl_L4);
+		dlp->dl_last->di_extern = fnp;
+		instr = BPF_STORE(BPF_DW, BPF_REG_FP,
+				  DT_STK_SCRATCH_BASE + ksz, BPF_REG_0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	}
+
+	dt_cg_xsetx(dlp, mid, DT_LBL_NONE, BPF_REG_1, mid->di_id);
+	instr = BPF_MOV_REG(BPF_REG_2, BPF_REG_FP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, DT_STK_SCRATCH_BASE);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+}
+
+/*
+ * Generate code to load the value of a dynamic variable element.  For
+ * associative arrays, the index tuple must already be stored in the scratch
+ * area (see dt_cg_dvar_tuple()).
+ *
+ *	rc = bpf_map_lookup_elem(&map, key);
+ *				// lddw %r1, &map
+ *				// mov %r2, %fp
+ *				// add %r2, DT_STK_SCRATCH_BASE
+ *				// call bpf_map_lookup_elem
+ *	if (rc != 0)		// jeq %r0, 0, lbl_done
+ *		rc = *rc;	// ldxdw %r0, [%r0 + 0]
+ * done:
+ *	val = rc;		// mov %dn_reg, %r0
+ */
+static void
+dt_cg_dvar_load(dt_node_t *dnp, dt_irlist_t *dlp, dt_regset_t *drp,
+		dt_ident_t *idp)
+{
+	uint_t		lbl_done = dt_irlist_label(dlp);
+	struct bpf_insn	instr;
+
+	if (dt_regset_xalloc_args(drp) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+	dt_regset_xalloc(drp, BPF_REG_0);
+
+	dt_cg_dvar_key(idp, dlp);
+	instr = BPF_CALL_HELPER(BPF_FUNC_map_lookup_elem);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JEQ, BPF_REG_0, 0, lbl_done);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_LOAD(BPF_DW, BPF_REG_0, BPF_REG_0, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_done, BPF_NOP()));
+	dt_regset_free_args(drp);
+
+	if ((dnp->dn_reg = dt_regset_alloc(drp)) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+
+	instr = BPF_MOV_REG(dnp->dn_reg, BPF_REG_0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_regset_free(drp, BPF_REG_0);
+}
+
+/*
+ * Generate code to store a value in a dynamic variable element.  For
+ * associative arrays, the index tuple must already be stored in the scratch
+ * area (see dt_cg_dvar_tuple()).
+ *
+ *	val = %src;		// stxdw [%fp + DT_STK_SCRATCH_BASE + koff],
+ *				//	 %src
+ *	if (val == 0)		// ldxdw %r3, [%fp + DT_STK_SCRATCH_BASE + koff]
+ *		goto upd;	// jne %r3, 0, lbl_upd
+ *	bpf_map_delete_elem(&map, key);
+ *				// lddw %r1, &map
+ *				// mov %r2, %fp
+ *				// add %r2, DT_STK_SCRATCH_BASE
+ *				// call bpf_map_delete_elem
+ *	goto done;		// ja lbl_done
+ * upd:
+ *	bpf_map_update_elem(&map, key, &val, BPF_ANY);
+ *				// mov %r3, %fp
+ *				// add %r3, DT_STK_SCRATCH_BASE + koff
+ *				// mov %r4, BPF_ANY
+ *				// call bpf_map_update_elem
+ * done:
+ */
+static void
+dt_cg_dvar_store(dt_node_t *src, dt_irlist_t *dlp, dt_regset_t *drp,
+		 dt_ident_t *idp)
+{
+	uint_t		lbl_upd = dt_irlist_label(dlp);
+	uint_t		lbl_done = dt_irlist_label(dlp);
+	int		koff;
+	struct bpf_insn	instr;
+
+	koff = DT_STK_SCRATCH_BASE + dt_cg_dvar_ksz(idp);
+	if (idp->di_flags & DT_IDFLG_TLS)
+		koff += sizeof(uint64_t);
+
+	instr = BPF_STORE(BPF_DW, BPF_REG_FP, koff, src->dn_reg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	if (dt_regset_xalloc_args(drp) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+	dt_regset_xalloc(drp, BPF_REG_0);
+
+	dt_cg_dvar_key(idp, dlp);
+	instr = BPF_LOAD(BPF_DW, BPF_REG_3, BPF_REG_FP, koff);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JNE, BPF_REG_3, 0, lbl_upd);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_map_delete_elem);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_JUMP(lbl_done);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	instr = BPF_MOV_REG(BPF_REG_3, BPF_REG_FP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_upd, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, koff);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_IMM(BPF_REG_4, BPF_ANY);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_map_update_elem);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_done, BPF_NOP()));
+
+	dt_regset_free(drp, BPF_REG_0);
+	dt_regset_free_args(drp);
+}
+
+static void
+dt_cg_arithmetic_op(dt_node_t *dnp, dt_irlist_t *dlp, dt_regset_t *drp,
+		    uint_t op)
+{
+	int is_ptr_op = (dnp->dn_op == DT_TOK_ADD || dnp->dn_op == DT_TOK_SUB ||
+	    dnp->dn_op == DT_TOK_ADD_EQ || dnp->dn_op == DT_TOK_SUB_EQ);
+
+	int lp_is_ptr = dt_node_is_pointer(dnp->dn_left);
+	int rp_is_ptr = dt_node_is_pointer(dnp->dn_right);
+
+	struct bpf_insn instr;
+
+	if (lp_is_ptr && rp_is_ptr) {
+		assert(dnp->dn_op == DT_TOK_SUB);
+		is_ptr_op = 0;
+	}
+
+	dt_cg_node(dnp->dn_left, dlp, drp);
+	if (is_ptr_op && rp_is_ptr)
+		dt_cg_ptrsize(dnp, dlp, drp, BPF_MUL, dnp->dn_left->dn_reg);
+
+	dt_cg_node(dnp->dn_right, dlp, drp);
+	if (is_ptr_op && lp_is_ptr)
+		dt_cg_ptrsize(dnp, dlp, drp, BPF_MUL, dnp->dn_right->dn_reg);
+
+	if ((op == BPF_MOD || op == BPF_DIV) &&
+	    (dnp->dn_flags & DT_NF_SIGNED)) {
+		/*
+		 * BPF_DIV and BPF_MOD are only for unsigned arguments.
+		 * For signed arguments, use the following algorithm.
+		 * The four right columns indicate the flow of steps.
+		 *
+		 *                   l > 0   l > 0   l < 0   l < 0
+		 *                   r > 0   r < 0   r > 0   r < 0
+		 *     jslt %rl,0,L3   1       1       1       1
+		 *     jslt %rr,0,L1   2       2
+		 *     ja   L4         3
+		 * L1: neg  %rr                3
+		 * L2: <op> %rl,%rr            4       4
+		 *     neg  %rl                5       5
+		 *     ja   L5                 6       6
+		 * L3: neg  %rl                        2       2
+		 *     jsge %rr,0,L2                   3       3
+		 *     neg  %rr                                4
+		 * L4: <op> %rl,%rr    4                       5
+		 * L5: nop
+		 */
+		uint_t	lbl_L1 = dt_irlist_label(dlp);
+		uint_t	lbl_L2 = dt_irlist_label(dlp);
+		uint_t	lbl_L3 = dt_irlist_label(dlp);
+		uint_t	lbl_L4 = dt_irlist_label(dlp);
+		uint_t	lbl_L5 = dt_irlist_label(dlp);
+
+		instr = BPF_BRANCH_IMM(BPF_JSLT, dnp->dn_left->dn_reg, 0, lbl_L3);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_BRANCH_IMM(BPF_JSLT, dnp->dn_right->dn_reg, 0, lbl_L1);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_JUMP(lbl_L4);
 		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
 		instr = BPF_NEG_REG(dnp->dn_right->dn_reg);
 		dt_irlist_append(dlp, dt_cg_node_alloc(lbl_L1, instr));
@@ -2154,7 +2665,7 @@ dt_cg_asgn_op(dt_node_t *dnp, dt_irlist_t *dlp, dt_regset_t *drp)
 		idp = dt_ident_resolve(dnp->dn_left->dn_ident);
 
 		if (idp->di_kind == DT_IDENT_ARRAY)
-			dt_cg_arglist(idp, dnp->dn_left->dn_args, dlp, drp);
+			dt_cg_dvar_tuple(idp, dnp->dn_left->dn_args, dlp, drp);
 
 		dt_cg_store_var(dnp, dlp, drp, idp);
 	} else {
@@ -2177,27 +2688,14 @@ dt_cg_asgn_op(dt_node_t *dnp, dt_irlist_t *dlp, dt_regset_t *drp)
 static void
 dt_cg_assoc_op(dt_node_t *dnp, dt_irlist_t *dlp, dt_regset_t *drp)
 {
-	struct bpf_insn instr;
-	ssize_t base;
-
 	assert(dnp->dn_kind == DT_NODE_VAR);
 	assert(!(dnp->dn_ident->di_flags & DT_IDFLG_LOCAL));
 	assert(dnp->dn_args != NULL);
 
-	dt_cg_arglist(dnp->dn_ident, dnp->dn_args, dlp, drp);
-
-	if ((dnp->dn_reg = dt_regset_alloc(drp)) == -1)
-		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
-
-	if (dnp->dn_ident->di_flags & DT_IDFLG_TLS)
-		base = 0x2000;
-	else
-		base = 0x3000;
+	dt_cg_dvar_tuple(dnp->dn_ident, dnp->dn_args, dlp, drp);
 
 	dnp->dn_ident->di_flags |= DT_IDFLG_DIFR;
-	instr = BPF_LOAD(BPF_DW, dnp->dn_reg, BPF_REG_FP,
-			 base + dnp->dn_ident->di_id);
-	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_cg_dvar_load(dnp, dlp, drp, dnp->dn_ident);
 
 	/*
 	 * If the associative array is a pass-by-reference type, then we are
@@ -2960,6 +3458,931 @@ if ((idp = dnp->dn_ident)->di_kind != DT_IDENT_FUNC)
 	}
 }
 
+/*
+ * Aggregations are kept in the kernel, in a BPF_MAP_TYPE_PERCPU_HASH map per
+ * aggregation.  The map key is the aggregation key tuple, laid out as a packed
+ * sequence of records (and padded to a multiple of 8 bytes).  The map value
+ * consists of a 64-bit update counter followed by the aggregation data.  The
+ * counter is used by the consumer to distinguish CPUs that never updated an
+ * element from CPUs that hold data that happens to be all zeros, which matters
+ * for min() and max().
+ *
+ * The functions below generate code to update the aggregation data in place,
+ * given a register (preg) that holds a pointer to the map value for the
+ * current CPU, a register (vreg) that holds the value to aggregate, and an
+ * (optional) register (ireg) that holds the increment for the quantization
+ * functions.
+ */
+static void
+dt_cg_agg_incr(dt_irlist_t *dlp, int preg, int treg, int off, int ireg)
+{
+	struct bpf_insn	instr;
+
+	instr = BPF_LOAD(BPF_DW, treg, preg, off);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	if (ireg == -1)
+		instr = BPF_ALU64_IMM(BPF_ADD, treg, 1);
+	else
+		instr = BPF_ALU64_REG(BPF_ADD, treg, ireg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_STORE(BPF_DW, preg, off, treg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+}
+
+static void
+dt_cg_agg_minmax(dt_irlist_t *dlp, dt_regset_t *drp, int preg, int vreg,
+		 int op)
+{
+	uint_t		lbl_set = dt_irlist_label(dlp);
+	uint_t		lbl_done = dt_irlist_label(dlp);
+	struct bpf_insn	instr;
+	int		treg;
+
+	if ((treg = dt_regset_alloc(drp)) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+
+	/*
+	 *	if (val[0] == 0)	// ldxdw %treg, [%preg + 0]
+	 *		goto set;	// jeq %treg, 0, lbl_set
+	 *	if (val[1] op vreg)	// ldxdw %treg, [%preg + 8]
+	 *		goto done;	// j<op> %treg, %vreg, lbl_done
+	 * set:
+	 *	val[1] = vreg;		// stxdw [%preg + 8], %vreg
+	 * done:
+	 */
+	instr = BPF_LOAD(BPF_DW, treg, preg, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JEQ, treg, 0, lbl_set);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_LOAD(BPF_DW, treg, preg, DT_AGG_HDRSZ);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_REG(op, treg, vreg, lbl_done);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_STORE(BPF_DW, preg, DT_AGG_HDRSZ, vreg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_set, instr));
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_done, BPF_NOP()));
+
+	dt_regset_free(drp, treg);
+}
+
+static void
+dt_cg_agg_stddev(dt_irlist_t *dlp, dt_regset_t *drp, int preg, int vreg)
+{
+	uint_t		lbl_pos = dt_irlist_label(dlp);
+	uint_t		lbl_nc1 = dt_irlist_label(dlp);
+	uint_t		lbl_nc2 = dt_irlist_label(dlp);
+	struct bpf_insn	instr;
+	int		lo, hi, mid;
+
+	if ((lo = dt_regset_alloc(drp)) == -1 ||
+	    (hi = dt_regset_alloc(drp)) == -1 ||
+	    (mid = dt_regset_alloc(drp)) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+
+	/*
+	 * The data consists of the count, the sum, and the 128-bit sum of
+	 * squares (low 64 bits first).
+	 */
+	dt_cg_agg_incr(dlp, preg, lo, DT_AGG_HDRSZ, -1);
+	dt_cg_agg_incr(dlp, preg, lo, DT_AGG_HDRSZ + 8, vreg);
+
+	/*
+	 * Square the absolute value of the value as 128-bit quantity, using
+	 * 32-bit halves (a = ah * 2^32 + al):
+	 *	a^2 = ah^2 * 2^64 + 2 * ah * al * 2^32 + al^2
+	 *
+	 *	lo = vreg < 0 ? -vreg : vreg;
+	 *	hi = lo >> 32;
+	 *	lo = lo & 0xffffffff;
+	 *	mid = lo * hi;
+	 *	lo = lo * lo;
+	 *	hi = hi * hi;
+	 *	hi += mid >> 31;
+	 *	mid <<= 33;
+	 *	lo += mid;
+	 *	if (lo < mid)
+	 *		hi++;
+	 */
+	instr = BPF_MOV_REG(lo, vreg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JSGE, lo, 0, lbl_pos);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_NEG_REG(lo);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_REG(hi, lo);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_pos, instr));
+	instr = BPF_ALU64_IMM(BPF_RSH, hi, 32);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_LSH, lo, 32);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_RSH, lo, 32);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_REG(mid, lo);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_REG(BPF_MUL, mid, hi);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_REG(BPF_MUL, lo, lo);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_REG(BPF_MUL, hi, hi);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_REG(vreg, mid);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_RSH, vreg, 31);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_REG(BPF_ADD, hi, vreg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_LSH, mid, 33);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_REG(BPF_ADD, lo, mid);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_REG(BPF_JGE, lo, mid, lbl_nc1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, hi, 1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	/*
+	 * Add the square to the 128-bit sum of squares:
+	 *
+	 *	mid = val[3] + lo;
+	 *	val[3] = mid;
+	 *	if (mid < lo)
+	 *		hi++;
+	 *	val[4] += hi;
+	 */
+	instr = BPF_LOAD(BPF_DW, mid, preg, DT_AGG_HDRSZ + 16);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_nc1, instr));
+	instr = BPF_ALU64_REG(BPF_ADD, mid, lo);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_STORE(BPF_DW, preg, DT_AGG_HDRSZ + 16, mid);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_REG(BPF_JGE, mid, lo, lbl_nc2);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, hi, 1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_nc2, BPF_NOP()));
+	dt_cg_agg_incr(dlp, preg, lo, DT_AGG_HDRSZ + 24, hi);
+
+	dt_regset_free(drp, mid);
+	dt_regset_free(drp, hi);
+	dt_regset_free(drp, lo);
+}
+
+/*
+ * Generate code to compute the integer base-2 logarithm of the (non-zero)
+ * unsigned value in areg into kreg, using treg as temporary register.  The
+ * value in areg is destroyed.
+ */
+static void
+dt_cg_agg_ilog2(dt_irlist_t *dlp, int areg, int kreg, int treg)
+{
+	struct bpf_insn	instr;
+	int		shift;
+
+	instr = BPF_MOV_IMM(kreg, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	for (shift = 32; shift > 0; shift >>= 1) {
+		uint_t	lbl_next = dt_irlist_label(dlp);
+
+		instr = BPF_MOV_REG(treg, areg);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_ALU64_IMM(BPF_RSH, treg, shift);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_BRANCH_IMM(BPF_JEQ, treg, 0, lbl_next);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_MOV_REG(areg, treg);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_ALU64_IMM(BPF_ADD, kreg, shift);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		dt_irlist_append(dlp, dt_cg_node_alloc(lbl_next, BPF_NOP()));
+	}
+}
+
+static void
+dt_cg_agg_quantize(dt_irlist_t *dlp, dt_regset_t *drp, int preg, int vreg,
+		   int ireg)
+{
+	uint_t		lbl_pos = dt_irlist_label(dlp);
+	uint_t		lbl_clamp = dt_irlist_label(dlp);
+	uint_t		lbl_add = dt_irlist_label(dlp);
+	struct bpf_insn	instr;
+	int		breg, areg, treg;
+
+	if ((breg = dt_regset_alloc(drp)) == -1 ||
+	    (areg = dt_regset_alloc(drp)) == -1 ||
+	    (treg = dt_regset_alloc(drp)) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+
+	/*
+	 * Determine the bucket (breg) for the value, consistent with
+	 * DTRACE_QUANTIZE_BUCKETVAL():
+	 *
+	 *	if (vreg == 0)
+	 *		breg = ZEROBUCKET;
+	 *	else if (vreg > 0)
+	 *		breg = ZEROBUCKET + 1 + ilog2(vreg);
+	 *	else
+	 *		breg = ZEROBUCKET - 1 - min(ilog2(-vreg),
+	 *					    ZEROBUCKET - 1);
+	 */
+	instr = BPF_MOV_IMM(breg, DTRACE_QUANTIZE_ZEROBUCKET);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JEQ, vreg, 0, lbl_add);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_REG(areg, vreg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JSGT, vreg, 0, lbl_pos);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	instr = BPF_NEG_REG(areg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_cg_agg_ilog2(dlp, areg, breg, treg);
+	instr = BPF_BRANCH_IMM(BPF_JLE, breg, DTRACE_QUANTIZE_ZEROBUCKET - 1,
+			       lbl_clamp);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_IMM(breg, DTRACE_QUANTIZE_ZEROBUCKET - 1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_NEG_REG(breg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_clamp, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, breg, DTRACE_QUANTIZE_ZEROBUCKET - 1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_JUMP(lbl_add);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_pos, BPF_NOP()));
+	dt_cg_agg_ilog2(dlp, areg, breg, treg);
+	instr = BPF_ALU64_IMM(BPF_ADD, breg, DTRACE_QUANTIZE_ZEROBUCKET + 1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	/*
+	 *	val[1 + breg] += ireg;
+	 */
+	instr = BPF_ALU64_IMM(BPF_LSH, breg, 3);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_add, instr));
+	instr = BPF_ALU64_REG(BPF_ADD, breg, preg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_cg_agg_incr(dlp, breg, treg, DT_AGG_HDRSZ, ireg);
+
+	dt_regset_free(drp, treg);
+	dt_regset_free(drp, areg);
+	dt_regset_free(drp, breg);
+}
+
+static void
+dt_cg_agg_lquantize(dt_irlist_t *dlp, dt_regset_t *drp, int preg, int vreg,
+		    int ireg, uint64_t arg)
+{
+	int32_t		base = DTRACE_LQUANTIZE_BASE(arg);
+	uint16_t	step = DTRACE_LQUANTIZE_STEP(arg);
+	uint16_t	levels = DTRACE_LQUANTIZE_LEVELS(arg);
+	uint_t		lbl_clamp = dt_irlist_label(dlp);
+	uint_t		lbl_add = dt_irlist_label(dlp);
+	struct bpf_insn	instr;
+	int		breg, treg;
+
+	if ((breg = dt_regset_alloc(drp)) == -1 ||
+	    (treg = dt_regset_alloc(drp)) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+
+	/*
+	 * The first data element holds the lquantize() argument, followed by
+	 * the underflow bucket, the levels, and the overflow bucket.
+	 *
+	 *	breg = 0;
+	 *	if (vreg < base)
+	 *		goto add;
+	 *	breg = (vreg - base) / step;
+	 *	if (breg > levels)
+	 *		breg = levels;
+	 *	breg++;
+	 * add:
+	 *	val[2 + breg] += ireg;
+	 */
+	instr = BPF_MOV_IMM(breg, 0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JSLT, vreg, base, lbl_add);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_REG(breg, vreg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_SUB, breg, base);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	if (step > 1) {
+		instr = BPF_ALU64_IMM(BPF_DIV, breg, step);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	}
+	instr = BPF_BRANCH_IMM(BPF_JLE, breg, levels, lbl_clamp);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_IMM(breg, levels);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, breg, 1);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_clamp, instr));
+
+	instr = BPF_ALU64_IMM(BPF_LSH, breg, 3);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_add, instr));
+	instr = BPF_ALU64_REG(BPF_ADD, breg, preg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_cg_agg_incr(dlp, breg, treg, DT_AGG_HDRSZ + 8, ireg);
+
+	dt_regset_free(drp, treg);
+	dt_regset_free(drp, breg);
+}
+
+/*
+ * Return the BPF store size for a key value of the given size.
+ */
+static int
+dt_cg_agg_keysize(uint32_t size)
+{
+	switch (size) {
+	case sizeof(uint8_t):
+		return BPF_B;
+	case sizeof(uint16_t):
+		return BPF_H;
+	case sizeof(uint32_t):
+		return BPF_W;
+	default:
+		return BPF_DW;
+	}
+}
+
+/*
+ * Validate the arguments to lquantize() and return the encoded argument that
+ * describes the base, step, and number of levels.  All uses of a given
+ * aggregation must agree on the argument.
+ */
+static uint64_t
+dt_cg_agg_lquantize_arg(dt_node_t *dnp, dt_ident_t *aid)
+{
+	/*
+	 * For linear quantization, we have between two and four arguments in
+	 * addition to the expression:
+	 *
+	 *    arg1 => Base value
+	 *    arg2 => Limit value
+	 *    arg3 => Quantization level step size (defaults to 1)
+	 *    arg4 => Quantization increment value (defaults to 1)
+	 */
+	dt_node_t	*arg1 = dnp->dn_aggfun->dn_args->dn_list;
+	dt_node_t	*arg2 = arg1->dn_list;
+	dt_node_t	*arg3 = arg2->dn_list;
+	dt_idsig_t	*isp;
+	uint64_t	nlevels, step = 1, arg, oarg;
+	int64_t		baseval, limitval;
+
+	if (arg1->dn_kind != DT_NODE_INT)
+		dnerror(arg1, D_LQUANT_BASETYPE, "lquantize( ) argument #1 "
+			"must be an integer constant\n");
+
+	baseval = (int64_t)arg1->dn_value;
+
+	if (baseval < INT32_MIN || baseval > INT32_MAX)
+		dnerror(arg1, D_LQUANT_BASEVAL, "lquantize( ) argument #1 "
+			"must be a 32-bit quantity\n");
+
+	if (arg2->dn_kind != DT_NODE_INT)
+		dnerror(arg2, D_LQUANT_LIMTYPE, "lquantize( ) argument #2 "
+			"must be an integer constant\n");
+
+	limitval = (int64_t)arg2->dn_value;
+
+	if (limitval < INT32_MIN || limitval > INT32_MAX)
+		dnerror(arg2, D_LQUANT_LIMVAL, "lquantize( ) argument #2 "
+			"must be a 32-bit quantity\n");
+
+	if (limitval < baseval)
+		dnerror(dnp, D_LQUANT_MISMATCH, "lquantize( ) base (argument "
+			"#1) must be less than limit (argument #2)\n");
+
+	if (arg3 != NULL) {
+		if (!dt_node_is_posconst(arg3))
+			dnerror(arg3, D_LQUANT_STEPTYPE, "lquantize( ) "
+				"argument #3 must be a non-zero positive "
+				"integer constant\n");
+
+		if ((step = arg3->dn_value) > UINT16_MAX)
+			dnerror(arg3, D_LQUANT_STEPVAL, "lquantize( ) "
+				"argument #3 must be a 16-bit quantity\n");
+	}
+
+	nlevels = (limitval - baseval) / step;
+
+	if (nlevels == 0)
+		dnerror(dnp, D_LQUANT_STEPLARGE, "lquantize( ) step "
+			"(argument #3) too large: must have at least one "
+			"quantization level\n");
+
+	if (nlevels > UINT16_MAX)
+		dnerror(dnp, D_LQUANT_STEPSMALL, "lquantize( ) step "
+			"(argument #3) too small: number of quantization "
+			"levels must be a 16-bit quantity\n");
+
+	arg = (step << DTRACE_LQUANTIZE_STEPSHIFT) |
+	      (nlevels << DTRACE_LQUANTIZE_LEVELSHIFT) |
+	      ((baseval << DTRACE_LQUANTIZE_BASESHIFT) &
+	       DTRACE_LQUANTIZE_BASEMASK);
+
+	assert(arg != 0);
+
+	isp = (dt_idsig_t *)aid->di_data;
+
+	if (isp->dis_auxinfo == 0) {
+		/*
+		 * This is the first time we've seen an lquantize() for this
+		 * aggregation; we'll store our argument as the auxiliary
+		 * signature information.
+		 */
+		isp->dis_auxinfo = arg;
+	} else if ((oarg = isp->dis_auxinfo) != arg) {
+		/*
+		 * If we have seen this lquantize() before and the argument
+		 * doesn't match the original argument, pick the original
+		 * argument apart to concisely report the mismatch.
+		 */
+		int	obaseval = DTRACE_LQUANTIZE_BASE(oarg);
+		int	onlevels = DTRACE_LQUANTIZE_LEVELS(oarg);
+		int	ostep = DTRACE_LQUANTIZE_STEP(oarg);
+
+		if (obaseval != baseval)
+			dnerror(dnp, D_LQUANT_MATCHBASE, "lquantize( ) base "
+				"(argument #1) doesn't match previous "
+				"declaration: expected %d, found %d\n",
+				obaseval, (int)baseval);
+
+		if (onlevels * ostep != nlevels * step)
+			dnerror(dnp, D_LQUANT_MATCHLIM, "lquantize( ) limit "
+				"(argument #2) doesn't match previous "
+				"declaration: expected %d, found %d\n",
+				obaseval + onlevels * ostep,
+				(int)baseval + (int)nlevels * (int)step);
+
+		if (ostep != step)
+			dnerror(dnp, D_LQUANT_MATCHSTEP, "lquantize( ) step "
+				"(argument #3) doesn't match previous "
+				"declaration: expected %d, found %d\n",
+				ostep, (int)step);
+
+		/*
+		 * We shouldn't be able to get here -- one of the parameters
+		 * must be mismatched if the arguments didn't match.
+		 */
+		assert(0);
+	}
+
+	return arg;
+}
+
+/*
+ * Load a pointer to the aggregation map into %r1.  For double-buffered
+ * aggregations, the map is selected based on the selector value that was
+ * stored on the stack (at offset sel).
+ */
+static void
+dt_cg_agg_map(dt_irlist_t *dlp, dt_ident_t *mid, dt_ident_t *alt, int sel)
+{
+	uint_t		lbl_alt, lbl_done;
+	struct bpf_insn	instr;
+
+	if (alt == NULL) {
+		dt_cg_xsetx(dlp, mid, DT_LBL_NONE, BPF_REG_1, mid->di_id);
+		return;
+	}
+
+	/*
+	 *	if (sel != 0)		// ldxdw %r1, [%fp + sel]
+	 *		goto alt;	// jne %r1, 0, lbl_alt
+	 *	%r1 = &agg_N;		// lddw %r1, &agg_N
+	 *	goto done;		// ja lbl_done
+	 * alt:
+	 *	%r1 = &agg_N_1;		// lddw %r1, &agg_N_1
+	 * done:
+	 */
+	lbl_alt = dt_irlist_label(dlp);
+	lbl_done = dt_irlist_label(dlp);
+
+	instr = BPF_LOAD(BPF_DW, BPF_REG_1, BPF_REG_FP, sel);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JNE, BPF_REG_1, 0, lbl_alt);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_cg_xsetx(dlp, mid, DT_LBL_NONE, BPF_REG_1, mid->di_id);
+	instr = BPF_JUMP(lbl_done);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_cg_xsetx(dlp, alt, lbl_alt, BPF_REG_1, alt->di_id);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_done, BPF_NOP()));
+}
+
+/*
+ * Generate code for an aggregation statement: @name[key, ...] = func(args).
+ *
+ *	1. Evaluate the keys and arguments, and store the key tuple in the
+ *	   scratch area on the stack.
+ *	2. Look up the map value for the key, creating a zero-filled element
+ *	   if the key does not exist yet.  If the map is full, the update is
+ *	   dropped.
+ *	3. Update the aggregation data in place, and increment the update
+ *	   counter.
+ */
+static void
+dt_cg_agg(dt_pcb_t *pcb, dt_node_t *dnp)
+{
+	dtrace_hdl_t		*dtp = pcb->pcb_hdl;
+	dt_irlist_t		*dlp = &pcb->pcb_ir;
+	dt_regset_t		*drp = pcb->pcb_regs;
+	dt_ident_t		*aid, *fid, *mid, *zid, *alt = NULL, *sid;
+	dt_node_t		*anp, *knp, *vnp = NULL, *inp = NULL;
+	dtrace_recdesc_t	*recs, *rec;
+	dtrace_diftype_t	vtype;
+	char			n[DT_TYPE_NAMELEN];
+	uint_t			lbl_found = dt_irlist_label(dlp);
+	uint_t			lbl_done = dt_irlist_label(dlp);
+	uint_t			nkeys = 0, ksz, koff = 0, dsz, i;
+	uint64_t		arg = 0;
+	int			zkey, sel, vreg = -1, ireg = -1, preg, treg;
+	struct bpf_insn		instr;
+
+	/*
+	 * If the aggregation has no aggregating function applied to it, then
+	 * this statement has no effect.  Flag this as a programming error.
+	 */
+	if (dnp->dn_aggfun == NULL)
+		dnerror(dnp, D_AGG_NULL, "expression has null effect: @%s\n",
+			dnp->dn_ident->di_name);
+
+	aid = dnp->dn_ident;
+	fid = dnp->dn_aggfun->dn_ident;
+
+	if (dnp->dn_aggfun->dn_args != NULL &&
+	    dt_node_is_scalar(dnp->dn_aggfun->dn_args) == 0)
+		dnerror(dnp->dn_aggfun, D_AGG_SCALAR, "%s( ) argument #1 must "
+			"be of scalar type\n", fid->di_name);
+
+	for (anp = dnp->dn_aggtup; anp != NULL; anp = anp->dn_list)
+		nkeys++;
+
+	recs = alloca((nkeys + 1) * sizeof(dtrace_recdesc_t));
+	memset(recs, 0, (nkeys + 1) * sizeof(dtrace_recdesc_t));
+
+	/*
+	 * Lay out the key tuple.  Each key is stored with its natural size and
+	 * alignment (as trace() would record it), so the consumer can format
+	 * the keys in the same way as the legacy implementation.
+	 */
+	for (anp = dnp->dn_aggtup, rec = recs; anp != NULL;
+	     anp = anp->dn_list, rec++) {
+		rec->dtrd_action = DTRACEACT_DIFEXPR;
+		knp = anp;
+
+		if (anp->dn_kind == DT_NODE_FUNC) {
+			switch (anp->dn_ident->di_id) {
+			case DT_ACT_STACK:
+			case DT_ACT_USTACK:
+			case DT_ACT_JSTACK:
+				dnerror(anp, D_UNKNOWN, "%s() is not supported "
+					"as aggregation key (yet)\n",
+					anp->dn_ident->di_name);
+			case DT_ACT_UADDR:
+				rec->dtrd_action = DTRACEACT_UADDR;
+				knp = anp->dn_args;
+				break;
+			case DT_ACT_USYM:
+				rec->dtrd_action = DTRACEACT_USYM;
+				knp = anp->dn_args;
+				break;
+			case DT_ACT_UMOD:
+				rec->dtrd_action = DTRACEACT_UMOD;
+				knp = anp->dn_args;
+				break;
+			case DT_ACT_SYM:
+				rec->dtrd_action = DTRACEACT_SYM;
+				knp = anp->dn_args;
+				break;
+			case DT_ACT_MOD:
+				rec->dtrd_action = DTRACEACT_MOD;
+				knp = anp->dn_args;
+				break;
+			}
+		}
+
+		if (!dt_node_is_scalar(knp))
+			dnerror(anp, D_KEY_TYPE, "aggregation key of type %s "
+				"is not supported (yet)\n",
+				dt_node_type_name(knp, n, sizeof(n)));
+
+		dt_node_diftype(dtp, knp, &vtype);
+		if (rec->dtrd_action != DTRACEACT_DIFEXPR)
+			vtype.dtdt_size = sizeof(uint64_t);
+
+		koff = P2ROUNDUP(koff, vtype.dtdt_size);
+		rec->dtrd_size = vtype.dtdt_size;
+		rec->dtrd_offset = koff;
+		rec->dtrd_alignment = vtype.dtdt_size;
+		rec->dtrd_arg = knp->dn_flags & DT_NF_SIGNED ? DT_NF_SIGNED : 0;
+		koff += vtype.dtdt_size;
+	}
+
+	/*
+	 * The key is padded to a multiple of 8 bytes.  BPF hash maps do not
+	 * support empty keys, so an aggregation without keys uses a single
+	 * 64-bit zero key.  The scratch slot right past the key is used for
+	 * the (32-bit) key of the 'aggzero' and 'aggsel' maps, and the slot
+	 * after that holds the map selector for double-buffered aggregations.
+	 */
+	ksz = P2ROUNDUP(koff, sizeof(uint64_t));
+	zkey = ksz ? ksz : sizeof(uint64_t);
+	sel = DT_STK_SCRATCH_BASE + zkey + sizeof(uint64_t);
+	if (zkey + 2 * sizeof(uint64_t) > DT_STK_SCRATCH_SZ)
+		dnerror(dnp, D_KEY_TYPE, "aggregation key for @%s is too "
+			"large: %u bytes (limit %lu)\n", aid->di_name, koff,
+			DT_STK_SCRATCH_SZ - 2 * sizeof(uint64_t));
+
+	/*
+	 * Determine the size of the aggregation data, and the arguments that
+	 * need to be evaluated.
+	 */
+	rec->dtrd_action = fid->di_id;
+	rec->dtrd_offset = ksz;
+	rec->dtrd_alignment = sizeof(uint64_t);
+
+	switch (fid->di_id) {
+	case DTRACEAGG_COUNT:
+		dsz = sizeof(uint64_t);
+		break;
+	case DTRACEAGG_SUM:
+	case DTRACEAGG_MIN:
+	case DTRACEAGG_MAX:
+		vnp = dnp->dn_aggfun->dn_args;
+		dsz = sizeof(uint64_t);
+		break;
+	case DTRACEAGG_AVG:
+		vnp = dnp->dn_aggfun->dn_args;
+		dsz = 2 * sizeof(uint64_t);
+		break;
+	case DTRACEAGG_STDDEV:
+		vnp = dnp->dn_aggfun->dn_args;
+		dsz = 4 * sizeof(uint64_t);
+		break;
+	case DTRACEAGG_QUANTIZE:
+		vnp = dnp->dn_aggfun->dn_args;
+		inp = vnp->dn_list;
+		dsz = DTRACE_QUANTIZE_NBUCKETS * sizeof(uint64_t);
+		break;
+	case DTRACEAGG_LQUANTIZE: {
+		dt_node_t	*arg3;
+
+		vnp = dnp->dn_aggfun->dn_args;
+		arg = dt_cg_agg_lquantize_arg(dnp, aid);
+		arg3 = vnp->dn_list->dn_list->dn_list;
+		inp = arg3 != NULL ? arg3->dn_list : NULL;
+		dsz = (DTRACE_LQUANTIZE_LEVELS(arg) + 3) * sizeof(uint64_t);
+		break;
+	}
+	default:
+		dnerror(dnp, D_UNKNOWN, "%s() is not implemented (yet)\n",
+			fid->di_name);
+	}
+
+	rec->dtrd_size = dsz;
+	rec->dtrd_arg = arg;
+
+	if (dt_aggid_add(dtp, aid, nkeys + 1, recs) == -1)
+		longjmp(yypcb->pcb_jmpbuf, dtrace_errno(dtp));
+
+	snprintf(n, sizeof(n), DT_AGG_MAPNAME, aid->di_id);
+	mid = dt_dlib_get_map(dtp, n);
+	if (mid == NULL)
+		mid = dt_dlib_add_map(dtp, n);
+	if (mid == NULL)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOMEM);
+
+	if (dtp->dt_aggregate.dtat_flags & DTRACE_A_DBUF) {
+		snprintf(n, sizeof(n), DT_AGG_MAPNAME_ALT, aid->di_id);
+		alt = dt_dlib_get_map(dtp, n);
+		if (alt == NULL)
+			alt = dt_dlib_add_map(dtp, n);
+		if (alt == NULL)
+			longjmp(yypcb->pcb_jmpbuf, EDT_NOMEM);
+	}
+
+	zid = dt_dlib_get_map(dtp, "aggzero");
+	assert(zid != NULL);
+	sid = dt_dlib_get_map(dtp, "aggsel");
+	assert(sid != NULL);
+
+	TRACE_REGSET("Aggregation: Begin");
+
+	/*
+	 * Evaluate the keys and arguments before anything gets stored in the
+	 * scratch area, because the evaluation of an expression may use the
+	 * scratch area itself (e.g. associative array lookups).
+	 */
+	for (anp = dnp->dn_aggtup, rec = recs; anp != NULL;
+	     anp = anp->dn_list, rec++) {
+		knp = rec->dtrd_action == DTRACEACT_DIFEXPR ? anp
+							    : anp->dn_args;
+
+		dt_cg_node(knp, dlp, drp);
+	}
+
+	if (vnp != NULL) {
+		dt_cg_node(vnp, dlp, drp);
+		vreg = vnp->dn_reg;
+	}
+	if (inp != NULL) {
+		dt_cg_node(inp, dlp, drp);
+		ireg = inp->dn_reg;
+	}
+
+	/*
+	 * Clear the key area (so that any padding is zero), and then store
+	 * the key values.
+	 */
+	for (i = 0; i < zkey + sizeof(uint64_t); i += sizeof(uint64_t)) {
+		instr = BPF_STORE_IMM(BPF_DW, BPF_REG_FP,
+				      DT_STK_SCRATCH_BASE + i, 0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	}
+
+	for (anp = dnp->dn_aggtup, rec = recs; anp != NULL;
+	     anp = anp->dn_list, rec++) {
+		knp = rec->dtrd_action == DTRACEACT_DIFEXPR ? anp
+							    : anp->dn_args;
+
+		instr = BPF_STORE(dt_cg_agg_keysize(rec->dtrd_size),
+				  BPF_REG_FP,
+				  DT_STK_SCRATCH_BASE + rec->dtrd_offset,
+				  knp->dn_reg);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		dt_regset_free(drp, knp->dn_reg);
+	}
+
+	/*
+	 *	rc = bpf_map_lookup_elem(&agg_N, key);
+	 *				// lddw %r1, &agg_N (or agg_N_1)
+	 *				// mov %r2, %fp
+	 *				// add %r2, DT_STK_SCRATCH_BASE
+	 *				// call bpf_map_lookup_elem
+	 *	if (rc != 0)		// jne %r0, 0, lbl_found
+	 *		goto found;
+	 *	rc = bpf_map_lookup_elem(&aggzero, &zkey);
+	 *				// lddw %r1, &aggzero
+	 *				// mov %r2, %fp
+	 *				// add %r2, DT_STK_SCRATCH_BASE + zkey
+	 *				// call bpf_map_lookup_elem
+	 *	if (rc == 0)		// jeq %r0, 0, lbl_found
+	 *		goto found;
+	 *	bpf_map_update_elem(&agg_N, key, rc, BPF_NOEXIST);
+	 *				// mov %r3, %r0
+	 *				// lddw %r1, &agg_N
+	 *				// mov %r2, %fp
+	 *				// add %r2, DT_STK_SCRATCH_BASE
+	 *				// mov %r4, BPF_NOEXIST
+	 *				// call bpf_map_update_elem
+	 *	rc = bpf_map_lookup_elem(&agg_N, key);
+	 *				// lddw %r1, &agg_N
+	 *				// mov %r2, %fp
+	 *				// add %r2, DT_STK_SCRATCH_BASE
+	 *				// call bpf_map_lookup_elem
+	 * found:
+	 *	if (rc == 0)		// jeq %r0, 0, lbl_done
+	 *		goto done;
+	 */
+	if (dt_regset_xalloc_args(drp) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+	dt_regset_xalloc(drp, BPF_REG_0);
+
+	/*
+	 * For double-buffered aggregations, retrieve the map selector first.
+	 *
+	 *	rc = bpf_map_lookup_elem(&aggsel, &zkey);
+	 *				// lddw %r1, &aggsel
+	 *				// mov %r2, %fp
+	 *				// add %r2, DT_STK_SCRATCH_BASE + zkey
+	 *				// call bpf_map_lookup_elem
+	 *	if (rc != 0)		// jeq %r0, 0, lbl_sel
+	 *		rc = *rc;	// ldxdw %r0, [%r0 + 0]
+	 * sel:
+	 *	sel = rc;		// stxdw [%fp + sel], %r0
+	 */
+	if (alt != NULL) {
+		uint_t	lbl_sel = dt_irlist_label(dlp);
+
+		dt_cg_xsetx(dlp, sid, DT_LBL_NONE, BPF_REG_1, sid->di_id);
+		instr = BPF_MOV_REG(BPF_REG_2, BPF_REG_FP);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_2,
+				      DT_STK_SCRATCH_BASE + zkey);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_CALL_HELPER(BPF_FUNC_map_lookup_elem);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_BRANCH_IMM(BPF_JEQ, BPF_REG_0, 0, lbl_sel);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_LOAD(BPF_DW, BPF_REG_0, BPF_REG_0, 0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_STORE(BPF_DW, BPF_REG_FP, sel, BPF_REG_0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(lbl_sel, instr));
+	}
+
+	dt_cg_agg_map(dlp, mid, alt, sel);
+	instr = BPF_MOV_REG(BPF_REG_2, BPF_REG_FP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, DT_STK_SCRATCH_BASE);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_map_lookup_elem);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JNE, BPF_REG_0, 0, lbl_found);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	dt_cg_xsetx(dlp, zid, DT_LBL_NONE, BPF_REG_1, zid->di_id);
+	instr = BPF_MOV_REG(BPF_REG_2, BPF_REG_FP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, DT_STK_SCRATCH_BASE + zkey);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_map_lookup_elem);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_BRANCH_IMM(BPF_JEQ, BPF_REG_0, 0, lbl_found);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	instr = BPF_MOV_REG(BPF_REG_3, BPF_REG_0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_cg_agg_map(dlp, mid, alt, sel);
+	instr = BPF_MOV_REG(BPF_REG_2, BPF_REG_FP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, DT_STK_SCRATCH_BASE);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_MOV_IMM(BPF_REG_4, BPF_NOEXIST);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_map_update_elem);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	dt_cg_agg_map(dlp, mid, alt, sel);
+	instr = BPF_MOV_REG(BPF_REG_2, BPF_REG_FP);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, DT_STK_SCRATCH_BASE);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_CALL_HELPER(BPF_FUNC_map_lookup_elem);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_found, BPF_NOP()));
+	dt_regset_free_args(drp);
+
+	if ((preg = dt_regset_alloc(drp)) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+	instr = BPF_MOV_REG(preg, BPF_REG_0);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	dt_regset_free(drp, BPF_REG_0);
+	instr = BPF_BRANCH_IMM(BPF_JEQ, preg, 0, lbl_done);
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	switch (fid->di_id) {
+	case DTRACEAGG_COUNT:
+	case DTRACEAGG_SUM:
+	case DTRACEAGG_AVG:
+		if ((treg = dt_regset_alloc(drp)) == -1)
+			longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+		if (fid->di_id == DTRACEAGG_AVG) {
+			dt_cg_agg_incr(dlp, preg, treg, DT_AGG_HDRSZ, -1);
+			dt_cg_agg_incr(dlp, preg, treg, DT_AGG_HDRSZ + 8,
+				       vreg);
+		} else
+			dt_cg_agg_incr(dlp, preg, treg, DT_AGG_HDRSZ, vreg);
+		dt_regset_free(drp, treg);
+		break;
+	case DTRACEAGG_MIN:
+		dt_cg_agg_minmax(dlp, drp, preg, vreg, BPF_JSLE);
+		break;
+	case DTRACEAGG_MAX:
+		dt_cg_agg_minmax(dlp, drp, preg, vreg, BPF_JSGE);
+		break;
+	case DTRACEAGG_STDDEV:
+		dt_cg_agg_stddev(dlp, drp, preg, vreg);
+		break;
+	case DTRACEAGG_QUANTIZE:
+		dt_cg_agg_quantize(dlp, drp, preg, vreg, ireg);
+		break;
+	case DTRACEAGG_LQUANTIZE:
+		dt_cg_agg_lquantize(dlp, drp, preg, vreg, ireg, arg);
+		break;
+	}
+
+	/*
+	 *	val[0]++;		// ldxdw %treg, [%preg + 0]
+	 *				// add %treg, 1
+	 *				// stxdw [%preg + 0], %treg
+	 * done:
+	 */
+	if ((treg = dt_regset_alloc(drp)) == -1)
+		longjmp(yypcb->pcb_jmpbuf, EDT_NOREG);
+	dt_cg_agg_incr(dlp, preg, treg, 0, -1);
+	dt_regset_free(drp, treg);
+	dt_irlist_append(dlp, dt_cg_node_alloc(lbl_done, BPF_NOP()));
+
+	dt_regset_free(drp, preg);
+	if (ireg != -1)
+		dt_regset_free(drp, ireg);
+	if (vreg != -1)
+		dt_regset_free(drp, vreg);
+
+	TRACE_REGSET("Aggregation: End  ");
+}
+
 void
 dt_cg(dt_pcb_t *pcb, dt_node_t *dnp)
 {
@@ -3003,12 +4426,23 @@ dt_cg(dt_pcb_t *pcb, dt_node_t *dnp)
 		dt_cg_node(dnp, &pcb->pcb_ir, pcb->pcb_regs);
 	} else if (dnp->dn_kind == DT_NODE_CLAUSE) {
 		dt_irlist_t	*dlp = &pcb->pcb_ir;
+		int		output = dnp->dn_acts == NULL;
 
-		dt_cg_prologue(pcb, dnp->dn_pred);
+		for (act = dnp->dn_acts; act != NULL; act = act->dn_list) {
+			if (act->dn_kind != DT_NODE_AGG)
+				output = 1;
+		}
+
+		dt_cg_prologue(pcb, dnp->dn_pred, output);
 
 		for (act = dnp->dn_acts; act != NULL; act = act->dn_list) {
 			pcb->pcb_dret = act->dn_expr;
 
+			if (act->dn_kind == DT_NODE_AGG) {
+				dt_cg_agg(pcb, act);
+				continue;
+			}
+
 			if (act->dn_kind == DT_NODE_DFUNC) {
 				const dt_cg_actdesc_t	*actdp;
 				dt_ident_t		*idp;
@@ -3027,7 +4461,7 @@ dt_cg(dt_pcb_t *pcb, dt_node_t *dnp)
 			}
 		}
 
-		dt_cg_epilogue(pcb);
+		dt_cg_epilogue(pcb, output);
 	} else if (dnp->dn_kind == DT_NODE_TRAMPOLINE) {
 		assert(pcb->pcb_probe != NULL);
 
@@ -6,6 +6,7 @@
  */
 
 #include <stdlib.h>
+#include <time.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -13,9 +14,15 @@
 #include <assert.h>
 #include <ctype.h>
 #include <alloca.h>
+#include <pthread.h>
+#include <signal.h>
 #include <dt_impl.h>
+#include <dt_bpf.h>
+#include <dt_oformat.h>
 #include <dt_pcap.h>
 #include <dt_peb.h>
+#include <dt_ringbuf.h>
+#include <dt_tracefile.h>
 #include <libproc.h>
 #include <port.h>
 #include <sys/epoll.h>
@@ -24,6 +31,22 @@
 
 #define	DT_MASK_LO 0x00000000FFFFFFFFULL
 
+/*
+ * Adaptive consumer wakeups: a round of consumption that processes at least
+ * DT_WAKEUP_BATCH records indicates a high event rate.  The consumer then
+ * sleeps between rounds, starting with DT_WAKEUP_MINDELAY.
+ */
+#define	DT_WAKEUP_BATCH		64
+#define	DT_WAKEUP_MINDELAY	(NANOSEC / 1000)
+
+/*
+ * With the 'bufresize' option set to 'auto', the perf event buffers are grown
+ * when records are lost in DT_RESIZE_ROUNDS consecutive rounds of consumption,
+ * up to DT_RESIZE_MAX times.
+ */
+#define	DT_RESIZE_ROUNDS	2
+#define	DT_RESIZE_MAX		4
+
 /*
  * We declare this here because (1) we need it and (2) we want to avoid a
  * dependency on libm in libdtrace.
@@ -361,47 +384,19 @@ dt_stddev(uint64_t *data, uint64_t normal)
 	return (dt_sqrt_128(diff));
 }
 
-static int
+/*
+ * Determine the flow kind and indentation prefix for a record.  The flow kind
+ * of every enabled probe is determined when its ID is registered (see
+ * dt_epid_info()), so this does not need to look at the probe name.
+ */
+static void
 dt_flowindent(dtrace_hdl_t *dtp, dtrace_probedata_t *data, dtrace_epid_t last,
 	      dtrace_epid_t next)
 {
-	dtrace_probedesc_t	*pd = data->dtpda_pdesc, *npd;
-	dtrace_datadesc_t	*dd = data->dtpda_ddesc, *ndd;
-	dtrace_flowkind_t	flow = DTRACEFLOW_NONE;
-	const char		*p = pd->prv;
-	const char		*n = pd->prb;
-	const char		*str = NULL;
-	char			*sub;
-	static const char	*e_str[2] = { " -> ", " => " };
-	static const char	*r_str[2] = { " <- ", " <= " };
-	static const char	*ent = "entry", *ret = "return";
-	static int		entlen = 0, retlen = 0;
 	dtrace_epid_t		id = data->dtpda_epid;
-	int			rval;
-
-	if (entlen == 0) {
-		assert(retlen == 0);
-		entlen = strlen(ent);
-		retlen = strlen(ret);
-	}
-
-	/*
-	 * If the name of the probe is "entry" or ends with "-entry", we
-	 * treat it as an entry; if it is "return" or ends with "-return",
-	 * we treat it as a return.  (This allows application-provided probes
-	 * like "method-entry" or "function-entry" to participate in flow
-	 * indentation -- without accidentally misinterpreting popular probe
-	 * names like "carpentry", "gentry" or "Coventry".)
-	 */
-	if ((sub = strstr(n, ent)) != NULL && sub[entlen] == '\0' &&
-	    (sub == n || sub[-1] == '-')) {
-		flow = DTRACEFLOW_ENTRY;
-		str = e_str[strcmp(p, "syscall") == 0];
-	} else if ((sub = strstr(n, ret)) != NULL && sub[retlen] == '\0' &&
-		   (sub == n || sub[-1] == '-')) {
-		flow = DTRACEFLOW_RETURN;
-		str = r_str[strcmp(p, "syscall") == 0];
-	}
+	const dt_epinfo_t	*eip = &dtp->dt_epinfo[id];
+	dtrace_flowkind_t	flow = eip->flow;
+	dtrace_id_t		prid = data->dtpda_pdesc->id;
 
 	/*
 	 * If we're going to indent this, we need to check the ID of our last
@@ -411,7 +406,7 @@ dt_flowindent(dtrace_hdl_t *dtp, dtrace_probedata_t *data, dtrace_epid_t last,
 	 */
 	if (flow == DTRACEFLOW_ENTRY) {
 		if (last != DTRACE_EPIDNONE && id != last &&
-		    pd->id == dtp->dt_pdesc[last]->id)
+		    prid == dtp->dt_pdesc[last]->id)
 			flow = DTRACEFLOW_NONE;
 	}
 
@@ -421,27 +416,15 @@ dt_flowindent(dtrace_hdl_t *dtp, dtrace_probedata_t *data, dtrace_epid_t last,
 	 * _next_ EPID.
 	 */
 	if (flow == DTRACEFLOW_RETURN && next != DTRACE_EPIDNONE &&
-	    next != id) {
-		rval = dt_epid_lookup(dtp, next, &ndd, &npd);
-		if (rval != 0)
-			return rval;
-
-		if (npd->id == pd->id)
-			flow = DTRACEFLOW_NONE;
-	}
+	    next != id && dtp->dt_pdesc[next]->id == prid)
+		flow = DTRACEFLOW_NONE;
 
-out:
-	if (flow == DTRACEFLOW_ENTRY || flow == DTRACEFLOW_RETURN)
-		data->dtpda_prefix = str;
-	else
-		data->dtpda_prefix = "| ";
+	data->dtpda_prefix = flow == DTRACEFLOW_NONE ? "| " : eip->prefix;
 
 	if (flow == DTRACEFLOW_RETURN && data->dtpda_indent > 0)
 		data->dtpda_indent -= 2;
 
 	data->dtpda_flow = flow;
-
-	return 0;
 }
 
 static int
@@ -2255,7 +2238,7 @@ nextepid:
 }
 #else
 static int
-dt_print_trace(dtrace_hdl_t *dtp, FILE *fp, dtrace_recdesc_t *rec,
+dt_print_trace(dtrace_hdl_t *dtp, FILE *fp, const dtrace_recdesc_t *rec,
 	       caddr_t data, int quiet)
 {
 	/*
@@ -2314,76 +2297,232 @@ dt_print_trace(dtrace_hdl_t *dtp, FILE *fp, dtrace_recdesc_t *rec,
 	return dt_print_bytes(dtp, fp, data, rec->dtrd_size, 33, quiet);
 }
 
+/*
+ * Decode plans.
+ *
+ * A decode plan is built for every data description when it is associated
+ * with an enabled probe ID.  It is a flat list of steps, each of which covers
+ * the records that are handled by a single output function: a printf-like
+ * action and its argument records form one step, and every other record is a
+ * step of its own.  Processing a trace data record is then a walk over the
+ * steps, without having to look at the kind of action for every record.
+ */
+typedef int dt_recfunc_f(dtrace_hdl_t *, FILE *, const dtrace_probedata_t *,
+			 const dtrace_recdesc_t *, uint_t, const void *, size_t,
+			 int);
+
+typedef struct dt_recstep {
+	const dtrace_recdesc_t	*rec;		/* first record of the step */
+	uint_t			nrecs;		/* records left (incl. this one) */
+	dt_recfunc_f		*func;		/* output function */
+} dt_recstep_t;
+
+typedef struct dt_recplan {
+	int		nsteps;			/* number of steps */
+	int		exit;			/* clause calls exit() */
+	dt_recstep_t	steps[1];		/* steps (nsteps) */
+} dt_recplan_t;
+
+static int
+dt_recfunc_trace(dtrace_hdl_t *dtp, FILE *fp, const dtrace_probedata_t *pdat,
+		 const dtrace_recdesc_t *rec, uint_t nrecs, const void *buf,
+		 size_t len, int quiet)
+{
+	return dt_print_trace(dtp, fp, rec, pdat->dtpda_data, quiet);
+}
+
+static int
+dt_recfunc_printf(dtrace_hdl_t *dtp, FILE *fp, const dtrace_probedata_t *pdat,
+		  const dtrace_recdesc_t *rec, uint_t nrecs, const void *buf,
+		  size_t len, int quiet)
+{
+	return dtrace_fprintf(dtp, fp, rec->dtrd_format, pdat, rec, nrecs,
+			      buf, len);
+}
+
+static int
+dt_recfunc_system(dtrace_hdl_t *dtp, FILE *fp, const dtrace_probedata_t *pdat,
+		  const dtrace_recdesc_t *rec, uint_t nrecs, const void *buf,
+		  size_t len, int quiet)
+{
+	return dtrace_system(dtp, fp, rec->dtrd_format, pdat, rec, nrecs,
+			     buf, len);
+}
+
+static int
+dt_recfunc_freopen(dtrace_hdl_t *dtp, FILE *fp, const dtrace_probedata_t *pdat,
+		   const dtrace_recdesc_t *rec, uint_t nrecs, const void *buf,
+		   size_t len, int quiet)
+{
+	return dtrace_freopen(dtp, fp, rec->dtrd_format, pdat, rec, nrecs,
+			      buf, len);
+}
+
+/*
+ * Build the decode plan for a data description (if it does not have one yet).
+ * The format of a printf-like action is stored with its first record only, so
+ * the records that follow it for the same action (without a format) are its
+ * arguments.
+ */
+int
+dt_consume_plan(dtrace_hdl_t *dtp, dtrace_datadesc_t *ddp)
+{
+	dt_recplan_t	*plan;
+	dt_recstep_t	*step = NULL;
+	int		i;
+
+	if (ddp->dtdd_plan != NULL)
+		return 0;
+
+	plan = dt_zalloc(dtp, offsetof(dt_recplan_t, steps) +
+			      MAX(ddp->dtdd_nrecs, 1) * sizeof(dt_recstep_t));
+	if (plan == NULL)
+		return dt_set_errno(dtp, EDT_NOMEM);
+
+	for (i = 0; i < ddp->dtdd_nrecs; i++) {
+		const dtrace_recdesc_t	*rec = &ddp->dtdd_recs[i];
+		dt_recfunc_f		*func;
+
+		if (rec->dtrd_action == DTRACEACT_EXIT)
+			plan->exit = 1;
+
+		if (rec->dtrd_format == NULL && step != NULL &&
+		    step->func != dt_recfunc_trace &&
+		    rec->dtrd_action == step->rec->dtrd_action)
+			continue;
+
+		switch (rec->dtrd_action) {
+		case DTRACEACT_PRINTF:
+			func = dt_recfunc_printf;
+			break;
+		case DTRACEACT_SYSTEM:
+			func = dt_recfunc_system;
+			break;
+		case DTRACEACT_FREOPEN:
+			func = dt_recfunc_freopen;
+			break;
+		default:
+			func = dt_recfunc_trace;
+			break;
+		}
+
+		if (rec->dtrd_format == NULL)
+			func = dt_recfunc_trace;
+
+		step = &plan->steps[plan->nsteps++];
+		step->rec = rec;
+		step->nrecs = ddp->dtdd_nrecs - i;
+		step->func = func;
+	}
+
+	ddp->dtdd_plan = plan;
+
+	return 0;
+}
+
+/*
+ * Return the statistics for the given CPU, or NULL if statistics are not being
+ * kept.
+ */
+static dtrace_cpustats_t *
+dt_consume_cpustats(dtrace_hdl_t *dtp, processorid_t cpu)
+{
+	if (dtp->dt_cpustats == NULL || cpu < 0 || cpu > dtp->dt_conf.max_cpuid)
+		return NULL;
+
+	return &dtp->dt_cpustats[cpu];
+}
+
+/*
+ * Process a single trace data record.  The 'data' pointer points to the EPID,
+ * which is followed by the tag and the data recorded by the clause, for a total
+ * of 'size' bytes.
+ */
 static dtrace_workstatus_t
-dt_consume_one(dtrace_hdl_t *dtp, FILE *fp, int cpu, char *buf,
+dt_consume_rec(dtrace_hdl_t *dtp, FILE *fp, char *data, uint32_t size,
 	       dtrace_probedata_t *pdat, dtrace_consume_probe_f *efunc,
 	       dtrace_consume_rec_f *rfunc, int flow, int quiet,
 	       dtrace_epid_t *last, void *arg)
 {
-	char				*data = buf;
-	struct perf_event_header	*hdr;
-	int				rval;
+	uint32_t	epid, tag;
+	int		i;
+	int		oformat = dt_oformat_enabled(dtp);
+	int		rval;
+	dt_recplan_t	*plan;
+	dt_recstep_t	*step;
+	dtrace_cpustats_t *csp;
+	hrtime_t	start = 0;
+
+	epid = ((uint32_t *)data)[0];
+	tag = ((uint32_t *)data)[1];
+
+	dtp->dt_nrecs++;
+
+	csp = dt_consume_cpustats(dtp, pdat->dtpda_cpu);
+	if (csp != NULL) {
+		csp->dtcs_nrecs++;
+		csp->dtcs_bytes += size;
+	}
 
-	hdr = (struct perf_event_header *)data;
-	data += sizeof(struct perf_event_header);
+	/*
+	 * When trace data is recorded to a trace file, it is processed when
+	 * the trace file is consumed.
+	 */
+	if (dtp->dt_tracefile != NULL && !dtp->dt_tracefile->replay)
+		return dt_tracefile_write_rec(dtp, pdat->dtpda_cpu, data, size);
 
-	if (hdr->type == PERF_RECORD_SAMPLE) {
-		char			*ptr = data;
-		uint32_t		size, epid, tag;
-		int			i;
-		int			done = 0;
+	/*
+	 * Fill in the epid and address of the epid in the buffer.  We need to
+	 * pass this to the efunc.
+	 */
+	pdat->dtpda_epid = epid;
+	pdat->dtpda_data = data;
 
-		/*
-		 * struct {
-		 *	struct perf_event_header	header;
-		 *	uint32_t			size;
-		 *	uint32_t			pad;
-		 *	uint32_t			epid;
-		 *	uint32_t			tag;
-		 *	uint64_t			data[n];
-		 * }
-		 * and 'data' points to the 'size' member at this point.
-		 * (Note that 'n' may be 0.)
-		 */
-		if (ptr > buf + hdr->size)
-			return -1;
+	/*
+	 * Enabled probe IDs are dense, so they index the descriptions directly.
+	 */
+	if (epid >= dtp->dt_maxprobe || dtp->dt_ddesc[epid] == NULL)
+		return dt_set_errno(dtp, EDT_BADID);
 
-		size = *(uint32_t *)data;
-		data += sizeof(size);
-		ptr += sizeof(size) + size;
-		if (ptr != buf + hdr->size)
-			return -1;
+	pdat->dtpda_ddesc = dtp->dt_ddesc[epid];
+	pdat->dtpda_pdesc = dtp->dt_pdesc[epid];
+	plan = pdat->dtpda_ddesc->dtdd_plan;
+	assert(plan != NULL);
 
-		data += sizeof(uint32_t);		/* skip padding */
-		size -= sizeof(uint32_t);
+	if (flow)
+		dt_flowindent(dtp, pdat, *last, DTRACE_EPIDNONE);
 
-		epid = ((uint32_t *)data)[0];
-		tag = ((uint32_t *)data)[1];
+	rval = (*efunc)(pdat, arg);
 
-		/*
-		 * Fill in the epid and address of the epid in the buffer.  We
-		 * need to pass this to the efunc.
-		 */
-		pdat->dtpda_epid = epid;
-		pdat->dtpda_data = data;
+	if (flow) {
+		if (pdat->dtpda_flow == DTRACEFLOW_ENTRY)
+			pdat->dtpda_indent += 2;
+	}
 
-		rval = dt_epid_lookup(dtp, epid, &pdat->dtpda_ddesc,
-						 &pdat->dtpda_pdesc);
-		if (rval != 0)
-			return rval;
+	if (rval == DTRACE_CONSUME_NEXT)
+		return 0;
 
-		if (flow)
-			dt_flowindent(dtp, pdat, *last, DTRACE_EPIDNONE);
+	if (rval == DTRACE_CONSUME_ABORT)
+		return dt_set_errno(dtp, EDT_DIRABORT);
 
-		rval = (*efunc)(pdat, arg);
+	if (rval != DTRACE_CONSUME_THIS)
+		return dt_set_errno(dtp, EDT_BADRVAL);
 
-		if (flow) {
-			if (pdat->dtpda_flow == DTRACEFLOW_ENTRY)
-				pdat->dtpda_indent += 2;
-		}
+	if (oformat && dt_oformat_probe(dtp, pdat) != 0)
+		return -1;
+
+	if (dtp->dt_cpustats != NULL)
+		start = gethrtime();
+
+	for (i = 0, step = plan->steps; i < plan->nsteps; i++, step++) {
+		const dtrace_recdesc_t	*rec = step->rec;
+		int			n;
+
+		pdat->dtpda_data = data + rec->dtrd_offset;
+		rval = (*rfunc)(pdat, rec, arg);
 
 		if (rval == DTRACE_CONSUME_NEXT)
-			return 0;
+			continue;
 
 		if (rval == DTRACE_CONSUME_ABORT)
 			return dt_set_errno(dtp, EDT_DIRABORT);
@@ -2391,83 +2530,80 @@ dt_consume_one(dtrace_hdl_t *dtp, FILE *fp, int cpu, char *buf,
 		if (rval != DTRACE_CONSUME_THIS)
 			return dt_set_errno(dtp, EDT_BADRVAL);
 
-		/*
-		 * FIXME: This code is temporary.
-		 */
-		for (i = 0; i < pdat->dtpda_ddesc->dtdd_nrecs; i++) {
-			int			n;
-			dtrace_recdesc_t	*rec;
-			int (*func)(dtrace_hdl_t *, FILE *, void *,
-			    const dtrace_probedata_t *,
-			    const dtrace_recdesc_t *, uint_t,
-			    const void *buf, size_t);
-
-			rec = &pdat->dtpda_ddesc->dtdd_recs[i];
-			if (rec->dtrd_action == DTRACEACT_EXIT)
-				done = 1;
-
-			pdat->dtpda_data = data + rec->dtrd_offset;
-			rval = (*rfunc)(pdat, rec, arg);
-
-			if (rval == DTRACE_CONSUME_NEXT)
-				continue;
+		if (oformat)
+			n = dt_oformat_datum(dtp, fp, pdat, rec, step->nrecs,
+					     data, size);
+		else
+			n = (*step->func)(dtp, fp, pdat, rec, step->nrecs,
+					  data, size, quiet);
+		if (n < 0)
+			return -1;
+	}
 
-			if (rval == DTRACE_CONSUME_ABORT)
-				return dt_set_errno(dtp, EDT_DIRABORT);
+	if (oformat && dt_oformat_end(dtp, fp) != 0)
+		return -1;
 
-			if (rval != DTRACE_CONSUME_THIS)
-				return dt_set_errno(dtp, EDT_BADRVAL);
+	if (dtp->dt_cpustats != NULL)
+		dtp->dt_stats.dtsts_format_time += gethrtime() - start;
 
-			switch (rec->dtrd_action) {
-			case DTRACEACT_PRINTF:
-				func = dtrace_fprintf;
-				break;
-/*
-			case DTRACEACT_PRINTA:
-				func = dtrace_fprinta;
-				break;
-*/
-			case DTRACEACT_SYSTEM:
-				func = dtrace_system;
-				break;
-			case DTRACEACT_FREOPEN:
-				func = dtrace_freopen;
-				break;
-			default:
-				func = NULL;
-				break;
-			}
+	/*
+	 * Call the record callback with a NULL record to indicate that we're
+	 * done processing this EPID.
+	 */
+	rval = (*rfunc)(pdat, NULL, arg);
 
-			if (func) {
-				int	nrecs;
+	*last = epid;
 
-				nrecs = pdat->dtpda_ddesc->dtdd_nrecs - i;
-				n = (*func)(dtp, fp, rec->dtrd_format, pdat,
-						   rec, nrecs, data, size);
-				if (n < 0)
-					return -1;
-				if (n > 0)
-					i += n - 1;
+	return plan->exit ? DTRACE_WORKSTATUS_DONE : DTRACE_WORKSTATUS_OKAY;
+}
 
-				continue;
-			}
+static dtrace_workstatus_t
+dt_consume_one(dtrace_hdl_t *dtp, FILE *fp, int cpu, char *buf,
+	       dtrace_probedata_t *pdat, dtrace_consume_probe_f *efunc,
+	       dtrace_consume_rec_f *rfunc, int flow, int quiet,
+	       dtrace_epid_t *last, void *arg)
+{
+	char				*data = buf;
+	struct perf_event_header	*hdr;
 
-			n = dt_print_trace(dtp, fp, rec, pdat->dtpda_data,
-					   quiet);
+	hdr = (struct perf_event_header *)data;
+	data += sizeof(struct perf_event_header);
 
-			if (n < 0)
-				return -1;
-		}
+	if (hdr->type == PERF_RECORD_SAMPLE) {
+		char			*ptr;
+		uint32_t		size;
 
 		/*
-		 * Call the record callback with a NULL record to indicate
-		 * that we're done processing this EPID.
+		 * struct {
+		 *	struct perf_event_header	header;
+		 *	uint64_t			time;	(optional)
+		 *	uint32_t			size;
+		 *	uint32_t			pad;
+		 *	uint32_t			epid;
+		 *	uint32_t			tag;
+		 *	uint64_t			data[n];
+		 * }
+		 * and 'data' points to the 'size' member after skipping the
+		 * timestamp (if any).  (Note that 'n' may be 0.)
 		 */
-		rval = (*rfunc)(pdat, NULL, arg);
+		if (dtp->dt_pebset->sample_type & PERF_SAMPLE_TIME)
+			data += sizeof(uint64_t);
 
-		*last = epid;
+		ptr = data;
+		if (ptr > buf + hdr->size)
+			return -1;
 
-		return done ? DTRACE_WORKSTATUS_DONE : DTRACE_WORKSTATUS_OKAY;
+		size = *(uint32_t *)data;
+		data += sizeof(size);
+		ptr += sizeof(size) + size;
+		if (ptr != buf + hdr->size)
+			return -1;
+
+		data += sizeof(uint32_t);		/* skip padding */
+		size -= sizeof(uint32_t);
+
+		return dt_consume_rec(dtp, fp, data, size, pdat, efunc, rfunc,
+				      flow, quiet, last, arg);
 	} else if (hdr->type == PERF_RECORD_LOST) {
 		uint64_t	lost;
 
@@ -2481,8 +2617,15 @@ dt_consume_one(dtrace_hdl_t *dtp, FILE *fp, int cpu, char *buf,
 		 */
 		lost = *(uint64_t *)(data + sizeof(uint64_t));
 
-		/* FIXME: To be implemented */
-		return DTRACE_WORKSTATUS_ERROR;
+		dtp->dt_drops += lost;
+		if (dtp->dt_tracefile != NULL && !dtp->dt_tracefile->replay &&
+		    dt_tracefile_write_drop(dtp, cpu, lost) != 0)
+			return DTRACE_WORKSTATUS_ERROR;
+		if (dt_handle_cpudrop(dtp, cpu, DTRACEDROP_PRINCIPAL,
+				      lost) != 0)
+			return DTRACE_WORKSTATUS_ERROR;
+
+		return DTRACE_WORKSTATUS_OKAY;
 	} else
 		return DTRACE_WORKSTATUS_ERROR;
 }
@@ -2498,9 +2641,10 @@ dt_consume_cpu(dtrace_hdl_t *dtp, FILE *fp, int cpu, dt_peb_t *peb,
 	char				*base;
 	char				*event;
 	uint32_t			len;
-	uint64_t			head, tail;
+	uint64_t			head, tail, released;
 	dt_pebset_t			*pebset = dtp->dt_pebset;
-	uint64_t			data_size = pebset->data_size;
+	uint64_t			data_size;
+	size_t				release = dt_pebs_release(dtp);
 	int				flow, quiet;
 	dtrace_probedata_t		pdat;
 	dtrace_workstatus_t		rval = DTRACE_WORKSTATUS_OKAY;
@@ -2520,6 +2664,7 @@ dt_consume_cpu(dtrace_hdl_t *dtp, FILE *fp, int cpu, dt_peb_t *peb,
 	 * page (it contains buffer management data).
 	 */
 	base = peb->base + pebset->page_size;
+	data_size = peb->endp - base + 1;
 
 	for (;;) {
 		head = ring_buffer_read_head(rb_page);
@@ -2528,6 +2673,7 @@ dt_consume_cpu(dtrace_hdl_t *dtp, FILE *fp, int cpu, dt_peb_t *peb,
 		if (head == tail)
 			break;
 
+		released = tail;
 		do {
 			event = base + tail % data_size;
 			hdr = (struct perf_event_header *)event;
@@ -2538,12 +2684,21 @@ dt_consume_cpu(dtrace_hdl_t *dtp, FILE *fp, int cpu, dt_peb_t *peb,
 			 * the buffer, we make a copy in contiguous memory.
 			 */
 			if (event + len > peb->endp) {
-				char		*dst;
-				uint32_t	num;
+				char			*dst;
+				uint32_t		num;
+				dtrace_cpustats_t	*csp;
 
-				/* Increase the buffer as needed. */
+				/*
+				 * The buffer is sized for the largest event,
+				 * but other record types could be larger.
+				 */
 				if (pebset->tmp_len < len) {
-					pebset->tmp = realloc(pebset->tmp, len);
+					dst = realloc(pebset->tmp, len);
+					if (dst == NULL)
+						return dt_set_errno(dtp,
+								    EDT_NOMEM);
+
+					pebset->tmp = dst;
 					pebset->tmp_len = len;
 				}
 
@@ -2553,6 +2708,10 @@ dt_consume_cpu(dtrace_hdl_t *dtp, FILE *fp, int cpu, dt_peb_t *peb,
 				memcpy(dst + num, base, len - num);
 
 				event = dst;
+
+				csp = dt_consume_cpustats(dtp, cpu);
+				if (csp != NULL)
+					csp->dtcs_wraps++;
 			}
 
 			rval = dt_consume_one(dtp, fp, cpu, event, &pdat,
@@ -2562,6 +2721,15 @@ dt_consume_cpu(dtrace_hdl_t *dtp, FILE *fp, int cpu, dt_peb_t *peb,
 				return rval;
 
 			tail += hdr->size;
+
+			/*
+			 * Release the space of consumed events in chunks, so
+			 * the kernel can reuse it during a long batch.
+			 */
+			if (tail - released >= release) {
+				ring_buffer_write_tail(rb_page, tail);
+				released = tail;
+			}
 		} while (tail != head);
 
 		ring_buffer_write_tail(rb_page, tail);
@@ -2569,343 +2737,865 @@ dt_consume_cpu(dtrace_hdl_t *dtp, FILE *fp, int cpu, dt_peb_t *peb,
 
 	return DTRACE_WORKSTATUS_OKAY;
 }
-#endif
-
-typedef struct dt_begin {
-	dtrace_consume_probe_f *dtbgn_probefunc;
-	dtrace_consume_rec_f *dtbgn_recfunc;
-	void *dtbgn_arg;
-	dtrace_handle_err_f *dtbgn_errhdlr;
-	void *dtbgn_errarg;
-	int dtbgn_beginonly;
-} dt_begin_t;
 
+/*
+ * Report records that were dropped because the BPF ring buffer was full.  The
+ * BPF programs count drops per CPU in the cpuinfo map (see
+ * dt_cg_ringbuf_reserve()), and we report the drops since the last time we
+ * looked.
+ */
 static int
-dt_consume_begin_probe(const dtrace_probedata_t *data, void *arg)
+dt_consume_ringbuf_drops(dtrace_hdl_t *dtp, dt_ringbuf_t *rb)
 {
-	dt_begin_t *begin = (dt_begin_t *)arg;
-	dtrace_probedesc_t *pd = data->dtpda_pdesc;
+	uint32_t	key = 0;
+	int		i;
 
-	int r1 = (strcmp(pd->prv, "dtrace") == 0);
-	int r2 = (strcmp(pd->prb, "BEGIN") == 0);
+	if (dt_bpf_map_lookup(rb->ci_fd, &key, rb->cpuinfo) == -1)
+		return DTRACE_WORKSTATUS_OKAY;
 
-	if (begin->dtbgn_beginonly) {
-		if (!(r1 && r2))
-			return (DTRACE_CONSUME_NEXT);
-	} else {
-		if (r1 && r2)
-			return (DTRACE_CONSUME_NEXT);
+	for (i = 0; i < dtp->dt_conf.num_possible_cpus; i++) {
+		uint64_t	drops;
+
+		drops = rb->cpuinfo[i].buf_drops - rb->drops[i];
+		if (drops == 0)
+			continue;
+
+		rb->drops[i] = rb->cpuinfo[i].buf_drops;
+		dtp->dt_drops += drops;
+		if (dtp->dt_tracefile != NULL && !dtp->dt_tracefile->replay &&
+		    dt_tracefile_write_drop(dtp, i, drops) != 0)
+			return DTRACE_WORKSTATUS_ERROR;
+		if (dt_handle_cpudrop(dtp, i, DTRACEDROP_PRINCIPAL,
+				      drops) != 0)
+			return DTRACE_WORKSTATUS_ERROR;
 	}
 
-	/*
-	 * We have a record that we're interested in.  Now call the underlying
-	 * probe function...
-	 */
-	return (begin->dtbgn_probefunc(data, begin->dtbgn_arg));
+	return DTRACE_WORKSTATUS_OKAY;
 }
 
+/*
+ * Consume the trace data in the BPF ring buffer.  Records are processed in the
+ * order in which they were reserved, regardless of the CPU that produced them.
+ * Each record starts with a header written by the kernel:
+ *
+ *	struct {
+ *		uint32_t	len;
+ *		uint32_t	pg_off;
+ *		uint32_t	cpu;
+ *		uint32_t	pad;
+ *		uint32_t	epid;
+ *		uint32_t	tag;
+ *		uint64_t	data[n];
+ *	}
+ *
+ * The 'len' member is the size of the record (not including the kernel
+ * header).  The kernel sets BPF_RINGBUF_BUSY_BIT in 'len' while the record is
+ * being written, and BPF_RINGBUF_DISCARD_BIT if the record was discarded.
+ */
 static int
-dt_consume_begin_record(const dtrace_probedata_t *data,
-    const dtrace_recdesc_t *rec, void *arg)
+dt_consume_ringbuf(dtrace_hdl_t *dtp, FILE *fp, dt_ringbuf_t *rb,
+		   dtrace_consume_probe_f *efunc, dtrace_consume_rec_f *rfunc,
+		   void *arg)
 {
-	dt_begin_t *begin = (dt_begin_t *)arg;
+	dtrace_epid_t		last = DTRACE_EPIDNONE;
+	unsigned long		cons, prod;
+	uint64_t		mask = rb->data_size - 1;
+	int			flow, quiet;
+	dtrace_probedata_t	pdat;
+	dtrace_workstatus_t	rval;
+
+	flow = (dtp->dt_options[DTRACEOPT_FLOWINDENT] != DTRACEOPT_UNSET);
+	quiet = (dtp->dt_options[DTRACEOPT_QUIET] != DTRACEOPT_UNSET);
 
-	return (begin->dtbgn_recfunc(data, rec, begin->dtbgn_arg));
+	rval = dt_consume_ringbuf_drops(dtp, rb);
+	if (rval != DTRACE_WORKSTATUS_OKAY)
+		return rval;
+
+	memset(&pdat, 0, sizeof(pdat));
+	pdat.dtpda_handle = dtp;
+
+	cons = smp_load_acquire(rb->cons_pos);
+	for (;;) {
+		prod = smp_load_acquire(rb->prod_pos);
+		if (cons == prod)
+			break;
+
+		do {
+			char		*rec = rb->data + (cons & mask);
+			uint32_t	len;
+
+			len = smp_load_acquire((uint32_t *)rec);
+			if (len & BPF_RINGBUF_BUSY_BIT)
+				return DTRACE_WORKSTATUS_OKAY;
+
+			cons += roundup((len & ~BPF_RINGBUF_DISCARD_BIT) +
+					BPF_RINGBUF_HDR_SZ, 8);
+
+			if (!(len & BPF_RINGBUF_DISCARD_BIT)) {
+				rec += BPF_RINGBUF_HDR_SZ;
+				pdat.dtpda_cpu = *(uint32_t *)rec;
+
+				rval = dt_consume_rec(dtp, fp,
+						      rec + DT_RINGBUF_HDRSZ,
+						      len - DT_RINGBUF_HDRSZ,
+						      &pdat, efunc, rfunc,
+						      flow, quiet, &last, arg);
+				if (rval != DTRACE_WORKSTATUS_OKAY) {
+					smp_store_release(rb->cons_pos, cons);
+					return rval;
+				}
+			}
+
+			smp_store_release(rb->cons_pos, cons);
+		} while (cons != prod);
+	}
+
+	return DTRACE_WORKSTATUS_OKAY;
 }
 
-static int
-dt_consume_begin_error(const dtrace_errdata_t *data, void *arg)
+/*
+ * Trace data consumer threads.  If the 'consumethreads' option is set to a
+ * value greater than 1, the perf event buffers are divided between that many
+ * worker threads.  In every round of consumption, each worker copies the
+ * events from its buffers into per-buffer batches, which frees up the space
+ * in the buffers as quickly as possible.  The thread that called
+ * dtrace_consume() then merges the batches and processes the records, so the
+ * probe and record callbacks are never called from a worker thread.
+ */
+typedef struct dt_conspool	dt_conspool_t;
+
+typedef struct dt_consworker {
+	dt_conspool_t	*pool;
+	int		id;		/* index of the first buffer */
+	pthread_t	tid;
+} dt_consworker_t;
+
+struct dt_conspool {
+	dtrace_hdl_t	*dtp;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;		/* pool state changed */
+	dt_consworker_t	*workers;	/* worker threads */
+	int		nthreads;	/* number of worker threads */
+	uint64_t	round;		/* current round of consumption */
+	int		busy;		/* workers busy in the current round */
+	int		done;		/* workers must exit */
+};
+
+/*
+ * Return the number of threads to use for copying trace data out of the perf
+ * event buffers.  The BPF ring buffer is always consumed by a single thread.
+ */
+int
+dt_consume_nthreads(dtrace_hdl_t *dtp)
 {
-	dt_begin_t *begin = (dt_begin_t *)arg;
-	dtrace_probedesc_t *pd = data->dteda_pdesc;
+	dtrace_optval_t	nthreads = dtp->dt_options[DTRACEOPT_CONSUMETHREADS];
 
-	int r1 = (strcmp(pd->prv, "dtrace") == 0);
-	int r2 = (strcmp(pd->prb, "BEGIN") == 0);
+	if (nthreads == DTRACEOPT_UNSET || nthreads <= 1 ||
+	    dt_ringbuf_enabled(dtp))
+		return 1;
 
-	if (begin->dtbgn_beginonly) {
-		if (!(r1 && r2))
-			return (DTRACE_HANDLE_OK);
-	} else {
-		if (r1 && r2)
-			return (DTRACE_HANDLE_OK);
-	}
+	return MIN(nthreads, dtp->dt_conf.num_online_cpus);
+}
 
-	return (begin->dtbgn_errhdlr(data, begin->dtbgn_errarg));
+/*
+ * Determine whether events from different perf event buffers need to be
+ * merged in timestamp order.
+ */
+int
+dt_consume_ordered(dtrace_hdl_t *dtp)
+{
+	return dt_consume_nthreads(dtp) > 1 &&
+	       dtp->dt_options[DTRACEOPT_UNORDERED] == DTRACEOPT_UNSET;
 }
 
-static int
-dt_consume_begin(dtrace_hdl_t *dtp, FILE *fp, dtrace_bufdesc_t *buf,
-    dtrace_consume_probe_f *pf, dtrace_consume_rec_f *rf, void *arg)
+/*
+ * Copy the events in a perf event buffer into its batch.  If the batch cannot
+ * be grown, the remaining events are left in the buffer for the next round.
+ */
+static void
+dt_consume_batch(dt_pebset_t *pebset, dt_peb_t *peb)
 {
-	/*
-	 * There's this idea that the BEGIN probe should be processed before
-	 * everything else, and that the END probe should be processed after
-	 * anything else.  In the common case, this is pretty easy to deal
-	 * with.  However, a situation may arise where the BEGIN enabling and
-	 * END enabling are on the same CPU, and some enabling in the middle
-	 * occurred on a different CPU.  To deal with this (blech!) we need to
-	 * consume the BEGIN buffer up until the end of the BEGIN probe, and
-	 * then set it aside.  We will then process every other CPU, and then
-	 * we'll return to the BEGIN CPU and process the rest of the data
-	 * (which will inevitably include the END probe, if any).  Making this
-	 * even more complicated (!) is the library's ERROR enabling.  Because
-	 * this enabling is processed before we even get into the consume call
-	 * back, any ERROR firing would result in the library's ERROR enabling
-	 * being processed twice -- once in our first pass (for BEGIN probes),
-	 * and again in our second pass (for everything but BEGIN probes).  To
-	 * deal with this, we interpose on the ERROR handler to assure that we
-	 * only process ERROR enablings induced by BEGIN enablings in the
-	 * first pass, and that we only process ERROR enablings _not_ induced
-	 * by BEGIN enablings in the second pass.
-	 */
-	dt_begin_t begin;
-	processorid_t cpu = dtp->dt_beganon;
-	dtrace_bufdesc_t nbuf;
-	int rval, i;
-	static int max_ncpus;
-	dtrace_optval_t size;
+	struct perf_event_mmap_page	*rb_page = (void *)peb->base;
+	char				*base = peb->base + pebset->page_size;
+	uint64_t			data_size = peb->endp - base + 1;
+	uint64_t			head, tail;
+
+	head = ring_buffer_read_head(rb_page);
+	tail = rb_page->data_tail;
+
+	while (tail != head) {
+		char		*event = base + tail % data_size;
+		uint32_t	len = ((struct perf_event_header *)event)->size;
+		uint32_t	num;
+
+		if (peb->batch_len + len > peb->batch_size) {
+			size_t	size = MAX(peb->batch_size * 2,
+					   peb->batch_len + len);
+			char	*batch;
+
+			size = MAX(size, data_size);
+			batch = realloc(peb->batch, size);
+			if (batch == NULL)
+				break;
 
-	dtp->dt_beganon = -1;
+			peb->batch = batch;
+			peb->batch_size = size;
+		}
 
-	if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, buf) == -1) {
 		/*
-		 * We really don't expect this to fail, but it is at least
-		 * technically possible for this to fail with ENOENT.  In this
-		 * case, we just drive on...
+		 * Events that wrap around the boundary of the buffer are
+		 * copied in two parts.
 		 */
-		if (errno == ENOENT)
-			return (0);
-
-		return (dt_set_errno(dtp, errno));
-	}
+		num = MIN(len, peb->endp - event + 1);
+		memcpy(peb->batch + peb->batch_len, event, num);
+		memcpy(peb->batch + peb->batch_len + num, base, len - num);
 
-	if (!dtp->dt_stopped || buf->dtbd_cpu != dtp->dt_endedon) {
 		/*
-		 * This is the simple case.  We're either not stopped, or if
-		 * we are, we actually processed any END probes on another
-		 * CPU.  We can simply consume this buffer and return.
+		 * Each buffer is only ever copied by one worker, so it can
+		 * update the statistics for its CPU without locking.
 		 */
-		return (dt_consume_cpu(dtp, fp, cpu, buf, pf, rf, arg));
+		if (num < len) {
+			dtrace_cpustats_t	*csp;
+
+			csp = dt_consume_cpustats(peb->dtp, peb->cpu);
+			if (csp != NULL)
+				csp->dtcs_wraps++;
+		}
+
+		peb->batch_len += len;
+		tail += len;
 	}
 
-	begin.dtbgn_probefunc = pf;
-	begin.dtbgn_recfunc = rf;
-	begin.dtbgn_arg = arg;
-	begin.dtbgn_beginonly = 1;
+	ring_buffer_write_tail(rb_page, tail);
+}
 
-	/*
-	 * We need to interpose on the ERROR handler to be sure that we
-	 * only process ERRORs induced by BEGIN.
-	 */
-	begin.dtbgn_errhdlr = dtp->dt_errhdlr;
-	begin.dtbgn_errarg = dtp->dt_errarg;
-	dtp->dt_errhdlr = dt_consume_begin_error;
-	dtp->dt_errarg = &begin;
+static void *
+dt_consume_worker(void *arg)
+{
+	dt_consworker_t	*wp = arg;
+	dt_conspool_t	*pool = wp->pool;
+	dtrace_hdl_t	*dtp = pool->dtp;
+	uint64_t	round = 0;
+	int		i;
 
-	rval = dt_consume_cpu(dtp, fp, cpu, buf, dt_consume_begin_probe,
-	    dt_consume_begin_record, &begin);
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->round == round && !pool->done)
+			pthread_cond_wait(&pool->cv, &pool->lock);
 
-	dtp->dt_errhdlr = begin.dtbgn_errhdlr;
-	dtp->dt_errarg = begin.dtbgn_errarg;
+		if (pool->done) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
 
-	if (rval != 0)
-		return (rval);
+		round = pool->round;
+		pthread_mutex_unlock(&pool->lock);
 
-	/*
-	 * Now allocate a new buffer.  We'll use this to deal with every other
-	 * CPU.
-	 */
-	memset(&nbuf, 0, sizeof (dtrace_bufdesc_t));
-	(void) dtrace_getopt(dtp, "bufsize", &size);
-	if ((nbuf.dtbd_data = malloc(size)) == NULL)
-		return (dt_set_errno(dtp, EDT_NOMEM));
+		for (i = wp->id; i < dtp->dt_conf.num_online_cpus;
+		     i += pool->nthreads) {
+			dt_peb_t	*peb = &dtp->dt_pebset->pebs[i];
 
-	if (max_ncpus == 0)
-		max_ncpus = dtp->dt_conf.dtc_maxbufs;
+			if (peb->fd != -1)
+				dt_consume_batch(dtp->dt_pebset, peb);
+		}
 
-	for (i = 0; i < max_ncpus; i++) {
-		nbuf.dtbd_cpu = i;
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_broadcast(&pool->cv);
+		pthread_mutex_unlock(&pool->lock);
+	}
 
-		if (i == cpu)
-			continue;
+	return NULL;
+}
 
-		if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, &nbuf) == -1) {
-			/*
-			 * If we failed with ENOENT, it may be because the
-			 * CPU was unconfigured -- this is okay.  Any other
-			 * error, however, is unexpected.
-			 */
-			if (errno == ENOENT)
-				continue;
+/*
+ * Stop the consumer threads (if any).
+ */
+void
+dt_consume_exit(dtrace_hdl_t *dtp)
+{
+	dt_conspool_t	*pool = dtp->dt_conspool;
+	int		i;
 
-			free(nbuf.dtbd_data);
+	if (pool == NULL)
+		return;
 
-			return (dt_set_errno(dtp, errno));
-		}
+	pthread_mutex_lock(&pool->lock);
+	pool->done = 1;
+	pthread_cond_broadcast(&pool->cv);
+	pthread_mutex_unlock(&pool->lock);
 
-		if ((rval = dt_consume_cpu(dtp, fp,
-		    i, &nbuf, pf, rf, arg)) != 0) {
-			free(nbuf.dtbd_data);
-			return (rval);
-		}
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->workers[i].tid, NULL);
+
+	pthread_cond_destroy(&pool->cv);
+	pthread_mutex_destroy(&pool->lock);
+	dt_free(dtp, pool->workers);
+	dt_free(dtp, pool);
+
+	dtp->dt_conspool = NULL;
+}
+
+/*
+ * Start the consumer threads.  If fewer threads than requested can be
+ * created, the buffers are divided between the threads that were created.
+ */
+static int
+dt_consume_init(dtrace_hdl_t *dtp)
+{
+	dt_conspool_t	*pool;
+	sigset_t	nset, oset;
+	int		nthreads = dt_consume_nthreads(dtp);
+	int		err = 0;
+
+	pool = dt_zalloc(dtp, sizeof(dt_conspool_t));
+	if (pool == NULL)
+		return -1;
+
+	pool->workers = dt_calloc(dtp, nthreads, sizeof(dt_consworker_t));
+	if (pool->workers == NULL) {
+		dt_free(dtp, pool);
+		return -1;
 	}
 
-	free(nbuf.dtbd_data);
+	pool->dtp = dtp;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cv, NULL);
+	dtp->dt_conspool = pool;
 
 	/*
-	 * Okay -- we're done with the other buffers.  Now we want to
-	 * reconsume the first buffer -- but this time we're looking for
-	 * everything _but_ BEGIN.  And of course, in order to only consume
-	 * those ERRORs _not_ associated with BEGIN, we need to reinstall our
-	 * ERROR interposition function...
+	 * Block all signals in the worker threads, so they get delivered to
+	 * the main thread.  The workers do not look at the number of threads
+	 * until the first round, so it can be updated as threads are created.
 	 */
-	begin.dtbgn_beginonly = 0;
+	sigfillset(&nset);
+	pthread_sigmask(SIG_SETMASK, &nset, &oset);
+	while (pool->nthreads < nthreads) {
+		dt_consworker_t	*wp = &pool->workers[pool->nthreads];
+
+		wp->pool = pool;
+		wp->id = pool->nthreads;
+		err = pthread_create(&wp->tid, NULL, dt_consume_worker, wp);
+		if (err != 0)
+			break;
 
-	assert(begin.dtbgn_errhdlr == dtp->dt_errhdlr);
-	assert(begin.dtbgn_errarg == dtp->dt_errarg);
-	dtp->dt_errhdlr = dt_consume_begin_error;
-	dtp->dt_errarg = &begin;
+		pool->nthreads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
 
-	rval = dt_consume_cpu(dtp, fp, cpu, buf, dt_consume_begin_probe,
-	    dt_consume_begin_record, &begin);
+	if (pool->nthreads == 0) {
+		dt_consume_exit(dtp);
+		return dt_set_errno(dtp, err);
+	}
 
-	dtp->dt_errhdlr = begin.dtbgn_errhdlr;
-	dtp->dt_errarg = begin.dtbgn_errarg;
+	return 0;
+}
 
-	return (rval);
+/*
+ * Return the timestamp of an event in a batch.  Events other than samples do
+ * not have a timestamp, and are processed as soon as they are reached.
+ */
+static uint64_t
+dt_consume_time(const char *event)
+{
+	const struct perf_event_header	*hdr = (const void *)event;
+
+	if (hdr->type != PERF_RECORD_SAMPLE)
+		return 0;
+
+	return *(const uint64_t *)(hdr + 1);
 }
 
-dtrace_workstatus_t
-dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
-    dtrace_consume_probe_f *pf, dtrace_consume_rec_f *rf, void *arg)
+/*
+ * Return the phase of an event in a batch (see dt_epid_info()).  The EPID
+ * follows the timestamp, the size, and 4 bytes of padding.  Events other than
+ * samples (and samples with an invalid EPID, which are reported when they are
+ * processed) are treated as part of the earliest phase.
+ */
+static uint_t
+dt_consume_phase(dtrace_hdl_t *dtp, const char *event)
 {
-#if 0
-	dtrace_bufdesc_t *buf = &dtp->dt_buf;
-	dtrace_optval_t size;
-	static int max_ncpus;
-	int i, rval;
-	dtrace_optval_t interval = dtp->dt_options[DTRACEOPT_SWITCHRATE];
-	hrtime_t now = gethrtime();
-
-	if (dtp->dt_lastswitch != 0) {
-		if (now - dtp->dt_lastswitch < interval)
-			return (0);
+	const struct perf_event_header	*hdr = (const void *)event;
+	uint32_t			epid;
 
-		dtp->dt_lastswitch += interval;
-	} else {
-		dtp->dt_lastswitch = now;
+	if (hdr->type != PERF_RECORD_SAMPLE)
+		return DT_PHASE_BEGIN;
+
+	epid = ((const uint32_t *)(hdr + 1))[4];
+	if (epid >= dtp->dt_maxprobe || dtp->dt_ddesc[epid] == NULL)
+		return DT_PHASE_BEGIN;
+
+	return dtp->dt_epinfo[epid].phase;
+}
+
+/*
+ * Process the events in the batches of all perf event buffers.  If events
+ * are ordered, they are processed in timestamp order, but only if their
+ * timestamp is before 'limit', because events with a later timestamp may
+ * still be preceded by events that were not copied into a batch yet.  Any
+ * events that are not processed are kept for the next round.
+ *
+ * Ordered events are merged by phase first, so that records for the BEGIN
+ * probe are processed before records from other buffers, and records for the
+ * END probe after them, in a single pass over the batches.  Events from the
+ * same buffer are always processed in the order in which they were written.
+ */
+static int
+dt_consume_merge(dtrace_hdl_t *dtp, FILE *fp, uint64_t limit,
+		 dtrace_consume_probe_f *efunc, dtrace_consume_rec_f *rfunc,
+		 void *arg)
+{
+	dt_pebset_t		*pebset = dtp->dt_pebset;
+	int			ncpus = dtp->dt_conf.num_online_cpus;
+	size_t			pos[ncpus];
+	dtrace_epid_t		last = DTRACE_EPIDNONE;
+	int			i, flow, quiet, ordered;
+	dtrace_probedata_t	pdat;
+	dtrace_workstatus_t	rval = DTRACE_WORKSTATUS_OKAY;
+
+	flow = (dtp->dt_options[DTRACEOPT_FLOWINDENT] != DTRACEOPT_UNSET);
+	quiet = (dtp->dt_options[DTRACEOPT_QUIET] != DTRACEOPT_UNSET);
+	ordered = pebset->sample_type & PERF_SAMPLE_TIME;
+
+	memset(&pdat, 0, sizeof(pdat));
+	pdat.dtpda_handle = dtp;
+	memset(pos, 0, sizeof(pos));
+
+	for (;;) {
+		dt_peb_t	*peb = NULL;
+		uint64_t	min = limit;
+		uint_t		minphase = DT_PHASE_END;
+		char		*event;
+		int		n = 0;
+
+		for (i = 0; i < ncpus; i++) {
+			dt_peb_t	*p = &pebset->pebs[i];
+			uint64_t	time;
+			uint_t		phase;
+
+			if (pos[i] == p->batch_len)
+				continue;
+
+			if (!ordered) {
+				peb = p;
+				n = i;
+				break;
+			}
+
+			time = dt_consume_time(p->batch + pos[i]);
+			if (time >= limit)
+				continue;
+
+			phase = dt_consume_phase(dtp, p->batch + pos[i]);
+			if (peb == NULL || phase < minphase ||
+			    (phase == minphase && time < min)) {
+				min = time;
+				minphase = phase;
+				peb = p;
+				n = i;
+			}
+		}
+
+		if (peb == NULL)
+			break;
+
+		event = peb->batch + pos[n];
+		pos[n] += ((struct perf_event_header *)event)->size;
+
+		pdat.dtpda_cpu = peb->cpu;
+		rval = dt_consume_one(dtp, fp, peb->cpu, event, &pdat, efunc,
+				      rfunc, flow, quiet, &last, arg);
+		if (rval != DTRACE_WORKSTATUS_OKAY)
+			break;
 	}
 
-	if (!dtp->dt_active)
-		return (dt_set_errno(dtp, EINVAL));
+	for (i = 0; i < ncpus; i++) {
+		dt_peb_t	*peb = &pebset->pebs[i];
 
-	if (max_ncpus == 0)
-		max_ncpus = dtp->dt_conf.dtc_maxbufs;
+		peb->batch_len -= pos[i];
+		memmove(peb->batch, peb->batch + pos[i], peb->batch_len);
+	}
 
-	if (pf == NULL)
-		pf = (dtrace_consume_probe_f *)dt_nullprobe;
+	return rval;
+}
 
-	if (rf == NULL)
-		rf = (dtrace_consume_rec_f *)dt_nullrec;
+/*
+ * Consume the trace data in the perf event buffers using the consumer
+ * threads.
+ */
+static int
+dt_consume_threads(dtrace_hdl_t *dtp, FILE *fp,
+		   dtrace_consume_probe_f *efunc, dtrace_consume_rec_f *rfunc,
+		   void *arg)
+{
+	dt_conspool_t	*pool = dtp->dt_conspool;
+	uint64_t	limit = UINT64_MAX;
 
-	if (buf->dtbd_data == NULL) {
-		(void) dtrace_getopt(dtp, "bufsize", &size);
-		if ((buf->dtbd_data = malloc(size)) == NULL)
-			return (dt_set_errno(dtp, EDT_NOMEM));
+	if (pool == NULL) {
+		if (dt_consume_init(dtp) != 0)
+			return DTRACE_WORKSTATUS_ERROR;
 
-		buf->dtbd_size = size;
+		pool = dtp->dt_conspool;
 	}
 
 	/*
-	 * If we have just begun, we want to first process the CPU that
-	 * executed the BEGIN probe (if any).
+	 * Events are timestamped when they are written to the buffer, so any
+	 * event with a timestamp before the start of this round is in a
+	 * buffer by the time the workers get to it.  Once tracing has
+	 * stopped, all events can be processed.
 	 */
-	if (dtp->dt_active && dtp->dt_beganon != -1) {
-		buf->dtbd_cpu = dtp->dt_beganon;
-		if ((rval = dt_consume_begin(dtp, fp, buf, pf, rf, arg)) != 0)
-			return (rval);
+	if (!dtp->dt_stopped) {
+		struct timespec	ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		limit = (uint64_t)ts.tv_sec * NANOSEC + ts.tv_nsec;
 	}
 
-	for (i = 0; i < max_ncpus; i++) {
-		buf->dtbd_cpu = i;
+	pthread_mutex_lock(&pool->lock);
+	pool->round++;
+	pool->busy = pool->nthreads;
+	pthread_cond_broadcast(&pool->cv);
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->cv, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
 
-		/*
-		 * If we have stopped, we want to process the CPU on which the
-		 * END probe was processed only _after_ we have processed
-		 * everything else.
-		 */
-		if (dtp->dt_stopped && (i == dtp->dt_endedon))
+	return dt_consume_merge(dtp, fp, limit, efunc, rfunc, arg);
+}
+
+/*
+ * Grow the perf event buffers if records were lost in too many consecutive
+ * rounds (see DT_RESIZE_ROUNDS).  Data that is left in the old buffers is
+ * consumed (or copied into the batches, when consumer threads are used) before
+ * the old buffers are released.
+ */
+static int
+dt_consume_resize(dtrace_hdl_t *dtp, FILE *fp, uint64_t drops,
+		  dtrace_consume_probe_f *efunc, dtrace_consume_rec_f *rfunc,
+		  void *arg)
+{
+	dt_pebset_t	*pebset = dtp->dt_pebset;
+	dt_peb_t	*old;
+	int		i, rval = 0;
+
+	if (dtp->dt_options[DTRACEOPT_BUFRESIZE] != DTRACEOPT_BUFRESIZE_AUTO)
+		return 0;
+
+	if (drops == 0) {
+		pebset->drop_rounds = 0;
+		return 0;
+	}
+
+	if (++pebset->drop_rounds < DT_RESIZE_ROUNDS ||
+	    pebset->resizes >= DT_RESIZE_MAX)
+		return 0;
+
+	old = dt_pebs_grow(dtp);
+	if (old == NULL)
+		return 0;
+
+	pebset->drop_rounds = 0;
+	pebset->resizes++;
+	if (dtp->dt_options[DTRACEOPT_QUIETRESIZE] == DTRACEOPT_UNSET)
+		fprintf(stderr, "bufsize increased to %lu\n",
+			pebset->data_size);
+
+	for (i = 0; i < dtp->dt_conf.num_online_cpus; i++) {
+		dt_peb_t	*peb = &old[i];
+		dt_peb_t	*npeb = &pebset->pebs[i];
+
+		if (peb->fd == -1)
 			continue;
 
-		if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, buf) == -1) {
-			/*
-			 * If we failed with ENOENT, it may be because the
-			 * CPU was unconfigured -- this is okay.  Any other
-			 * error, however, is unexpected.
-			 */
-			if (errno == ENOENT)
-				continue;
+		if (dtp->dt_conspool != NULL) {
+			dt_consume_batch(pebset, peb);
 
-			return (dt_set_errno(dtp, errno));
-		}
+			npeb->batch = peb->batch;
+			npeb->batch_size = peb->batch_size;
+			npeb->batch_len = peb->batch_len;
+			peb->batch = NULL;
+		} else if (rval == 0)
+			rval = dt_consume_cpu(dtp, fp, peb->cpu, peb, efunc,
+					      rfunc, arg);
+	}
 
-		if ((rval = dt_consume_cpu(dtp, fp, i, buf, pf, rf, arg)) != 0)
-			return (rval);
+	dt_pebs_free(dtp, old);
+
+	return rval;
+}
+#endif
+
+/*
+ * Adapt the consumer wakeup rate to the event rate (for the adaptive wakeup
+ * policy).  When a round of consumption processes a large batch of records,
+ * the consumer starts sleeping between rounds instead of waiting for wakeups,
+ * and the delay is doubled (up to the switch rate) for as long as the event
+ * rate remains high.  When the event rate drops, the delay is halved until
+ * the consumer is once again woken up for every event.
+ */
+static void
+dt_consume_adapt(dtrace_hdl_t *dtp, uint64_t nrecs)
+{
+	hrtime_t	delay = dtp->dt_wakeupdelay;
+	dtrace_optval_t	max = dtp->dt_options[DTRACEOPT_SWITCHRATE];
+
+	if (nrecs >= DT_WAKEUP_BATCH)
+		delay = delay == 0 ? DT_WAKEUP_MINDELAY : delay * 2;
+	else if (nrecs < DT_WAKEUP_BATCH / 4)
+		delay /= 2;
+
+	if (delay < DT_WAKEUP_MINDELAY)
+		delay = 0;
+	if (max != DTRACEOPT_UNSET && delay > max)
+		delay = max;
+
+	dtp->dt_wakeupdelay = delay;
+}
+
+/*
+ * Determine the order in which the perf event buffers are drained when no
+ * consumer threads are used: the buffer of the CPU that the BEGIN probe fired
+ * on comes first, and the buffer of the CPU that the END probe fired on comes
+ * last (see dt_probe_oncpu()).  The records for BEGIN are thereby processed
+ * before, and the records for END after, the records from all other CPUs in
+ * the same round (dt_consume_merge() orders them by phase instead).
+ */
+static void
+dt_consume_pebs_order(dtrace_hdl_t *dtp, int *order)
+{
+	int	ncpus = dtp->dt_conf.num_online_cpus;
+	int	i, tmp;
+
+	for (i = 0; i < ncpus; i++)
+		order[i] = i;
+
+	for (i = 0; i < ncpus; i++) {
+		if (dtp->dt_pebset->pebs[order[i]].cpu != dtp->dt_beganon)
+			continue;
+
+		tmp = order[0];
+		order[0] = order[i];
+		order[i] = tmp;
+		break;
 	}
 
-	if (!dtp->dt_stopped)
-		return (0);
+	for (i = 0; i < ncpus; i++) {
+		if (dtp->dt_pebset->pebs[order[i]].cpu != dtp->dt_endedon)
+			continue;
 
-	buf->dtbd_cpu = dtp->dt_endedon;
+		tmp = order[ncpus - 1];
+		order[ncpus - 1] = order[i];
+		order[i] = tmp;
+		break;
+	}
+}
 
-	if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, buf) == -1) {
-		/*
-		 * This _really_ shouldn't fail, but it is strictly speaking
-		 * possible for this to return ENOENT if the CPU that called
-		 * the END enabling somehow managed to become unconfigured.
-		 * It's unclear how the user can possibly expect anything
-		 * rational to happen in this case -- the state has been thrown
-		 * out along with the unconfigured CPU -- so we'll just drive
-		 * on...
-		 */
-		if (errno == ENOENT)
-			return (0);
+/*
+ * Drain all trace data buffers.
+ */
+static dtrace_workstatus_t
+dt_consume_bufs(dtrace_hdl_t *dtp, FILE *fp, dtrace_consume_probe_f *pf,
+		dtrace_consume_rec_f *rf, void *arg)
+{
+	uint64_t	drops = dtp->dt_drops;
+	int		i, rval;
+
+	/*
+	 * The ring buffer is referenced by the loaded BPF programs, so it
+	 * cannot be grown while tracing.  Its drops are only reported.
+	 */
+	if (dtp->dt_ringbuf != NULL)
+		return dt_consume_ringbuf(dtp, fp, dtp->dt_ringbuf, pf, rf,
+					  arg);
+
+	if (dt_consume_nthreads(dtp) > 1) {
+		rval = dt_consume_threads(dtp, fp, pf, rf, arg);
+		if (rval != 0)
+			return rval;
+	} else {
+		int	ncpus = dtp->dt_conf.num_online_cpus;
+		int	order[ncpus];
+
+		dt_consume_pebs_order(dtp, order);
+		for (i = 0; i < ncpus; i++) {
+			dt_peb_t	*peb = &dtp->dt_pebset->pebs[order[i]];
+
+			if (peb->fd == -1)
+				continue;
 
-		return (dt_set_errno(dtp, errno));
+			rval = dt_consume_cpu(dtp, fp, peb->cpu, peb, pf, rf,
+					      arg);
+			if (rval != 0)
+				return rval;
+		}
 	}
 
-	return (dt_consume_cpu(dtp, fp, dtp->dt_endedon, buf, pf, rf, arg));
-#else
+	return dt_consume_resize(dtp, fp, dtp->dt_drops - drops, pf, rf, arg);
+}
+
+dtrace_workstatus_t
+dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
+    dtrace_consume_probe_f *pf, dtrace_consume_rec_f *rf, void *arg)
+{
 	dtrace_optval_t		timeout = dtp->dt_options[DTRACEOPT_SWITCHRATE];
+	dtrace_optval_t		policy = dtp->dt_options[DTRACEOPT_WAKEUP];
+	hrtime_t		delay = dtp->dt_wakeupdelay;
+	hrtime_t		start = 0;
+	uint64_t		nrecs = dtp->dt_nrecs;
 	struct epoll_event	events[dtp->dt_conf.num_online_cpus];
-	int			i, cnt;
+	int			cnt, rval;
+
+	if (pf == NULL)
+		pf = (dtrace_consume_probe_f *)dt_nullprobe;
+
+	if (rf == NULL)
+		rf = (dtrace_consume_rec_f *)dt_nullrec;
 
 	/*
-	 * The epoll_wait() function expects the timeout to be expressed in
-	 * milliseconds whereas the switch rate is expressed in nanoseconds.
-	 * We therefore need to convert the value.
+	 * With the adaptive wakeup policy, the consumer sleeps for a while
+	 * (rather than waiting for a wakeup) while the event rate is high, so
+	 * that it processes larger batches of data.
 	 */
-	timeout /= NANOSEC / MILLISEC;
-	cnt = epoll_wait(dtp->dt_poll_fd, events, dtp->dt_conf.num_online_cpus,
-			 timeout);
-	if (cnt < 0) {
-		dt_set_errno(dtp, errno);
-		return DTRACE_WORKSTATUS_ERROR;
+	if (delay > 0 && !dtp->dt_stopped) {
+		struct timespec	ts;
+
+		ts.tv_sec = delay / NANOSEC;
+		ts.tv_nsec = delay % NANOSEC;
+		nanosleep(&ts, NULL);
+	} else {
+		/*
+		 * The epoll_wait() function expects the timeout to be
+		 * expressed in milliseconds whereas the switch rate is
+		 * expressed in nanoseconds.  We therefore need to convert the
+		 * value.
+		 */
+		timeout /= NANOSEC / MILLISEC;
+		cnt = epoll_wait(dtp->dt_poll_fd, events,
+				 dtp->dt_conf.num_online_cpus, timeout);
+		if (cnt < 0) {
+			dt_set_errno(dtp, errno);
+			return DTRACE_WORKSTATUS_ERROR;
+		}
+
+		if (cnt > 0 && dtp->dt_cpustats != NULL)
+			dtp->dt_stats.dtsts_wakeups++;
 	}
 
 	/*
-	 * Loop over the buffers that have data available, and process them one
-	 * by one.
+	 * Depending on the wakeup policy, there may be data in buffers that
+	 * did not wake us up, so we drain all buffers.  This also means that
+	 * buffers that are about to wake us up get processed in this batch.
 	 */
-	for (i = 0; i < cnt; i++) {
-		dt_peb_t	*peb = events[i].data.ptr;
-		int		rval;
+	if (dtp->dt_cpustats != NULL)
+		start = gethrtime();
 
-		rval = dt_consume_cpu(dtp, fp, peb->cpu, peb, pf, rf, arg);
-		if (rval != 0)
-			return rval;
+	rval = dt_consume_bufs(dtp, fp, pf, rf, arg);
+
+	if (dtp->dt_cpustats != NULL) {
+		dtp->dt_stats.dtsts_rounds++;
+		dtp->dt_stats.dtsts_consume_time += gethrtime() - start;
 	}
 
+	if (rval != 0)
+		return rval;
+
+	if (policy == DTRACEOPT_WAKEUP_ADAPTIVE)
+		dt_consume_adapt(dtp, dtp->dt_nrecs - nrecs);
+
 	return DTRACE_WORKSTATUS_OKAY;
-#endif
+}
+
+/*
+ * Process the trace data in a trace file that was opened with
+ * dtrace_tracefile_open().  Records are processed in the order in which they
+ * were consumed when the trace file was written.
+ */
+dtrace_workstatus_t
+dtrace_tracefile_consume(dtrace_hdl_t *dtp, FILE *fp,
+			 dtrace_consume_probe_f *pf, dtrace_consume_rec_f *rf,
+			 void *arg)
+{
+	dtrace_epid_t		last = DTRACE_EPIDNONE;
+	int			flow, quiet;
+	int			done = 0;
+	dtrace_probedata_t	pdat;
+	dt_tfchunk_t		chunk;
+	char			*payload;
+
+	if (dtp->dt_tracefile == NULL || !dtp->dt_tracefile->replay) {
+		dt_set_errno(dtp, EINVAL);
+		return DTRACE_WORKSTATUS_ERROR;
+	}
+
+	flow = (dtp->dt_options[DTRACEOPT_FLOWINDENT] != DTRACEOPT_UNSET);
+	quiet = (dtp->dt_options[DTRACEOPT_QUIET] != DTRACEOPT_UNSET);
+
+	memset(&pdat, 0, sizeof(pdat));
+	pdat.dtpda_handle = dtp;
+
+	for (;;) {
+		int		rval;
+		uint32_t	cpu, epid;
+		uint64_t	drops;
+
+		rval = dt_tracefile_read(dtp, &chunk, &payload);
+		if (rval < 0)
+			return DTRACE_WORKSTATUS_ERROR;
+		if (rval == 0)
+			break;
+
+		switch (chunk.type) {
+		case DT_TF_DATA:
+			/*
+			 * The record must at least hold the EPID and the tag,
+			 * and the EPID must be known.
+			 */
+			if (chunk.size < DT_TF_DATAHDRSZ + 2 * sizeof(uint32_t))
+				goto corrupt;
+
+			cpu = ((uint32_t *)payload)[0];
+			epid = ((uint32_t *)payload)[2];
+			if (epid >= dtp->dt_maxprobe ||
+			    dtp->dt_ddesc[epid] == NULL ||
+			    chunk.size - DT_TF_DATAHDRSZ <
+			    dtp->dt_ddesc[epid]->dtdd_size)
+				goto corrupt;
+
+			pdat.dtpda_cpu = cpu;
+			rval = dt_consume_rec(dtp, fp,
+					      payload + DT_TF_DATAHDRSZ,
+					      chunk.size - DT_TF_DATAHDRSZ,
+					      &pdat, pf, rf, flow, quiet,
+					      &last, arg);
+			if (rval == DTRACE_WORKSTATUS_DONE)
+				done = 1;
+			else if (rval != DTRACE_WORKSTATUS_OKAY)
+				return DTRACE_WORKSTATUS_ERROR;
+
+			break;
+		case DT_TF_DROP:
+			if (chunk.size < DT_TF_DATAHDRSZ + sizeof(uint64_t))
+				goto corrupt;
+
+			cpu = ((uint32_t *)payload)[0];
+			drops = *(uint64_t *)(payload + DT_TF_DATAHDRSZ);
+
+			dtp->dt_drops += drops;
+			if (dt_handle_cpudrop(dtp, cpu, DTRACEDROP_PRINCIPAL,
+					      drops) != 0)
+				return DTRACE_WORKSTATUS_ERROR;
+
+			break;
+		default:
+			/*
+			 * Chunks of unknown types are skipped.
+			 */
+			break;
+		}
+	}
+
+	return done ? DTRACE_WORKSTATUS_DONE : DTRACE_WORKSTATUS_OKAY;
+
+corrupt:
+	dt_set_errno(dtp, EDT_TRACEFILE);
+	return DTRACE_WORKSTATUS_ERROR;
 }
@@ -16,6 +16,7 @@
 typedef struct dt_mstate {
 	uint32_t	epid;		/* Enabled probe ID */
 	uint32_t	tag;		/* Tag (for future use) */
+	uint64_t	epoff;		/* EPID offset (for shared programs) */
 	uint64_t	fault;		/* DTrace fault flags */
 	uint64_t	tstamp;		/* cached timestamp value */
 #if 0
@@ -46,9 +47,16 @@ typedef struct dt_dctx {
 
 #define DMST_EPID	offsetof(dt_mstate_t, epid)
 #define DMST_TAG	offsetof(dt_mstate_t, tag)
+#define DMST_EPOFF	offsetof(dt_mstate_t, epoff)
 #define DMST_FAULT	offsetof(dt_mstate_t, fault)
 #define DMST_TSTAMP	offsetof(dt_mstate_t, tstamp)
 #define DMST_REGS	offsetof(dt_mstate_t, regs)
 #define DMST_ARG(n)	offsetof(dt_mstate_t, argv[n])
 
+/*
+ * Macro to determine the offset of a global variable in the global variables
+ * array (the value of the 'gvars' map), given its variable id.
+ */
+#define DT_GVAR_OFF(id)	(((id) - DIF_VAR_OTHER_UBASE) * sizeof(uint64_t))
+
 #endif /* _DT_DCTX_H */
@@ -78,6 +78,35 @@ dt_dis_lvarname(const dtrace_difo_t *dp, int reg, int var, uint_t addr,
 	return NULL;
 }
 
+/*
+ * Global variables are accessed through their address in the value of the
+ * 'gvars' map.  The code generator always emits this exact sequence of
+ * instructions:
+ *
+ *	lddw %reg, &gvars + off		(BPF_PSEUDO_MAP_VALUE)
+ *	lddw %dst, [%reg + 0]		(or stdw [%reg + 0], %src)
+ */
+static const char *
+dt_dis_gvarname(const dtrace_difo_t *dp, int reg, int off, uint_t addr,
+		const struct bpf_insn *in)
+{
+	int	var;
+
+	if (addr < 2 || reg == BPF_REG_FP || off != 0)
+		return NULL;
+
+	if (in[-2].code != (BPF_LD | BPF_IMM | BPF_DW) ||
+	    in[-2].src_reg != BPF_PSEUDO_MAP_VALUE || in[-2].dst_reg != reg)
+		return NULL;
+
+	var = in[-1].imm;
+	if (var < 0 || var % sizeof(uint64_t) != 0)
+		return NULL;
+
+	return dt_dis_varname(dp, var / sizeof(uint64_t) + DIF_VAR_OTHER_UBASE,
+			      DIFV_SCOPE_GLOBAL, addr);
+}
+
 /*ARGSUSED*/
 static uint_t
 dt_dis_str(const dtrace_difo_t *dp, const char *name, uint_t addr,
@@ -147,6 +176,8 @@ dt_dis_load(const dtrace_difo_t *dp, const char *name, uint_t addr,
 
 	vname = dt_dis_lvarname(dp, in->src_reg, in->off, addr, buf,
 				sizeof(buf));
+	if (vname == NULL)
+		vname = dt_dis_gvarname(dp, in->src_reg, in->off, addr, in);
 	if (vname)
 		fprintf(fp, "\t! %s\n", vname);
 	else
@@ -189,6 +220,8 @@ dt_dis_store(const dtrace_difo_t *dp, const char *name, uint_t addr,
 
 	vname = dt_dis_lvarname(dp, in->dst_reg, in->off, addr, buf,
 				sizeof(buf));
+	if (vname == NULL)
+		vname = dt_dis_gvarname(dp, in->dst_reg, in->off, addr, in);
 	if (vname)
 		fprintf(fp, "\t! %s\n", vname);
 	else
@@ -239,30 +272,6 @@ dt_dis_bpf_args(const dtrace_difo_t *dp, const char *fn,
 		snprintf(buf, len, "%s",
 			 dt_dis_varname(dp, in->imm, DIFV_SCOPE_GLOBAL, addr));
 		return buf;
-	} else if (strcmp(fn, "dt_get_gvar") == 0 ||
-		   strcmp(fn, "dt_set_gvar") == 0) {
-		/*
-		 * We know that the previous instruction exists and assigns
-		 * the variable id to %r1 (because we wrote the code generator
-		 * to emit these instructions in this exact order.)
-		 */
-		in--;
-		snprintf(buf, len, "%s",
-			 dt_dis_varname(dp, in->imm + DIF_VAR_OTHER_UBASE,
-					DIFV_SCOPE_GLOBAL, addr));
-		return buf;
-	} else if (strcmp(fn, "dt_get_tvar") == 0 ||
-		   strcmp(fn, "dt_set_tvar") == 0 ) {
-		/*
-		 * We know that the previous instruction exists and assigns
-		 * the variable id to %r1 (because we wrote the code generator
-		 * to emit these instructions in this exact order.)
-		 */
-		in--;
-		snprintf(buf, len, "self->%s",
-			 dt_dis_varname(dp, in->imm + DIF_VAR_OTHER_UBASE,
-					DIFV_SCOPE_THREAD, addr));
-		return buf;
 	} else if (strcmp(fn, "dt_get_string") == 0) {
 		/*
 		 * We know that the previous instruction exists and assigns
@@ -93,7 +93,8 @@ static const struct {
 	{ EDT_ELFCLASS, "Unknown ELF class, neither 32- nor 64-bit" },
 	{ EDT_OBJIO, "Cannot read object file or modules.dep" },
 	{ EDT_TRACEMEM, "Missing or corrupt tracemem() record" },
-	{ EDT_PCAP, "Missing or corrupt pcap() record" }
+	{ EDT_PCAP, "Missing or corrupt pcap() record" },
+	{ EDT_TRACEFILE, "Invalid or corrupt trace file" }
 };
 
 static const int _dt_nerr = sizeof (_dt_errlist) / sizeof (_dt_errlist[0]);
@@ -270,6 +270,7 @@ static const struct {
 	{ DROPTAG(DTRACEDROP_SPECUNAVAIL) },
 	{ DROPTAG(DTRACEDROP_DBLERROR) },
 	{ DROPTAG(DTRACEDROP_STKSTROVERFLOW) },
+	{ DROPTAG(DTRACEDROP_OUTPUT) },
 	{ 0, NULL }
 };
 
@@ -325,6 +326,46 @@ dt_handle_cpudrop(dtrace_hdl_t *dtp, processorid_t cpu,
 	return (0);
 }
 
+/*
+ * Report output that was dropped by the asynchronous output writer because
+ * it could not keep up (see dtrace_writer_open()).
+ */
+int
+dt_handle_outdrop(dtrace_hdl_t *dtp, uint64_t howmany)
+{
+	dtrace_dropdata_t drop;
+	char str[80], *s;
+	int size;
+
+	memset(&drop, 0, sizeof (drop));
+	drop.dtdda_handle = dtp;
+	drop.dtdda_cpu = DTRACE_CPUALL;
+	drop.dtdda_kind = DTRACEDROP_OUTPUT;
+	drop.dtdda_drops = howmany;
+	drop.dtdda_msg = str;
+
+	if (dtp->dt_droptags) {
+		(void) snprintf(str, sizeof (str), "[%s] ",
+		    dt_droptag(DTRACEDROP_OUTPUT));
+		s = &str[strlen(str)];
+		size = sizeof (str) - (s - str);
+	} else {
+		s = str;
+		size = sizeof (str);
+	}
+
+	(void) snprintf(s, size, "%llu byte%s of output dropped\n",
+	    (unsigned long long) howmany, howmany > 1 ? "s" : "");
+
+	if (dtp->dt_drophdlr == NULL)
+		return (dt_set_errno(dtp, EDT_DROPABORT));
+
+	if ((*dtp->dt_drophdlr)(&drop, dtp->dt_droparg) == DTRACE_HANDLE_ABORT)
+		return (dt_set_errno(dtp, EDT_DROPABORT));
+
+	return (0);
+}
+
 static const struct {
 	dtrace_dropkind_t dtdrt_kind;
 	uintptr_t dtdrt_offset;
@@ -69,6 +69,11 @@ struct dt_provider;		/* see <dt_provider.h> */
 struct dt_probe;		/* see <dt_probe.h> */
 struct dt_probe;		/* see <dt_probe.h> */
 struct dt_pebset;		/* see <dt_peb.h> */
+struct dt_ringbuf;		/* see <dt_ringbuf.h> */
+struct dt_btf;			/* see <dt_btf.h> */
+struct dt_conspool;		/* see dt_consume.c */
+struct dt_tracefile;		/* see <dt_tracefile.h> */
+struct dt_writer;		/* see <dt_writer.h> */
 struct dt_xlator;		/* see <dt_xlator.h> */
 
 typedef struct dt_intrinsic {
@@ -89,6 +94,22 @@ typedef struct dt_intdesc {
 	uintmax_t did_limit;	/* maximum positive value held by type */
 } dt_intdesc_t;
 
+/*
+ * Information about an enabled probe that the consumer needs for every trace
+ * data record, determined when the enabled probe ID is registered.  Records
+ * are processed in order of their phase first: records for BEGIN come before
+ * all other records, and records for END come after all other records.
+ */
+#define DT_PHASE_BEGIN	0		/* dtrace:::BEGIN */
+#define DT_PHASE_RUN	1		/* any other probe */
+#define DT_PHASE_END	2		/* dtrace:::END */
+
+typedef struct dt_epinfo {
+	dtrace_flowkind_t flow;	/* flow kind (for flowindent) */
+	const char *prefix;	/* flowindent prefix */
+	uint_t phase;		/* processing phase (DT_PHASE_*) */
+} dt_epinfo_t;
+
 typedef struct dt_modops {
 	uint_t (*do_syminit)(struct dt_module *);
 	void (*do_symsort)(struct dt_module *);
@@ -185,6 +206,9 @@ typedef struct dt_ahashent {
 	size_t dtahe_size;			/* size of data */
 	dtrace_aggdata_t dtahe_data;		/* data */
 	void (*dtahe_aggregate)(int64_t *, int64_t *, size_t); /* function */
+	uint64_t dtahe_gen;			/* last snapshot generation */
+	char *dtahe_kkeys;			/* raw kernel keys */
+	uint_t dtahe_nkkeys;			/* number of kernel keys */
 } dt_ahashent_t;
 
 typedef struct dt_ahash {
@@ -194,11 +218,9 @@ typedef struct dt_ahash {
 } dt_ahash_t;
 
 typedef struct dt_aggregate {
-	dtrace_bufdesc_t dtat_buf; 	/* buf aggregation snapshot */
+	uint64_t dtat_gen;		/* snapshot generation */
 	int dtat_flags;			/* aggregate flags */
-	processorid_t dtat_ncpus;	/* number of CPUs in aggregate */
-	processorid_t *dtat_cpus;	/* CPUs in aggregate */
-	processorid_t dtat_ncpu;	/* size of dtat_cpus array */
+	int dtat_nobatch;		/* no batched BPF map operations */
 	processorid_t dtat_maxcpu;	/* maximum number of CPUs */
 	dt_ahash_t dtat_hash;		/* aggregate hash table */
 } dt_aggregate_t;
@@ -233,6 +255,8 @@ struct dtrace_hdl {
 	dt_list_t dt_programs;	/* linked list of dtrace_prog_t's */
 	dt_list_t dt_xlators;	/* linked list of dt_xlator_t's */
 	dt_list_t dt_enablings;	/* list of (to be) enabled probes */
+	dt_list_t dt_progcache;	/* list of constructed programs */
+	dt_htab_t *dt_proghash;	/* htab of constructed programs */
 	struct dt_xlator **dt_xlatormap; /* dt_xlator_t's indexed by dx_id */
 	id_t dt_xlatorid;	/* next dt_xlator_t id to assign */
 	dt_ident_t *dt_externs;	/* linked list of external symbol identifiers */
@@ -284,6 +308,7 @@ struct dtrace_hdl {
 	struct dt_provider **dt_provs; /* hash table of dt_provider_t's */
 	uint_t dt_provbuckets;	/* number of provider hash buckets */
 	uint_t dt_nprovs;	/* number of providers in hash and list */
+	uint_t dt_provpop;	/* bitmap of populated provider modules */
 	dt_proc_hash_t *dt_procs; /* hash table of grabbed process handles */
 	dt_intdesc_t dt_ints[6]; /* cached integer type descriptions */
 	ctf_id_t dt_type_func;	/* cached CTF identifier for function type */
@@ -297,11 +322,18 @@ struct dtrace_hdl {
 	size_t dt_maxprobe;	/* max enabled probe ID */
 	dtrace_datadesc_t **dt_ddesc; /* probe data descriptions */
 	dtrace_probedesc_t **dt_pdesc; /* probe descriptions for enabled prbs */
+	dt_epinfo_t *dt_epinfo;	/* consumer information for enabled prbs */
 	size_t dt_maxagg;	/* max aggregation ID */
 	dtrace_aggdesc_t **dt_aggdesc; /* aggregation descriptions */
 	int dt_maxformat;	/* max format ID */
 	dt_aggregate_t dt_aggregate; /* aggregate */
 	struct dt_pebset *dt_pebset; /* perf event buffers set */
+	struct dt_ringbuf *dt_ringbuf; /* BPF ring buffer (if used) */
+	struct dt_btf *dt_btf;	/* kernel BTF data (if loaded) */
+	int dt_btf_loaded;	/* whether loading kernel BTF was attempted */
+	struct dt_conspool *dt_conspool; /* trace data consumer threads */
+	struct dt_tracefile *dt_tracefile; /* trace file (if any) */
+	struct dt_writer *dt_writer; /* asynchronous output writer (if any) */
 	struct dt_pfdict *dt_pfdict; /* dictionary of printf conversions */
 	dt_version_t dt_vmax;	/* optional ceiling on program API binding */
 	dtrace_attribute_t dt_amin; /* optional floor on program attributes */
@@ -315,6 +347,7 @@ struct dtrace_hdl {
 	dt_version_t dt_kernver;/* kernel version, used in the libpath */
 	uid_t dt_useruid;	/* lowest non-system uid: set via -xuseruid */
 	char *dt_sysslice;	/* the systemd system slice: set via -xsysslice */
+	char *dt_pcachedir;	/* probe cache directory: set via -xpcachedir */
 	uint_t dt_lazyload;	/* boolean:  set via -xlazyload */
 	uint_t dt_droptags;	/* boolean:  set via -xdroptags */
 	uint_t dt_active;	/* boolean:  set once tracing is active */
@@ -339,6 +372,7 @@ struct dtrace_hdl {
 	int dt_ddefs_fd;	/* file descriptor for D CTF debugging cache */
 	int dt_stdout_fd;	/* file descriptor for saved stdout */
 	int dt_poll_fd;		/* file descriptor for event polling */
+	int dt_bpfstats_fd;	/* fd keeping BPF run-time stats enabled */
 	dtrace_handle_err_f *dt_errhdlr; /* error handler, if any */
 	void *dt_errarg;	/* error handler argument */
 	dtrace_prog_t *dt_errprog; /* error handler program, if any */
@@ -353,9 +387,17 @@ struct dtrace_hdl {
 	hrtime_t dt_laststatus;	/* last status */
 	hrtime_t dt_lastswitch;	/* last switch of buffer data */
 	hrtime_t dt_lastagg;	/* last snapshot of aggregation data */
+	hrtime_t dt_wakeupdelay; /* consumer batching delay (adaptive wakeup) */
+	uint64_t dt_nrecs;	/* number of trace data records consumed */
+	uint64_t dt_drops;	/* number of trace data records lost */
+	dtrace_stats_t dt_stats; /* consumer statistics */
+	dtrace_cpustats_t *dt_cpustats; /* per-CPU statistics (if 'stats' set) */
 	char *dt_sprintf_buf;	/* buffer for dtrace_sprintf() */
 	int dt_sprintf_buflen;	/* length of dtrace_sprintf() buffer */
 	pthread_mutex_t dt_sprintf_lock; /* lock for dtrace_sprintf() buffer */
+	char *dt_pfbuf;		/* output buffer (printf and structured output) */
+	size_t dt_pfbuf_size;	/* size of output buffer */
+	size_t dt_pfbuf_len;	/* length of output in output buffer */
 	const char *dt_filetag;	/* default filetag for dt_set_errmsg() */
 	char *dt_buffered_buf;	/* buffer for buffered output */
 	size_t dt_buffered_offs; /* current offset into buffered buffer */
@@ -673,7 +715,8 @@ enum {
 	EDT_ELFCLASS,		/* unknown ELF class, neither 32- nor 64-bit */
 	EDT_OBJIO,		/* cannot read object file or module name mapping */
 	EDT_TRACEMEM,		/* missing or corrupt tracemem() record */
-	EDT_PCAP		/* missing or corrupt pcap() record */
+	EDT_PCAP,		/* missing or corrupt pcap() record */
+	EDT_TRACEFILE		/* invalid or corrupt trace file */
 };
 
 /*
@@ -758,6 +801,7 @@ extern void dt_endcontext(dtrace_hdl_t *);
 extern void dt_dlib_init(dtrace_hdl_t *dtp);
 extern dt_ident_t *dt_dlib_add_func(dtrace_hdl_t *, const char *);
 extern dt_ident_t *dt_dlib_get_func(dtrace_hdl_t *, const char *);
+extern dt_ident_t *dt_dlib_add_map(dtrace_hdl_t *, const char *);
 extern dt_ident_t *dt_dlib_get_map(dtrace_hdl_t *, const char *);
 extern dt_ident_t *dt_dlib_get_var(dtrace_hdl_t *, const char *);
 extern dt_ident_t *dt_dlib_get_sym(dtrace_hdl_t *, const char *);
@@ -769,7 +813,9 @@ extern void *dt_compile(dtrace_hdl_t *dtp, int context,
 			dtrace_probespec_t pspec, void *arg, uint_t cflags,
 			int argc, char *const argv[], FILE *fp, const char *s);
 extern dtrace_difo_t *dt_program_construct(dtrace_hdl_t *dtp,
-					   struct dt_probe *prp, uint_t cflags);
+					   struct dt_probe *prp, uint_t cflags,
+					   uint64_t *epoffp);
+extern void dt_program_cache_destroy(dtrace_hdl_t *dtp);
 
 extern void dt_pragma(dt_node_t *);
 extern int dt_reduce(dtrace_hdl_t *, dt_version_t);
@@ -790,12 +836,16 @@ extern dtrace_datadesc_t *dt_datadesc_create(dtrace_hdl_t *);
 extern int dt_datadesc_finalize(dtrace_hdl_t *, dtrace_datadesc_t *);
 extern dtrace_epid_t dt_epid_add(dtrace_hdl_t *, dtrace_datadesc_t *,
 				 dtrace_id_t);
+extern int dt_epid_grow(dtrace_hdl_t *, dtrace_epid_t);
+extern void dt_epid_info(dtrace_hdl_t *, dtrace_epid_t);
 extern int dt_epid_lookup(dtrace_hdl_t *, dtrace_epid_t, dtrace_datadesc_t **,
 			  dtrace_probedesc_t **);
 extern void dt_epid_destroy(dtrace_hdl_t *);
 typedef void (*dt_cg_gap_f)(dt_pcb_t *, int);
 extern uint32_t dt_rec_add(dtrace_hdl_t *, dt_cg_gap_f, dtrace_actkind_t,
 			   uint32_t, uint16_t, dt_pfargv_t *, uint64_t);
+extern int dt_aggid_add(dtrace_hdl_t *, const dt_ident_t *, int,
+			const dtrace_recdesc_t *);
 extern int dt_aggid_lookup(dtrace_hdl_t *, dtrace_aggid_t, dtrace_aggdesc_t **);
 extern void dt_aggid_destroy(dtrace_hdl_t *);
 
@@ -807,11 +857,17 @@ extern int dt_print_llquantize(dtrace_hdl_t *, FILE *,
     const void *, size_t, uint64_t);
 extern int dt_print_agg(const dtrace_aggdata_t *, void *);
 
+extern int dt_consume_nthreads(dtrace_hdl_t *);
+extern int dt_consume_ordered(dtrace_hdl_t *);
+extern void dt_consume_exit(dtrace_hdl_t *);
+extern int dt_consume_plan(dtrace_hdl_t *, dtrace_datadesc_t *);
+
 extern int dt_handle(dtrace_hdl_t *, dtrace_probedata_t *);
 extern int dt_handle_liberr(dtrace_hdl_t *,
     const dtrace_probedata_t *, const char *);
 extern int dt_handle_cpudrop(dtrace_hdl_t *, processorid_t,
     dtrace_dropkind_t, uint64_t);
+extern int dt_handle_outdrop(dtrace_hdl_t *, uint64_t);
 extern int dt_handle_status(dtrace_hdl_t *,
     dtrace_status_t *, dtrace_status_t *);
 extern int dt_handle_setopt(dtrace_hdl_t *, dtrace_setoptdata_t *);
@@ -845,6 +901,8 @@ extern uint_t _dtrace_stkindent;	/* default indent for stack/ustack */
 extern uint_t _dtrace_pidbuckets;	/* number of hash buckets for pids */
 extern uint_t _dtrace_pidlrulim;	/* number of proc handles to cache */
 extern size_t _dtrace_bufsize;		/* default dt_buf_create() size */
+extern size_t _dtrace_aggsize;		/* default aggregation map size */
+extern size_t _dtrace_dynvarsize;	/* default dynamic variable map size */
 extern int _dtrace_argmax;		/* default maximum probe arguments */
 extern int _dtrace_debug_assert;	/* turn on expensive assertions */
 
@@ -34,6 +34,7 @@ dt_datadesc_release(dtrace_hdl_t *dtp, dtrace_datadesc_t *ddp)
 		if (rec->dtrd_format != NULL)
 			dt_printf_destroy(rec->dtrd_format);
 	}
+	dt_free(dtp, ddp->dtdd_plan);
 	dt_free(dtp, ddp->dtdd_recs);
 	dt_free(dtp, ddp);
 }
@@ -81,49 +82,121 @@ dt_datadesc_finalize(dtrace_hdl_t *dtp, dtrace_datadesc_t *ddp)
 	}
 
 	ddp->dtdd_nrecs = oddp->dtdd_nrecs;
+	ddp->dtdd_size = pcb->pcb_bufoff;
 
 	return 0;
 }
 
+/*
+ * Grow the tables of enabled probe information so they can hold the given
+ * enabled probe ID.
+ */
+int
+dt_epid_grow(dtrace_hdl_t *dtp, dtrace_epid_t epid)
+{
+	size_t			max = dtp->dt_maxprobe;
+	size_t			nmax = max ? max : 2;
+	dtrace_datadesc_t	**nddesc;
+	dtrace_probedesc_t	**npdesc;
+	dt_epinfo_t		*nepinfo;
+
+	if (epid < max && dtp->dt_ddesc != NULL)
+		return 0;
+
+	while (epid >= nmax)
+		nmax <<= 1;
+
+	nddesc = dt_calloc(dtp, nmax, sizeof(void *));
+	npdesc = dt_calloc(dtp, nmax, sizeof(void *));
+	nepinfo = dt_calloc(dtp, nmax, sizeof(dt_epinfo_t));
+	if (nddesc == NULL || npdesc == NULL || nepinfo == NULL) {
+		dt_free(dtp, nddesc);
+		dt_free(dtp, npdesc);
+		dt_free(dtp, nepinfo);
+		return dt_set_errno(dtp, EDT_NOMEM);
+	}
+
+	if (dtp->dt_ddesc != NULL) {
+		memcpy(nddesc, dtp->dt_ddesc, max * sizeof(void *));
+		dt_free(dtp, dtp->dt_ddesc);
+		memcpy(npdesc, dtp->dt_pdesc, max * sizeof(void *));
+		dt_free(dtp, dtp->dt_pdesc);
+		memcpy(nepinfo, dtp->dt_epinfo, max * sizeof(dt_epinfo_t));
+		dt_free(dtp, dtp->dt_epinfo);
+	}
+
+	dtp->dt_ddesc = nddesc;
+	dtp->dt_pdesc = npdesc;
+	dtp->dt_epinfo = nepinfo;
+	dtp->dt_maxprobe = nmax;
+
+	return 0;
+}
+
+/*
+ * Determine the information the consumer needs about an enabled probe, based
+ * on its probe description.  If the name of the probe is "entry" or ends with
+ * "-entry", it is treated as an entry for flowindent; if it is "return" or
+ * ends with "-return", it is treated as a return.  (This allows
+ * application-provided probes like "method-entry" or "function-entry" to
+ * participate in flow indentation -- without accidentally misinterpreting
+ * popular probe names like "carpentry", "gentry" or "Coventry".)
+ */
+void
+dt_epid_info(dtrace_hdl_t *dtp, dtrace_epid_t epid)
+{
+	const dtrace_probedesc_t *pdp = dtp->dt_pdesc[epid];
+	dt_epinfo_t	*eip = &dtp->dt_epinfo[epid];
+	const char	*n = pdp->prb;
+	const char	*sub;
+	size_t		len = strlen(n);
+	int		sys = strcmp(pdp->prv, "syscall") == 0;
+
+	eip->flow = DTRACEFLOW_NONE;
+	eip->prefix = "| ";
+	eip->phase = DT_PHASE_RUN;
+
+	if (len >= 5) {
+		sub = n + len - 5;
+		if (strcmp(sub, "entry") == 0 && (sub == n || sub[-1] == '-')) {
+			eip->flow = DTRACEFLOW_ENTRY;
+			eip->prefix = sys ? " => " : " -> ";
+		}
+	}
+	if (len >= 6) {
+		sub = n + len - 6;
+		if (strcmp(sub, "return") == 0 && (sub == n || sub[-1] == '-')) {
+			eip->flow = DTRACEFLOW_RETURN;
+			eip->prefix = sys ? " <= " : " <- ";
+		}
+	}
+
+	if (strcmp(pdp->prv, "dtrace") == 0) {
+		if (strcmp(n, "BEGIN") == 0)
+			eip->phase = DT_PHASE_BEGIN;
+		else if (strcmp(n, "END") == 0)
+			eip->phase = DT_PHASE_END;
+	}
+}
+
 /*
  * Associate a probe data description and probe description with an enabled
  * probe ID.  This means that the given ID refers to the program matching the
  * probe data description being attached to the probe that matches the probe
- * description.
+ * description.  The decode plan for the probe data description is built here
+ * (once), so the consumer does not need to work it out for every record.
  */
 dtrace_epid_t
 dt_epid_add(dtrace_hdl_t *dtp, dtrace_datadesc_t *ddp, dtrace_id_t prid)
 {
-	dtrace_id_t		max = dtp->dt_maxprobe;
 	dtrace_epid_t		epid;
 
-	epid = dtp->dt_nextepid++;
-	if (epid >= max || dtp->dt_ddesc == NULL) {
-		dtrace_id_t		nmax = max ? (max << 1) : 2;
-		dtrace_datadesc_t	**nddesc;
-		dtrace_probedesc_t	**npdesc;
-
-		nddesc = dt_calloc(dtp, nmax, sizeof(void *));
-		npdesc = dt_calloc(dtp, nmax, sizeof(void *));
-		if (nddesc == NULL || npdesc == NULL) {
-			dt_free(dtp, nddesc);
-			dt_free(dtp, npdesc);
-			return dt_set_errno(dtp, EDT_NOMEM);
-		}
+	if (dt_consume_plan(dtp, ddp) != 0)
+		return -1;
 
-		if (dtp->dt_ddesc != NULL) {
-			size_t	osize = max * sizeof(void *);
-
-			memcpy(nddesc, dtp->dt_ddesc, osize);
-			dt_free(dtp, dtp->dt_ddesc);
-			memcpy(npdesc, dtp->dt_pdesc, osize);
-			dt_free(dtp, dtp->dt_pdesc);
-		}
-
-		dtp->dt_ddesc = nddesc;
-		dtp->dt_pdesc = npdesc;
-		dtp->dt_maxprobe = nmax;
-	}
+	epid = dtp->dt_nextepid++;
+	if (dt_epid_grow(dtp, epid) != 0)
+		return -1;
 
 	if (dtp->dt_ddesc[epid] != NULL)
 		return epid;
@@ -131,6 +204,7 @@ dt_epid_add(dtrace_hdl_t *dtp, dtrace_datadesc_t *ddp, dtrace_id_t prid)
 	dt_datadesc_hold(ddp);
 	dtp->dt_ddesc[epid] = ddp;
 	dtp->dt_pdesc[epid] = (dtrace_probedesc_t *)dtp->dt_probes[prid]->desc;
+	dt_epid_info(dtp, epid);
 
 	return epid;
 }
@@ -176,6 +250,9 @@ dt_epid_destroy(dtrace_hdl_t *dtp)
 
 	free(dtp->dt_ddesc);
 	dtp->dt_ddesc = NULL;
+
+	free(dtp->dt_epinfo);
+	dtp->dt_epinfo = NULL;
 	dtp->dt_nextepid = 0;
 	dtp->dt_maxprobe = 0;
 }
@@ -232,123 +309,85 @@ dt_rec_add(dtrace_hdl_t *dtp, dt_cg_gap_f gapf, dtrace_actkind_t kind,
 	return off;
 }
 
-static int
-dt_aggid_add(dtrace_hdl_t *dtp, dtrace_aggid_t id)
+/*
+ * Associate an aggregation description with the given aggregation identifier.
+ * The code generator determines the layout of the key and data records and
+ * passes them in (with offsets relative to the start of the key).  The
+ * aggregation variable ID is always recorded as the first record, so it is
+ * prepended here and all other records are shifted accordingly.
+ *
+ * An aggregation may be used in multiple clauses, but the parser guarantees
+ * that all uses agree on the key signature and aggregating function.  If a
+ * description already exists for the aggregation, it is therefore retained.
+ */
+int
+dt_aggid_add(dtrace_hdl_t *dtp, const dt_ident_t *aid, int nrecs,
+	     const dtrace_recdesc_t *recs)
 {
-	dtrace_id_t max;
-	int rval;
+	dtrace_id_t		max;
+	dtrace_aggid_t		id = aid->di_id;
+	dtrace_aggdesc_t	*agg;
+	dtrace_recdesc_t	*rec;
+	int			i;
 
 	while (id >= (max = dtp->dt_maxagg) || dtp->dt_aggdesc == NULL) {
-		dtrace_id_t new_max = max ? (max << 1) : 1;
-		size_t nsize = new_max * sizeof (void *);
-		dtrace_aggdesc_t **new_aggdesc;
-
-		if ((new_aggdesc = malloc(nsize)) == NULL)
-			return (dt_set_errno(dtp, EDT_NOMEM));
+		dtrace_id_t		nmax = max ? (max << 1) : 2;
+		dtrace_aggdesc_t	**nadesc;
 
-		memset(new_aggdesc, 0, nsize);
+		nadesc = dt_calloc(dtp, nmax, sizeof(void *));
+		if (nadesc == NULL)
+			return dt_set_errno(dtp, EDT_NOMEM);
 
 		if (dtp->dt_aggdesc != NULL) {
-			memcpy(new_aggdesc, dtp->dt_aggdesc,
-			    max * sizeof (void *));
-			free(dtp->dt_aggdesc);
+			memcpy(nadesc, dtp->dt_aggdesc, max * sizeof(void *));
+			dt_free(dtp, dtp->dt_aggdesc);
 		}
 
-		dtp->dt_aggdesc = new_aggdesc;
-		dtp->dt_maxagg = new_max;
+		dtp->dt_aggdesc = nadesc;
+		dtp->dt_maxagg = nmax;
 	}
 
-	if (dtp->dt_aggdesc[id] == NULL) {
-		dtrace_aggdesc_t *agg, *nagg;
-
-		if ((agg = malloc(sizeof (dtrace_aggdesc_t))) == NULL)
-			return (dt_set_errno(dtp, EDT_NOMEM));
-
-		memset(agg, 0, sizeof (dtrace_aggdesc_t));
-		agg->dtagd_id = id;
-		agg->dtagd_nrecs = 1;
-
-		if (dt_ioctl(dtp, DTRACEIOC_AGGDESC, agg) == -1) {
-			rval = dt_set_errno(dtp, errno);
-			free(agg);
-			return (rval);
-		}
-
-		if (DTRACE_SIZEOF_AGGDESC(agg) != sizeof (*agg)) {
-			/*
-			 * There must be more than one action.  Allocate the
-			 * appropriate amount of space and try again.
-			 */
-			if ((nagg = malloc(DTRACE_SIZEOF_AGGDESC(agg))) != NULL)
-				memcpy(nagg, agg, sizeof (*agg));
-
-			free(agg);
-
-			if ((agg = nagg) == NULL)
-				return (dt_set_errno(dtp, EDT_NOMEM));
-
-			rval = dt_ioctl(dtp, DTRACEIOC_AGGDESC, agg);
-
-			if (rval == -1) {
-				rval = dt_set_errno(dtp, errno);
-				free(agg);
-				return (rval);
-			}
-		}
+	if (dtp->dt_aggdesc[id] != NULL)
+		return 0;
+
+	agg = dt_zalloc(dtp, sizeof(dtrace_aggdesc_t) +
+			     nrecs * sizeof(dtrace_recdesc_t));
+	if (agg == NULL)
+		return dt_set_errno(dtp, EDT_NOMEM);
+
+	agg->dtagd_name = aid->di_name;
+	agg->dtagd_varid = aid->di_id;
+	agg->dtagd_id = id;
+	agg->dtagd_nrecs = nrecs + 1;
+
+	rec = &agg->dtagd_rec[0];
+	rec->dtrd_action = DTRACEACT_DIFEXPR;
+	rec->dtrd_size = sizeof(dtrace_aggvarid_t);
+	rec->dtrd_offset = 0;
+	rec->dtrd_alignment = sizeof(dtrace_aggvarid_t);
+
+	for (i = 0; i < nrecs; i++) {
+		rec = &agg->dtagd_rec[i + 1];
+		*rec = recs[i];
+		rec->dtrd_offset += sizeof(dtrace_aggvarid_t);
+	}
 
-		/*
-		 * If we have a uarg, it's a pointer to the compiler-generated
-		 * statement; we'll use this value to get the name and
-		 * compiler-generated variable ID for the aggregation.  If
-		 * we're grabbing an anonymous enabling, this pointer value
-		 * is obviously meaningless -- and in this case, we can't
-		 * provide the compiler-generated aggregation information.
-		 */
-		if (dtp->dt_options[DTRACEOPT_GRABANON] == DTRACEOPT_UNSET &&
-		    agg->dtagd_rec[0].dtrd_uarg != 0) {
-			dtrace_stmtdesc_t *sdp;
-			dt_ident_t *aid;
-
-			sdp = (dtrace_stmtdesc_t *)(uintptr_t)
-			    agg->dtagd_rec[0].dtrd_uarg;
-			aid = sdp->dtsd_aggdata;
-			agg->dtagd_name = aid->di_name;
-			agg->dtagd_varid = aid->di_id;
-		} else {
-			agg->dtagd_varid = DTRACE_AGGVARIDNONE;
-		}
+	agg->dtagd_size = rec->dtrd_offset + rec->dtrd_size;
 
-#if 0
-		if ((epid = agg->dtagd_epid) >= dtp->dt_maxprobe ||
-		    dtp->dt_pdesc[epid] == NULL) {
-			if ((rval = dt_epid_add(dtp, epid)) != 0) {
-				free(agg);
-				return (rval);
-			}
-		}
-#endif
+	dtp->dt_aggdesc[id] = agg;
 
-		dtp->dt_aggdesc[id] = agg;
-	}
-
-	return (0);
+	return 0;
 }
 
 int
 dt_aggid_lookup(dtrace_hdl_t *dtp, dtrace_aggid_t aggid, dtrace_aggdesc_t **adp)
 {
-	int rval;
+	if (aggid >= dtp->dt_maxagg || dtp->dt_aggdesc[aggid] == NULL)
+		return dt_set_errno(dtp, EDT_BADAGGVAR);
 
-	if (aggid >= dtp->dt_maxagg || dtp->dt_aggdesc[aggid] == NULL) {
-		if ((rval = dt_aggid_add(dtp, aggid)) != 0)
-			return (rval);
-	}
-
-	assert(aggid < dtp->dt_maxagg);
-	assert(dtp->dt_aggdesc[aggid] != NULL);
 	*adp = dtp->dt_aggdesc[aggid];
 
-	return (0);
+	return 0;
 }
 
 void
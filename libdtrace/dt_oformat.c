@@ -0,0 +1,708 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, 2026, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+/*
+ * Structured output (the 'oformat' option).  Rather than being formatted for
+ * people to read, the data recorded by each probe firing is written as a
+ * single line: a JSON object or a CSV row.  Aggregations are written as one
+ * line per tuple (in CSV, one line per histogram bucket).
+ *
+ * A line is encoded directly from the record descriptions into the output
+ * buffer that compiled printf() formats also use (see dt_pfbuf_write()), and
+ * is written out once the line is complete.
+ */
+#include <alloca.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dt_impl.h>
+#include <dt_oformat.h>
+
+static const char	dt_oformat_hex[] = "0123456789abcdef";
+
+int
+dt_oformat_enabled(dtrace_hdl_t *dtp)
+{
+	dtrace_optval_t	fmt = dtp->dt_options[DTRACEOPT_OFORMAT];
+
+	return fmt != DTRACEOPT_UNSET && fmt != DTRACEOPT_OFORMAT_TEXT;
+}
+
+static int
+dt_oformat_csv(dtrace_hdl_t *dtp)
+{
+	return dtp->dt_options[DTRACEOPT_OFORMAT] == DTRACEOPT_OFORMAT_CSV;
+}
+
+static int
+dt_obuf_puts(dtrace_hdl_t *dtp, const char *s)
+{
+	return dt_pfbuf_write(dtp, s, strlen(s));
+}
+
+static int
+dt_obuf_int(dtrace_hdl_t *dtp, int64_t val)
+{
+	if (val < 0)
+		return dt_pfbuf_dec(dtp, -(uint64_t)val, 1);
+
+	return dt_pfbuf_dec(dtp, val, 0);
+}
+
+/*
+ * Values are separated by commas, except at the start of a line (or, in JSON,
+ * at the start of an object or array).
+ */
+static int
+dt_obuf_sep(dtrace_hdl_t *dtp)
+{
+	char	c;
+
+	if (dtp->dt_pfbuf_len == 0)
+		return 0;
+
+	c = dtp->dt_pfbuf[dtp->dt_pfbuf_len - 1];
+	if (!dt_oformat_csv(dtp) && (c == '{' || c == '['))
+		return 0;
+
+	return dt_pfbuf_write(dtp, ",", 1);
+}
+
+/*
+ * Start a named value.  In CSV, values are identified by their position only.
+ */
+static int
+dt_obuf_key(dtrace_hdl_t *dtp, const char *key)
+{
+	if (dt_obuf_sep(dtp) != 0)
+		return -1;
+
+	if (dt_oformat_csv(dtp))
+		return 0;
+
+	if (dt_pfbuf_write(dtp, "\"", 1) != 0 || dt_obuf_puts(dtp, key) != 0)
+		return -1;
+
+	return dt_pfbuf_write(dtp, "\":", 2);
+}
+
+/*
+ * Return the length of the valid UTF-8 multi-byte sequence at the start of the
+ * given data, or 0 if it does not start with one.  Overlong encodings,
+ * surrogates, and code points beyond U+10FFFF are not valid.
+ */
+static size_t
+dt_utf8_len(const unsigned char *s, size_t len)
+{
+	unsigned char	lo = 0x80, hi = 0xbf;
+	size_t		i, n;
+
+	if (s[0] >= 0xc2 && s[0] <= 0xdf)
+		n = 2;
+	else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		n = 3;
+		if (s[0] == 0xe0)
+			lo = 0xa0;
+		else if (s[0] == 0xed)
+			hi = 0x9f;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		n = 4;
+		if (s[0] == 0xf0)
+			lo = 0x90;
+		else if (s[0] == 0xf4)
+			hi = 0x8f;
+	} else
+		return 0;
+
+	if (len < n || s[1] < lo || s[1] > hi)
+		return 0;
+
+	for (i = 2; i < n; i++) {
+		if (s[i] < 0x80 || s[i] > 0xbf)
+			return 0;
+	}
+
+	return n;
+}
+
+/*
+ * Write a string.  JSON strings are escaped as needed, and bytes that are not
+ * part of a valid UTF-8 sequence are written as \u00XX escapes (i.e. taken to
+ * be Latin-1 characters) so that the output is always valid JSON.  CSV fields
+ * are only quoted if they contain a comma, a quote, or a line break.
+ */
+static int
+dt_obuf_string(dtrace_hdl_t *dtp, const char *s, size_t len)
+{
+	char	*p;
+	size_t	i;
+
+	if (dt_pfbuf_reserve(dtp, len * 6 + 2) != 0)
+		return -1;
+
+	p = dtp->dt_pfbuf + dtp->dt_pfbuf_len;
+
+	if (dt_oformat_csv(dtp)) {
+		for (i = 0; i < len; i++) {
+			if (strchr(",\"\r\n", s[i]) != NULL && s[i] != '\0')
+				break;
+		}
+
+		if (i == len) {
+			memcpy(p, s, len);
+			dtp->dt_pfbuf_len += len;
+
+			return 0;
+		}
+
+		*p++ = '"';
+		for (i = 0; i < len; i++) {
+			if (s[i] == '"')
+				*p++ = '"';
+			*p++ = s[i];
+		}
+		*p++ = '"';
+	} else {
+		*p++ = '"';
+		for (i = 0; i < len; i++) {
+			unsigned char	c = s[i];
+			size_t		n;
+
+			switch (c) {
+			case '"':
+			case '\\':
+				*p++ = '\\';
+				*p++ = c;
+				break;
+			case '\n':
+				*p++ = '\\';
+				*p++ = 'n';
+				break;
+			case '\r':
+				*p++ = '\\';
+				*p++ = 'r';
+				break;
+			case '\t':
+				*p++ = '\\';
+				*p++ = 't';
+				break;
+			default:
+				if (c >= 0x20 && c < 0x80) {
+					*p++ = c;
+					break;
+				}
+
+				n = c < 0x80 ? 0
+					     : dt_utf8_len((const unsigned char *)
+							   s + i, len - i);
+				if (n > 0) {
+					memcpy(p, s + i, n);
+					p += n;
+					i += n - 1;
+					break;
+				}
+
+				memcpy(p, "\\u00", 4);
+				p += 4;
+				*p++ = dt_oformat_hex[c >> 4];
+				*p++ = dt_oformat_hex[c & 0xf];
+			}
+		}
+		*p++ = '"';
+	}
+
+	dtp->dt_pfbuf_len = p - dtp->dt_pfbuf;
+
+	return 0;
+}
+
+/*
+ * Write data that is not numeric: as a string if it holds a printable string,
+ * and as a hexadecimal number otherwise.
+ */
+static int
+dt_oformat_bytes(dtrace_hdl_t *dtp, const char *addr, size_t size)
+{
+	const char	*end = memchr(addr, '\0', size);
+	int		csv = dt_oformat_csv(dtp);
+	char		*p;
+	size_t		i;
+
+	if (end != NULL) {
+		for (i = 0; addr + i < end; i++) {
+			unsigned char	c = addr[i];
+
+			if (!isprint(c) && !isspace(c))
+				break;
+		}
+
+		if (addr + i == end)
+			return dt_obuf_string(dtp, addr, end - addr);
+	}
+
+	if (dt_pfbuf_reserve(dtp, size * 2 + 4) != 0)
+		return -1;
+
+	p = dtp->dt_pfbuf + dtp->dt_pfbuf_len;
+	if (!csv)
+		*p++ = '"';
+	*p++ = '0';
+	*p++ = 'x';
+	for (i = 0; i < size; i++) {
+		unsigned char	c = addr[i];
+
+		*p++ = dt_oformat_hex[c >> 4];
+		*p++ = dt_oformat_hex[c & 0xf];
+	}
+	if (!csv)
+		*p++ = '"';
+
+	dtp->dt_pfbuf_len = p - dtp->dt_pfbuf;
+
+	return 0;
+}
+
+static int
+dt_oformat_value(dtrace_hdl_t *dtp, const dtrace_recdesc_t *rec,
+		 const char *addr)
+{
+	int	sgn = rec->dtrd_arg == DT_NF_SIGNED;
+
+	if (rec->dtrd_arg == DT_NF_REF)
+		return dt_oformat_bytes(dtp, addr, rec->dtrd_size);
+
+	switch (rec->dtrd_size) {
+	case sizeof(uint64_t):
+		return sgn ? dt_obuf_int(dtp, *(int64_t *)addr)
+			   : dt_pfbuf_dec(dtp, *(uint64_t *)addr, 0);
+	case sizeof(uint32_t):
+		return sgn ? dt_obuf_int(dtp, *(int32_t *)addr)
+			   : dt_pfbuf_dec(dtp, *(uint32_t *)addr, 0);
+	case sizeof(uint16_t):
+		return sgn ? dt_obuf_int(dtp, *(int16_t *)addr)
+			   : dt_pfbuf_dec(dtp, *(uint16_t *)addr, 0);
+	case sizeof(uint8_t):
+		return sgn ? dt_obuf_int(dtp, *(int8_t *)addr)
+			   : dt_pfbuf_dec(dtp, *(uint8_t *)addr, 0);
+	}
+
+	return dt_oformat_bytes(dtp, addr, rec->dtrd_size);
+}
+
+/*
+ * Start the line for a probe firing.  It identifies the CPU and the probe; the
+ * values of the records follow (in JSON, in the 'data' array).
+ */
+int
+dt_oformat_probe(dtrace_hdl_t *dtp, const dtrace_probedata_t *data)
+{
+	const dtrace_probedesc_t	*pd = data->dtpda_pdesc;
+	char				name[DTRACE_FULLNAMELEN], *p;
+
+	p = stpcpy(name, pd->prv);
+	*p++ = ':';
+	p = stpcpy(p, pd->mod);
+	*p++ = ':';
+	p = stpcpy(p, pd->fun);
+	*p++ = ':';
+	p = stpcpy(p, pd->prb);
+
+	dtp->dt_pfbuf_len = 0;
+	if (!dt_oformat_csv(dtp) && dt_pfbuf_write(dtp, "{", 1) != 0)
+		return -1;
+
+	if (dt_obuf_key(dtp, "cpu") != 0 ||
+	    dt_pfbuf_dec(dtp, data->dtpda_cpu, 0) != 0 ||
+	    dt_obuf_key(dtp, "id") != 0 ||
+	    dt_pfbuf_dec(dtp, pd->id, 0) != 0 ||
+	    dt_obuf_key(dtp, "probe") != 0 ||
+	    dt_obuf_string(dtp, name, p - name) != 0)
+		return -1;
+
+	if (!dt_oformat_csv(dtp) &&
+	    (dt_obuf_key(dtp, "data") != 0 || dt_pfbuf_write(dtp, "[", 1) != 0))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Add the value of a record to the line for a probe firing.  Like the output
+ * functions for actions, this returns the number of records that were
+ * consumed.  The output of printf() is added as a string, and system() and
+ * freopen() are performed as usual.
+ */
+int
+dt_oformat_datum(dtrace_hdl_t *dtp, FILE *fp, const dtrace_probedata_t *data,
+		 const dtrace_recdesc_t *rec, uint_t nrecs, const void *buf,
+		 size_t len)
+{
+	char	*s;
+	int	n;
+
+	switch (rec->dtrd_action) {
+	case DTRACEACT_PRINTF:
+		n = dt_printf_asprintf(dtp, rec->dtrd_format, rec, nrecs, buf,
+				       len, &s);
+		if (n < 0)
+			return -1;
+
+		if (dt_obuf_sep(dtp) != 0 ||
+		    dt_obuf_string(dtp, s, strlen(s)) != 0) {
+			free(s);
+			return -1;
+		}
+
+		free(s);
+
+		return MAX(n, 1);
+	case DTRACEACT_SYSTEM:
+		return dtrace_system(dtp, fp, rec->dtrd_format, data, rec,
+				     nrecs, buf, len);
+	case DTRACEACT_FREOPEN:
+		return dtrace_freopen(dtp, fp, rec->dtrd_format, data, rec,
+				      nrecs, buf, len);
+	}
+
+	if (dt_obuf_sep(dtp) != 0 ||
+	    dt_oformat_value(dtp, rec, (const char *)data->dtpda_data) != 0)
+		return -1;
+
+	return 1;
+}
+
+/*
+ * Complete the line for a probe firing, and write it out.
+ */
+int
+dt_oformat_end(dtrace_hdl_t *dtp, FILE *fp)
+{
+	if (dt_obuf_puts(dtp, dt_oformat_csv(dtp) ? "\n" : "]}\n") != 0)
+		return -1;
+
+	return dt_pfbuf_flush(dtp, fp);
+}
+
+/*
+ * Add a histogram bucket (identified by its lower bound) with a non-zero count.
+ * In JSON, buckets are [value, count] pairs.  In CSV, every bucket is written
+ * on a line of its own, starting with the first 'prefix' bytes of the output
+ * buffer (the aggregation name and its keys).
+ */
+static int
+dt_oformat_bucket(dtrace_hdl_t *dtp, size_t prefix, int64_t val,
+		  int64_t count, uint64_t normal)
+{
+	if (count == 0)
+		return 0;
+
+	count /= (int64_t)normal;
+
+	if (dt_oformat_csv(dtp)) {
+		if (dtp->dt_pfbuf_len > prefix) {
+			if (dt_pfbuf_reserve(dtp, prefix) != 0)
+				return -1;
+
+			memcpy(dtp->dt_pfbuf + dtp->dt_pfbuf_len, dtp->dt_pfbuf,
+			       prefix);
+			dtp->dt_pfbuf_len += prefix;
+		}
+
+		if (dt_obuf_sep(dtp) != 0 || dt_obuf_int(dtp, val) != 0 ||
+		    dt_obuf_sep(dtp) != 0 || dt_obuf_int(dtp, count) != 0)
+			return -1;
+
+		return dt_pfbuf_write(dtp, "\n", 1);
+	}
+
+	if (dt_obuf_sep(dtp) != 0 || dt_pfbuf_write(dtp, "[", 1) != 0 ||
+	    dt_obuf_int(dtp, val) != 0 || dt_pfbuf_write(dtp, ",", 1) != 0 ||
+	    dt_obuf_int(dtp, count) != 0)
+		return -1;
+
+	return dt_pfbuf_write(dtp, "]", 1);
+}
+
+static int
+dt_oformat_quantize(dtrace_hdl_t *dtp, size_t prefix, const int64_t *data,
+		    size_t size, uint64_t normal)
+{
+	int	i;
+
+	if (size != DTRACE_QUANTIZE_NBUCKETS * sizeof(uint64_t))
+		return dt_set_errno(dtp, EDT_DMISMATCH);
+
+	for (i = 0; i < DTRACE_QUANTIZE_NBUCKETS; i++) {
+		if (dt_oformat_bucket(dtp, prefix,
+				      DTRACE_QUANTIZE_BUCKETVAL(i), data[i],
+				      normal) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The underflow bucket of a linear histogram has no lower bound, so it is
+ * reported as INT64_MIN.
+ */
+static int
+dt_oformat_lquantize(dtrace_hdl_t *dtp, size_t prefix, const int64_t *data,
+		     size_t size, uint64_t normal)
+{
+	uint64_t	arg;
+	int		i, base;
+	uint16_t	step, levels;
+
+	if (size < sizeof(uint64_t))
+		return dt_set_errno(dtp, EDT_DMISMATCH);
+
+	arg = *data++;
+	size -= sizeof(uint64_t);
+
+	base = DTRACE_LQUANTIZE_BASE(arg);
+	step = DTRACE_LQUANTIZE_STEP(arg);
+	levels = DTRACE_LQUANTIZE_LEVELS(arg);
+
+	if (size != sizeof(uint64_t) * (levels + 2))
+		return dt_set_errno(dtp, EDT_DMISMATCH);
+
+	for (i = 0; i <= levels + 1; i++) {
+		int64_t	val;
+
+		if (i == 0)
+			val = INT64_MIN;
+		else
+			val = base + (int64_t)(i - 1) * step;
+
+		if (dt_oformat_bucket(dtp, prefix, val, data[i], normal) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The bucket values of a log-linear histogram are determined in the same way
+ * as the labels printed by dt_print_llquantize().
+ */
+static int
+dt_oformat_llquantize(dtrace_hdl_t *dtp, size_t prefix, const int64_t *data,
+		      size_t size, uint64_t normal)
+{
+	int		factor, lmag, hmag, steps, steps_factor, step, bin0;
+	int		nbins, i, mag;
+	uint64_t	arg, scale;
+	int64_t		*vals;
+
+	if (size < sizeof(uint64_t))
+		return dt_set_errno(dtp, EDT_DMISMATCH);
+
+	arg = *data++;
+	size -= sizeof(uint64_t);
+
+	factor = DTRACE_LLQUANTIZE_FACTOR(arg);
+	lmag = DTRACE_LLQUANTIZE_LMAG(arg);
+	hmag = DTRACE_LLQUANTIZE_HMAG(arg);
+	steps = DTRACE_LLQUANTIZE_STEPS(arg);
+	steps_factor = steps / factor;
+	bin0 = 1 + (hmag - lmag + 1) * (steps - steps_factor);
+	nbins = 2 * bin0 + 1;
+
+	if (size != sizeof(uint64_t) * nbins)
+		return dt_set_errno(dtp, EDT_DMISMATCH);
+
+	vals = alloca(nbins * sizeof(int64_t));
+	memset(vals, 0, nbins * sizeof(int64_t));
+
+	scale = (uint64_t)powl(factor, lmag);
+	vals[bin0 - 1] = -(int64_t)scale;
+	vals[bin0 + 1] = scale;
+
+	mag = lmag;
+	i = 1;
+	if (lmag == 0 && steps > factor) {
+		for (step = 2; step <= factor; step++) {
+			i += steps_factor;
+			if (i < bin0) {
+				vals[bin0 - i] = -step;
+				vals[bin0 + i] = step;
+			}
+		}
+		mag++;
+	}
+
+	scale = (uint64_t)powl(factor, mag + 1) / steps;
+	for ( ; mag <= hmag; mag++) {
+		for (step = steps_factor + 1; step <= steps; step++) {
+			i++;
+			if (i < bin0) {
+				vals[bin0 - i] = -(int64_t)(step * scale);
+				vals[bin0 + i] = step * scale;
+			}
+		}
+		scale *= factor;
+	}
+
+	scale = (uint64_t)powl(factor, hmag + 1);
+	vals[0] = -(int64_t)scale;
+	vals[nbins - 1] = scale;
+
+	for (i = 0; i < nbins; i++) {
+		if (dt_oformat_bucket(dtp, prefix, vals[i], data[i],
+				      normal) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write an aggregation tuple: the name of the aggregation, its keys, and its
+ * value.  The value of a histogram is its list of non-empty buckets.  This is
+ * an aggregation walker with the same semantics as dt_print_agg().
+ */
+int
+dt_oformat_agg(const dtrace_aggdata_t *aggdata, void *arg)
+{
+	dtrace_print_aggdata_t	*pd = arg;
+	dtrace_hdl_t		*dtp = pd->dtpa_dtp;
+	dtrace_aggdesc_t	*agg = aggdata->dtada_desc;
+	uint64_t		normal = aggdata->dtada_normal;
+	int			csv = dt_oformat_csv(dtp);
+	const dtrace_recdesc_t	*rec;
+	const char		*addr;
+	size_t			prefix;
+	int			i, rval;
+
+	if (pd->dtpa_allunprint) {
+		if (agg->dtagd_flags & DTRACE_AGD_PRINTED)
+			return 0;
+	} else {
+		if (agg->dtagd_nrecs == 0)
+			return 0;
+
+		if (pd->dtpa_id != agg->dtagd_varid)
+			return 0;
+	}
+
+	dtp->dt_pfbuf_len = 0;
+	if (!csv && dt_pfbuf_write(dtp, "{", 1) != 0)
+		return -1;
+
+	if (dt_obuf_key(dtp, "name") != 0 ||
+	    dt_obuf_string(dtp, agg->dtagd_name, strlen(agg->dtagd_name)) != 0)
+		return -1;
+
+	if (!csv &&
+	    (dt_obuf_key(dtp, "keys") != 0 || dt_pfbuf_write(dtp, "[", 1) != 0))
+		return -1;
+
+	/*
+	 * As in dt_print_aggs(), the first record (the tuple member created by
+	 * the compiler) is skipped.
+	 */
+	for (i = 1; i < agg->dtagd_nrecs; i++) {
+		rec = &agg->dtagd_rec[i];
+		if (DTRACEACT_ISAGG(rec->dtrd_action))
+			break;
+
+		addr = aggdata->dtada_data + rec->dtrd_offset;
+		if (dt_obuf_sep(dtp) != 0 ||
+		    dt_oformat_value(dtp, rec, addr) != 0)
+			return -1;
+	}
+
+	assert(i < agg->dtagd_nrecs);
+
+	if (!csv && dt_pfbuf_write(dtp, "]", 1) != 0)
+		return -1;
+
+	rec = &agg->dtagd_rec[i];
+	addr = aggdata->dtada_data + rec->dtrd_offset;
+	prefix = dtp->dt_pfbuf_len;
+
+	switch (rec->dtrd_action) {
+	case DTRACEAGG_QUANTIZE:
+	case DTRACEAGG_LQUANTIZE:
+	case DTRACEAGG_LLQUANTIZE:
+		if (!csv && (dt_obuf_key(dtp, "buckets") != 0 ||
+			     dt_pfbuf_write(dtp, "[", 1) != 0))
+			return -1;
+
+		if (rec->dtrd_action == DTRACEAGG_QUANTIZE)
+			rval = dt_oformat_quantize(dtp, prefix,
+						   (const int64_t *)addr,
+						   rec->dtrd_size, normal);
+		else if (rec->dtrd_action == DTRACEAGG_LQUANTIZE)
+			rval = dt_oformat_lquantize(dtp, prefix,
+						    (const int64_t *)addr,
+						    rec->dtrd_size, normal);
+		else
+			rval = dt_oformat_llquantize(dtp, prefix,
+						     (const int64_t *)addr,
+						     rec->dtrd_size, normal);
+		if (rval != 0)
+			return -1;
+
+		/*
+		 * In CSV, the buckets are complete lines.
+		 */
+		if (csv) {
+			if (dtp->dt_pfbuf_len == prefix)
+				dtp->dt_pfbuf_len = 0;
+			goto out;
+		}
+
+		if (dt_pfbuf_write(dtp, "]", 1) != 0)
+			return -1;
+		break;
+	case DTRACEAGG_AVG: {
+		const int64_t	*data = (const int64_t *)addr;
+
+		if (dt_obuf_key(dtp, "value") != 0 ||
+		    dt_obuf_int(dtp, data[0] ? data[1] / (int64_t)normal /
+					       data[0] : 0) != 0)
+			return -1;
+		break;
+	}
+	case DTRACEAGG_STDDEV: {
+		uint64_t	*data = (uint64_t *)addr;
+
+		if (dt_obuf_key(dtp, "value") != 0 ||
+		    dt_pfbuf_dec(dtp, data[0] ? dt_stddev(data, normal) : 0,
+				0) != 0)
+			return -1;
+		break;
+	}
+	default:
+		if (dt_obuf_key(dtp, "value") != 0)
+			return -1;
+
+		if (rec->dtrd_size == sizeof(uint64_t))
+			rval = dt_obuf_int(dtp, *(int64_t *)addr /
+						(int64_t)normal);
+		else
+			rval = dt_oformat_value(dtp, rec, addr);
+		if (rval != 0)
+			return -1;
+	}
+
+	if (dt_obuf_puts(dtp, csv ? "\n" : "}\n") != 0)
+		return -1;
+
+out:
+	if (!pd->dtpa_allunprint)
+		agg->dtagd_flags |= DTRACE_AGD_PRINTED;
+
+	return dt_pfbuf_flush(dtp, pd->dtpa_fp);
+}
@@ -0,0 +1,31 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#ifndef	_DT_OFORMAT_H
+#define	_DT_OFORMAT_H
+
+#include <stdio.h>
+
+#include <dt_impl.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+extern int dt_oformat_enabled(dtrace_hdl_t *);
+extern int dt_oformat_probe(dtrace_hdl_t *, const dtrace_probedata_t *);
+extern int dt_oformat_datum(dtrace_hdl_t *, FILE *, const dtrace_probedata_t *,
+			    const dtrace_recdesc_t *, uint_t, const void *,
+			    size_t);
+extern int dt_oformat_end(dtrace_hdl_t *, FILE *);
+extern int dt_oformat_agg(const dtrace_aggdata_t *, void *);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _DT_OFORMAT_H */
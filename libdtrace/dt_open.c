@@ -37,6 +37,10 @@
 #include <dt_provider.h>
 #include <dt_probe.h>
 #include <dt_peb.h>
+#include <dt_ringbuf.h>
+#include <dt_btf.h>
+#include <dt_tracefile.h>
+#include <dt_writer.h>
 
 const dt_version_t _dtrace_versions[] = {
 	DT_VERS_1_0,	/* D API 1.0.0 (PSARC 2001/466) Solaris 10 FCS */
@@ -57,18 +61,6 @@ const dt_version_t _dtrace_versions[] = {
 	0
 };
 
-/*
- * List of provider modules that register providers and probes.  A single
- * provider module may create multiple providers.
- */
-static const dt_provimpl_t *dt_providers[] = {
-	&dt_dtrace,
-	&dt_fbt,
-	&dt_profile,
-	&dt_sdt,
-	&dt_syscall,
-};
-
 /*
  * Table of global identifiers.  This is used to populate the global identifier
  * hash when a new dtrace client open occurs.  For more info see dt_ident.h.
@@ -601,6 +593,8 @@ static const char *_dtrace_defld = "ld";   /* default ld(1) to invoke */
 static const char *_dtrace_defproc = "/proc";   /* default /proc path */
 static const char *_dtrace_defsysslice = ":/system.slice/"; /* default systemd
 							       system slice */
+static const char *_dtrace_defpcachedir = "/var/cache/dtrace"; /* default probe
+								 cache dir */
 
 static const char *_dtrace_libdir = DTRACE_LIBDIR;  /* default library directory */
 
@@ -610,6 +604,8 @@ uint_t _dtrace_stkindent = 14;	/* default whitespace indent for stack/ustack */
 uint_t _dtrace_pidbuckets = 64; /* default number of pid hash buckets */
 uint_t _dtrace_pidlrulim = 8;	/* default number of pid handles to cache */
 size_t _dtrace_bufsize = 512;	/* default dt_buf_create() size */
+size_t _dtrace_aggsize = 4 * 1024 * 1024; /* default aggregation map size */
+size_t _dtrace_dynvarsize = 1024 * 1024; /* default dynamic variable map size */
 int _dtrace_argmax = 32;	/* default maximum number of probe arguments */
 
 const char *const _dtrace_version = DT_VERS_STRING; /* API version string */
@@ -730,6 +726,7 @@ dt_vopen(int version, int flags, int *errp,
 	dtp->dt_ddefs_fd = -1;
 	dtp->dt_stdout_fd = -1;
 	dtp->dt_poll_fd = -1;
+	dtp->dt_bpfstats_fd = -1;
 	dtp->dt_modbuckets = _dtrace_strbuckets;
 	dtp->dt_mods = calloc(dtp->dt_modbuckets, sizeof (dt_module_t *));
 	dtp->dt_kernpathbuckets = _dtrace_strbuckets;
@@ -747,6 +744,7 @@ dt_vopen(int version, int flags, int *errp,
 	dtp->dt_ld_path = strdup(_dtrace_defld);
 	Pset_procfs_path(_dtrace_defproc);
 	dtp->dt_sysslice = strdup(_dtrace_defsysslice);
+	dtp->dt_pcachedir = strdup(_dtrace_defpcachedir);
 	dtp->dt_useruid = DTRACE_USER_UID;
 	dtp->dt_vector = vector;
 	dtp->dt_varg = arg;
@@ -770,7 +768,8 @@ dt_vopen(int version, int flags, int *errp,
 	if (dtp->dt_mods == NULL || dtp->dt_kernpaths == NULL || 
 	    dtp->dt_provs == NULL || dtp->dt_procs == NULL ||
 	    dtp->dt_ld_path == NULL || dtp->dt_cpp_path == NULL ||
-	    dtp->dt_cpp_argv == NULL || dtp->dt_sysslice == NULL)
+	    dtp->dt_cpp_argv == NULL || dtp->dt_sysslice == NULL ||
+	    dtp->dt_pcachedir == NULL)
 		return (set_open_errno(dtp, errp, EDT_NOMEM));
 
 	for (i = 0; i < DTRACEOPT_MAX; i++)
@@ -1097,16 +1096,10 @@ dt_vopen(int version, int flags, int *errp,
 
 	/*
 	 * Initialize the collection of probes that is made available by the
-	 * known providers.
+	 * known providers.  Providers are populated on demand, when a probe
+	 * description that may match their probes is first looked up.
 	 */
 	dt_probe_init(dtp);
-	for (i = 0; i < ARRAY_SIZE(dt_providers); i++) {
-		int n;
-
-		n = dt_providers[i]->populate(dtp);
-		dt_dprintf("loaded %d probes for %s\n", n,
-			   dt_providers[i]->name);
-	}
 
 	/*
 	 * Load hard-wired inlines into the definition cache by calling the
@@ -1220,12 +1213,20 @@ dtrace_close(dtrace_hdl_t *dtp)
 		close(dtp->dt_stdout_fd);
 	if (dtp->dt_poll_fd != -1)
 		close(dtp->dt_poll_fd);
+	if (dtp->dt_bpfstats_fd != -1)
+		close(dtp->dt_bpfstats_fd);
 
 	dt_epid_destroy(dtp);
 	dt_aggid_destroy(dtp);
 	dt_buffered_destroy(dtp);
 	dt_aggregate_destroy(dtp);
+	dt_consume_exit(dtp);
+	dt_tracefile_close(dtp);
+	dt_writer_fini(dtp);
 	dt_pebs_exit(dtp);
+	dt_ringbuf_exit(dtp);
+	dt_btf_destroy(dtp, dtp->dt_btf);
+	dt_free(dtp, dtp->dt_cpustats);
 	dt_pfdict_destroy(dtp);
 	dt_dof_fini(dtp);
 	dt_probe_fini(dtp);
@@ -1246,9 +1247,11 @@ dtrace_close(dtrace_hdl_t *dtp)
 	free(dtp->dt_cpp_path);
 	free(dtp->dt_ld_path);
 	free(dtp->dt_sysslice);
+	free(dtp->dt_pcachedir);
 
 	free(dtp->dt_freopen_filename);
 	free(dtp->dt_sprintf_buf);
+	free(dtp->dt_pfbuf);
 	pthread_mutex_destroy(&dtp->dt_sprintf_lock);
 
 	elf_end(dtp->dt_ctf_elf);
@@ -507,6 +507,27 @@ dt_opt_syslibdir(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
 	return (0);
 }
 
+/*ARGSUSED*/
+static int
+dt_opt_pcachedir(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
+{
+	char *dir;
+
+	/*
+	 * An empty directory name disables the probe cache.
+	 */
+	if (arg == NULL)
+		return (dt_set_errno(dtp, EDT_BADOPTVAL));
+
+	if ((dir = strdup(arg)) == NULL)
+		return (dt_set_errno(dtp, EDT_NOMEM));
+
+	free(dtp->dt_pcachedir);
+	dtp->dt_pcachedir = dir;
+
+	return (0);
+}
+
 /*ARGSUSED*/
 static int
 dt_opt_sysslice(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
@@ -941,6 +962,119 @@ dt_opt_bufresize(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
 	return (0);
 }
 
+static const struct {
+	const char *dtbb_name;
+	int dtbb_backend;
+} _dtrace_bufbackends[] = {
+	{ "auto", DTRACEOPT_BUFBACKEND_AUTO },
+	{ "perf", DTRACEOPT_BUFBACKEND_PERF },
+	{ "ringbuf", DTRACEOPT_BUFBACKEND_RINGBUF },
+	{ NULL, 0 }
+};
+
+/*ARGSUSED*/
+static int
+dt_opt_bufbackend(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
+{
+	dtrace_optval_t backend = DTRACEOPT_UNSET;
+	int i;
+
+	if (arg == NULL)
+		return (dt_set_errno(dtp, EDT_BADOPTVAL));
+
+	for (i = 0; _dtrace_bufbackends[i].dtbb_name != NULL; i++) {
+		if (strcmp(_dtrace_bufbackends[i].dtbb_name, arg) == 0) {
+			backend = _dtrace_bufbackends[i].dtbb_backend;
+			break;
+		}
+	}
+
+	if (backend == DTRACEOPT_UNSET)
+		return (dt_set_errno(dtp, EDT_BADOPTVAL));
+
+	dtp->dt_options[DTRACEOPT_BUFBACKEND] = backend;
+
+	return (0);
+}
+
+static const struct {
+	const char *dtof_name;
+	int dtof_format;
+} _dtrace_oformats[] = {
+	{ "text", DTRACEOPT_OFORMAT_TEXT },
+	{ "json", DTRACEOPT_OFORMAT_JSON },
+	{ "csv", DTRACEOPT_OFORMAT_CSV },
+	{ NULL, 0 }
+};
+
+/*ARGSUSED*/
+static int
+dt_opt_oformat(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
+{
+	dtrace_optval_t format = DTRACEOPT_UNSET;
+	int i;
+
+	if (arg == NULL)
+		return (dt_set_errno(dtp, EDT_BADOPTVAL));
+
+	for (i = 0; _dtrace_oformats[i].dtof_name != NULL; i++) {
+		if (strcmp(_dtrace_oformats[i].dtof_name, arg) == 0) {
+			format = _dtrace_oformats[i].dtof_format;
+			break;
+		}
+	}
+
+	if (format == DTRACEOPT_UNSET)
+		return (dt_set_errno(dtp, EDT_BADOPTVAL));
+
+	dtp->dt_options[DTRACEOPT_OFORMAT] = format;
+
+	/*
+	 * Structured output cannot be mixed with the default output for probe
+	 * firings, so it implies the quiet option.
+	 */
+	if (format != DTRACEOPT_OFORMAT_TEXT)
+		dtp->dt_options[DTRACEOPT_QUIET] = 0;
+
+	return (0);
+}
+
+static const struct {
+	const char *dtwk_name;
+	int dtwk_policy;
+} _dtrace_wakeups[] = {
+	{ "adaptive", DTRACEOPT_WAKEUP_ADAPTIVE },
+	{ "events", DTRACEOPT_WAKEUP_EVENTS },
+	{ "watermark", DTRACEOPT_WAKEUP_WATERMARK },
+	{ "timer", DTRACEOPT_WAKEUP_TIMER },
+	{ NULL, 0 }
+};
+
+/*ARGSUSED*/
+static int
+dt_opt_wakeup(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
+{
+	dtrace_optval_t policy = DTRACEOPT_UNSET;
+	int i;
+
+	if (arg == NULL)
+		return (dt_set_errno(dtp, EDT_BADOPTVAL));
+
+	for (i = 0; _dtrace_wakeups[i].dtwk_name != NULL; i++) {
+		if (strcmp(_dtrace_wakeups[i].dtwk_name, arg) == 0) {
+			policy = _dtrace_wakeups[i].dtwk_policy;
+			break;
+		}
+	}
+
+	if (policy == DTRACEOPT_UNSET)
+		return (dt_set_errno(dtp, EDT_BADOPTVAL));
+
+	dtp->dt_options[DTRACEOPT_WAKEUP] = policy;
+
+	return (0);
+}
+
 int
 dt_options_load(dtrace_hdl_t *dtp)
 {
@@ -1034,6 +1168,7 @@ typedef struct dt_option {
  * Compile-time options.
  */
 static const dt_option_t _dtrace_ctoptions[] = {
+	{ "aggdbuf", dt_opt_agg, DTRACE_A_DBUF },
 	{ "aggpercpu", dt_opt_agg, DTRACE_A_PERCPU },
 	{ "amin", dt_opt_amin },
 	{ "argref", dt_opt_cflags, DTRACE_C_ARGREF },
@@ -1066,6 +1201,8 @@ static const dt_option_t _dtrace_ctoptions[] = {
 	{ "linktype", dt_opt_linktype },
 	{ "modpath", dt_opt_module_path },
 	{ "nolibs", dt_opt_cflags, DTRACE_C_NOLIBS },
+	{ "noopt", dt_opt_cflags, DTRACE_C_NOOPT },
+	{ "pcachedir", dt_opt_pcachedir },
 	{ "pgmax", dt_opt_pgmax },
 	{ "preallocate", dt_opt_preallocate },
 	{ "procfspath", dt_opt_procfs_path },
@@ -1091,24 +1228,36 @@ static const dt_option_t _dtrace_ctoptions[] = {
  */
 static const dt_option_t _dtrace_rtoptions[] = {
 	{ "aggsize", dt_opt_size, DTRACEOPT_AGGSIZE },
+	{ "bufbackend", dt_opt_bufbackend, DTRACEOPT_BUFBACKEND },
 	{ "bufsize", dt_opt_size, DTRACEOPT_BUFSIZE },
 	{ "bufpolicy", dt_opt_bufpolicy, DTRACEOPT_BUFPOLICY },
 	{ "bufresize", dt_opt_bufresize, DTRACEOPT_BUFRESIZE },
 	{ "cleanrate", dt_opt_rate, DTRACEOPT_CLEANRATE },
+	{ "consumethreads", dt_opt_runtime, DTRACEOPT_CONSUMETHREADS },
 	{ "cpu", dt_opt_runtime, DTRACEOPT_CPU },
 	{ "destructive", dt_opt_runtime, DTRACEOPT_DESTRUCTIVE },
 	{ "dynvarsize", dt_opt_size, DTRACEOPT_DYNVARSIZE },
 	{ "grabanon", dt_opt_runtime, DTRACEOPT_GRABANON },
 	{ "jstackframes", dt_opt_runtime, DTRACEOPT_JSTACKFRAMES },
 	{ "jstackstrsize", dt_opt_size, DTRACEOPT_JSTACKSTRSIZE },
+	{ "loadthreads", dt_opt_runtime, DTRACEOPT_LOADTHREADS },
 	{ "nspec", dt_opt_runtime, DTRACEOPT_NSPEC },
+	{ "oformat", dt_opt_oformat, DTRACEOPT_OFORMAT },
 	{ "pcapsize", dt_opt_pcapsize, DTRACEOPT_PCAPSIZE },
 	{ "specsize", dt_opt_size, DTRACEOPT_SPECSIZE },
 	{ "stackframes", dt_opt_runtime, DTRACEOPT_STACKFRAMES },
+	{ "stats", dt_opt_runtime, DTRACEOPT_STATS },
 	{ "statusrate", dt_opt_rate, DTRACEOPT_STATUSRATE },
 	{ "strsize", dt_opt_strsize, DTRACEOPT_STRSIZE },
+	{ "tailrelease", dt_opt_size, DTRACEOPT_TAILRELEASE },
 	{ "ustackframes", dt_opt_runtime, DTRACEOPT_USTACKFRAMES },
 	{ "noresolve", dt_opt_runtime, DTRACEOPT_NORESOLVE },
+	{ "outbatch", dt_opt_size, DTRACEOPT_OUTBATCH },
+	{ "outqueue", dt_opt_runtime, DTRACEOPT_OUTQUEUE },
+	{ "unordered", dt_opt_runtime, DTRACEOPT_UNORDERED },
+	{ "wakeup", dt_opt_wakeup, DTRACEOPT_WAKEUP },
+	{ "wakeupevents", dt_opt_runtime, DTRACEOPT_WAKEUPEVENTS },
+	{ "wakeupwmark", dt_opt_size, DTRACEOPT_WAKEUPWMARK },
 	{ NULL }
 };
 
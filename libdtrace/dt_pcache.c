@@ -0,0 +1,385 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+/*
+ * Probe catalog cache.
+ *
+ * Populating the fbt and syscall providers involves reading tens of thousands
+ * of lines from tracefs, and (for fbt) looking up the module of many kernel
+ * functions in the kernel symbol table.  The result only changes when the
+ * kernel or the set of loaded modules changes, so we store the probe
+ * descriptions that a provider registered in a cache file, and use that file
+ * instead of scanning tracefs as long as the system has not changed.
+ *
+ * The cache must only be used by providers whose probes are fully determined
+ * by the key: the sdt provider does not use it, because tracepoint events can
+ * also be created at runtime (user_events, synthetic events).
+ *
+ * All errors are silently ignored: if the cache cannot be used, providers
+ * simply fall back to discovering their probes the regular way.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dt_impl.h>
+#include <dt_pcache.h>
+#include <dt_strtab.h>
+
+#define KERNEL_NOTES	"/sys/kernel/notes"
+#define BOOT_ID		"/proc/sys/kernel/random/boot_id"
+#define MODULE_LIST	"/proc/modules"
+
+/*
+ * Retrieve the build id of the running kernel from its ELF notes.
+ */
+static int
+dt_pcache_buildid(dt_pcache_hdr_t *hdr)
+{
+	char		buf[4096];
+	char		*p, *end;
+	ssize_t		len;
+	int		fd;
+
+	fd = open(KERNEL_NOTES, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (len <= 0)
+		return -1;
+
+	p = buf;
+	end = buf + len;
+	while (p + sizeof(Elf64_Nhdr) <= end) {
+		Elf64_Nhdr	nhdr;
+		const char	*name, *desc;
+
+		memcpy(&nhdr, p, sizeof(nhdr));
+		name = p + sizeof(nhdr);
+		desc = name + ((nhdr.n_namesz + 3) & ~3);
+		p = (char *)desc + ((nhdr.n_descsz + 3) & ~3);
+		if (p > end)
+			break;
+
+		if (nhdr.n_type != NT_GNU_BUILD_ID || nhdr.n_namesz != 4 ||
+		    memcmp(name, "GNU", 4) != 0)
+			continue;
+		if (nhdr.n_descsz == 0 ||
+		    nhdr.n_descsz > DT_PCACHE_BUILDIDLEN)
+			break;
+
+		memcpy(hdr->buildid, desc, nhdr.n_descsz);
+		hdr->buildidsz = nhdr.n_descsz;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static int
+dt_pcache_bootid(dt_pcache_hdr_t *hdr)
+{
+	FILE	*f;
+	char	*p;
+
+	f = fopen(BOOT_ID, "r");
+	if (f == NULL)
+		return -1;
+
+	p = fgets(hdr->bootid, sizeof(hdr->bootid), f);
+	fclose(f);
+	if (p == NULL)
+		return -1;
+
+	p = strchr(hdr->bootid, '\n');
+	if (p)
+		*p = '\0';
+
+	return 0;
+}
+
+static uint64_t
+dt_pcache_hash(uint64_t h, const char *s)
+{
+	do {
+		h ^= (unsigned char)*s;
+		h *= 0x100000001b3ULL;
+	} while (*s++);
+
+	return h;
+}
+
+/*
+ * Compute a hash over the names, sizes, and load addresses of all loaded
+ * kernel modules.  The reference counts and states are ignored because they
+ * change without affecting the available probes.
+ */
+static int
+dt_pcache_modhash(dt_pcache_hdr_t *hdr)
+{
+	FILE		*f;
+	char		buf[1024];
+	char		name[256], size[32], addr[32];
+	uint64_t	h = 0xcbf29ce484222325ULL;
+
+	f = fopen(MODULE_LIST, "r");
+	if (f == NULL)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		if (sscanf(buf, "%255s %31s %*s %*s %*s %31s",
+			   name, size, addr) != 3)
+			continue;
+
+		h = dt_pcache_hash(h, name);
+		h = dt_pcache_hash(h, size);
+		h = dt_pcache_hash(h, addr);
+	}
+
+	fclose(f);
+	hdr->modhash = h;
+
+	return 0;
+}
+
+/*
+ * Fill in the header that a valid cache file for the given provider would
+ * have on the running system.
+ */
+static int
+dt_pcache_key(dtrace_hdl_t *dtp, const dt_provider_t *prov,
+	      dt_pcache_hdr_t *hdr)
+{
+	if (dtp->dt_pcachedir == NULL || dtp->dt_pcachedir[0] == '\0')
+		return -1;
+
+	memset(hdr, 0, sizeof(dt_pcache_hdr_t));
+	memcpy(hdr->magic, DT_PCACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = DT_PCACHE_VERSION;
+	strlcpy(hdr->prv, prov->desc.dtvd_name, sizeof(hdr->prv));
+
+	if (dt_pcache_buildid(hdr) == -1 || dt_pcache_bootid(hdr) == -1 ||
+	    dt_pcache_modhash(hdr) == -1)
+		return -1;
+
+	return 0;
+}
+
+static char *
+dt_pcache_path(dtrace_hdl_t *dtp, const dt_provider_t *prov)
+{
+	char	*fn;
+
+	if (asprintf(&fn, "%s/%s.pcache", dtp->dt_pcachedir,
+		     prov->desc.dtvd_name) < 0)
+		return NULL;
+
+	return fn;
+}
+
+/*
+ * Register the probes of the given provider from its cache file, using 'func'
+ * to create the probes.  Returns the number of probes that were created, or
+ * -1 if there is no valid cache file for the provider (in which case no probes
+ * were created).
+ */
+int
+dt_pcache_restore(dtrace_hdl_t *dtp, dt_provider_t *prov,
+		  dt_pcache_insert_f *func)
+{
+	dt_pcache_hdr_t		key;
+	const dt_pcache_hdr_t	*hdr;
+	const dt_pcache_rec_t	*rec;
+	const char		*strs;
+	char			*fn;
+	struct stat		st;
+	void			*map;
+	uint32_t		i;
+	int			fd, n = -1;
+
+	if (dt_pcache_key(dtp, prov, &key) == -1)
+		return -1;
+
+	fn = dt_pcache_path(dtp, prov);
+	if (fn == NULL)
+		return -1;
+
+	fd = open(fn, O_RDONLY | O_CLOEXEC);
+	free(fn);
+	if (fd == -1)
+		return -1;
+
+	/*
+	 * Only trust cache files that were written by us or by root, and that
+	 * cannot have been modified by anyone else.
+	 */
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (st.st_uid != 0 && st.st_uid != geteuid()) ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    st.st_size < (off_t)sizeof(dt_pcache_hdr_t)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (memcmp(hdr->magic, key.magic, sizeof(key.magic)) != 0 ||
+	    hdr->version != key.version ||
+	    hdr->buildidsz != key.buildidsz ||
+	    memcmp(hdr->buildid, key.buildid, key.buildidsz) != 0 ||
+	    strncmp(hdr->bootid, key.bootid, sizeof(key.bootid)) != 0 ||
+	    strncmp(hdr->prv, key.prv, sizeof(key.prv)) != 0 ||
+	    hdr->modhash != key.modhash) {
+		dt_dprintf("probe cache for %s is stale\n", key.prv);
+		goto out;
+	}
+
+	if (hdr->strsz == 0 ||
+	    st.st_size != (off_t)(sizeof(dt_pcache_hdr_t) +
+				  (size_t)hdr->nprobes *
+				  sizeof(dt_pcache_rec_t) + hdr->strsz))
+		goto out;
+
+	rec = (const dt_pcache_rec_t *)(hdr + 1);
+	strs = (const char *)(rec + hdr->nprobes);
+	if (strs[hdr->strsz - 1] != '\0')
+		goto out;
+
+	/* Validate all records before creating any probes. */
+	for (i = 0; i < hdr->nprobes; i++) {
+		if (rec[i].mod >= hdr->strsz || rec[i].fun >= hdr->strsz ||
+		    rec[i].prb >= hdr->strsz)
+			goto out;
+	}
+
+	for (i = 0, n = 0; i < hdr->nprobes; i++) {
+		if (func(dtp, prov, prov->desc.dtvd_name, strs + rec[i].mod,
+			 strs + rec[i].fun, strs + rec[i].prb))
+			n++;
+	}
+
+	dt_dprintf("restored %d probes for %s from cache\n", n, key.prv);
+
+out:
+	munmap(map, st.st_size);
+
+	return n;
+}
+
+/*
+ * Write a cache file for the given provider, containing all probes that are
+ * currently registered for it.  The file is written under a temporary name
+ * and then renamed, so that concurrent readers never see a partial file.
+ */
+void
+dt_pcache_save(dtrace_hdl_t *dtp, const dt_provider_t *prov)
+{
+	dt_pcache_hdr_t	hdr;
+	dt_pcache_rec_t	*recs;
+	dt_strtab_t	*stab;
+	char		*fn = NULL, *tmp = NULL;
+	char		*buf = NULL, *p;
+	size_t		size;
+	ssize_t		len;
+	uint32_t	i, n = 0;
+	int		fd;
+
+	if (dt_pcache_key(dtp, prov, &hdr) == -1)
+		return;
+
+	recs = dt_calloc(dtp, dtp->dt_probe_id, sizeof(dt_pcache_rec_t));
+	if (recs == NULL)
+		return;
+
+	stab = dt_strtab_create(BUFSIZ);
+	if (stab == NULL)
+		goto out;
+
+	for (i = 0; i < dtp->dt_probe_id; i++) {
+		const dt_probe_t	*prp = dtp->dt_probes[i];
+		ssize_t			mod, fun, prb;
+
+		if (prp == NULL || prp->prov != prov)
+			continue;
+
+		mod = dt_strtab_insert(stab, prp->desc->mod);
+		fun = dt_strtab_insert(stab, prp->desc->fun);
+		prb = dt_strtab_insert(stab, prp->desc->prb);
+		if (mod == -1 || fun == -1 || prb == -1)
+			goto out;
+
+		recs[n].mod = mod;
+		recs[n].fun = fun;
+		recs[n].prb = prb;
+		n++;
+	}
+
+	hdr.nprobes = n;
+	hdr.strsz = dt_strtab_size(stab);
+
+	size = sizeof(hdr) + n * sizeof(dt_pcache_rec_t) + hdr.strsz;
+	buf = dt_alloc(dtp, size);
+	if (buf == NULL)
+		goto out;
+
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), recs, n * sizeof(dt_pcache_rec_t));
+	dt_strtab_write(stab, (dt_strtab_write_f *)dt_strtab_copystr,
+			buf + sizeof(hdr) + n * sizeof(dt_pcache_rec_t));
+
+	fn = dt_pcache_path(dtp, prov);
+	if (fn == NULL)
+		goto out;
+	if (asprintf(&tmp, "%s.XXXXXX", fn) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+
+	if (mkdir(dtp->dt_pcachedir, 0755) == -1 && errno != EEXIST)
+		goto out;
+
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		goto out;
+
+	fchmod(fd, 0644);
+	for (p = buf; size > 0; p += len, size -= len) {
+		len = write(fd, p, size);
+		if (len < 0 && errno == EINTR)
+			len = 0;
+		else if (len <= 0)
+			break;
+	}
+
+	if (close(fd) == -1 || size > 0 || rename(tmp, fn) == -1) {
+		dt_dprintf("failed to write probe cache %s\n", fn);
+		unlink(tmp);
+	} else
+		dt_dprintf("saved %u probes for %s to cache\n", n, hdr.prv);
+
+out:
+	free(tmp);
+	free(fn);
+	dt_free(dtp, buf);
+	if (stab != NULL)
+		dt_strtab_destroy(stab);
+	dt_free(dtp, recs);
+}
@@ -0,0 +1,72 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#ifndef	_DT_PCACHE_H
+#define	_DT_PCACHE_H
+
+#include <stdint.h>
+
+#include <dt_impl.h>
+#include <dt_provider.h>
+#include <dt_probe.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * The probe catalog cache stores the probes that a provider discovered while
+ * populating, so that later dtrace invocations on the same kernel can skip the
+ * (expensive) scanning of tracefs and kernel symbols.
+ *
+ * A cache file (<pcachedir>/<provider>.pcache) consists of a header, followed
+ * by an array of fixed-size probe records, followed by a string pool.  The
+ * probe records refer to their module, function, and probe names by offset
+ * into the string pool.  The header records the kernel build id, the boot id,
+ * and a hash of the list of loaded kernel modules.  A cache file is only used
+ * if all of them match the running system.
+ */
+#define DT_PCACHE_MAGIC		"DTPCACHE"
+#define DT_PCACHE_VERSION	1
+#define DT_PCACHE_BUILDIDLEN	64
+#define DT_PCACHE_BOOTIDLEN	40
+
+typedef struct dt_pcache_hdr {
+	char		magic[8];			/* DT_PCACHE_MAGIC */
+	uint32_t	version;			/* DT_PCACHE_VERSION */
+	uint32_t	nprobes;			/* number of records */
+	uint32_t	strsz;				/* string pool size */
+	uint32_t	buildidsz;			/* kernel build id size */
+	uint8_t		buildid[DT_PCACHE_BUILDIDLEN];	/* kernel build id */
+	char		bootid[DT_PCACHE_BOOTIDLEN];	/* boot id */
+	char		prv[DTRACE_PROVNAMELEN];	/* provider name */
+	uint64_t	modhash;			/* loaded module hash */
+} dt_pcache_hdr_t;
+
+typedef struct dt_pcache_rec {
+	uint32_t	mod;				/* module name */
+	uint32_t	fun;				/* function name */
+	uint32_t	prb;				/* probe name */
+} dt_pcache_rec_t;
+
+/*
+ * Function to create a probe from a cache record.  This has the same
+ * signature as tp_probe_insert().
+ */
+typedef dt_probe_t *dt_pcache_insert_f(dtrace_hdl_t *dtp, dt_provider_t *prov,
+				       const char *prv, const char *mod,
+				       const char *fun, const char *prb);
+
+extern int dt_pcache_restore(dtrace_hdl_t *dtp, dt_provider_t *prov,
+			     dt_pcache_insert_f *func);
+extern void dt_pcache_save(dtrace_hdl_t *dtp, const dt_provider_t *prov);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _DT_PCACHE_H */
@@ -10,6 +10,8 @@
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 #include <linux/perf_event.h>
 
 #include <dt_impl.h>
@@ -42,15 +44,12 @@ roundup_pow2(uint64_t n)
 static void
 dt_peb_close(dt_peb_t *peb)
 {
-	dt_pebset_t	*pebs;
-
 	if (peb == NULL || peb->dtp == NULL || peb->fd == -1)
 		return;
 
 	ioctl(peb->fd, PERF_EVENT_IOC_DISABLE, 0);
 
-	pebs = peb->dtp->dt_pebset;
-	munmap(peb->base, pebs->page_size + pebs->data_size);
+	munmap(peb->base, peb->endp - peb->base + 1);
 
 	close(peb->fd);
 
@@ -58,6 +57,53 @@ dt_peb_close(dt_peb_t *peb)
 	peb->fd = -1;
 }
 
+/*
+ * Configure when the consumer gets woken up to read data from a perf event
+ * buffer, based on the wakeup policy:
+ *
+ * - adaptive:	Wake up for every event.  The consumer itself stops waiting
+ *		for wakeups while the event rate is high (see dtrace_consume()).
+ *		The wakeup settings of a perf event cannot be changed once it
+ *		is open, so the kernel keeps signalling every event.
+ * - events:	Wake up for every wakeupevents events (default 1).  This is the
+ *		default policy.
+ * - watermark:	Wake up when wakeupwmark bytes of data are available (default
+ *		half the buffer size).
+ * - timer:	Data is consumed at the switch rate.  The consumer only gets
+ *		woken up when the buffer is three quarters full, to avoid
+ *		losing data.
+ */
+static void
+dt_peb_wakeup(dtrace_hdl_t *dtp, struct perf_event_attr *attr)
+{
+	dtrace_optval_t	val;
+	size_t		size = dtp->dt_pebset->data_size;
+
+	switch (dtp->dt_options[DTRACEOPT_WAKEUP]) {
+	case DTRACEOPT_WAKEUP_EVENTS:
+		val = dtp->dt_options[DTRACEOPT_WAKEUPEVENTS];
+		if (val == DTRACEOPT_UNSET || val < 1)
+			val = 1;
+
+		attr->wakeup_events = val;
+		break;
+	case DTRACEOPT_WAKEUP_WATERMARK:
+		val = dtp->dt_options[DTRACEOPT_WAKEUPWMARK];
+		if (val == DTRACEOPT_UNSET)
+			val = size / 2;
+
+		attr->watermark = 1;
+		attr->wakeup_watermark = MIN((size_t)val, size);
+		break;
+	case DTRACEOPT_WAKEUP_TIMER:
+		attr->watermark = 1;
+		attr->wakeup_watermark = size / 4 * 3;
+		break;
+	default:
+		attr->wakeup_events = 1;
+	}
+}
+
 /*
  * Set up a perf event buffer.
  */
@@ -75,9 +121,13 @@ dt_peb_open(dt_peb_t *peb)
 	memset(&attr, 0, sizeof(attr));
 	attr.config = PERF_COUNT_SW_BPF_OUTPUT;
 	attr.type = PERF_TYPE_SOFTWARE;
-	attr.sample_type = PERF_SAMPLE_RAW;
+	attr.sample_type = pebs->sample_type;
 	attr.sample_period = 1;
-	attr.wakeup_events = 1;
+	if (attr.sample_type & PERF_SAMPLE_TIME) {
+		attr.use_clockid = 1;
+		attr.clockid = CLOCK_MONOTONIC;
+	}
+	dt_peb_wakeup(peb->dtp, &attr);
 	fd = perf_event_open(&attr, -1, peb->cpu, -1, PERF_FLAG_FD_CLOEXEC);
 	if (fd < 0)
 		goto fail;
@@ -115,20 +165,32 @@ fail:
 }
 
 /*
- * Perform cleanup of the perf event buffers.
+ * Close and free an array of perf event buffers (one per online CPU).
  */
 void
-dt_pebs_exit(dtrace_hdl_t *dtp)
+dt_pebs_free(dtrace_hdl_t *dtp, dt_peb_t *pebs)
 {
 	int	i;
 
+	for (i = 0; i < dtp->dt_conf.num_online_cpus; i++) {
+		dt_peb_close(&pebs[i]);
+		free(pebs[i].batch);
+	}
+
+	dt_free(dtp, pebs);
+}
+
+/*
+ * Perform cleanup of the perf event buffers.
+ */
+void
+dt_pebs_exit(dtrace_hdl_t *dtp)
+{
 	if (dtp->dt_pebset == NULL)
 		return;
 
-	for (i = 0; i < dtp->dt_conf.num_online_cpus; i++)
-		dt_peb_close(&dtp->dt_pebset->pebs[i]);
-
-	dt_free(dtp, dtp->dt_pebset->pebs);
+	dt_pebs_free(dtp, dtp->dt_pebset->pebs);
+	dt_free(dtp, dtp->dt_pebset->tmp);
 	dt_free(dtp, dtp->dt_pebset);
 
 	dtp->dt_pebset = NULL;
@@ -196,6 +258,30 @@ int dt_pebs_init(dtrace_hdl_t *dtp, size_t bufsize)
 	dtp->dt_pebset->page_size = getpagesize();
 	dtp->dt_pebset->data_size = num_pages * dtp->dt_pebset->page_size;
 
+	/*
+	 * When the trace data is consumed by multiple threads, the events are
+	 * timestamped so they can be merged in order (unless the 'unordered'
+	 * option is set).
+	 */
+	dtp->dt_pebset->sample_type = PERF_SAMPLE_RAW;
+	if (dt_consume_ordered(dtp))
+		dtp->dt_pebset->sample_type |= PERF_SAMPLE_TIME;
+
+	/*
+	 * Events that wrap around the end of a buffer are copied into
+	 * contiguous memory before they are processed.  The size of the
+	 * largest event is known, so the copy buffer is allocated here rather
+	 * than in the consumer loop.  (The perf event buffer cannot be mapped
+	 * twice back-to-back instead: the kernel only maps it whole, starting
+	 * with the control page.)
+	 */
+	dtp->dt_pebset->tmp_len = sizeof(struct perf_event_header) +
+				  sizeof(uint64_t) + 2 * sizeof(uint32_t) +
+				  dtp->dt_maxreclen;
+	dtp->dt_pebset->tmp = dt_alloc(dtp, dtp->dt_pebset->tmp_len);
+	if (dtp->dt_pebset->tmp == NULL)
+		goto fail;
+
 	/*
 	 * Initialize a perf event buffer for each online CPU.
 	 */
@@ -242,3 +328,98 @@ fail:
 
 	return -1;
 }
+
+/*
+ * Return the amount of consumed data after which the consumer releases the
+ * space it occupies back to the kernel (the 'tailrelease' option).  Releasing
+ * space while a long batch of events is being processed allows the kernel to
+ * reuse it sooner.  By default, space is released every quarter buffer.
+ */
+size_t
+dt_pebs_release(dtrace_hdl_t *dtp)
+{
+	dtrace_optval_t	val = dtp->dt_options[DTRACEOPT_TAILRELEASE];
+	size_t		size = dtp->dt_pebset->data_size;
+
+	if (val == DTRACEOPT_UNSET)
+		return size / 4;
+
+	return MIN(MAX((size_t)val, 1), size);
+}
+
+/*
+ * Grow the perf event buffers to twice their size.  The new buffers are put
+ * in place (in the 'buffers' BPF map) before the old ones are retired.  BPF
+ * programs that were already running at that point may still be writing to
+ * the old buffers, so we wait for them to complete (dt_bpf_prog_sync()).  If
+ * that fails, records that those programs write after the caller has drained
+ * the old buffers are lost (without being reported as drops).
+ *
+ * The old buffers are returned so that the caller can consume any data that
+ * is left in them before releasing them with dt_pebs_free().  If the buffers
+ * cannot be grown, NULL is returned and the current buffers remain in use.
+ */
+dt_peb_t *
+dt_pebs_grow(dtrace_hdl_t *dtp)
+{
+	dt_pebset_t	*pebset = dtp->dt_pebset;
+	dt_peb_t	*old = pebset->pebs;
+	dt_peb_t	*pebs;
+	dt_ident_t	*idp;
+	int		i, mapfd;
+
+	idp = dt_dlib_get_map(dtp, "buffers");
+	if (idp == NULL || idp->di_id == DT_IDENT_UNDEF)
+		return NULL;
+
+	mapfd = idp->di_id;
+
+	pebs = dt_calloc(dtp, dtp->dt_conf.num_online_cpus,
+			 sizeof(struct dt_peb));
+	if (pebs == NULL)
+		return NULL;
+
+	pebset->data_size *= 2;
+
+	for (i = 0; i < dtp->dt_conf.num_online_cpus; i++) {
+		struct epoll_event	ev;
+		dt_peb_t		*peb = &pebs[i];
+
+		peb->dtp = dtp;
+		peb->cpu = old[i].cpu;
+		peb->fd = -1;
+
+		if (old[i].fd == -1)
+			continue;
+
+		if (dt_peb_open(peb) == -1)
+			goto fail;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = peb;
+		if (epoll_ctl(dtp->dt_poll_fd, EPOLL_CTL_ADD,
+			      peb->fd, &ev) == -1)
+			goto fail;
+	}
+
+	for (i = 0; i < dtp->dt_conf.num_online_cpus; i++) {
+		dt_peb_t	*peb = &pebs[i];
+
+		if (peb->fd != -1)
+			dt_bpf_map_update(mapfd, &peb->cpu, &peb->fd);
+	}
+
+	if (dt_bpf_prog_sync() == -1)
+		dt_dprintf("cannot wait for BPF programs to complete: %s\n",
+			   strerror(errno));
+
+	pebset->pebs = pebs;
+
+	return old;
+
+fail:
+	dt_pebs_free(dtp, pebs);
+	pebset->data_size /= 2;
+
+	return NULL;
+}
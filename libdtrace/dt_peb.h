@@ -26,6 +26,9 @@ typedef struct dt_peb {
 	int		fd;		/* fd of perf output buffer */
 	char		*base;		/* address of buffer */
 	char		*endp;		/* address of end of buffer */
+	char		*batch;		/* events copied out of the buffer */
+	size_t		batch_size;	/* allocated size of the batch */
+	size_t		batch_len;	/* size of the events in the batch */
 } dt_peb_t;
 
 /*
@@ -36,6 +39,9 @@ typedef struct dt_peb {
 typedef struct dt_pebset {
 	size_t		page_size;	/* size of each page in buffer */
 	size_t		data_size;	/* total buffer size */
+	uint64_t	sample_type;	/* perf sample type of the events */
+	int		drop_rounds;	/* consecutive rounds with drops */
+	int		resizes;	/* number of times buffers were grown */
 	struct dt_peb	*pebs;		/* array of perf event buffers */
 	char		*tmp;		/* temporary event buffer */
 	size_t		tmp_len;	/* length of temporary event buffer */
@@ -43,6 +49,9 @@ typedef struct dt_pebset {
 
 extern void dt_pebs_exit(dtrace_hdl_t *);
 extern int dt_pebs_init(dtrace_hdl_t *, size_t);
+extern size_t dt_pebs_release(dtrace_hdl_t *);
+extern dt_peb_t *dt_pebs_grow(dtrace_hdl_t *);
+extern void dt_pebs_free(dtrace_hdl_t *, dt_peb_t *);
 
 #ifdef	__cplusplus
 }
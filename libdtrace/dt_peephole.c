@@ -0,0 +1,854 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+/*
+ * Peephole optimizer for BPF code in IR form.
+ *
+ * The code generator emits instruction sequences that are easy to generate
+ * but often longer than necessary (e.g. loading a constant in a register in
+ * order to add it to another register).  This pass walks the IR list before
+ * it is assembled by dt_as(), and:
+ *
+ *	- applies a table of pattern rewrites (see dt_pp_rules[] below),
+ *	- removes stores to the stack that are overwritten before they can be
+ *	  read,
+ *	- removes redundant loads of the DTrace context pointer (from the stack
+ *	  at DT_STK_DCTX) and of its members, and
+ *	- removes unreachable instructions and jumps to the next instruction.
+ *
+ * Instructions are never moved across labels, so the control flow of the
+ * program is not affected.  Rewrites that make a register value redundant
+ * are only performed if the register is not used afterwards (as determined
+ * by a conservative liveness analysis).
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <dt_impl.h>
+#include <dt_as.h>
+#include <bpf_asm.h>
+
+#define DT_PP_MAXPASS	8		/* maximum number of passes */
+#define DT_PP_BUDGET	256		/* instructions per liveness query */
+#define DT_PP_DSE_MAX	32		/* instructions per dead store scan */
+
+#define DT_PP_DEAD	0xff		/* opcode for removed instructions */
+
+#define DT_PP_REG(r)	(1U << (r))
+#define DT_PP_ARGS	(DT_PP_REG(BPF_REG_1) | DT_PP_REG(BPF_REG_2) | \
+			 DT_PP_REG(BPF_REG_3) | DT_PP_REG(BPF_REG_4) | \
+			 DT_PP_REG(BPF_REG_5))
+
+/*
+ * Values tracked for the redundant load elimination: the DTrace context
+ * pointer, a pointer derived from it by pointer arithmetic, or the value of a
+ * member of the DTrace context.
+ */
+#define DT_PP_DERIVED	(-1)
+#define DT_PP_UNKNOWN	0
+#define DT_PP_DCTX	1
+#define DT_PP_IS_DCTX(v)	((v) == DT_PP_DCTX || (v) == DT_PP_DERIVED)
+#define DT_PP_MEMBER(off)	(2 + (off))
+#define DT_PP_IS_MEMBER(v)	((v) >= 2)
+
+typedef struct dt_pp {
+	dt_irlist_t	*dlp;		/* IR list being optimized */
+	dt_irnode_t	**lbls;		/* label to IR node mapping */
+	int		budget;		/* remaining liveness budget */
+} dt_pp_t;
+
+typedef int dt_pp_rule_f(dt_pp_t *, dt_irnode_t *);
+
+/*
+ * Return whether an IR node does not represent an instruction to execute:
+ * a removed instruction, a label declaration, or the second half of a lddw
+ * instruction.
+ */
+static int
+dt_pp_ignore(const dt_irnode_t *dip)
+{
+	const struct bpf_insn	*in = &dip->di_instr;
+
+	if (in->code == DT_PP_DEAD || in->code == 0)
+		return 1;
+
+	return dip->di_label != DT_LBL_NONE && BPF_IS_NOP(*in);
+}
+
+/*
+ * Return the number of bytes accessed by a memory instruction.
+ */
+static int
+dt_pp_size(const struct bpf_insn *in)
+{
+	switch (BPF_SIZE(in->code)) {
+	case BPF_B:
+		return 1;
+	case BPF_H:
+		return 2;
+	case BPF_W:
+		return 4;
+	default:
+		return 8;
+	}
+}
+
+static int
+dt_pp_is_lddw(const dt_irnode_t *dip)
+{
+	return dip->di_instr.code == (BPF_LD | BPF_IMM | BPF_DW);
+}
+
+/*
+ * Return the instruction that immediately follows the given instruction in
+ * straight-line code, or NULL if there is a label in between (or the next
+ * instruction is labeled).
+ */
+static dt_irnode_t *
+dt_pp_succ(dt_irnode_t *dip)
+{
+	for (dip = dip->di_next; dip != NULL; dip = dip->di_next) {
+		if (dip->di_label != DT_LBL_NONE)
+			return NULL;
+		if (!dt_pp_ignore(dip))
+			return dip;
+	}
+
+	return NULL;
+}
+
+/*
+ * Remove an instruction.  If the instruction is labeled, it is turned into a
+ * label declaration.  Otherwise it is marked as removed, and it will be freed
+ * at the end of the pass.
+ */
+static void
+dt_pp_remove(dt_pp_t *pp, dt_irnode_t *dip)
+{
+	int	lddw = dt_pp_is_lddw(dip);
+
+	dip->di_instr = BPF_NOP();
+	if (dip->di_label == DT_LBL_NONE)
+		dip->di_instr.code = DT_PP_DEAD;
+	dip->di_extern = NULL;
+	pp->dlp->dl_len--;
+
+	if (lddw) {
+		dip = dip->di_next;
+		dip->di_instr.code = DT_PP_DEAD;
+		pp->dlp->dl_len--;
+	}
+}
+
+/*
+ * Free all IR nodes that were marked as removed.
+ */
+static void
+dt_pp_sweep(dt_pp_t *pp)
+{
+	dt_irlist_t	*dlp = pp->dlp;
+	dt_irnode_t	*dip, *nip, *prev = NULL;
+
+	for (dip = dlp->dl_list; dip != NULL; dip = nip) {
+		nip = dip->di_next;
+
+		if (dip->di_label != DT_LBL_NONE ||
+		    dip->di_instr.code != DT_PP_DEAD) {
+			prev = dip;
+			continue;
+		}
+
+		if (prev != NULL)
+			prev->di_next = nip;
+		else
+			dlp->dl_list = nip;
+
+		free(dip);
+	}
+
+	dlp->dl_last = prev;
+}
+
+/*
+ * Determine the registers used and defined by a non-jump instruction.
+ */
+static void
+dt_pp_usedef(const struct bpf_insn *in, uint_t *use, uint_t *def)
+{
+	uint_t	dst = DT_PP_REG(in->dst_reg);
+	uint_t	src = DT_PP_REG(in->src_reg);
+	uint_t	op = BPF_OP(in->code);
+
+	*use = *def = 0;
+
+	switch (BPF_CLASS(in->code)) {
+	case BPF_ALU:
+	case BPF_ALU64:
+		*def = dst;
+		if (op == BPF_NEG || op == BPF_END)
+			*use = dst;
+		else if (BPF_SRC(in->code) == BPF_X)
+			*use = op == BPF_MOV ? src : src | dst;
+		else
+			*use = op == BPF_MOV ? 0 : dst;
+		break;
+	case BPF_LD:
+		if (in->code == (BPF_LD | BPF_IMM | BPF_DW))
+			*def = dst;
+		else
+			*use = -1U;		/* be conservative */
+		break;
+	case BPF_LDX:
+		*use = src;
+		*def = dst;
+		break;
+	case BPF_ST:
+		*use = dst;
+		break;
+	case BPF_STX:
+		*use = dst | src;
+		break;
+	default:
+		*use = -1U;
+	}
+}
+
+/*
+ * Determine whether the value in register 'reg' may be used by any
+ * instruction reachable from the given IR node before the register gets
+ * overwritten.  If no conclusion can be reached within the budget, the
+ * register is considered to be live.
+ */
+static int
+dt_pp_live(dt_pp_t *pp, const dt_irnode_t *dip, int reg)
+{
+	uint_t	bit = DT_PP_REG(reg);
+	uint_t	use, def;
+
+	while (dip != NULL) {
+		const struct bpf_insn	*in = &dip->di_instr;
+
+		if (dt_pp_ignore(dip)) {
+			dip = dip->di_next;
+			continue;
+		}
+
+		if (--pp->budget < 0)
+			return 1;
+
+		if (BPF_CLASS(in->code) == BPF_JMP ||
+		    BPF_CLASS(in->code) == BPF_JMP32) {
+			switch (BPF_OP(in->code)) {
+			case BPF_JA:
+				if (in->off != 0) {
+					dip = pp->lbls[in->off];
+					if (dip == NULL)
+						return 1;
+				} else
+					dip = dip->di_next;
+				continue;
+			case BPF_CALL:
+				/*
+				 * We do not know how many arguments are used,
+				 * so assume all of them are.  The call
+				 * clobbers %r0 - %r5.
+				 */
+				if (bit & DT_PP_ARGS)
+					return 1;
+				if (reg == BPF_REG_0)
+					return 0;
+				dip = dip->di_next;
+				continue;
+			case BPF_EXIT:
+				return reg == BPF_REG_0;
+			default:
+				use = DT_PP_REG(in->dst_reg);
+				if (BPF_SRC(in->code) == BPF_X)
+					use |= DT_PP_REG(in->src_reg);
+				if (use & bit)
+					return 1;
+				if (pp->lbls[in->off] == NULL ||
+				    dt_pp_live(pp, pp->lbls[in->off], reg))
+					return 1;
+				dip = dip->di_next;
+				continue;
+			}
+		}
+
+		dt_pp_usedef(in, &use, &def);
+		if (use & bit)
+			return 1;
+		if (def & bit)
+			return 0;
+
+		dip = dip->di_next;
+	}
+
+	return 0;
+}
+
+static int
+dt_pp_dead_after(dt_pp_t *pp, const dt_irnode_t *dip, int reg)
+{
+	pp->budget = DT_PP_BUDGET;
+
+	return !dt_pp_live(pp, dip->di_next, reg);
+}
+
+/*
+ * Load a 64-bit constant that fits in a 32-bit signed value with a mov.
+ *
+ *	lddw %rX, IMM		becomes		mov %rX, IMM
+ */
+static int
+dt_pp_lddw_mov(dt_pp_t *pp, dt_irnode_t *dip)
+{
+	const struct bpf_insn	*in = &dip->di_instr;
+	dt_irnode_t		*hip = dip->di_next;
+	int64_t			val;
+
+	if (!dt_pp_is_lddw(dip) || in->src_reg != 0 ||
+	    dip->di_extern != NULL || hip->di_label != DT_LBL_NONE)
+		return 0;
+
+	val = (int64_t)(((uint64_t)(uint32_t)hip->di_instr.imm << 32) |
+			(uint32_t)in->imm);
+	if (val != (int32_t)val)
+		return 0;
+
+	dip->di_instr = BPF_MOV_IMM(in->dst_reg, (int32_t)val);
+	hip->di_instr.code = DT_PP_DEAD;
+	pp->dlp->dl_len--;
+
+	return 1;
+}
+
+/*
+ * Use an immediate operand rather than a register that holds a constant.
+ *
+ *	mov %rY, IMM		becomes		op %rX, IMM
+ *	op %rX, %rY
+ */
+static int
+dt_pp_mov_alu(dt_pp_t *pp, dt_irnode_t *dip)
+{
+	const struct bpf_insn	*in = &dip->di_instr;
+	dt_irnode_t		*nip;
+	struct bpf_insn		*nin;
+	uint_t			op;
+
+	if (in->code != (BPF_ALU64 | BPF_MOV | BPF_K) ||
+	    dip->di_extern != NULL || (nip = dt_pp_succ(dip)) == NULL)
+		return 0;
+
+	nin = &nip->di_instr;
+	op = BPF_OP(nin->code);
+	if (BPF_CLASS(nin->code) != BPF_ALU64 || BPF_SRC(nin->code) != BPF_X ||
+	    op == BPF_NEG || op == BPF_END ||
+	    nin->src_reg != in->dst_reg || nin->dst_reg == in->dst_reg)
+		return 0;
+
+	/*
+	 * The verifier rejects division by a zero immediate and out-of-range
+	 * immediate shift counts, whereas the register forms are well-defined
+	 * at runtime.
+	 */
+	if ((op == BPF_DIV || op == BPF_MOD) && in->imm == 0)
+		return 0;
+	if ((op == BPF_LSH || op == BPF_RSH || op == BPF_ARSH) &&
+	    (in->imm < 0 || in->imm >= 64))
+		return 0;
+
+	if (!dt_pp_dead_after(pp, nip, in->dst_reg))
+		return 0;
+
+	dip->di_instr = BPF_ALU64_IMM(op, nin->dst_reg, in->imm);
+	dt_pp_remove(pp, nip);
+
+	return 1;
+}
+
+/*
+ * Store a constant directly rather than through a register.
+ *
+ *	mov %rY, IMM		becomes		st [%rX+OFF], IMM
+ *	stx [%rX+OFF], %rY
+ *
+ * A relocation on the mov instruction can only be retained for 32-bit and
+ * 64-bit stores.
+ */
+static int
+dt_pp_mov_st(dt_pp_t *pp, dt_irnode_t *dip)
+{
+	const struct bpf_insn	*in = &dip->di_instr;
+	dt_irnode_t		*nip;
+	struct bpf_insn		*nin;
+	uint_t			sz;
+
+	if (in->code != (BPF_ALU64 | BPF_MOV | BPF_K) ||
+	    (nip = dt_pp_succ(dip)) == NULL)
+		return 0;
+
+	nin = &nip->di_instr;
+	sz = BPF_SIZE(nin->code);
+	if (BPF_CLASS(nin->code) != BPF_STX || BPF_MODE(nin->code) != BPF_MEM ||
+	    nin->src_reg != in->dst_reg || nin->dst_reg == in->dst_reg ||
+	    (dip->di_extern != NULL && sz != BPF_W && sz != BPF_DW) ||
+	    !dt_pp_dead_after(pp, nip, in->dst_reg))
+		return 0;
+
+	dip->di_instr = BPF_STORE_IMM(sz, nin->dst_reg, nin->off, in->imm);
+	dt_pp_remove(pp, nip);
+
+	return 1;
+}
+
+/*
+ * Fold a constant pointer adjustment into the offset of a memory access.
+ *
+ *	add %rX, IMM		becomes		ldx %rY, [%rX+OFF+IMM]
+ *	ldx %rY, [%rX+OFF]
+ *
+ * (and similar for st and stx.)
+ */
+static int
+dt_pp_add_mem(dt_pp_t *pp, dt_irnode_t *dip)
+{
+	const struct bpf_insn	*in = &dip->di_instr;
+	dt_irnode_t		*nip;
+	struct bpf_insn		nin;
+	int			base, off;
+
+	if (in->code != (BPF_ALU64 | BPF_ADD | BPF_K) ||
+	    dip->di_extern != NULL || (nip = dt_pp_succ(dip)) == NULL)
+		return 0;
+
+	nin = nip->di_instr;
+	if (BPF_MODE(nin.code) != BPF_MEM)
+		return 0;
+
+	switch (BPF_CLASS(nin.code)) {
+	case BPF_LDX:
+		base = nin.src_reg;
+		break;
+	case BPF_STX:
+		if (nin.src_reg == in->dst_reg)
+			return 0;
+		/* fall through */
+	case BPF_ST:
+		base = nin.dst_reg;
+		break;
+	default:
+		return 0;
+	}
+
+	off = nin.off + in->imm;
+	if (base != in->dst_reg || off < INT16_MIN || off > INT16_MAX)
+		return 0;
+
+	/*
+	 * The adjusted pointer must not be used after the memory access
+	 * (unless the load overwrites it).
+	 */
+	if ((BPF_CLASS(nin.code) != BPF_LDX || nin.dst_reg != base) &&
+	    !dt_pp_dead_after(pp, nip, base))
+		return 0;
+
+	nin.off = off;
+	dip->di_instr = nin;
+	dip->di_extern = nip->di_extern;
+	dt_pp_remove(pp, nip);
+
+	return 1;
+}
+
+/*
+ * Remove instructions that have no effect.
+ *
+ *	mov %rX, %rX
+ *	add %rX, 0		(and sub, or, xor, lsh, rsh, arsh)
+ *	mul %rX, 1		(and div)
+ */
+static int
+dt_pp_nop_alu(dt_pp_t *pp, dt_irnode_t *dip)
+{
+	const struct bpf_insn	*in = &dip->di_instr;
+
+	if (BPF_CLASS(in->code) != BPF_ALU64 || dip->di_extern != NULL)
+		return 0;
+
+	if (BPF_SRC(in->code) == BPF_X) {
+		if (BPF_OP(in->code) != BPF_MOV || in->dst_reg != in->src_reg)
+			return 0;
+	} else {
+		switch (BPF_OP(in->code)) {
+		case BPF_ADD:
+		case BPF_SUB:
+		case BPF_OR:
+		case BPF_XOR:
+		case BPF_LSH:
+		case BPF_RSH:
+		case BPF_ARSH:
+			if (in->imm != 0)
+				return 0;
+			break;
+		case BPF_MUL:
+		case BPF_DIV:
+			if (in->imm != 1)
+				return 0;
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	dt_pp_remove(pp, dip);
+
+	return 1;
+}
+
+/*
+ * Remove jumps to the next instruction.
+ */
+static int
+dt_pp_jmp_next(dt_pp_t *pp, dt_irnode_t *dip)
+{
+	const struct bpf_insn	*in = &dip->di_instr;
+	dt_irnode_t		*nip;
+
+	if (BPF_CLASS(in->code) != BPF_JMP ||
+	    BPF_OP(in->code) == BPF_CALL || BPF_OP(in->code) == BPF_EXIT ||
+	    in->off == 0)
+		return 0;
+
+	for (nip = dip->di_next; nip != NULL; nip = nip->di_next) {
+		if (nip->di_label == (uint_t)in->off)
+			break;
+		if (!dt_pp_ignore(nip))
+			return 0;
+	}
+	if (nip == NULL)
+		return 0;
+
+	dt_pp_remove(pp, dip);
+
+	return 1;
+}
+
+static dt_pp_rule_f * const dt_pp_rules[] = {
+	dt_pp_lddw_mov,
+	dt_pp_mov_alu,
+	dt_pp_mov_st,
+	dt_pp_add_mem,
+	dt_pp_nop_alu,
+	dt_pp_jmp_next,
+	NULL
+};
+
+static int
+dt_pp_apply_rules(dt_pp_t *pp)
+{
+	dt_irnode_t	*dip;
+	int		changed = 0;
+	int		i;
+
+	for (dip = pp->dlp->dl_list; dip != NULL; dip = dip->di_next) {
+		/*
+		 * When a rule rewrites an instruction, try all the rules again
+		 * on the new instruction.
+		 */
+		for (i = 0; dt_pp_rules[i] != NULL && !dt_pp_ignore(dip); i++) {
+			if (dt_pp_rules[i](pp, dip)) {
+				changed = 1;
+				i = -1;
+			}
+		}
+	}
+
+	return changed;
+}
+
+/*
+ * Remove stores to the stack that are overwritten (in straight-line code)
+ * before anything can read them.  The scan for the overwriting store stops
+ * at any instruction that may read memory, and at any instruction that makes
+ * the frame pointer available in another register.
+ */
+static int
+dt_pp_dead_stores(dt_pp_t *pp)
+{
+	dt_irnode_t	*dip, *nip;
+	int		changed = 0;
+
+	for (dip = pp->dlp->dl_list; dip != NULL; dip = dip->di_next) {
+		const struct bpf_insn	*in = &dip->di_instr;
+		int			lo, hi, n;
+
+		if ((BPF_CLASS(in->code) != BPF_ST &&
+		     BPF_CLASS(in->code) != BPF_STX) ||
+		    BPF_MODE(in->code) != BPF_MEM ||
+		    in->dst_reg != BPF_REG_FP || dip->di_extern != NULL)
+			continue;
+
+		lo = in->off;
+		hi = lo + dt_pp_size(in);
+
+		for (nip = dt_pp_succ(dip), n = 0;
+		     nip != NULL && n < DT_PP_DSE_MAX;
+		     nip = dt_pp_succ(nip), n++) {
+			const struct bpf_insn	*nin = &nip->di_instr;
+			uint_t			cls = BPF_CLASS(nin->code);
+
+			if (cls == BPF_LDX || cls == BPF_LD ||
+			    cls == BPF_JMP || cls == BPF_JMP32)
+				break;
+			if ((cls == BPF_STX || cls == BPF_ALU ||
+			     cls == BPF_ALU64) &&
+			    BPF_SRC(nin->code) == BPF_X &&
+			    nin->src_reg == BPF_REG_FP)
+				break;
+			if (cls != BPF_ST && cls != BPF_STX)
+				continue;
+			if (BPF_MODE(nin->code) != BPF_MEM)
+				break;
+			if (nin->dst_reg == BPF_REG_FP &&
+			    nin->off <= lo &&
+			    nin->off + dt_pp_size(nin) >= hi) {
+				dt_pp_remove(pp, dip);
+				changed = 1;
+				break;
+			}
+		}
+	}
+
+	return changed;
+}
+
+/*
+ * Forget all cached DTrace context members.
+ */
+static void
+dt_pp_dctx_clobber(int *val)
+{
+	int	r;
+
+	for (r = 0; r < MAX_BPF_REG; r++) {
+		if (DT_PP_IS_MEMBER(val[r]))
+			val[r] = DT_PP_UNKNOWN;
+	}
+}
+
+/*
+ * Remove redundant loads of the DTrace context pointer (stored on the stack at
+ * DT_STK_DCTX by the function prologue) and of its members.  The DTrace
+ * context lives in the stack frame of the trampoline, so stores relative to
+ * %fp (in the current frame) cannot change it.
+ *
+ * Any store through the DTrace context pointer or through a pointer derived
+ * from it, and any helper call that is passed such a pointer, invalidates the
+ * cached members.  If such a pointer is ever stored to memory (e.g. a register
+ * spill), we can no longer tell which pointers refer to the DTrace context, so
+ * from then on every store through a register and every call invalidates the
+ * cached members.
+ *
+ * Register contents are only tracked within straight-line code.
+ */
+static int
+dt_pp_dctx_loads(dt_pp_t *pp)
+{
+	dt_irnode_t	*dip;
+	int		val[MAX_BPF_REG];
+	int		changed = 0;
+	int		escaped = 0;
+	int		r;
+
+	memset(val, 0, sizeof(val));
+
+	for (dip = pp->dlp->dl_list; dip != NULL; dip = dip->di_next) {
+		struct bpf_insn	*in = &dip->di_instr;
+		uint_t		use, def;
+		int		v = DT_PP_UNKNOWN;
+
+		if (dip->di_label != DT_LBL_NONE)
+			memset(val, 0, sizeof(val));
+		if (dt_pp_ignore(dip))
+			continue;
+
+		switch (BPF_CLASS(in->code)) {
+		case BPF_JMP:
+		case BPF_JMP32:
+			switch (BPF_OP(in->code)) {
+			case BPF_CALL:
+				for (r = BPF_REG_1; r <= BPF_REG_5; r++) {
+					if (DT_PP_IS_DCTX(val[r]))
+						escaped = 1;
+				}
+				if (escaped)
+					dt_pp_dctx_clobber(val);
+				for (r = BPF_REG_0; r <= BPF_REG_5; r++)
+					val[r] = DT_PP_UNKNOWN;
+				break;
+			case BPF_JA:
+			case BPF_EXIT:
+				memset(val, 0, sizeof(val));
+				break;
+			}
+			continue;
+		case BPF_ST:
+		case BPF_STX:
+			/*
+			 * Storing the DTrace context pointer anywhere but in
+			 * its own stack slot lets it escape our tracking.
+			 */
+			if (BPF_CLASS(in->code) == BPF_STX &&
+			    DT_PP_IS_DCTX(val[in->src_reg]) &&
+			    !(in->dst_reg == BPF_REG_FP &&
+			      in->off == DT_STK_DCTX &&
+			      val[in->src_reg] == DT_PP_DCTX))
+				escaped = 1;
+
+			if (in->dst_reg != BPF_REG_FP) {
+				if (escaped || DT_PP_IS_DCTX(val[in->dst_reg]))
+					dt_pp_dctx_clobber(val);
+				continue;
+			}
+			if (in->off + dt_pp_size(in) <= DT_STK_DCTX ||
+			    in->off >= DT_STK_DCTX + DT_STK_SLOT_SZ)
+				continue;
+
+			/* The DTrace context pointer is being replaced. */
+			memset(val, 0, sizeof(val));
+			if (in->code == (BPF_STX | BPF_MEM | BPF_DW) &&
+			    in->off == DT_STK_DCTX)
+				val[in->src_reg] = DT_PP_DCTX;
+			continue;
+		case BPF_LDX:
+			if (in->code != (BPF_LDX | BPF_MEM | BPF_DW))
+				break;
+			if (in->src_reg == BPF_REG_FP && in->off == DT_STK_DCTX)
+				v = DT_PP_DCTX;
+			else if (val[in->src_reg] == DT_PP_DCTX &&
+				 in->off >= 0 && in->off < DCTX_SIZE &&
+				 in->off % sizeof(uint64_t) == 0)
+				v = DT_PP_MEMBER(in->off);
+			break;
+		case BPF_ALU64:
+			if (in->code == (BPF_ALU64 | BPF_MOV | BPF_X) &&
+			    in->dst_reg != in->src_reg) {
+				val[in->dst_reg] = val[in->src_reg];
+				continue;
+			}
+
+			/* Pointer arithmetic on the DTrace context pointer. */
+			if ((BPF_OP(in->code) == BPF_ADD ||
+			     BPF_OP(in->code) == BPF_SUB) &&
+			    (DT_PP_IS_DCTX(val[in->dst_reg]) ||
+			     (BPF_SRC(in->code) == BPF_X &&
+			      DT_PP_IS_DCTX(val[in->src_reg])))) {
+				val[in->dst_reg] = DT_PP_DERIVED;
+				continue;
+			}
+			break;
+		}
+
+		/*
+		 * If the value being loaded is already available in a
+		 * register, use that register instead.
+		 */
+		if (v != DT_PP_UNKNOWN) {
+			if (val[in->dst_reg] == v) {
+				dt_pp_remove(pp, dip);
+				changed = 1;
+				continue;
+			}
+
+			for (r = 0; r < MAX_BPF_REG; r++) {
+				if (val[r] == v && r != BPF_REG_FP)
+					break;
+			}
+			if (r < MAX_BPF_REG) {
+				*in = BPF_MOV_REG(in->dst_reg, r);
+				changed = 1;
+			}
+		}
+
+		dt_pp_usedef(in, &use, &def);
+		for (r = 0; r < MAX_BPF_REG; r++) {
+			if (def & DT_PP_REG(r))
+				val[r] = DT_PP_UNKNOWN;
+		}
+		if (v != DT_PP_UNKNOWN)
+			val[in->dst_reg] = v;
+	}
+
+	return changed;
+}
+
+/*
+ * Remove instructions that follow an unconditional jump or an exit, up to the
+ * next label.
+ */
+static int
+dt_pp_unreachable(dt_pp_t *pp)
+{
+	dt_irnode_t	*dip, *nip;
+	int		changed = 0;
+
+	for (dip = pp->dlp->dl_list; dip != NULL; dip = dip->di_next) {
+		const struct bpf_insn	*in = &dip->di_instr;
+
+		if (dt_pp_ignore(dip) || BPF_CLASS(in->code) != BPF_JMP ||
+		    (BPF_OP(in->code) != BPF_EXIT &&
+		     (BPF_OP(in->code) != BPF_JA || in->off == 0)))
+			continue;
+
+		for (nip = dip->di_next;
+		     nip != NULL && nip->di_label == DT_LBL_NONE;
+		     nip = nip->di_next) {
+			if (dt_pp_ignore(nip))
+				continue;
+
+			dt_pp_remove(pp, nip);
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+void
+dt_peephole(dt_irlist_t *dlp)
+{
+	dt_pp_t		pp;
+	dt_irnode_t	*dip;
+	int		changed, pass = 0;
+
+	/*
+	 * The optimizations are not essential, so if we cannot allocate the
+	 * label table, we simply skip them.
+	 */
+	pp.dlp = dlp;
+	pp.lbls = calloc(dlp->dl_label, sizeof(dt_irnode_t *));
+	if (pp.lbls == NULL)
+		return;
+
+	for (dip = dlp->dl_list; dip != NULL; dip = dip->di_next) {
+		if (dip->di_label != DT_LBL_NONE &&
+		    pp.lbls[dip->di_label] == NULL)
+			pp.lbls[dip->di_label] = dip;
+	}
+
+	do {
+		changed = dt_pp_unreachable(&pp);
+		changed |= dt_pp_apply_rules(&pp);
+		changed |= dt_pp_dctx_loads(&pp);
+		changed |= dt_pp_dead_stores(&pp);
+	} while (changed && ++pass < DT_PP_MAXPASS);
+
+	dt_pp_sweep(&pp);
+	free(pp.lbls);
+}
@@ -751,6 +751,7 @@ dt_printf_create(dtrace_hdl_t *dtp, const char *s)
 	pfv->pfv_argv = NULL;
 	pfv->pfv_argc = 0;
 	pfv->pfv_flags = 0;
+	pfv->pfv_prog = NULL;
 	pfv->pfv_dtp = dtp;
 
 	for (q = format; (p = strchr(q, '%')) != NULL; q = *p ? p + 1 : p) {
@@ -931,6 +932,8 @@ dt_printf_create(dtrace_hdl_t *dtp, const char *s)
 	return (pfv);
 }
 
+static void dt_pfprog_destroy(struct dt_pfprog *);
+
 void
 dt_printf_destroy(dt_pfargv_t *pfv)
 {
@@ -941,6 +944,7 @@ dt_printf_destroy(dt_pfargv_t *pfv)
 		free(pfd);
 	}
 
+	dt_pfprog_destroy(pfv->pfv_prog);
 	free(pfv->pfv_format);
 	free(pfv);
 }
@@ -1095,6 +1099,60 @@ dt_printf_validate(dt_pfargv_t *pfv, uint_t flags,
 	}
 }
 
+/*
+ * Restore the output format (and signedness) that dt_printf_validate() derived
+ * for a conversion from the type of its argument.  This is used when no type
+ * information is available (e.g. when replaying a trace file).  The format is
+ * only accepted if validation (or dtrace_printf_create()) could have produced
+ * it for the conversion, so it cannot introduce conversions of its own.
+ */
+int
+dt_printf_setfmt(dt_pfargd_t *pfd, const char *fmt, uint_t flags)
+{
+	const dt_pfconv_t *pfc = pfd->pfd_conv;
+	static const char *const pfxs[] = { "", "ll", "L" };
+	char buf[sizeof (pfd->pfd_fmt)];
+	int i, sgn = flags & DT_PFCONV_SIGNED;
+
+	if (pfc == NULL)
+		return (fmt[0] == '\0' ? 0 : -1);
+
+	for (i = 0; i < sizeof (pfxs) / sizeof (pfxs[0]); i++) {
+		if (i == 1 && pfc->pfc_print != &pfprint_sint &&
+		    pfc->pfc_print != &pfprint_uint &&
+		    pfc->pfc_print != &pfprint_dint)
+			continue;
+		if (i == 2 && pfc->pfc_print != &pfprint_fp)
+			continue;
+
+		if (snprintf(buf, sizeof (buf), "%s%s", pfxs[i],
+		    pfc->pfc_ofmt) >= sizeof (buf))
+			continue;
+
+		/* See pfcheck_dint(). */
+		if (pfc->pfc_check == &pfcheck_dint && !sgn)
+			buf[strlen(buf) - 1] = 'u';
+
+		if (strcmp(fmt, buf) == 0)
+			goto found;
+	}
+
+	if (strcmp(pfc->pfc_ofmt, "s") != 0 && !sgn &&
+	    strcmp(fmt, pfc->pfc_name) == 0)
+		goto found;
+
+	return (-1);
+
+found:
+	if (pfc->pfc_check != &pfcheck_dint)
+		sgn = 0;
+
+	(void) strcpy(pfd->pfd_fmt, fmt);
+	pfd->pfd_flags = (pfd->pfd_flags & ~DT_PFCONV_SIGNED) | sgn;
+
+	return (0);
+}
+
 void
 dt_printa_validate(dt_node_t *lhs, dt_node_t *rhs)
 {
@@ -1240,6 +1298,75 @@ pfprint_llquantize(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	return (dt_print_llquantize(dtp, fp, addr, size, normal));
 }
 
+/*
+ * Return the print function to use for a conversion.  Some records need to be
+ * printed in a special way, regardless of the conversion.
+ */
+static dt_pfprint_f *
+dt_printf_func(const dt_pfconv_t *pfc, const dtrace_recdesc_t *rec)
+{
+	switch (rec->dtrd_action) {
+	case DTRACEAGG_AVG:
+		return (pfprint_average);
+	case DTRACEAGG_STDDEV:
+		return (pfprint_stddev);
+	case DTRACEAGG_QUANTIZE:
+		return (pfprint_quantize);
+	case DTRACEAGG_LQUANTIZE:
+		return (pfprint_lquantize);
+	case DTRACEAGG_LLQUANTIZE:
+		return (pfprint_llquantize);
+	case DTRACEACT_MOD:
+		return (pfprint_mod);
+	case DTRACEACT_UMOD:
+		return (pfprint_umod);
+	default:
+		return (pfc->pfc_print);
+	}
+}
+
+/*
+ * Construct the printf(3) format string for a conversion, given its (possibly
+ * dynamic) width and precision.
+ */
+static void
+dt_printf_fmt(const dt_pfargd_t *pfd, dt_pfprint_f *func, int width, int prec,
+    char *format, size_t size)
+{
+	char *f = format;
+
+	*f++ = '%';
+
+	if (pfd->pfd_flags & DT_PFCONV_ALT)
+		*f++ = '#';
+	if (pfd->pfd_flags & DT_PFCONV_ZPAD)
+		*f++ = '0';
+	if (width < 0 || (pfd->pfd_flags & DT_PFCONV_LEFT))
+		*f++ = '-';
+	if (pfd->pfd_flags & DT_PFCONV_SPOS)
+		*f++ = '+';
+	if (pfd->pfd_flags & DT_PFCONV_GROUP)
+		*f++ = '\'';
+	if (pfd->pfd_flags & DT_PFCONV_SPACE)
+		*f++ = ' ';
+
+	/*
+	 * If we're printing a stack and DT_PFCONV_LEFT is set, we don't add
+	 * the width to the format string.  See the block comment in
+	 * pfprint_stack() for a description of the behavior in this case.
+	 */
+	if (func == pfprint_stack && (pfd->pfd_flags & DT_PFCONV_LEFT))
+		width = 0;
+
+	if (width != 0)
+		f += snprintf(f, size - (f - format), "%d", ABS(width));
+
+	if (prec > 0)
+		f += snprintf(f, size - (f - format), ".%d", prec);
+
+	(void) strcpy(f, pfd->pfd_fmt);
+}
+
 static int
 dt_printf_format(dtrace_hdl_t *dtp, FILE *fp, const dt_pfargv_t *pfv,
     const dtrace_recdesc_t *recs, uint_t nrecs, const void *buf,
@@ -1250,7 +1377,7 @@ dt_printf_format(dtrace_hdl_t *dtp, FILE *fp, const dt_pfargv_t *pfv,
 	const dtrace_aggdata_t *aggdata = NULL; /* gcc -Wmaybe-uninitialized */
 	dtrace_aggdesc_t *agg;
 	caddr_t lim = (caddr_t)buf + len, limit;
-	char format[64] = "%";
+	char format[64];
 	int i, aggrec = 0, curagg = -1;
 	uint64_t normal;
 
@@ -1282,7 +1409,6 @@ dt_printf_format(dtrace_hdl_t *dtp, FILE *fp, const dt_pfargv_t *pfv,
 		int prec = pfd->pfd_prec;
 		int rval;
 
-		char *f = format + 1; /* skip initial '%' */
 		const dtrace_recdesc_t *rec;
 		dt_pfprint_f *func;
 		caddr_t addr;
@@ -1412,64 +1538,8 @@ dt_printf_format(dtrace_hdl_t *dtp, FILE *fp, const dt_pfargv_t *pfv,
 			return (dt_set_errno(dtp, EDT_DALIGN));
 		}
 
-		switch (rec->dtrd_action) {
-		case DTRACEAGG_AVG:
-			func = pfprint_average;
-			break;
-		case DTRACEAGG_STDDEV:
-			func = pfprint_stddev;
-			break;
-		case DTRACEAGG_QUANTIZE:
-			func = pfprint_quantize;
-			break;
-		case DTRACEAGG_LQUANTIZE:
-			func = pfprint_lquantize;
-			break;
-		case DTRACEAGG_LLQUANTIZE:
-			func = pfprint_llquantize;
-			break;
-		case DTRACEACT_MOD:
-			func = pfprint_mod;
-			break;
-		case DTRACEACT_UMOD:
-			func = pfprint_umod;
-			break;
-		default:
-			func = pfc->pfc_print;
-			break;
-		}
-
-		if (pfd->pfd_flags & DT_PFCONV_ALT)
-			*f++ = '#';
-		if (pfd->pfd_flags & DT_PFCONV_ZPAD)
-			*f++ = '0';
-		if (width < 0 || (pfd->pfd_flags & DT_PFCONV_LEFT))
-			*f++ = '-';
-		if (pfd->pfd_flags & DT_PFCONV_SPOS)
-			*f++ = '+';
-		if (pfd->pfd_flags & DT_PFCONV_GROUP)
-			*f++ = '\'';
-		if (pfd->pfd_flags & DT_PFCONV_SPACE)
-			*f++ = ' ';
-
-		/*
-		 * If we're printing a stack and DT_PFCONV_LEFT is set, we
-		 * don't add the width to the format string.  See the block
-		 * comment in pfprint_stack() for a description of the
-		 * behavior in this case.
-		 */
-		if (func == pfprint_stack && (pfd->pfd_flags & DT_PFCONV_LEFT))
-			width = 0;
-
-		if (width != 0)
-			f += snprintf(f, sizeof (format) - (f - format), "%d",
-				      ABS(width));
-
-		if (prec > 0)
-			f += snprintf(f, sizeof (format) - (f - format), ".%d",
-				      prec);
-
-		(void) strcpy(f, pfd->pfd_fmt);
+		func = dt_printf_func(pfc, rec);
+		dt_printf_fmt(pfd, func, width, prec, format, sizeof (format));
 		pfd->pfd_rec = rec;
 
 		if (func(dtp, fp, format, pfd, addr, size, normal) < 0)
@@ -1493,6 +1563,541 @@ dt_printf_format(dtrace_hdl_t *dtp, FILE *fp, const dt_pfargv_t *pfv,
 	return ((int)(recp - recs));
 }
 
+/*
+ * Compiled printf() formats.  Interpreting a format for every record means
+ * constructing a printf(3) format string for each conversion and writing each
+ * prefix and conversion to the output file separately.  Instead, a format can
+ * be compiled (once) into a sequence of operations: literal text (including
+ * any %% conversions) and value conversions, each with its printf(3) format
+ * string.  The output for a record is collected in a buffer that is written
+ * to the output file at once.  Conversions that have no native implementation
+ * flush the buffer and call the regular print function.
+ *
+ * Formats that use dynamic widths or precisions, and printa() formats, are
+ * not compiled.  They are always interpreted by dt_printf_format().
+ */
+#define	DT_PFOP_TEXT	0	/* literal text */
+#define	DT_PFOP_INT	1	/* integer (pfprint_[sud]int) */
+#define	DT_PFOP_FP	2	/* floating-point value (pfprint_fp) */
+#define	DT_PFOP_STR	3	/* string (pfprint_cstr) */
+#define	DT_PFOP_CALL	4	/* any other conversion */
+
+#define	DT_PFPLAIN_NONE	0	/* conversion has flags, width, or precision */
+#define	DT_PFPLAIN_S	1	/* plain %d, %i, %lld, or %lli */
+#define	DT_PFPLAIN_U	2	/* plain %u or %llu */
+#define	DT_PFPLAIN_STR	3	/* plain %s */
+
+typedef struct dt_pfop {
+	int pfo_kind;			/* operation kind (DT_PFOP_*) */
+	size_t pfo_off;			/* offset of literal text */
+	size_t pfo_len;			/* length of literal text */
+	dt_pfargd_t *pfo_pfd;		/* conversion argument descriptor */
+	char pfo_format[64];		/* printf(3) format for conversion */
+	int pfo_plain;			/* conversion is plain (DT_PFPLAIN_*) */
+	int pfo_ll;			/* conversion is for a 64-bit integer */
+} dt_pfop_t;
+
+typedef struct dt_pfprog {
+	dt_pfop_t *pfp_ops;		/* operations */
+	uint_t pfp_nops;		/* number of operations */
+	char *pfp_text;			/* literal text */
+	size_t pfp_textlen;		/* length of literal text */
+	int pfp_noconv;			/* format has no conversions */
+} dt_pfprog_t;
+
+static void
+dt_pfprog_destroy(dt_pfprog_t *pfp)
+{
+	if (pfp == NULL)
+		return;
+
+	free(pfp->pfp_ops);
+	free(pfp->pfp_text);
+	free(pfp);
+}
+
+/*
+ * Append literal text to a format program, merging it with the preceding
+ * operation if that is literal text as well.
+ */
+static void
+dt_pfprog_text(dt_pfprog_t *pfp, const char *s, size_t len)
+{
+	dt_pfop_t *op = NULL;
+
+	if (pfp->pfp_nops != 0)
+		op = &pfp->pfp_ops[pfp->pfp_nops - 1];
+
+	if (op == NULL || op->pfo_kind != DT_PFOP_TEXT) {
+		op = &pfp->pfp_ops[pfp->pfp_nops++];
+		op->pfo_kind = DT_PFOP_TEXT;
+		op->pfo_off = pfp->pfp_textlen;
+		op->pfo_len = 0;
+	}
+
+	memcpy(pfp->pfp_text + pfp->pfp_textlen, s, len);
+	pfp->pfp_textlen += len;
+	op->pfo_len += len;
+}
+
+/*
+ * Determine whether a conversion can be performed without printf(3).
+ */
+static int
+dt_pfprog_plain(const dt_pfop_t *op)
+{
+	const char *f = op->pfo_format;
+
+	if (op->pfo_kind == DT_PFOP_STR)
+		return (strcmp(f, "%s") == 0 ?
+		    DT_PFPLAIN_STR : DT_PFPLAIN_NONE);
+
+	if (op->pfo_kind != DT_PFOP_INT)
+		return (DT_PFPLAIN_NONE);
+
+	if (strcmp(f, "%d") == 0 || strcmp(f, "%i") == 0 ||
+	    strcmp(f, "%lld") == 0 || strcmp(f, "%lli") == 0)
+		return (DT_PFPLAIN_S);
+	if (strcmp(f, "%u") == 0 || strcmp(f, "%llu") == 0)
+		return (DT_PFPLAIN_U);
+
+	return (DT_PFPLAIN_NONE);
+}
+
+/*
+ * Compile a printf() format (see above).  Compilation is an optimization, so
+ * if the format cannot be compiled, it is left to be interpreted.
+ */
+void
+dt_printf_compile(dtrace_hdl_t *dtp, dt_pfargv_t *pfv)
+{
+	dt_pfargd_t *pfd;
+	dt_pfprog_t *pfp;
+	size_t len = 0;
+	int i;
+
+	if (pfv->pfv_prog != NULL || (pfv->pfv_flags & DT_PRINTF_AGGREGATION))
+		return;
+
+	for (i = 0, pfd = pfv->pfv_argv; i < pfv->pfv_argc;
+	    i++, pfd = pfd->pfd_next) {
+		const dt_pfconv_t *pfc = pfd->pfd_conv;
+
+		if (pfd->pfd_flags &
+		    (DT_PFCONV_DYNWIDTH | DT_PFCONV_DYNPREC | DT_PFCONV_AGG))
+			return;
+
+		/*
+		 * The format of a left-aligned stack conversion depends on the
+		 * record it is applied to (see dt_printf_fmt()).
+		 */
+		if (pfc != NULL && pfc->pfc_print == &pfprint_stack &&
+		    (pfd->pfd_flags & DT_PFCONV_LEFT))
+			return;
+
+		len += pfd->pfd_preflen + 1;
+	}
+
+	if ((pfp = calloc(1, sizeof (dt_pfprog_t))) == NULL ||
+	    (pfp->pfp_ops = calloc(pfv->pfv_argc * 2,
+	    sizeof (dt_pfop_t))) == NULL ||
+	    (pfp->pfp_text = malloc(len + 1)) == NULL) {
+		dt_pfprog_destroy(pfp);
+		return;
+	}
+
+	for (i = 0, pfd = pfv->pfv_argv; i < pfv->pfv_argc;
+	    i++, pfd = pfd->pfd_next) {
+		const dt_pfconv_t *pfc = pfd->pfd_conv;
+		dt_pfop_t *op;
+
+		if (pfd->pfd_preflen != 0)
+			dt_pfprog_text(pfp, pfd->pfd_prefix, pfd->pfd_preflen);
+
+		if (pfc == NULL)
+			continue;
+
+		if (pfc->pfc_print == &pfprint_pct) {
+			dt_pfprog_text(pfp, "%", 1);
+			continue;
+		}
+
+		op = &pfp->pfp_ops[pfp->pfp_nops++];
+		op->pfo_pfd = pfd;
+
+		if (pfc->pfc_print == &pfprint_sint ||
+		    pfc->pfc_print == &pfprint_uint ||
+		    pfc->pfc_print == &pfprint_dint)
+			op->pfo_kind = DT_PFOP_INT;
+		else if (pfc->pfc_print == &pfprint_fp)
+			op->pfo_kind = DT_PFOP_FP;
+		else if (pfc->pfc_print == &pfprint_cstr)
+			op->pfo_kind = DT_PFOP_STR;
+		else
+			op->pfo_kind = DT_PFOP_CALL;
+
+		dt_printf_fmt(pfd, pfc->pfc_print, pfd->pfd_width,
+		    pfd->pfd_prec, op->pfo_format, sizeof (op->pfo_format));
+		op->pfo_plain = dt_pfprog_plain(op);
+		op->pfo_ll = strncmp(pfd->pfd_fmt, "ll", 2) == 0;
+	}
+
+	pfp->pfp_noconv = pfv->pfv_argc == 1 && pfv->pfv_argv->pfd_conv == NULL;
+	pfv->pfv_prog = pfp;
+}
+
+/*
+ * Compile the printf() formats of all enabled probes.
+ */
+void
+dt_printf_compile_all(dtrace_hdl_t *dtp)
+{
+	int i, j;
+
+	for (i = 0; i < dtp->dt_maxprobe; i++) {
+		dtrace_datadesc_t *ddp = dtp->dt_ddesc[i];
+
+		if (ddp == NULL)
+			continue;
+
+		for (j = 0; j < ddp->dtdd_nrecs; j++) {
+			dtrace_recdesc_t *rec = &ddp->dtdd_recs[j];
+
+			if (rec->dtrd_action == DTRACEACT_PRINTF &&
+			    rec->dtrd_format != NULL)
+				dt_printf_compile(dtp, rec->dtrd_format);
+		}
+	}
+}
+
+/*
+ * The output buffer collects the output of a compiled printf() format (or a
+ * line of structured output, see dt_oformat.c) so that it can be written out
+ * at once.
+ *
+ * Make room for 'len' more bytes in the output buffer.
+ */
+int
+dt_pfbuf_reserve(dtrace_hdl_t *dtp, size_t len)
+{
+	size_t size = dtp->dt_pfbuf_size;
+	char *buf;
+
+	if (dtp->dt_pfbuf_len + len <= size)
+		return (0);
+
+	if (size == 0)
+		size = BUFSIZ;
+	while (dtp->dt_pfbuf_len + len > size)
+		size *= 2;
+
+	if ((buf = realloc(dtp->dt_pfbuf, size)) == NULL)
+		return (dt_set_errno(dtp, EDT_NOMEM));
+
+	dtp->dt_pfbuf = buf;
+	dtp->dt_pfbuf_size = size;
+
+	return (0);
+}
+
+int
+dt_pfbuf_write(dtrace_hdl_t *dtp, const char *s, size_t len)
+{
+	if (dt_pfbuf_reserve(dtp, len) != 0)
+		return (-1);
+
+	memcpy(dtp->dt_pfbuf + dtp->dt_pfbuf_len, s, len);
+	dtp->dt_pfbuf_len += len;
+
+	return (0);
+}
+
+/*PRINTFLIKE2*/
+static int
+dt_pfbuf_printf(dtrace_hdl_t *dtp, const char *format, ...)
+{
+	va_list ap;
+	size_t avail = dtp->dt_pfbuf_size - dtp->dt_pfbuf_len;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(dtp->dt_pfbuf + dtp->dt_pfbuf_len, avail, format, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return (dt_set_errno(dtp, errno));
+
+	if (n >= avail) {
+		if (dt_pfbuf_reserve(dtp, n + 1) != 0)
+			return (-1);
+
+		va_start(ap, format);
+		n = vsnprintf(dtp->dt_pfbuf + dtp->dt_pfbuf_len, n + 1,
+		    format, ap);
+		va_end(ap);
+
+		if (n < 0)
+			return (dt_set_errno(dtp, errno));
+	}
+
+	dtp->dt_pfbuf_len += n;
+
+	return (0);
+}
+
+/*
+ * Write a decimal integer to the output buffer.
+ */
+int
+dt_pfbuf_dec(dtrace_hdl_t *dtp, uint64_t val, int neg)
+{
+	char buf[24], *p = &buf[sizeof (buf)];
+
+	do {
+		*--p = '0' + val % 10;
+		val /= 10;
+	} while (val != 0);
+
+	if (neg)
+		*--p = '-';
+
+	return (dt_pfbuf_write(dtp, p, &buf[sizeof (buf)] - p));
+}
+
+/*
+ * Write out the output buffer.  If no stream is given, the output is passed
+ * to the buffered output handler.
+ */
+int
+dt_pfbuf_flush(dtrace_hdl_t *dtp, FILE *fp)
+{
+	size_t len = dtp->dt_pfbuf_len;
+
+	if (len == 0)
+		return (0);
+
+	dtp->dt_pfbuf_len = 0;
+	if (fp == NULL)
+		return (dt_printf(dtp, fp, "%.*s", (int)len, dtp->dt_pfbuf));
+
+	if (fwrite(dtp->dt_pfbuf, 1, len, fp) != len) {
+		clearerr(fp);
+		return (dt_set_errno(dtp, errno));
+	}
+
+	return (0);
+}
+
+/*
+ * Perform an integer conversion.  The value is passed to printf(3) in the
+ * same way as pfprint_sint() and pfprint_uint() do.
+ */
+static int
+dt_pfop_int(dtrace_hdl_t *dtp, const dt_pfop_t *op, const void *addr,
+    size_t size)
+{
+	int sign = op->pfo_pfd->pfd_conv->pfc_print == &pfprint_sint ||
+	    (op->pfo_pfd->pfd_conv->pfc_print == &pfprint_dint &&
+	    (op->pfo_pfd->pfd_flags & DT_PFCONV_SIGNED));
+	uint64_t val;
+
+	switch (size) {
+	case sizeof (uint8_t):
+		val = sign ? (uint64_t)*((int8_t *)addr) : *((uint8_t *)addr);
+		break;
+	case sizeof (uint16_t):
+		val = sign ? (uint64_t)*((int16_t *)addr) :
+		    *((uint16_t *)addr);
+		break;
+	case sizeof (uint32_t):
+		val = sign ? (uint64_t)*((int32_t *)addr) :
+		    *((uint32_t *)addr);
+		break;
+	case sizeof (uint64_t):
+		val = *((uint64_t *)addr);
+		break;
+	default:
+		return (dt_set_errno(dtp, EDT_DMISMATCH));
+	}
+
+	/*
+	 * A plain conversion only gets the same result as printf(3) if the
+	 * size of the value matches the size of the conversion.
+	 */
+	if (op->pfo_plain != DT_PFPLAIN_NONE &&
+	    op->pfo_ll == (size == sizeof (uint64_t))) {
+		if (!op->pfo_ll)
+			val = op->pfo_plain == DT_PFPLAIN_S ?
+			    (uint64_t)(int64_t)(int32_t)val : (uint32_t)val;
+
+		if (op->pfo_plain == DT_PFPLAIN_S && (int64_t)val < 0)
+			return (dt_pfbuf_dec(dtp, -val, 1));
+
+		return (dt_pfbuf_dec(dtp, val, 0));
+	}
+
+	if (size == sizeof (uint64_t))
+		return (dt_pfbuf_printf(dtp, op->pfo_format, val));
+
+	return (dt_pfbuf_printf(dtp, op->pfo_format, (uint32_t)val));
+}
+
+static int
+dt_pfop_fp(dtrace_hdl_t *dtp, const dt_pfop_t *op, const void *addr,
+    size_t size)
+{
+	switch (size) {
+	case sizeof (float):
+		return (dt_pfbuf_printf(dtp, op->pfo_format,
+		    (double)*((float *)addr)));
+	case sizeof (double):
+		return (dt_pfbuf_printf(dtp, op->pfo_format,
+		    *((double *)addr)));
+	case sizeof (long double):
+		return (dt_pfbuf_printf(dtp, op->pfo_format,
+		    *((long double *)addr)));
+	default:
+		return (dt_set_errno(dtp, EDT_DMISMATCH));
+	}
+}
+
+static int
+dt_pfop_str(dtrace_hdl_t *dtp, const dt_pfop_t *op, const void *addr,
+    size_t size)
+{
+	char *s;
+
+	if (op->pfo_plain == DT_PFPLAIN_STR)
+		return (dt_pfbuf_write(dtp, addr, strnlen(addr, size)));
+
+	s = alloca(size + 1);
+	memcpy(s, addr, size);
+	s[size] = '\0';
+
+	return (dt_pfbuf_printf(dtp, op->pfo_format, s));
+}
+
+/*
+ * Execute a compiled printf() format.  This produces the same output (and
+ * return value) as dt_printf_format().
+ */
+static int
+dt_printf_exec(dtrace_hdl_t *dtp, FILE *fp, const dt_pfprog_t *pfp,
+    const dtrace_recdesc_t *recs, uint_t nrecs, const void *buf, size_t len)
+{
+	const dtrace_recdesc_t *recp = recs;
+	caddr_t lim = (caddr_t)buf + len;
+	int i, rval = 0;
+
+	dtp->dt_pfbuf_len = 0;
+
+	for (i = 0; i < pfp->pfp_nops && rval >= 0; i++) {
+		const dt_pfop_t *op = &pfp->pfp_ops[i];
+		dt_pfargd_t *pfd = op->pfo_pfd;
+		const dtrace_recdesc_t *rec;
+		dt_pfprint_f *func;
+		caddr_t addr;
+		size_t size;
+
+		if (op->pfo_kind == DT_PFOP_TEXT) {
+			rval = dt_pfbuf_write(dtp, pfp->pfp_text + op->pfo_off,
+			    op->pfo_len);
+			continue;
+		}
+
+		if (nrecs == 0) {
+			rval = dt_set_errno(dtp, EDT_DMISMATCH);
+			break;
+		}
+
+		rec = recp++;
+		nrecs--;
+		addr = (caddr_t)buf + rec->dtrd_offset;
+		size = rec->dtrd_size;
+
+		if (addr + size > lim) {
+			dt_dprintf("bad size: addr=%p size=0x%x lim=%p\n",
+			    (void *)addr, rec->dtrd_size, (void *)lim);
+			rval = dt_set_errno(dtp, EDT_DOFFSET);
+			break;
+		}
+
+		if (rec->dtrd_alignment != 0 &&
+		    ((uintptr_t)addr & (rec->dtrd_alignment - 1)) != 0) {
+			dt_dprintf("bad align: addr=%p size=0x%x align=0x%x\n",
+			    (void *)addr, rec->dtrd_size, rec->dtrd_alignment);
+			rval = dt_set_errno(dtp, EDT_DALIGN);
+			break;
+		}
+
+		func = dt_printf_func(pfd->pfd_conv, rec);
+		pfd->pfd_dynwidth = 0;
+		pfd->pfd_rec = rec;
+
+		if (func != pfd->pfd_conv->pfc_print ||
+		    op->pfo_kind == DT_PFOP_CALL) {
+			if ((rval = dt_pfbuf_flush(dtp, fp)) == 0)
+				rval = func(dtp, fp, op->pfo_format, pfd, addr,
+				    size, 1);
+		} else if (op->pfo_kind == DT_PFOP_INT)
+			rval = dt_pfop_int(dtp, op, addr, size);
+		else if (op->pfo_kind == DT_PFOP_FP)
+			rval = dt_pfop_fp(dtp, op, addr, size);
+		else
+			rval = dt_pfop_str(dtp, op, addr, size);
+	}
+
+	/*
+	 * Output that precedes an error is still written, as it would be if
+	 * the format were interpreted.
+	 */
+	if (rval < 0) {
+		(void) dt_pfbuf_flush(dtp, fp);
+		return (-1);
+	}
+
+	if (dt_pfbuf_flush(dtp, fp) != 0)
+		return (-1);
+
+	if (pfp->pfp_noconv)
+		return (nrecs != 0);
+
+	return ((int)(recp - recs));
+}
+
+/*
+ * Format the data for a printf() format into a newly allocated string of any
+ * length, which the caller must free.  Unlike dtrace_sprintf(), the output is
+ * not limited to strsize bytes, and unlike compiled formats, this does not use
+ * the output buffer (so it can be used while a line of structured output is
+ * being assembled there).
+ */
+int
+dt_printf_asprintf(dtrace_hdl_t *dtp, void *fmtdata,
+    const dtrace_recdesc_t *recp, uint_t nrecs, const void *buf, size_t len,
+    char **sp)
+{
+	size_t size;
+	FILE *fp;
+	int rval;
+
+	if ((fp = open_memstream(sp, &size)) == NULL)
+		return (dt_set_errno(dtp, errno));
+
+	rval = dt_printf_format(dtp, fp, fmtdata, recp, nrecs, buf, len,
+	    NULL, 0);
+
+	if (fclose(fp) == EOF && rval >= 0)
+		rval = dt_set_errno(dtp, errno);
+
+	if (rval < 0) {
+		free(*sp);
+		*sp = NULL;
+	}
+
+	return (rval);
+}
+
 int
 dtrace_sprintf(dtrace_hdl_t *dtp, FILE *fp, void *fmtdata,
     const dtrace_recdesc_t *recp, uint_t nrecs, const void *buf, size_t len)
@@ -1652,6 +2257,15 @@ dtrace_fprintf(dtrace_hdl_t *dtp, FILE *fp, void *fmtdata,
     const dtrace_probedata_t *data, const dtrace_recdesc_t *recp,
     uint_t nrecs, const void *buf, size_t len)
 {
+	dt_pfargv_t *pfv = fmtdata;
+
+	/*
+	 * Compiled formats are only used when writing to a file.
+	 */
+	if (pfv->pfv_prog != NULL && fp != NULL && dtp->dt_sprintf_buflen == 0)
+		return (dt_printf_exec(dtp, fp, pfv->pfv_prog,
+		    recp, nrecs, buf, len));
+
 	return (dt_printf_format(dtp, fp, fmtdata,
 	    recp, nrecs, buf, len, NULL, 0));
 }
@@ -71,12 +71,15 @@ typedef struct dt_pfargd {
 #define	DT_PFCONV_AGG		0x0100	/* use aggregation result (%@) */
 #define	DT_PFCONV_SIGNED	0x0200	/* arg is a signed integer */
 
+struct dt_pfprog;
+
 typedef struct dt_pfargv {
 	dtrace_hdl_t *pfv_dtp;		/* libdtrace client handle */
 	char *pfv_format;		/* format string pointer */
 	dt_pfargd_t *pfv_argv;		/* list of argument descriptors */
 	uint_t pfv_argc;		/* number of argument descriptors */
 	uint_t pfv_flags;		/* flags used for validation */
+	struct dt_pfprog *pfv_prog;	/* compiled format (or NULL) */
 } dt_pfargv_t;
 
 typedef struct dt_pfwalk {
@@ -91,12 +94,22 @@ extern void dt_pfdict_destroy(dtrace_hdl_t *);
 
 extern dt_pfargv_t *dt_printf_create(dtrace_hdl_t *, const char *);
 extern void dt_printf_destroy(dt_pfargv_t *);
+extern void dt_printf_compile(dtrace_hdl_t *, dt_pfargv_t *);
+extern void dt_printf_compile_all(dtrace_hdl_t *);
 
 #define	DT_PRINTF_EXACTLEN	0x1	/* do not permit extra arguments */
 #define	DT_PRINTF_AGGREGATION	0x2	/* enable aggregation conversion */
 
 extern void dt_printf_validate(dt_pfargv_t *, uint_t,
     struct dt_ident *, int, dtrace_actkind_t, struct dt_node *);
+extern int dt_printf_setfmt(dt_pfargd_t *, const char *, uint_t);
+extern int dt_printf_asprintf(dtrace_hdl_t *, void *,
+    const dtrace_recdesc_t *, uint_t, const void *, size_t, char **);
+
+extern int dt_pfbuf_reserve(dtrace_hdl_t *, size_t);
+extern int dt_pfbuf_write(dtrace_hdl_t *, const char *, size_t);
+extern int dt_pfbuf_dec(dtrace_hdl_t *, uint64_t, int);
+extern int dt_pfbuf_flush(dtrace_hdl_t *, FILE *);
 
 extern void dt_printa_validate(struct dt_node *, struct dt_node *);
 
@@ -425,6 +425,7 @@ dt_probe_create(dtrace_hdl_t *dtp, dt_ident_t *idp, int protoc,
 
 	prp->prov = NULL;
 	prp->pr_ident = idp;
+	prp->prog_fd = -1;
 
 	p = strrchr(idp->di_name, ':');
 	assert(p != NULL);
@@ -723,6 +724,7 @@ dt_probe_insert(dtrace_hdl_t *dtp, dt_provider_t *prov, const char *prv,
 	prp->desc = desc;
 	prp->prov = prov;
 	prp->prv_data = datap;
+	prp->prog_fd = -1;
 
 	dt_htab_insert(dtp->dt_byprv, prp);
 	dt_htab_insert(dtp->dt_bymod, prp);
@@ -788,9 +790,13 @@ dt_probe_lookup(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp)
 	int		p_is_glob, m_is_glob, f_is_glob, n_is_glob;
 
 	/*
-	 * If a probe id is provided, we can do a direct lookup.
+	 * If a probe id is provided, we can do a direct lookup.  Probe ids
+	 * depend on the order in which providers are populated, so all of
+	 * them must be populated first.
 	 */
 	if (pdp->id != DTRACE_IDNONE) {
+		dt_provider_populate(dtp, NULL);
+
 		if (pdp->id >= dtp->dt_probe_id)
 			goto no_probe;
 
@@ -801,6 +807,8 @@ dt_probe_lookup(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp)
 		return prp;
 	}
 
+	dt_provider_populate(dtp, pdp);
+
 	tmpl.desc = pdp;
 
 	p_is_glob = pdp->prv[0] == '\0' || strisglob(pdp->prv);
@@ -1098,9 +1106,12 @@ dt_probe_iter(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp,
 
 	/*
 	 * Special case: if no probe description is provided, we need to loop
-	 * over all registered probes.
+	 * over all registered probes (after making sure that all providers
+	 * have registered their probes).
 	 */
 	if (!pdp) {
+		dt_provider_populate(dtp, NULL);
+
 		for (i = 0; i < dtp->dt_probe_id; i++) {
 			if (!dtp->dt_probes[i])
 				continue;
@@ -1119,9 +1130,13 @@ dt_probe_iter(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp,
 	}
 
 	/*
-	 * Special case: If a probe id is provided, we can do a direct lookup.
+	 * Special case: If a probe id is provided, we can do a direct lookup
+	 * (once all providers have been populated, since that determines the
+	 * probe ids).
 	 */
 	if (pdp->id != DTRACE_IDNONE) {
+		dt_provider_populate(dtp, NULL);
+
 		if (pdp->id >= dtp->dt_probe_id)
 			goto done;
 
@@ -1149,8 +1164,12 @@ dt_probe_iter(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp,
 	tmpl.desc = pdp;
 
 	/*
-	 * Loop over providers, allowing them to provide these probes.
+	 * Make sure that all providers that may offer probes matching the
+	 * probe description have been populated, and then loop over the
+	 * providers, allowing them to provide these probes.
 	 */
+	dt_provider_populate(dtp, pdp);
+
 	for (pvp = dt_list_next(&dtp->dt_provlist); pvp != NULL;
 	     pvp = dt_list_next(pvp)) {
 		if (pvp->impl->provide == NULL ||
@@ -1360,6 +1379,8 @@ dtrace_id2desc(dtrace_hdl_t *dtp, dtrace_id_t id, dtrace_probedesc_t *pdp)
 {
 	dt_probe_t	*prp;
 
+	dt_provider_populate(dtp, NULL);
+
 	if (id >= dtp->dt_probe_id)
 		return dt_set_errno(dtp, EDT_NOPROBE);
 
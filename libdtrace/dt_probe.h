@@ -53,6 +53,9 @@ typedef struct dt_probe {
 	dtrace_typeinfo_t *argv;	/* output argument types */
 	int argc;			/* output argument count */
 	dt_probe_instance_t *pr_inst;	/* list of functions and offsets */
+	int prog_fd;			/* fd of the loaded BPF program */
+	hrtime_t load_time;		/* time spent loading the program */
+	hrtime_t attach_time;		/* time spent attaching the program */
 } dt_probe_t;
 
 extern dt_probe_t *dt_probe_lookup2(dt_provider_t *, const char *);
@@ -8,6 +8,8 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <bpf_asm.h>
@@ -23,6 +25,12 @@ static const char		funname[] = "";
 
 #define UPROBE_EVENTS		TRACEFS "uprobe_events"
 
+/*
+ * Programs may be attached from multiple threads (see the 'loadthreads'
+ * option), and libproc is not thread-safe.
+ */
+static pthread_mutex_t		uprobe_spec_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static const dtrace_pattr_t	pattr = {
 { DTRACE_STABILITY_STABLE, DTRACE_STABILITY_STABLE, DTRACE_CLASS_COMMON },
 { DTRACE_STABILITY_PRIVATE, DTRACE_STABILITY_PRIVATE, DTRACE_CLASS_UNKNOWN },
@@ -50,6 +58,18 @@ static int populate(dtrace_hdl_t *dtp)
 	return n;
 }
 
+/*
+ * The dtrace provider only ever offers the BEGIN, END, and ERROR probes.
+ */
+static int may_provide(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp)
+{
+	if (!dt_gmatch(modname, pdp->mod) || !dt_gmatch(funname, pdp->fun))
+		return 0;
+
+	return dt_gmatch("BEGIN", pdp->prb) || dt_gmatch("END", pdp->prb) ||
+	       dt_gmatch("ERROR", pdp->prb);
+}
+
 /*
  * Generate a BPF trampoline for a dtrace probe (BEGIN, END, or ERROR).
  *
@@ -157,7 +177,15 @@ static void trampoline(dt_pcb_t *pcb)
 	dt_cg_tramp_epilogue(pcb, lbl_exit);
 }
 
-static char *uprobe_spec(dtrace_hdl_t *dtp, const char *prb)
+/*
+ * Determine the location of the function that implements the given probe in
+ * the dtrace executable (or library), as a file name and an offset in that
+ * file.  The returned string must be freed with free().
+ *
+ * This is called while attaching probes, possibly from multiple threads, so it
+ * uses malloc() rather than dt_alloc() (which sets the DTrace error number).
+ */
+static char *uprobe_spec(const char *prb, uint64_t *offp)
 {
 	struct ps_prochandle	*P;
 	int			perr = 0;
@@ -166,7 +194,7 @@ static char *uprobe_spec(dtrace_hdl_t *dtp, const char *prb)
 	prsyminfo_t		si;
 	char			*spec = NULL;
 
-	fun = dt_alloc(dtp, strlen(prb) + strlen(PROBE_FUNC_SUFFIX) + 1);
+	fun = malloc(strlen(prb) + strlen(PROBE_FUNC_SUFFIX) + 1);
 	if (fun == NULL)
 		return NULL;
 
@@ -176,14 +204,13 @@ static char *uprobe_spec(dtrace_hdl_t *dtp, const char *prb)
 	/* grab our process */
 	P = Pgrab(getpid(), 2, 0, NULL, &perr);
 	if (P == NULL) {
-		dt_free(dtp, fun);
+		free(fun);
 		return NULL;
 	}
 
 	/* look up function, get the map, and record */
 	if (Pxlookup_by_name(P, -1, PR_OBJ_EVERY, fun, &sym, &si) == 0) {
 		const prmap_t	*mapp;
-		size_t		len;
 
 		mapp = Paddr_to_map(P, sym.st_value);
 		if (mapp == NULL)
@@ -192,19 +219,16 @@ static char *uprobe_spec(dtrace_hdl_t *dtp, const char *prb)
 		if (mapp->pr_file->first_segment != mapp)
 			mapp = mapp->pr_file->first_segment;
 
-		len = snprintf(NULL, 0, "%s:0x%lx",
-			       mapp->pr_file->prf_mapname,
-			       sym.st_value - mapp->pr_vaddr) + 1;
-		spec = dt_alloc(dtp, len);
+		spec = malloc(strlen(mapp->pr_file->prf_mapname) + 1);
 		if (spec == NULL)
 			goto out;
 
-		snprintf(spec, len, "%s:0x%lx", mapp->pr_file->prf_mapname,
-			 sym.st_value - mapp->pr_vaddr);
+		strcpy(spec, mapp->pr_file->prf_mapname);
+		*offp = sym.st_value - mapp->pr_vaddr;
 	}
 
 out:
-	dt_free(dtp, fun);
+	free(fun);
 	Prelease(P, PS_RELEASE_NORMAL);
 	Pfree(P);
 
@@ -215,40 +239,59 @@ static int attach(dtrace_hdl_t *dtp, const dt_probe_t *prp, int bpf_fd)
 {
 	tp_probe_t	*datap = prp->prv_data;
 
-	if (datap->event_id == -1) {
-		char	*spec;
-		char	*fn;
-		FILE	*f;
-		size_t	len;
-		int	fd, rc = -1;
+	if (datap->event_id == -1 && datap->event_fd == -1) {
+		char		*spec;
+		uint64_t	off;
+		char		*fn;
+		FILE		*f;
+		size_t		len;
+		int		fd, rc = -1;
 
 		/* get a uprobe specification for this probe */
-		spec = uprobe_spec(dtp, prp->desc->prb);
+		pthread_mutex_lock(&uprobe_spec_lock);
+		spec = uprobe_spec(prp->desc->prb, &off);
+		pthread_mutex_unlock(&uprobe_spec_lock);
 		if (spec == NULL)
 			return -ENOENT;
 
+		/*
+		 * Create the uprobe through the uprobe PMU if the kernel
+		 * supports it.  Otherwise, use the TRACEFS interface.
+		 */
+		rc = tp_pmu_probe(dtp, prp, NULL, spec, off, 0);
+		if (rc != -ENOTSUP) {
+			free(spec);
+			if (rc < 0)
+				return rc;
+
+			return tp_attach(dtp, prp, bpf_fd);
+		}
+
 		/* add a uprobe */
+		rc = -1;
 		fd = open(UPROBE_EVENTS, O_WRONLY | O_APPEND);
 		if (fd != -1) {
-			rc = dprintf(fd, "p:" GROUP_FMT "/%s %s\n",
-				     GROUP_DATA, prp->desc->prb, spec);
+			rc = dprintf(fd, "p:" GROUP_FMT "/%s %s:0x%lx\n",
+				     GROUP_DATA, prp->desc->prb, spec, off);
 			close(fd);
 		}
-		dt_free(dtp, spec);
+		free(spec);
 		if (rc == -1)
 			return -ENOENT;
 
+		datap->tracefs = 1;
+
 		/* open format file */
 		len = snprintf(NULL, 0, "%s" GROUP_FMT "/%s/format",
 			       EVENTSFS, GROUP_DATA, prp->desc->prb) + 1;
-		fn = dt_alloc(dtp, len);
+		fn = malloc(len);
 		if (fn == NULL)
 			return -ENOENT;
 
 		snprintf(fn, len, "%s" GROUP_FMT "/%s/format",
 			 EVENTSFS, GROUP_DATA, prp->desc->prb);
 		f = fopen(fn, "r");
-		dt_free(dtp, fn);
+		free(fn);
 		if (f == NULL)
 			return -ENOENT;
 
@@ -275,17 +318,25 @@ static int probe_info(dtrace_hdl_t *dtp, const dt_probe_t *prp,
  *
  * If there is an event FD, we close it.
  *
- * We also try to remove any uprobe that may have been created for the probe.
- * This is harmless for probes that didn't get created.  If the removal fails
- * for some reason we are out of luck - fortunately it is not harmful to the
- * system as a whole.
+ * We also try to remove any uprobe that may have been created for the probe
+ * through TRACEFS.  If the removal fails for some reason we are out of luck -
+ * fortunately it is not harmful to the system as a whole.
  */
 static void probe_fini(dtrace_hdl_t *dtp, const dt_probe_t *prp)
 {
-	int	fd;
+	tp_probe_t	*datap = prp->prv_data;
+	int		tracefs = datap->tracefs;
+	int		fd;
 
 	tp_probe_fini(dtp, prp);
 
+	/*
+	 * Uprobes that were created through the uprobe PMU are removed by the
+	 * kernel when their perf event is closed.
+	 */
+	if (!tracefs)
+		return;
+
 	fd = open(UPROBE_EVENTS, O_WRONLY | O_APPEND);
 	if (fd == -1)
 		return;
@@ -298,6 +349,7 @@ dt_provimpl_t	dt_dtrace = {
 	.name		= prvname,
 	.prog_type	= BPF_PROG_TYPE_KPROBE,
 	.populate	= &populate,
+	.may_provide	= &may_provide,
 	.trampoline	= &trampoline,
 	.attach		= &attach,
 	.probe_info	= &probe_info,
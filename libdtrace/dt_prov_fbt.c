@@ -8,7 +8,25 @@
  *
  * FBT probes are exposed by the kernel as kprobes.  They are listed in the
  * TRACEFS/available_filter_functions file.  Some kprobes are associated with
- * a specific kernel module, while most are in the core kernel.
+ * a specific kernel module, while most are in the core kernel.  Kprobes are
+ * created through the kprobe PMU if the kernel supports it, and through the
+ * TRACEFS/kprobe_events file otherwise.
+ *
+ * If the kernel supports it (Linux 5.5 and later, with BTF), probes on core
+ * kernel functions are implemented as fentry (entry) and fexit (return) BPF
+ * programs instead.  These are called directly from a trampoline at the start
+ * of the function rather than through a breakpoint, and the BTF description
+ * of the function provides the types of its arguments and its return value.
+ * Functions that cannot be traced this way use kprobes, and so do probes for
+ * which the fentry/fexit program cannot be loaded or attached.
+ *
+ * If the kernel supports kprobe_multi links (Linux 5.18 and later), probes on
+ * core kernel functions use those instead.  All probes that share the same
+ * program (typically because they were enabled with a wildcard) are attached
+ * with a single link, and the program is loaded only once.  The trampoline
+ * retrieves the identity of the probe that fired from the BPF cookie of the
+ * function in the link.  If the link cannot be created, the probes fall back
+ * to fentry/fexit programs or kprobes.
  *
  * Mapping from event name to DTrace probe name:
  *
@@ -21,18 +39,23 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <linux/bpf.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
 #include <bpf_asm.h>
 
 #include "dt_impl.h"
+#include "dt_bpf.h"
 #include "dt_bpf_builtins.h"
+#include "dt_btf.h"
+#include "dt_pcache.h"
 #include "dt_provider.h"
 #include "dt_probe.h"
 #include "dt_pt_regs.h"
@@ -46,6 +69,51 @@ static const char		modname[] = "vmlinux";
 #define FBT_GROUP_FMT		GROUP_FMT "_%s"
 #define FBT_GROUP_DATA		GROUP_DATA, prp->desc->prb
 
+/*
+ * BPF program type and attach types for fentry/fexit programs.
+ */
+#define FBT_PROG_TYPE_TRACING	26	/* BPF_PROG_TYPE_TRACING */
+#define FBT_TRACE_FENTRY	24	/* BPF_TRACE_FENTRY */
+#define FBT_TRACE_FEXIT		25	/* BPF_TRACE_FEXIT */
+
+/*
+ * Attach type and link creation command for kprobe_multi links.
+ */
+#define FBT_TRACE_KPROBE_MULTI	42	/* BPF_TRACE_KPROBE_MULTI */
+#define FBT_KPROBE_MULTI_RETURN	1	/* BPF_F_KPROBE_MULTI_RETURN */
+#define FBT_LINK_CREATE		28	/* BPF_LINK_CREATE */
+
+/*
+ * Attributes for BPF_LINK_CREATE, for kprobe_multi links.
+ */
+struct fbt_link_create_attr {
+	uint32_t	prog_fd;
+	uint32_t	target_fd;
+	uint32_t	attach_type;
+	uint32_t	flags;
+	uint32_t	kprobe_multi_flags;
+	uint32_t	kprobe_multi_cnt;
+	uint64_t	kprobe_multi_syms;
+	uint64_t	kprobe_multi_addrs;
+	uint64_t	kprobe_multi_cookies;
+};
+
+/*
+ * How a probe is implemented.  This is determined when the probe is first
+ * used.
+ */
+#define FBT_UNKNOWN		0
+#define FBT_KPROBE		1	/* kprobe or kretprobe */
+#define FBT_FPROBE		2	/* fentry or fexit program */
+#define FBT_KMULTI		3	/* kprobe_multi link */
+
+typedef struct fbt_probe {
+	tp_probe_t	tp;		/* tracepoint (for kprobes) */
+	int		kind;		/* FBT_UNKNOWN, FBT_KPROBE, ... */
+	dt_btf_func_t	func;		/* BTF function (for fentry/fexit) */
+	int		link_fd;	/* fentry/fexit or kprobe_multi link */
+} fbt_probe_t;
+
 static const dtrace_pattr_t	pattr = {
 { DTRACE_STABILITY_EVOLVING, DTRACE_STABILITY_EVOLVING, DTRACE_CLASS_COMMON },
 { DTRACE_STABILITY_PRIVATE, DTRACE_STABILITY_PRIVATE, DTRACE_CLASS_UNKNOWN },
@@ -54,9 +122,46 @@ static const dtrace_pattr_t	pattr = {
 { DTRACE_STABILITY_PRIVATE, DTRACE_STABILITY_PRIVATE, DTRACE_CLASS_ISA },
 };
 
+/*
+ * Create a FBT probe.  Its provider-specific data starts with the tracepoint
+ * data, so the tracepoint functions can be used for probes that are
+ * implemented as kprobes.
+ */
+static dt_probe_t *fbt_probe_insert(dtrace_hdl_t *dtp, dt_provider_t *prov,
+				    const char *prv, const char *mod,
+				    const char *fun, const char *prb)
+{
+	fbt_probe_t	*datap;
+	dt_probe_t	*prp;
+
+	datap = dt_zalloc(dtp, sizeof(fbt_probe_t));
+	if (datap == NULL)
+		return NULL;
+
+	datap->tp.event_id = -1;
+	datap->tp.event_fd = -1;
+	datap->tp.link_fd = -1;
+	datap->kind = FBT_UNKNOWN;
+	datap->link_fd = -1;
+
+	prp = dt_probe_insert(dtp, prov, prv, mod, fun, prb, datap);
+	if (prp == NULL)
+		dt_free(dtp, datap);
+
+	return prp;
+}
+
+/*
+ * All FBT probes are named either entry or return.
+ */
+static int may_provide(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp)
+{
+	return dt_gmatch("entry", pdp->prb) || dt_gmatch("return", pdp->prb);
+}
+
 /*
  * Scan the PROBE_LIST file and add entry and return probes for every function
- * that is listed.
+ * that is listed, unless the probes can be restored from the probe cache.
  */
 static int populate(dtrace_hdl_t *dtp)
 {
@@ -73,6 +178,11 @@ static int populate(dtrace_hdl_t *dtp)
 	if (prv == NULL)
 		return 0;
 
+	n = dt_pcache_restore(dtp, prv, fbt_probe_insert);
+	if (n >= 0)
+		return n;
+
+	n = 0;
 	f = fopen(PROBE_LIST, "r");
 	if (f == NULL)
 		return 0;
@@ -136,17 +246,157 @@ static int populate(dtrace_hdl_t *dtp)
 		if (dt_probe_lookup(dtp, &pd) != NULL)
 			continue;
 
-		if (tp_probe_insert(dtp, prv, prvname, mod, buf, "entry"))
+		if (fbt_probe_insert(dtp, prv, prvname, mod, buf, "entry"))
 			n++;
-		if (tp_probe_insert(dtp, prv, prvname, mod, buf, "return"))
+		if (fbt_probe_insert(dtp, prv, prvname, mod, buf, "return"))
 			n++;
 	}
 
 	fclose(f);
+	dt_pcache_save(dtp, prv);
 
 	return n;
 }
 
+/*
+ * Use a fentry/fexit program for the probe if the kernel supports them (Linux
+ * 5.5 and later) and there is BTF data for the function.
+ */
+static void fbt_resolve_fprobe(dtrace_hdl_t *dtp, const dt_probe_t *prp)
+{
+	fbt_probe_t	*datap = prp->prv_data;
+	dt_btf_t	*btf;
+
+	if (dtp->dt_kernver < DT_VERSION_NUMBER(5, 5, 0))
+		return;
+
+	btf = dt_btf_load_vmlinux(dtp);
+	if (btf == NULL)
+		return;
+
+	if (dt_btf_func(btf, prp->desc->fun, &datap->func) == 0)
+		datap->kind = FBT_FPROBE;
+}
+
+/*
+ * Support for kprobe_multi links is determined once, by loading a trivial
+ * program with the kprobe_multi attach type and creating a link for it on a
+ * function that does not exist.  Kernels that support these links fail to
+ * find the function (ESRCH).  Other kernels reject the program or the link.
+ */
+static pthread_once_t	kmulti_once = PTHREAD_ONCE_INIT;
+static int		kmulti_supported;
+
+static void fbt_kmulti_init(void)
+{
+	struct bpf_insn			insns[] = {
+		BPF_MOV_IMM(BPF_REG_0, 0),
+		BPF_RETURN(),
+	};
+	const char			*sym = "dtrace_kprobe_multi_probe";
+	union bpf_attr			attr;
+	struct fbt_link_create_attr	lattr;
+	int				fd, lfd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_KPROBE;
+	attr.expected_attach_type = FBT_TRACE_KPROBE_MULTI;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = ARRAY_SIZE(insns);
+	attr.license = (uintptr_t)"GPL";
+
+	fd = bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0)
+		return;
+
+	memset(&lattr, 0, sizeof(lattr));
+	lattr.prog_fd = fd;
+	lattr.attach_type = FBT_TRACE_KPROBE_MULTI;
+	lattr.kprobe_multi_cnt = 1;
+	lattr.kprobe_multi_syms = (uintptr_t)&sym;
+
+	lfd = syscall(__NR_bpf, FBT_LINK_CREATE, &lattr, sizeof(lattr));
+	kmulti_supported = lfd >= 0 || errno == ESRCH;
+	if (lfd >= 0)
+		close(lfd);
+	close(fd);
+
+	dt_dprintf("fbt: kprobe_multi links are%s supported\n",
+		   kmulti_supported ? "" : " not");
+}
+
+/*
+ * Determine how the probe is implemented.  Probes on core kernel functions use
+ * kprobe_multi links if the kernel supports them, or otherwise fentry/fexit
+ * programs if there is BTF data for the function.
+ */
+static void fbt_resolve(dtrace_hdl_t *dtp, const dt_probe_t *prp)
+{
+	fbt_probe_t	*datap = prp->prv_data;
+
+	if (datap->kind != FBT_UNKNOWN)
+		return;
+
+	datap->kind = FBT_KPROBE;
+
+	if (strcmp(prp->desc->mod, modname) != 0)
+		return;
+
+	pthread_once(&kmulti_once, fbt_kmulti_init);
+	if (kmulti_supported) {
+		datap->kind = FBT_KMULTI;
+		return;
+	}
+
+	fbt_resolve_fprobe(dtp, prp);
+}
+
+/*
+ * Probes that are implemented as fentry/fexit programs use a trampoline that
+ * depends on the number of arguments of the function (and for return probes,
+ * whether there is a return value).
+ *
+ * Probes that use kprobe_multi links share their program with all other such
+ * probes with the same clauses.
+ *
+ * Probes that are implemented as kprobes use one trampoline for entry probes
+ * and one for return probes, except that return probes that fall back from a
+ * fexit program (and keep its argument types) have a trampoline of their own.
+ */
+static void prog_attr(dtrace_hdl_t *dtp, const dt_probe_t *prp,
+		      dt_progattr_t *attr)
+{
+	fbt_probe_t	*datap = prp->prv_data;
+
+	fbt_resolve(dtp, prp);
+	if (datap->kind == FBT_KMULTI) {
+		attr->attach_type = FBT_TRACE_KPROBE_MULTI;
+		attr->variant = strcmp(prp->desc->prb, "entry") == 0 ? -1 : -2;
+		attr->shared = 1;
+		return;
+	}
+	if (datap->kind == FBT_KPROBE) {
+		if (strcmp(prp->desc->prb, "entry") == 0)
+			attr->variant = -3;
+		else
+			attr->variant = datap->func.id != 0 ? -5 : -4;
+		return;
+	}
+	if (datap->kind != FBT_FPROBE)
+		return;
+
+	attr->prog_type = FBT_PROG_TYPE_TRACING;
+	attr->btf_id = datap->func.id;
+	if (strcmp(prp->desc->prb, "entry") == 0) {
+		attr->attach_type = FBT_TRACE_FENTRY;
+		attr->variant = 1 + 2 * datap->func.argc;
+	} else {
+		attr->attach_type = FBT_TRACE_FEXIT;
+		attr->variant = 2 + 2 * (datap->func.retval ?
+					 datap->func.argc + 1 : 0);
+	}
+}
+
 /*
  * Generate a BPF trampoline for a FBT probe.
  *
@@ -158,12 +408,13 @@ static int populate(dtrace_hdl_t *dtp)
  * The trampoline will populate a dt_dctx_t struct and then call the function
  * that implements the compiled D clause.  It returns 0 to the caller.
  */
-static void trampoline(dt_pcb_t *pcb)
+static void kprobe_trampoline(dt_pcb_t *pcb)
 {
 	int		i;
 	dt_irlist_t	*dlp = &pcb->pcb_ir;
 	struct bpf_insn	instr;
 	uint_t		lbl_exit = dt_irlist_label(dlp);
+	fbt_probe_t	*datap = pcb->pcb_probe->prv_data;
 
 	dt_cg_tramp_prologue(pcb, lbl_exit);
 
@@ -180,6 +431,37 @@ static void trampoline(dt_pcb_t *pcb)
 	instr = BPF_LOAD(BPF_DW, BPF_REG_8, BPF_REG_FP, DCTX_FP(DCTX_CTX));
 	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
 
+	/*
+	 * A return probe that falls back from a fexit program has its
+	 * arguments typed like one: the return offset (unknown) in arg0 and
+	 * the return value in arg1.
+	 *
+	 *	dctx->mst->argv[0] = -1;
+	 *				// stdw [%r7 + DMST_ARG(0)], -1
+	 *	dctx->mst->argv[1] = PT_REGS_RC((dt_pt_regs *)dctx->ctx);
+	 *				// lddw %r0, [%r8 + PT_REGS_RC]
+	 *				// stdw [%r7 + DMST_ARG(1)], %r0
+	 */
+	if (datap->func.id != 0 &&
+	    strcmp(pcb->pcb_probe->desc->prb, "return") == 0) {
+		instr = BPF_STORE_IMM(BPF_DW, BPF_REG_7, DMST_ARG(0), -1);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_LOAD(BPF_DW, BPF_REG_0, BPF_REG_8, PT_REGS_RC);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_STORE(BPF_DW, BPF_REG_7, DMST_ARG(1), BPF_REG_0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+		for (i = 2; i < ARRAY_SIZE(((dt_mstate_t *)0)->argv); i++) {
+			instr = BPF_STORE_IMM(BPF_DW, BPF_REG_7, DMST_ARG(i),
+					      0);
+			dt_irlist_append(dlp,
+					 dt_cg_node_alloc(DT_LBL_NONE, instr));
+		}
+
+		dt_cg_tramp_epilogue(pcb, lbl_exit);
+		return;
+	}
+
 #if 0
 	/*
 	 *	dctx->mst->regs = *(dt_pt_regs *)dctx->ctx;
@@ -249,11 +531,226 @@ static void trampoline(dt_pcb_t *pcb)
 	dt_cg_tramp_epilogue(pcb, lbl_exit);
 }
 
+/*
+ * Generate a BPF trampoline for a FBT probe that is implemented as a fentry or
+ * fexit program.
+ *
+ * The context of these programs is an array of 64-bit values that holds the
+ * arguments of the function, followed by its return value (for fexit programs
+ * on functions that return a value).  The verifier only allows access to the
+ * slots that exist for the function.
+ *
+ * Return probes provide the return value in arg1.  The offset of the return
+ * instruction (arg0) is not known, and is reported as -1.
+ */
+static void fprobe_trampoline(dt_pcb_t *pcb)
+{
+	int		i, argc;
+	dt_irlist_t	*dlp = &pcb->pcb_ir;
+	struct bpf_insn	instr;
+	uint_t		lbl_exit = dt_irlist_label(dlp);
+	fbt_probe_t	*datap = pcb->pcb_probe->prv_data;
+
+	dt_cg_tramp_prologue(pcb, lbl_exit);
+
+	/*
+	 *				//     (%r7 = dctx->mst)
+	 *				// lddw %r7, [%fp + DCTX_FP(DCTX_MST)]
+	 *				//     (%r8 = dctx->ctx)
+	 *				// lddw %r8, [%fp + DCTX_FP(DCTX_CTX)]
+	 */
+	instr = BPF_LOAD(BPF_DW, BPF_REG_7, BPF_REG_FP, DCTX_FP(DCTX_MST));
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_LOAD(BPF_DW, BPF_REG_8, BPF_REG_FP, DCTX_FP(DCTX_CTX));
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	if (strcmp(pcb->pcb_probe->desc->prb, "entry") == 0) {
+		/*
+		 * for (i = 0; i < argc; i++)
+		 *	dctx->mst->argv[i] = ((uint64_t *)dctx->ctx)[i];
+		 *				// lddw %r0, [%r8 + i * 8]
+		 *				// stdw [%r7 + DMST_ARG(i)], %r0
+		 */
+		argc = datap->func.argc;
+		for (i = 0; i < argc; i++) {
+			instr = BPF_LOAD(BPF_DW, BPF_REG_0, BPF_REG_8, i * 8);
+			dt_irlist_append(dlp,
+					 dt_cg_node_alloc(DT_LBL_NONE, instr));
+			instr = BPF_STORE(BPF_DW, BPF_REG_7, DMST_ARG(i),
+					  BPF_REG_0);
+			dt_irlist_append(dlp,
+					 dt_cg_node_alloc(DT_LBL_NONE, instr));
+		}
+	} else {
+		/*
+		 *	dctx->mst->argv[0] = -1;
+		 *				// stdw [%r7 + DMST_ARG(0)], -1
+		 *	dctx->mst->argv[1] = ((uint64_t *)dctx->ctx)[n];
+		 *				// lddw %r0, [%r8 + n * 8]
+		 *				// stdw [%r7 + DMST_ARG(1)], %r0
+		 */
+		instr = BPF_STORE_IMM(BPF_DW, BPF_REG_7, DMST_ARG(0), -1);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+		if (datap->func.retval) {
+			instr = BPF_LOAD(BPF_DW, BPF_REG_0, BPF_REG_8,
+					 datap->func.argc * 8);
+			dt_irlist_append(dlp,
+					 dt_cg_node_alloc(DT_LBL_NONE, instr));
+			instr = BPF_STORE(BPF_DW, BPF_REG_7, DMST_ARG(1),
+					  BPF_REG_0);
+		} else
+			instr = BPF_STORE_IMM(BPF_DW, BPF_REG_7, DMST_ARG(1),
+					      0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+		argc = 2;
+	}
+
+	/*
+	 *     (we clear dctx->mst->argv[argc] and on)
+	 */
+	for (i = argc; i < ARRAY_SIZE(((dt_mstate_t *)0)->argv); i++) {
+		instr = BPF_STORE_IMM(BPF_DW, BPF_REG_7, DMST_ARG(i), 0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	}
+
+	dt_cg_tramp_epilogue(pcb, lbl_exit);
+}
+
+/*
+ * Generate a BPF trampoline for FBT probes that are attached with a kprobe_multi
+ * link.  The program is shared by all probes in the link, so the trampoline
+ * prologue retrieves the EPID offset for the probe that fired from the BPF
+ * cookie that was associated with the function when the link was created.
+ *
+ * Like for fexit programs, return probes provide the return value in arg1, and
+ * -1 as the offset of the return instruction (arg0).
+ */
+static void kmulti_trampoline(dt_pcb_t *pcb)
+{
+	static const int	argoff[] = {
+		PT_REGS_ARG0, PT_REGS_ARG1, PT_REGS_ARG2,
+		PT_REGS_ARG3, PT_REGS_ARG4, PT_REGS_ARG5,
+	};
+	int			i, argc;
+	dt_irlist_t		*dlp = &pcb->pcb_ir;
+	struct bpf_insn		instr;
+	uint_t			lbl_exit = dt_irlist_label(dlp);
+
+	dt_cg_tramp_prologue(pcb, lbl_exit);
+
+	/*
+	 *				//     (%r7 = dctx->mst)
+	 *				// lddw %r7, [%fp + DCTX_FP(DCTX_MST)]
+	 *				//     (%r8 = dctx->ctx)
+	 *				// lddw %r8, [%fp + DCTX_FP(DCTX_CTX)]
+	 */
+	instr = BPF_LOAD(BPF_DW, BPF_REG_7, BPF_REG_FP, DCTX_FP(DCTX_MST));
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	instr = BPF_LOAD(BPF_DW, BPF_REG_8, BPF_REG_FP, DCTX_FP(DCTX_CTX));
+	dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+	if (strcmp(pcb->pcb_probe->desc->prb, "entry") == 0) {
+		/*
+		 * for (i = 0; i < 6; i++)
+		 *	dctx->mst->argv[i] = PT_REGS_PARAMi((dt_pt_regs *)
+		 *					    dctx->ctx);
+		 *				// lddw %r0, [%r8 + PT_REGS_ARGi]
+		 *				// stdw [%r7 + DMST_ARG(i)], %r0
+		 */
+		argc = ARRAY_SIZE(argoff);
+		for (i = 0; i < argc; i++) {
+			instr = BPF_LOAD(BPF_DW, BPF_REG_0, BPF_REG_8,
+					 argoff[i]);
+			dt_irlist_append(dlp,
+					 dt_cg_node_alloc(DT_LBL_NONE, instr));
+			instr = BPF_STORE(BPF_DW, BPF_REG_7, DMST_ARG(i),
+					  BPF_REG_0);
+			dt_irlist_append(dlp,
+					 dt_cg_node_alloc(DT_LBL_NONE, instr));
+		}
+	} else {
+		/*
+		 *	dctx->mst->argv[0] = -1;
+		 *				// stdw [%r7 + DMST_ARG(0)], -1
+		 *	dctx->mst->argv[1] = PT_REGS_RC((dt_pt_regs *)dctx->ctx);
+		 *				// lddw %r0, [%r8 + PT_REGS_RC]
+		 *				// stdw [%r7 + DMST_ARG(1)], %r0
+		 */
+		instr = BPF_STORE_IMM(BPF_DW, BPF_REG_7, DMST_ARG(0), -1);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_LOAD(BPF_DW, BPF_REG_0, BPF_REG_8, PT_REGS_RC);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+		instr = BPF_STORE(BPF_DW, BPF_REG_7, DMST_ARG(1), BPF_REG_0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+
+		argc = 2;
+	}
+
+	/*
+	 *     (we clear dctx->mst->argv[argc] and on)
+	 */
+	for (i = argc; i < ARRAY_SIZE(((dt_mstate_t *)0)->argv); i++) {
+		instr = BPF_STORE_IMM(BPF_DW, BPF_REG_7, DMST_ARG(i), 0);
+		dt_irlist_append(dlp, dt_cg_node_alloc(DT_LBL_NONE, instr));
+	}
+
+	dt_cg_tramp_epilogue(pcb, lbl_exit);
+}
+
+static void trampoline(dt_pcb_t *pcb)
+{
+	fbt_probe_t	*datap = pcb->pcb_probe->prv_data;
+
+	if (datap->kind == FBT_FPROBE)
+		fprobe_trampoline(pcb);
+	else if (datap->kind == FBT_KMULTI)
+		kmulti_trampoline(pcb);
+	else
+		kprobe_trampoline(pcb);
+}
+
 static int attach(dtrace_hdl_t *dtp, const dt_probe_t *prp, int bpf_fd)
 {
-	tp_probe_t	*datap = prp->prv_data;
+	fbt_probe_t	*fdatap = prp->prv_data;
+	tp_probe_t	*datap = &fdatap->tp;
 
-	if (datap->event_id == -1) {
+	/*
+	 * A fentry/fexit program is attached to its function when the program
+	 * is opened as a raw tracepoint.  It stays attached for as long as the
+	 * returned link is open.
+	 */
+	if (fdatap->kind == FBT_FPROBE) {
+		union bpf_attr	attr;
+
+		if (fdatap->link_fd != -1)
+			return 0;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.raw_tracepoint.prog_fd = bpf_fd;
+
+		fdatap->link_fd = bpf(BPF_RAW_TRACEPOINT_OPEN, &attr);
+		if (fdatap->link_fd == -1)
+			return -errno;
+
+		return 0;
+	}
+
+	/*
+	 * Create the kprobe through the kprobe PMU if the kernel supports it.
+	 * Otherwise, use the TRACEFS interface.
+	 */
+	if (datap->event_id == -1 && datap->event_fd == -1) {
+		int	rc;
+
+		rc = tp_pmu_probe(dtp, prp, prp->desc->fun, NULL, 0,
+				  prp->desc->prb[0] != 'e');
+		if (rc < 0 && rc != -ENOTSUP)
+			return rc;
+	}
+
+	if (datap->event_id == -1 && datap->event_fd == -1) {
 		char	*fn;
 		FILE	*f;
 		size_t	len;
@@ -274,10 +771,12 @@ static int attach(dtrace_hdl_t *dtp, const dt_probe_t *prp, int bpf_fd)
 		if (rc == -1)
 			return -ENOENT;
 
+		datap->tracefs = 1;
+
 		/* create format file name */
 		len = snprintf(NULL, 0, "%s" FBT_GROUP_FMT "/%s/format",
 			       EVENTSFS, FBT_GROUP_DATA, prp->desc->fun) + 1;
-		fn = dt_alloc(dtp, len);
+		fn = malloc(len);
 		if (fn == NULL)
 			return -ENOENT;;
 
@@ -286,7 +785,7 @@ static int attach(dtrace_hdl_t *dtp, const dt_probe_t *prp, int bpf_fd)
 
 		/* open format file */
 		f = fopen(fn, "r");
-		dt_free(dtp, fn);
+		free(fn);
 		if (f == NULL)
 			return -ENOENT;
 
@@ -302,12 +801,163 @@ static int attach(dtrace_hdl_t *dtp, const dt_probe_t *prp, int bpf_fd)
 	return tp_attach(dtp, prp, bpf_fd);
 }
 
+/*
+ * If the kprobe_multi link for a probe cannot be created, the probe is
+ * implemented as a fentry/fexit program instead (or as a kprobe).
+ *
+ * If the fentry/fexit program for a probe cannot be loaded or attached (e.g.
+ * because the function cannot be traced through a trampoline), the probe is
+ * implemented as a kprobe instead.  It keeps the argument types from BTF.
+ */
+static int fallback(dtrace_hdl_t *dtp, const dt_probe_t *prp)
+{
+	fbt_probe_t	*datap = prp->prv_data;
+
+	if (datap->link_fd != -1) {
+		close(datap->link_fd);
+		datap->link_fd = -1;
+	}
+
+	switch (datap->kind) {
+	case FBT_KMULTI:
+		datap->kind = FBT_KPROBE;
+		fbt_resolve_fprobe(dtp, prp);
+		break;
+	case FBT_FPROBE:
+		datap->kind = FBT_KPROBE;
+		break;
+	default:
+		return -1;
+	}
+
+	dt_dprintf("fbt: using a%s for %s:%s\n",
+		   datap->kind == FBT_FPROBE ? " fentry/fexit program" :
+					       " kprobe",
+		   prp->desc->fun, prp->desc->prb);
+
+	return 0;
+}
+
+/*
+ * Attach a shared program to all the given probes with a single kprobe_multi
+ * link.  The BPF cookie for each function is the EPID offset of its probe.
+ *
+ * The link is owned by the first probe, and all probes are detached when it is
+ * closed.
+ */
+static int attach_shared(dtrace_hdl_t *dtp, dt_probe_t **prpv,
+			 const uint64_t *epoffv, uint_t prpc, int bpf_fd)
+{
+	fbt_probe_t			*datap = prpv[0]->prv_data;
+	struct fbt_link_create_attr	attr;
+	const char			**syms;
+	uint_t				i;
+	int				fd, err;
+
+	syms = calloc(prpc, sizeof(char *));
+	if (syms == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < prpc; i++)
+		syms[i] = prpv[i]->desc->fun;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_fd = bpf_fd;
+	attr.attach_type = FBT_TRACE_KPROBE_MULTI;
+	if (strcmp(prpv[0]->desc->prb, "return") == 0)
+		attr.kprobe_multi_flags = FBT_KPROBE_MULTI_RETURN;
+	attr.kprobe_multi_cnt = prpc;
+	attr.kprobe_multi_syms = (uintptr_t)syms;
+	attr.kprobe_multi_cookies = (uintptr_t)epoffv;
+
+	fd = syscall(__NR_bpf, FBT_LINK_CREATE, &attr, sizeof(attr));
+	err = errno;
+	free(syms);
+	if (fd == -1)
+		return -err;
+
+	datap->link_fd = fd;
+
+	return 0;
+}
+
+/*
+ * Probes that are implemented as fentry/fexit programs (or that fell back to
+ * kprobes from those) or that use kprobe_multi links have typed arguments (if
+ * the function is described by BTF data): the arguments of the function for
+ * entry probes, and the return offset and return value for return probes.
+ */
 static int probe_info(dtrace_hdl_t *dtp, const dt_probe_t *prp,
 		      int *argcp, dt_argdesc_t **argvp)
 {
+	fbt_probe_t	*datap = prp->prv_data;
+	dt_btf_t	*btf;
+	dt_argdesc_t	*argv;
+	char		types[DT_BTF_MAX_ARGS][DT_TYPE_NAMELEN];
+	char		*strp;
+	size_t		argsz = 0;
+	int		i, argc;
+
 	*argcp = 0;			/* no arguments by default */
 	*argvp = NULL;
 
+	fbt_resolve(dtp, prp);
+	if (datap->kind == FBT_KPROBE && datap->func.id == 0)
+		return 0;
+
+	btf = dt_btf_load_vmlinux(dtp);
+	if (datap->kind == FBT_KMULTI &&
+	    (btf == NULL || dt_btf_func(btf, prp->desc->fun, &datap->func) != 0))
+		return 0;
+
+	/*
+	 * Pass 1:
+	 * Determine the argument types, and the space needed to store them.
+	 */
+	if (strcmp(prp->desc->prb, "entry") == 0) {
+		argc = datap->func.argc;
+		for (i = 0; i < argc; i++) {
+			if (dt_btf_func_type(btf, &datap->func, i, types[i],
+					     DT_TYPE_NAMELEN) != 0)
+				strcpy(types[i], "uint64_t");
+		}
+	} else {
+		argc = datap->func.retval ? 2 : 1;
+		strcpy(types[0], "int");
+		if (argc > 1 &&
+		    dt_btf_func_type(btf, &datap->func, -1, types[1],
+				     DT_TYPE_NAMELEN) != 0)
+			strcpy(types[1], "uint64_t");
+	}
+
+	if (argc == 0)
+		return 0;
+
+	for (i = 0; i < argc; i++)
+		argsz += strlen(types[i]) + 1;
+
+	argv = dt_zalloc(dtp, argc * sizeof(dt_argdesc_t) + argsz);
+	if (argv == NULL)
+		return -ENOMEM;
+	strp = (char *)(argv + argc);
+
+	/*
+	 * Pass 2:
+	 * Fill in the argument descriptions.
+	 */
+	for (i = 0; i < argc; i++) {
+		strcpy(strp, types[i]);
+
+		argv[i].mapping = i;
+		argv[i].native = strp;
+		argv[i].xlate = NULL;
+
+		strp += strlen(strp) + 1;
+	}
+
+	*argcp = argc;
+	*argvp = argv;
+
 	return 0;
 }
 
@@ -317,17 +967,31 @@ static int probe_info(dtrace_hdl_t *dtp, const dt_probe_t *prp,
  *
  * If there is an event FD, we close it.
  *
- * We also try to remove any uprobe that may have been created for the probe.
- * This is harmless for probes that didn't get created.  If the removal fails
- * for some reason we are out of luck - fortunately it is not harmful to the
- * system as a whole.
+ * We also try to remove any kprobe that may have been created for the probe
+ * through TRACEFS.  If the removal fails for some reason we are out of luck -
+ * fortunately it is not harmful to the system as a whole.
  */
 static void probe_fini(dtrace_hdl_t *dtp, const dt_probe_t *prp)
 {
-	int	fd;
+	fbt_probe_t	*datap = prp->prv_data;
+	int		tracefs = datap->tp.tracefs;
+	int		fd;
+
+	if (datap->link_fd != -1) {
+		close(datap->link_fd);
+		datap->link_fd = -1;
+	}
 
 	tp_probe_fini(dtp, prp);
 
+	/*
+	 * Only kprobes that were created through TRACEFS need to be removed.
+	 * Those created through the kprobe PMU are removed by the kernel when
+	 * their perf event is closed.
+	 */
+	if (!tracefs)
+		return;
+
 	fd = open(KPROBE_EVENTS, O_WRONLY | O_APPEND);
 	if (fd == -1)
 		return;
@@ -340,9 +1004,13 @@ static void probe_fini(dtrace_hdl_t *dtp, const dt_probe_t *prp)
 dt_provimpl_t	dt_fbt = {
 	.name		= prvname,
 	.prog_type	= BPF_PROG_TYPE_KPROBE,
+	.prog_attr	= &prog_attr,
 	.populate	= &populate,
+	.may_provide	= &may_provide,
 	.trampoline	= &trampoline,
 	.attach		= &attach,
+	.attach_shared	= &attach_shared,
+	.fallback	= &fallback,
 	.probe_info	= &probe_info,
 	.probe_destroy	= &tp_probe_destroy,
 	.probe_fini	= &probe_fini,
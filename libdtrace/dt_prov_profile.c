@@ -13,6 +13,7 @@
 
 #include "dt_bpf.h"
 #include "dt_probe.h"
+#include "dt_string.h"
 
 static const char		prvname[] = "profile";
 static const char		modname[] = "";
@@ -154,6 +155,20 @@ static uint64_t get_period(const char *name)
 	return val;
 }
 
+/*
+ * Probes for any rate can be provided on demand, but only for probe names
+ * that start with one of the known prefixes.
+ */
+static int may_provide(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp)
+{
+	if (!dt_gmatch(modname, pdp->mod) || !dt_gmatch(funname, pdp->fun))
+		return 0;
+
+	return pdp->prb[0] == '\0' || strisglob(pdp->prb) ||
+	       strncmp(pdp->prb, PREFIX_PROFILE, strlen(PREFIX_PROFILE)) == 0 ||
+	       strncmp(pdp->prb, PREFIX_TICK, strlen(PREFIX_TICK)) == 0;
+}
+
 static int provide(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp)
 {
 	dt_provider_t	*prv;
@@ -285,7 +300,8 @@ static int attach(dtrace_hdl_t *dtp, const dt_probe_t *prp, int bpf_fd)
 {
 	profile_probe_t		*datap = prp->prv_data;
 	struct perf_event_attr	attr;
-	int			i, nattach = 0;;
+	int			i, nattach = 0;
+	int			err = ENOENT;
 	int			cnt = FDS_CNT(datap->kind);
 
 	memset(&attr, 0, sizeof(attr));
@@ -306,9 +322,12 @@ static int attach(dtrace_hdl_t *dtp, const dt_probe_t *prp, int bpf_fd)
 
 		fd = perf_event_open(&attr, -1, dtp->dt_conf.cpus[j].cpu_id,
 				     -1, 0);
-		if (fd < 0)
+		if (fd < 0) {
+			err = errno;
 			continue;
+		}
 		if (ioctl(fd, PERF_EVENT_IOC_SET_BPF, bpf_fd) < 0) {
+			err = errno;
 			close(fd);
 			continue;
 		}
@@ -316,7 +335,7 @@ static int attach(dtrace_hdl_t *dtp, const dt_probe_t *prp, int bpf_fd)
 		nattach++;
 	}
 
-	return nattach > 0 ? 0 : -1;
+	return nattach > 0 ? 0 : -err;
 }
 
 static int probe_info(dtrace_hdl_t *dtp, const dt_probe_t *prp,
@@ -355,6 +374,7 @@ dt_provimpl_t	dt_profile = {
 	.name		= prvname,
 	.prog_type	= BPF_PROG_TYPE_PERF_EVENT,
 	.populate	= &populate,
+	.may_provide	= &may_provide,
 	.trampoline	= &trampoline,
 	.probe_info	= &probe_info,
 	.provide	= &provide,
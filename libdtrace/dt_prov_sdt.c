@@ -15,6 +15,8 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <glob.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +25,7 @@
 #include <linux/bpf.h>
 #include <linux/perf_event.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
 #include <bpf_asm.h>
@@ -33,6 +36,7 @@
 #include "dt_provider.h"
 #include "dt_probe.h"
 #include "dt_pt_regs.h"
+#include "dt_string.h"
 
 static const char		prvname[] = "sdt";
 static const char		modname[] = "vmlinux";
@@ -52,6 +56,24 @@ static const char		modname[] = "vmlinux";
 
 #define FIELD_PREFIX		"field:"
 
+/*
+ * Dynamic PMUs for creating kprobes and uprobes through perf_event_open()
+ * (Linux 4.17 and later).
+ */
+#define PMU_DIR			"/sys/bus/event_source/devices/"
+
+typedef struct tp_pmu {
+	const char	*name;		/* PMU name */
+	pthread_once_t	once;		/* lookup control */
+	int		type;		/* PMU type (-1 if not available) */
+	int		retbit;		/* config bit for return probes */
+} tp_pmu_t;
+
+static tp_pmu_t			tp_pmus[] = {
+	{ "kprobe", PTHREAD_ONCE_INIT, -1, -1 },
+	{ "uprobe", PTHREAD_ONCE_INIT, -1, -1 },
+};
+
 static const dtrace_pattr_t	pattr = {
 { DTRACE_STABILITY_EVOLVING, DTRACE_STABILITY_EVOLVING, DTRACE_CLASS_ISA },
 { DTRACE_STABILITY_PRIVATE, DTRACE_STABILITY_PRIVATE, DTRACE_CLASS_UNKNOWN },
@@ -60,6 +82,58 @@ static const dtrace_pattr_t	pattr = {
 { DTRACE_STABILITY_PRIVATE, DTRACE_STABILITY_PRIVATE, DTRACE_CLASS_ISA },
 };
 
+/*
+ * Link creation command and attach type for attaching BPF programs to perf
+ * events with a BPF cookie (Linux 5.15).
+ */
+#define TP_LINK_CREATE		28	/* BPF_LINK_CREATE */
+#define TP_PERF_EVENT		41	/* BPF_PERF_EVENT */
+
+struct tp_link_create_attr {
+	uint32_t	prog_fd;
+	uint32_t	target_fd;
+	uint32_t	attach_type;
+	uint32_t	flags;
+	uint64_t	bpf_cookie;
+};
+
+/*
+ * Open the perf event for a tracepoint based probe (unless it is already open).
+ */
+static int tp_event_open(tp_probe_t *datap)
+{
+	int			fd;
+	struct perf_event_attr	attr = { 0, };
+
+	if (datap->event_fd != -1)
+		return 0;
+
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.sample_type = PERF_SAMPLE_RAW;
+	attr.sample_period = 1;
+	attr.wakeup_events = 1;
+	attr.config = datap->event_id;
+
+	fd = perf_event_open(&attr, -1, 0, -1, 0);
+	if (fd < 0)
+		return -errno;
+
+	datap->event_fd = fd;
+
+	return 0;
+}
+
+/*
+ * If the kernel supports BPF cookies for perf event attachments, all probes
+ * with the same clauses (and argument count) share a single loaded program.
+ * The EPID offset for each probe is passed to the program as its BPF cookie.
+ */
+void tp_prog_attr(dtrace_hdl_t *dtp, const dt_probe_t *prp,
+		  dt_progattr_t *attr)
+{
+	attr->shared = dt_bpf_have_attach_cookie();
+}
+
 /*
  * Attach the given (loaded) BPF program to the given probe.  This function
  * performs the necessary steps for attaching the BPF program to a tracepoint
@@ -69,29 +143,150 @@ static const dtrace_pattr_t	pattr = {
 int tp_attach(dtrace_hdl_t *dtp, const dt_probe_t *prp, int bpf_fd)
 {
 	tp_probe_t	*datap = prp->prv_data;
+	int		rc;
 
-	if (datap->event_id == -1)
+	if (datap->event_id == -1 && datap->event_fd == -1)
 		return 0;
 
-	if (datap->event_fd == -1) {
-		int			fd;
-		struct perf_event_attr	attr = { 0, };
+	rc = tp_event_open(datap);
+	if (rc < 0)
+		return rc;
+
+	if (ioctl(datap->event_fd, PERF_EVENT_IOC_SET_BPF, bpf_fd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Attach the given (loaded) shared BPF program to the given probes.  Each probe
+ * gets a BPF link for its perf event, with the EPID offset for the probe as BPF
+ * cookie.  The probes are detached when their link is closed.
+ */
+int tp_attach_shared(dtrace_hdl_t *dtp, dt_probe_t **prpv,
+		     const uint64_t *epoffv, uint_t prpc, int bpf_fd)
+{
+	uint_t	i;
+
+	for (i = 0; i < prpc; i++) {
+		tp_probe_t			*datap = prpv[i]->prv_data;
+		struct tp_link_create_attr	attr;
+		int				fd, rc;
+
+		if (datap->event_id == -1 && datap->event_fd == -1)
+			continue;
+
+		rc = tp_event_open(datap);
+		if (rc < 0)
+			return rc;
 
-		attr.type = PERF_TYPE_TRACEPOINT;
-		attr.sample_type = PERF_SAMPLE_RAW;
-		attr.sample_period = 1;
-		attr.wakeup_events = 1;
-		attr.config = datap->event_id;
+		memset(&attr, 0, sizeof(attr));
+		attr.prog_fd = bpf_fd;
+		attr.target_fd = datap->event_fd;
+		attr.attach_type = TP_PERF_EVENT;
+		attr.bpf_cookie = epoffv[i];
 
-		fd = perf_event_open(&attr, -1, 0, -1, 0);
-		if (fd < 0)
-			return dt_set_errno(dtp, errno);
+		fd = syscall(__NR_bpf, TP_LINK_CREATE, &attr, sizeof(attr));
+		if (fd == -1)
+			return -errno;
 
-		datap->event_fd = fd;
+		datap->link_fd = fd;
 	}
 
-	if (ioctl(datap->event_fd, PERF_EVENT_IOC_SET_BPF, bpf_fd) < 0)
-		return dt_set_errno(dtp, errno);
+	return 0;
+}
+
+/*
+ * Read a single integer value from a sysfs file, using the given format.
+ */
+static int tp_pmu_read(const char *pmu, const char *file, const char *fmt,
+		       int *valp)
+{
+	char	fn[PATH_MAX];
+	FILE	*f;
+	int	rc;
+
+	snprintf(fn, sizeof(fn), PMU_DIR "%s/%s", pmu, file);
+	f = fopen(fn, "r");
+	if (f == NULL)
+		return -1;
+
+	rc = fscanf(f, fmt, valp);
+	fclose(f);
+
+	return rc == 1 ? 0 : -1;
+}
+
+static void tp_pmu_init(tp_pmu_t *pmu)
+{
+	int	type, bit;
+
+	if (tp_pmu_read(pmu->name, "type", "%d", &type) != 0 ||
+	    tp_pmu_read(pmu->name, "format/retprobe", "config:%d", &bit) != 0)
+		return;
+
+	pmu->retbit = bit;
+	pmu->type = type;
+}
+
+static void tp_pmu_init_kprobe(void)
+{
+	tp_pmu_init(&tp_pmus[0]);
+}
+
+static void tp_pmu_init_uprobe(void)
+{
+	tp_pmu_init(&tp_pmus[1]);
+}
+
+/*
+ * Create a kprobe (if path is NULL) or uprobe, and open a perf event for it,
+ * using the dynamic kprobe and uprobe PMUs.  For a kprobe, sym is the name of
+ * the kernel function to probe.  For a uprobe, path is the file to probe, and
+ * off is the offset of the probe location in that file.
+ *
+ * Unlike probes that are created through the TRACEFS text interface, these
+ * probes do not have an event id, and the kernel removes them when the perf
+ * event is closed.
+ *
+ * On success, the perf event is stored in the tracepoint data of the probe.
+ * If the kernel does not support the PMU, -ENOTSUP is returned, and the caller
+ * should fall back to using TRACEFS.
+ */
+int tp_pmu_probe(dtrace_hdl_t *dtp, const dt_probe_t *prp, const char *sym,
+		 const char *path, uint64_t off, int retprobe)
+{
+	tp_probe_t		*datap = prp->prv_data;
+	tp_pmu_t		*pmu;
+	struct perf_event_attr	attr = { 0, };
+	int			fd;
+
+	if (path == NULL) {
+		pmu = &tp_pmus[0];
+		pthread_once(&pmu->once, tp_pmu_init_kprobe);
+	} else {
+		pmu = &tp_pmus[1];
+		pthread_once(&pmu->once, tp_pmu_init_uprobe);
+	}
+
+	if (pmu->type == -1)
+		return -ENOTSUP;
+
+	attr.size = sizeof(attr);
+	attr.type = pmu->type;
+	attr.sample_type = PERF_SAMPLE_RAW;
+	attr.sample_period = 1;
+	attr.wakeup_events = 1;
+	if (retprobe)
+		attr.config |= 1ULL << pmu->retbit;
+	attr.config1 = (uintptr_t)(path != NULL ? path : sym);
+	attr.config2 = off;
+
+	fd = perf_event_open(&attr, -1, 0, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	datap->event_fd = fd;
 
 	return 0;
 }
@@ -114,6 +309,7 @@ dt_probe_t *tp_probe_insert(dtrace_hdl_t *dtp, dt_provider_t *prov,
 
 	datap->event_id = -1;
 	datap->event_fd = -1;
+	datap->link_fd = -1;
 
 	return dt_probe_insert(dtp, prov, prv, mod, fun, prb, datap);
 }
@@ -302,6 +498,11 @@ void tp_probe_fini(dtrace_hdl_t *dtp, const dt_probe_t *prp)
 {
 	tp_probe_t	*datap = prp->prv_data;
 
+	if (datap->link_fd != -1) {
+		close(datap->link_fd);
+		datap->link_fd = -1;
+	}
+
 	if (datap->event_fd != -1) {
 		close(datap->event_fd);
 		datap->event_fd = -1;
@@ -312,12 +513,42 @@ void tp_probe_fini(dtrace_hdl_t *dtp, const dt_probe_t *prp)
 	tp_probe_destroy(dtp, datap);
 }
 
+/*
+ * SDT probes have an empty function name, and are named after the tracepoint
+ * event.  If a specific probe name is requested, check whether an event by
+ * that name exists in any group rather than reading the full PROBE_LIST.
+ */
+static int may_provide(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp)
+{
+	char	fn[256];
+	glob_t	gl;
+	int	rc;
+
+	if (!dt_gmatch("", pdp->fun))
+		return 0;
+	if (pdp->prb[0] == '\0' || strisglob(pdp->prb) ||
+	    strchr(pdp->prb, '/') != NULL)
+		return 1;
+
+	if (snprintf(fn, sizeof(fn), EVENTSFS "*/%s", pdp->prb) >= sizeof(fn))
+		return 1;
+
+	rc = glob(fn, GLOB_NOSORT, NULL, &gl);
+	globfree(&gl);
+
+	return rc == 0;
+}
+
 /*
  * The PROBE_LIST file lists all tracepoints in a <group>:<name> format.
  * We need to ignore these groups:
  *   - GROUP_FMT (created by DTrace processes)
  *   - kprobes and uprobes
  *   - syscalls (handled by a different provider)
+ *
+ * The probes are not cached (see dt_pcache.c) because events can be added at
+ * runtime (e.g. user_events and synthetic events) without any change to the
+ * kernel or its modules.
  */
 static int populate(dtrace_hdl_t *dtp)
 {
@@ -469,9 +700,12 @@ static int probe_info(dtrace_hdl_t *dtp, const dt_probe_t *prp,
 dt_provimpl_t	dt_sdt = {
 	.name		= prvname,
 	.prog_type	= BPF_PROG_TYPE_TRACEPOINT,
+	.prog_attr	= &tp_prog_attr,
 	.populate	= &populate,
+	.may_provide	= &may_provide,
 	.trampoline	= &trampoline,
 	.attach		= &tp_attach,
+	.attach_shared	= &tp_attach_shared,
 	.probe_info	= &probe_info,
 	.probe_destroy	= &tp_probe_destroy,
 	.probe_fini	= &tp_probe_fini,
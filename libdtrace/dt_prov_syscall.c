@@ -31,6 +31,7 @@
 
 #include "dt_impl.h"
 #include "dt_bpf_builtins.h"
+#include "dt_pcache.h"
 #include "dt_provider.h"
 #include "dt_probe.h"
 #include "dt_pt_regs.h"
@@ -67,7 +68,21 @@ struct syscall_data {
 #define ENTRY_PREFIX	"sys_enter_"
 #define EXIT_PREFIX	"sys_exit_"
 
-/* Scan the PROBE_LIST file and add probes for any syscalls events. */
+/*
+ * All syscall probes are named either entry or return.
+ */
+static int may_provide(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp)
+{
+	if (!dt_gmatch(modname, pdp->mod))
+		return 0;
+
+	return dt_gmatch("entry", pdp->prb) || dt_gmatch("return", pdp->prb);
+}
+
+/*
+ * Scan the PROBE_LIST file and add probes for any syscalls events, unless the
+ * probes can be restored from the probe cache.
+ */
 static int populate(dtrace_hdl_t *dtp)
 {
 	dt_provider_t	*prv;
@@ -79,6 +94,11 @@ static int populate(dtrace_hdl_t *dtp)
 	if (prv == NULL)
 		return 0;
 
+	n = dt_pcache_restore(dtp, prv, tp_probe_insert);
+	if (n >= 0)
+		return n;
+
+	n = 0;
 	f = fopen(PROBE_LIST, "r");
 	if (f == NULL)
 		return 0;
@@ -128,6 +148,7 @@ static int populate(dtrace_hdl_t *dtp)
 	}
 
 	fclose(f);
+	dt_pcache_save(dtp, prv);
 
 	return n;
 }
@@ -242,9 +263,12 @@ static int probe_info(dtrace_hdl_t *dtp, const dt_probe_t *prp,
 dt_provimpl_t	dt_syscall = {
 	.name		= prvname,
 	.prog_type	= BPF_PROG_TYPE_TRACEPOINT,
+	.prog_attr	= &tp_prog_attr,
 	.populate	= &populate,
+	.may_provide	= &may_provide,
 	.trampoline	= &trampoline,
 	.attach		= &tp_attach,
+	.attach_shared	= &tp_attach_shared,
 	.probe_info	= &probe_info,
 	.probe_destroy	= &tp_probe_destroy,
 	.probe_fini	= &tp_probe_fini,
@@ -22,6 +22,58 @@
 #include <dt_string.h>
 #include <dt_list.h>
 
+/*
+ * List of provider modules that register providers and probes.  A single
+ * provider module may create multiple providers.
+ */
+static const dt_provimpl_t *dt_providers[] = {
+	&dt_dtrace,
+	&dt_fbt,
+	&dt_profile,
+	&dt_sdt,
+	&dt_syscall,
+};
+
+/*
+ * Populate the provider modules that may offer probes matching the given
+ * probe description (all of them if the description is NULL), unless that
+ * already happened.  Populating fbt or sdt means reading thousands of entries
+ * from tracefs, so we only do this for providers a probe description can
+ * actually refer to.  A module that can tell cheaply whether it has matching
+ * probes does so with its may_provide() callback, so that e.g. a description
+ * with an empty provider name does not force all modules to be populated.
+ *
+ * The module is marked as populated before its populate() callback is called,
+ * because providers may look up their own probes while registering them.
+ */
+int
+dt_provider_populate(dtrace_hdl_t *dtp, const dtrace_probedesc_t *pdp)
+{
+	int	i, n, cnt = 0;
+
+	for (i = 0; i < ARRAY_SIZE(dt_providers); i++) {
+		const dt_provimpl_t	*impl = dt_providers[i];
+
+		if (dtp->dt_provpop & (1 << i))
+			continue;
+		if (pdp != NULL) {
+			if (!dt_gmatch(impl->name, pdp->prv))
+				continue;
+			if (impl->may_provide != NULL &&
+			    !impl->may_provide(dtp, pdp))
+				continue;
+		}
+
+		dtp->dt_provpop |= 1 << i;
+		n = impl->populate(dtp);
+		dt_dprintf("loaded %d probes for %s\n", n, impl->name);
+		if (n > 0)
+			cnt += n;
+	}
+
+	return cnt;
+}
+
 static dt_provider_t *
 dt_provider_insert(dtrace_hdl_t *dtp, dt_provider_t *pvp, uint_t h)
 {
@@ -39,6 +91,9 @@ dt_provider_lookup(dtrace_hdl_t *dtp, const char *name)
 {
 	uint_t h = dt_strtab_hash(name, NULL) % dtp->dt_provbuckets;
 	dt_provider_t *pvp;
+	dtrace_probedesc_t pd = { DTRACE_IDNONE, name, "", "", "" };
+
+	dt_provider_populate(dtp, &pd);
 
 	for (pvp = dtp->dt_provs[h]; pvp != NULL; pvp = pvp->pv_next) {
 		if (strcmp(pvp->desc.dtvd_name, name) == 0)
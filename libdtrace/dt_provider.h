@@ -55,15 +55,47 @@ typedef struct dt_argdesc {
 	char *xlate;
 } dt_argdesc_t;
 
+/*
+ * The kind of BPF program to load for a probe.  Most providers use the same
+ * program type for all their probes, but a provider can determine the program
+ * attributes for each probe with its prog_attr() callback.  The 'variant'
+ * identifies the trampoline that the provider generates for the probe:
+ * probes with different variants never share a program.
+ *
+ * If 'shared' is set, a single loaded program serves all probes that use it.
+ * The program is attached to all those probes at once with the attach_shared()
+ * callback, with the EPID offset for each probe as its BPF cookie.  The
+ * trampoline prologue stores the cookie of the probe that fired in the machine
+ * state.  Otherwise, the EPIDs are stored in the program for each probe.
+ */
+typedef struct dt_progattr {
+	int prog_type;				/* BPF program type */
+	uint32_t attach_type;			/* expected attach type */
+	uint32_t btf_id;			/* BTF id of attach target */
+	int variant;				/* trampoline variant */
+	int shared;				/* program shared by probes */
+} dt_progattr_t;
+
 typedef struct dt_provimpl {
 	const char *name;			/* provider generic name */
 	int prog_type;				/* BPF program type */
+	void (*prog_attr)(dtrace_hdl_t *dtp,	/* BPF program attributes */
+			  const struct dt_probe *prp,
+			  dt_progattr_t *attr);
 	int (*populate)(dtrace_hdl_t *dtp);	/* register probes */
+	int (*may_provide)(dtrace_hdl_t *dtp,	/* may have matching probes */
+			   const dtrace_probedesc_t *pdp);
 	int (*provide)(dtrace_hdl_t *dtp,	/* provide probes */
 		       const dtrace_probedesc_t *pdp);
 	void (*trampoline)(dt_pcb_t *pcb);	/* generate BPF trampoline */
 	int (*attach)(dtrace_hdl_t *dtp,	/* attach BPF prog to probe */
-		      const struct dt_probe *prp, int bpf_fd);
+		      const struct dt_probe *prp,	/* (0 or -errno) */
+		      int bpf_fd);
+	int (*attach_shared)(dtrace_hdl_t *dtp,	/* attach BPF prog to probes */
+			     struct dt_probe **prpv, const uint64_t *epoffv,
+			     uint_t prpc, int bpf_fd);	/* (0 or -errno) */
+	int (*fallback)(dtrace_hdl_t *dtp,	/* use another implementation */
+			const struct dt_probe *prp);	/* (0 if possible) */
 	int (*probe_info)(dtrace_hdl_t *dtp,	/* get probe info */
 			  const struct dt_probe *prp,
 			  int *argcp, dt_argdesc_t **argvp);
@@ -96,9 +128,18 @@ typedef struct dt_provider {
 typedef struct tp_probe {
 	int	event_id;		/* tracepoint event id */
 	int	event_fd;		/* tracepoint perf event fd */
+	int	tracefs;		/* event was created through TRACEFS */
+	int	link_fd;		/* BPF link (for shared programs) */
 } tp_probe_t;
 
+extern void tp_prog_attr(dtrace_hdl_t *dtp, const struct dt_probe *prp,
+			 dt_progattr_t *attr);
 extern int tp_attach(dtrace_hdl_t *dtp, const struct dt_probe *prp, int bpf_fd);
+extern int tp_attach_shared(dtrace_hdl_t *dtp, struct dt_probe **prpv,
+			    const uint64_t *epoffv, uint_t prpc, int bpf_fd);
+extern int tp_pmu_probe(dtrace_hdl_t *dtp, const struct dt_probe *prp,
+			const char *sym, const char *path, uint64_t off,
+			int retprobe);
 extern struct dt_probe *tp_probe_insert(dtrace_hdl_t *dtp, dt_provider_t *prov,
 					const char *prv, const char *mod,
 					const char *fun, const char *prb);
@@ -111,6 +152,7 @@ extern void tp_probe_fini(dtrace_hdl_t *dtp, const struct dt_probe *prb);
 #define	DT_PROVIDER_INTF	0x1	/* provider interface declaration */
 #define	DT_PROVIDER_IMPL	0x2	/* provider implementation is loaded */
 
+extern int dt_provider_populate(dtrace_hdl_t *, const dtrace_probedesc_t *);
 extern dt_provider_t *dt_provider_lookup(dtrace_hdl_t *, const char *);
 extern dt_provider_t *dt_provider_create(dtrace_hdl_t *, const char *,
 					 const dt_provimpl_t *,
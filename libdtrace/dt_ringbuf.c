@@ -0,0 +1,217 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, 2026, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#include <dt_impl.h>
+#include <dt_bpf.h>
+#include <dt_ringbuf.h>
+
+/*
+ * Determine whether the kernel supports BPF ring buffers by trying to create
+ * a minimal one.
+ */
+static int
+dt_ringbuf_supported(void)
+{
+	union bpf_attr	attr;
+	int		fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_RINGBUF;
+	attr.max_entries = getpagesize();
+
+	fd = bpf(BPF_MAP_CREATE, &attr);
+	if (fd < 0)
+		return 0;
+
+	close(fd);
+
+	return 1;
+}
+
+/*
+ * Determine whether trace data is written to a BPF ring buffer (rather than
+ * to per-CPU perf event buffers).  The first call resolves the bufbackend
+ * option, so that code generation, map creation, and trace data consumption
+ * all agree on the backend.
+ *
+ * Per-CPU perf event buffers are used unless the ring buffer is asked for,
+ * because the bufsize option means the size of each per-CPU buffer for the
+ * former, and the size of the one buffer for all CPUs for the latter.  The
+ * 'auto' setting selects the ring buffer if the kernel supports it.
+ */
+int
+dt_ringbuf_enabled(dtrace_hdl_t *dtp)
+{
+	dtrace_optval_t	*optp = &dtp->dt_options[DTRACEOPT_BUFBACKEND];
+
+	if (*optp == DTRACEOPT_UNSET)
+		*optp = DTRACEOPT_BUFBACKEND_PERF;
+	else if (*optp == DTRACEOPT_BUFBACKEND_AUTO)
+		*optp = dt_ringbuf_supported() ? DTRACEOPT_BUFBACKEND_RINGBUF
+					       : DTRACEOPT_BUFBACKEND_PERF;
+
+	return *optp == DTRACEOPT_BUFBACKEND_RINGBUF;
+}
+
+/*
+ * The size of the ring buffer data area must be a power-of-2 multiple of the
+ * page size.  Since the ring buffer is shared between all CPUs, the bufsize
+ * option is taken to be the size of the whole buffer (rounded up to an
+ * acceptable value).
+ */
+size_t
+dt_ringbuf_size(dtrace_hdl_t *dtp)
+{
+	dtrace_optval_t	bufsize = dtp->dt_options[DTRACEOPT_BUFSIZE];
+	size_t		size = getpagesize();
+
+	while (bufsize != DTRACEOPT_UNSET && size < bufsize)
+		size <<= 1;
+
+	return size;
+}
+
+/*
+ * Producers only wake up the consumer once the amount of unconsumed data in
+ * the ring buffer reaches the watermark.  Any data below the watermark gets
+ * picked up when the consumer polls the buffer.  The watermark depends on the
+ * wakeup policy (see dt_peb_wakeup() for the perf event buffer equivalent):
+ *
+ * - adaptive:	Wake up for every record (watermark 0).
+ * - events:	Wake up after at most wakeupevents records, assuming records of
+ *		the maximum size.  This is the default policy.
+ * - watermark:	Wake up when wakeupwmark bytes of data are available (default
+ *		half the buffer size).
+ * - timer:	Only wake up when the buffer is three quarters full.
+ */
+size_t
+dt_ringbuf_wmark(dtrace_hdl_t *dtp)
+{
+	size_t		size = dt_ringbuf_size(dtp);
+	dtrace_optval_t	val;
+
+	switch (dtp->dt_options[DTRACEOPT_WAKEUP]) {
+	case DTRACEOPT_WAKEUP_EVENTS:
+		val = dtp->dt_options[DTRACEOPT_WAKEUPEVENTS];
+		if (val == DTRACEOPT_UNSET || val <= 1)
+			return 0;
+
+		return MIN(val * (BPF_RINGBUF_HDR_SZ + DT_RINGBUF_HDRSZ +
+				  dtp->dt_maxreclen), size / 4 * 3);
+	case DTRACEOPT_WAKEUP_WATERMARK:
+		val = dtp->dt_options[DTRACEOPT_WAKEUPWMARK];
+		if (val == DTRACEOPT_UNSET)
+			return size / 2;
+
+		return MIN((size_t)val, size);
+	case DTRACEOPT_WAKEUP_TIMER:
+		return size / 4 * 3;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Perform cleanup of the ring buffer.
+ */
+void
+dt_ringbuf_exit(dtrace_hdl_t *dtp)
+{
+	dt_ringbuf_t	*rb = dtp->dt_ringbuf;
+
+	if (rb == NULL)
+		return;
+
+	if (rb->cons_pos != NULL)
+		munmap(rb->cons_pos, rb->page_size);
+	if (rb->prod_pos != NULL)
+		munmap(rb->prod_pos, rb->page_size + 2 * rb->data_size);
+
+	dt_free(dtp, rb->cpuinfo);
+	dt_free(dtp, rb->drops);
+
+	dt_free(dtp, rb);
+
+	dtp->dt_ringbuf = NULL;
+}
+
+/*
+ * Initialize the ring buffer.  The 'ringbuf' BPF map has already been created
+ * (see dt_bpf_gmap_create()), so all we need to do here is mmap its memory so
+ * the consumer can read the trace data, and add it to the event polling file
+ * descriptor.  We also set up the buffers used to read the drop counters from
+ * the cpuinfo map.
+ */
+int
+dt_ringbuf_init(dtrace_hdl_t *dtp)
+{
+	dt_ident_t		*idp, *ci;
+	dt_ringbuf_t		*rb;
+	int			ncpus = dtp->dt_conf.num_possible_cpus;
+	struct epoll_event	ev;
+	void			*base;
+
+	idp = dt_dlib_get_map(dtp, "ringbuf");
+	if (idp == NULL || idp->di_id == DT_IDENT_UNDEF)
+		return -ENOENT;
+	ci = dt_dlib_get_map(dtp, "cpuinfo");
+	if (ci == NULL || ci->di_id == DT_IDENT_UNDEF)
+		return -ENOENT;
+
+	rb = dt_zalloc(dtp, sizeof(dt_ringbuf_t));
+	if (rb == NULL)
+		return -ENOMEM;
+
+	dtp->dt_ringbuf = rb;
+
+	rb->dtp = dtp;
+	rb->fd = idp->di_id;
+	rb->page_size = getpagesize();
+	rb->data_size = dt_ringbuf_size(dtp);
+	rb->ci_fd = ci->di_id;
+
+	rb->cpuinfo = dt_calloc(dtp, ncpus, sizeof(cpuinfo_t));
+	rb->drops = dt_calloc(dtp, ncpus, sizeof(uint64_t));
+	if (rb->cpuinfo == NULL || rb->drops == NULL)
+		goto fail;
+
+	if (rb->data_size > (size_t)dtp->dt_options[DTRACEOPT_BUFSIZE])
+		fprintf(stderr, "bufsize increased to %lu\n", rb->data_size);
+
+	base = mmap(NULL, rb->page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    rb->fd, 0);
+	if (base == MAP_FAILED)
+		goto fail;
+	rb->cons_pos = base;
+
+	base = mmap(NULL, rb->page_size + 2 * rb->data_size, PROT_READ,
+		    MAP_SHARED, rb->fd, rb->page_size);
+	if (base == MAP_FAILED)
+		goto fail;
+	rb->prod_pos = base;
+	rb->data = (char *)base + rb->page_size;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = rb;
+	assert(dtp->dt_poll_fd >= 0);
+	if (epoll_ctl(dtp->dt_poll_fd, EPOLL_CTL_ADD, rb->fd, &ev) == -1)
+		goto fail;
+
+	return 0;
+
+fail:
+	dt_ringbuf_exit(dtp);
+
+	return -1;
+}
@@ -0,0 +1,63 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, 2026, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#ifndef	_DT_RINGBUF_H
+#define	_DT_RINGBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <dt_impl.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * BPF ring buffer (BPF_MAP_TYPE_RINGBUF).  A single ring buffer is shared by
+ * all CPUs.  Its memory is mapped in three parts: a consumer page (writable)
+ * that holds the consumer position, a producer page (read-only) that holds
+ * the producer position, and the data area.  The kernel maps the data area
+ * twice in a row, so records that wrap around the end of the buffer can be
+ * read as contiguous memory.
+ *
+ * Records that do not fit in the ring buffer are counted per CPU in the
+ * cpuinfo map.  The consumer keeps track of how many of those drops it has
+ * already reported.
+ */
+typedef struct dt_ringbuf {
+	dtrace_hdl_t	*dtp;		/* pointer to containing dtrace_hdl */
+	int		fd;		/* fd of the ring buffer map */
+	size_t		page_size;	/* size of a page */
+	size_t		data_size;	/* size of the data area */
+	unsigned long	*cons_pos;	/* consumer position */
+	unsigned long	*prod_pos;	/* producer position */
+	char		*data;		/* start of the data area */
+	int		ci_fd;		/* fd of the cpuinfo map */
+	cpuinfo_t	*cpuinfo;	/* cpuinfo map values (per CPU) */
+	uint64_t	*drops;		/* drops reported so far (per CPU) */
+} dt_ringbuf_t;
+
+/*
+ * Each record in the ring buffer consists of the ring buffer header (written
+ * by the kernel), the ID of the CPU that produced the record, 4 bytes of
+ * padding, and the trace data (starting with the EPID and the tag).  The
+ * padding ensures that the trace data is 64-bit aligned.
+ */
+#define DT_RINGBUF_HDRSZ	(2 * sizeof(uint32_t))
+
+extern int dt_ringbuf_enabled(dtrace_hdl_t *);
+extern size_t dt_ringbuf_size(dtrace_hdl_t *);
+extern size_t dt_ringbuf_wmark(dtrace_hdl_t *);
+extern void dt_ringbuf_exit(dtrace_hdl_t *);
+extern int dt_ringbuf_init(dtrace_hdl_t *);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _DT_RINGBUF_H */
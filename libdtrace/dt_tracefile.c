@@ -0,0 +1,599 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dt_impl.h>
+#include <dt_printf.h>
+#include <dt_tracefile.h>
+
+/*
+ * Trace data records are written to the trace file through a large stdio
+ * buffer, so recording a record costs little more than a memcpy().
+ */
+#define	DT_TF_BUFSIZE	(1024 * 1024)
+
+static int
+dt_tracefile_write(dtrace_hdl_t *dtp, const void *ptr, size_t len)
+{
+	if (len > 0 && fwrite(ptr, len, 1, dtp->dt_tracefile->fp) != 1)
+		return dt_set_errno(dtp, errno);
+
+	return 0;
+}
+
+static int
+dt_tracefile_chunk(dtrace_hdl_t *dtp, uint32_t type, size_t size)
+{
+	dt_tfchunk_t	chunk;
+
+	chunk.type = type;
+	chunk.size = size;
+
+	return dt_tracefile_write(dtp, &chunk, sizeof(chunk));
+}
+
+/*
+ * Write the description of an enabled probe (see dt_tfepid_t).
+ */
+static int
+dt_tracefile_write_epid(dtrace_hdl_t *dtp, dtrace_epid_t epid,
+			const dtrace_datadesc_t *ddp,
+			const dtrace_probedesc_t *pdp)
+{
+	const char	*strs[] = { pdp->prv, pdp->mod, pdp->fun, pdp->prb };
+	dt_tfepid_t	tfe;
+	size_t		size;
+	int		i, j;
+
+	size = sizeof(dt_tfepid_t) + ddp->dtdd_nrecs * sizeof(dt_tfrec_t);
+	for (i = 0; i < 4; i++)
+		size += strlen(strs[i]) + 1;
+	for (i = 0; i < ddp->dtdd_nrecs; i++) {
+		const dt_pfargv_t	*pfv = ddp->dtdd_recs[i].dtrd_format;
+
+		if (pfv != NULL)
+			size += strlen(pfv->pfv_format) + 1 +
+				pfv->pfv_argc * sizeof(dt_tfarg_t);
+	}
+
+	tfe.epid = epid;
+	tfe.prid = pdp->id;
+	tfe.size = ddp->dtdd_size;
+	tfe.nrecs = ddp->dtdd_nrecs;
+
+	if (dt_tracefile_chunk(dtp, DT_TF_EPID, size) != 0 ||
+	    dt_tracefile_write(dtp, &tfe, sizeof(tfe)) != 0)
+		return -1;
+
+	for (i = 0; i < 4; i++) {
+		if (dt_tracefile_write(dtp, strs[i], strlen(strs[i]) + 1) != 0)
+			return -1;
+	}
+
+	for (i = 0; i < ddp->dtdd_nrecs; i++) {
+		const dtrace_recdesc_t	*rec = &ddp->dtdd_recs[i];
+		const dt_pfargv_t	*pfv = rec->dtrd_format;
+		const dt_pfargd_t	*pfd;
+		dt_tfrec_t		tfr;
+
+		memset(&tfr, 0, sizeof(tfr));
+		tfr.action = rec->dtrd_action;
+		tfr.size = rec->dtrd_size;
+		tfr.offset = rec->dtrd_offset;
+		tfr.alignment = rec->dtrd_alignment;
+		tfr.arg = rec->dtrd_arg;
+		tfr.uarg = rec->dtrd_uarg;
+		if (pfv != NULL) {
+			tfr.nargs = pfv->pfv_argc;
+			tfr.fmtlen = strlen(pfv->pfv_format) + 1;
+			tfr.fmtflags = pfv->pfv_flags;
+		}
+
+		if (dt_tracefile_write(dtp, &tfr, sizeof(tfr)) != 0)
+			return -1;
+
+		if (pfv == NULL)
+			continue;
+
+		if (dt_tracefile_write(dtp, pfv->pfv_format, tfr.fmtlen) != 0)
+			return -1;
+
+		/*
+		 * The argument descriptors carry the output formats that were
+		 * derived when the format was validated against its arguments.
+		 */
+		for (j = 0, pfd = pfv->pfv_argv; j < pfv->pfv_argc;
+		     j++, pfd = pfd->pfd_next) {
+			dt_tfarg_t	tfa;
+
+			memset(&tfa, 0, sizeof(tfa));
+			tfa.flags = pfd->pfd_flags;
+			strncpy(tfa.fmt, pfd->pfd_fmt, sizeof(tfa.fmt) - 1);
+
+			if (dt_tracefile_write(dtp, &tfa, sizeof(tfa)) != 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write the options and the descriptions of all enabled probes to the trace
+ * file (if any).  This is called when tracing is started.
+ */
+int
+dt_tracefile_start(dtrace_hdl_t *dtp)
+{
+	dt_tracefile_t	*tf = dtp->dt_tracefile;
+	dtrace_epid_t	epid;
+
+	if (tf == NULL || tf->replay)
+		return 0;
+
+	if (dt_tracefile_chunk(dtp, DT_TF_OPTIONS, sizeof(dtp->dt_options)) ||
+	    dt_tracefile_write(dtp, dtp->dt_options, sizeof(dtp->dt_options)))
+		return -1;
+
+	for (epid = 0; epid < dtp->dt_maxprobe; epid++) {
+		if (dtp->dt_ddesc[epid] == NULL)
+			continue;
+
+		if (dt_tracefile_write_epid(dtp, epid, dtp->dt_ddesc[epid],
+					    dtp->dt_pdesc[epid]) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write a trace data record (starting with the EPID and the tag) to the trace
+ * file.  Just like for records that are processed, DTRACE_WORKSTATUS_DONE is
+ * returned if the record is for a clause that calls exit().
+ */
+dtrace_workstatus_t
+dt_tracefile_write_rec(dtrace_hdl_t *dtp, uint_t cpu, const char *data,
+		       uint32_t size)
+{
+	dtrace_epid_t		epid = ((uint32_t *)data)[0];
+	dtrace_datadesc_t	*ddp;
+	uint32_t		hdr[2] = { cpu, 0 };
+	int			i;
+
+	if (dt_tracefile_chunk(dtp, DT_TF_DATA, sizeof(hdr) + size) != 0 ||
+	    dt_tracefile_write(dtp, hdr, sizeof(hdr)) != 0 ||
+	    dt_tracefile_write(dtp, data, size) != 0)
+		return DTRACE_WORKSTATUS_ERROR;
+
+	if (epid >= dtp->dt_maxprobe || dtp->dt_ddesc[epid] == NULL)
+		return DTRACE_WORKSTATUS_OKAY;
+
+	ddp = dtp->dt_ddesc[epid];
+	for (i = 0; i < ddp->dtdd_nrecs; i++) {
+		if (ddp->dtdd_recs[i].dtrd_action == DTRACEACT_EXIT)
+			return DTRACE_WORKSTATUS_DONE;
+	}
+
+	return DTRACE_WORKSTATUS_OKAY;
+}
+
+int
+dt_tracefile_write_drop(dtrace_hdl_t *dtp, uint_t cpu, uint64_t drops)
+{
+	uint32_t	hdr[2] = { cpu, 0 };
+
+	if (dt_tracefile_chunk(dtp, DT_TF_DROP, sizeof(hdr) + sizeof(drops)) ||
+	    dt_tracefile_write(dtp, hdr, sizeof(hdr)) != 0 ||
+	    dt_tracefile_write(dtp, &drops, sizeof(drops)) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Read the next chunk from the trace file.  On success, the payload is stored
+ * in a buffer that remains valid until the next chunk is read.  Returns 1 if a
+ * chunk was read, 0 at the end of the file, and -1 on error.
+ */
+int
+dt_tracefile_read(dtrace_hdl_t *dtp, dt_tfchunk_t *chunk, char **payload)
+{
+	dt_tracefile_t	*tf = dtp->dt_tracefile;
+	size_t		n;
+
+	n = fread(chunk, 1, sizeof(dt_tfchunk_t), tf->fp);
+	if (n != sizeof(dt_tfchunk_t)) {
+		if (ferror(tf->fp))
+			return dt_set_errno(dtp, errno);
+		if (n > 0)
+			return dt_set_errno(dtp, EDT_TRACEFILE);
+
+		return 0;
+	}
+
+	if (chunk->size > tf->buf_size) {
+		char	*buf;
+
+		buf = dt_alloc(dtp, chunk->size);
+		if (buf == NULL)
+			return -1;
+
+		dt_free(dtp, tf->buf);
+		tf->buf = buf;
+		tf->buf_size = chunk->size;
+	}
+
+	if (chunk->size > 0 && fread(tf->buf, chunk->size, 1, tf->fp) != 1) {
+		if (ferror(tf->fp))
+			return dt_set_errno(dtp, errno);
+
+		return dt_set_errno(dtp, EDT_TRACEFILE);
+	}
+
+	*payload = tf->buf;
+
+	return 1;
+}
+
+/*
+ * Register an enabled probe that was read from a trace file.
+ */
+static int
+dt_tracefile_epid_add(dtrace_hdl_t *dtp, dtrace_epid_t epid,
+		      dtrace_datadesc_t *ddp, dtrace_probedesc_t *pdp)
+{
+	dt_tracefile_t	*tf = dtp->dt_tracefile;
+
+	if (dt_epid_grow(dtp, epid) != 0)
+		return -1;
+
+	if (dtp->dt_ddesc[epid] != NULL)
+		return dt_set_errno(dtp, EDT_TRACEFILE);
+
+	if (tf->npdescs % 16 == 0) {
+		dtrace_probedesc_t	**npdescs;
+
+		npdescs = dt_calloc(dtp, tf->npdescs + 16, sizeof(void *));
+		if (npdescs == NULL)
+			return dt_set_errno(dtp, EDT_NOMEM);
+
+		if (tf->pdescs != NULL) {
+			memcpy(npdescs, tf->pdescs,
+			       tf->npdescs * sizeof(void *));
+			dt_free(dtp, tf->pdescs);
+		}
+		tf->pdescs = npdescs;
+	}
+
+	tf->pdescs[tf->npdescs++] = pdp;
+	dtp->dt_ddesc[epid] = ddp;
+	dtp->dt_pdesc[epid] = pdp;
+	dt_epid_info(dtp, epid);
+	if (epid >= dtp->dt_nextepid)
+		dtp->dt_nextepid = epid + 1;
+
+	return 0;
+}
+
+/*
+ * Read the description of an enabled probe (see dt_tracefile_write_epid()).
+ */
+static int
+dt_tracefile_read_epid(dtrace_hdl_t *dtp, const char *p, uint32_t size)
+{
+	const char		*end = p + size;
+	const char		*strs[4];
+	dt_tfepid_t		tfe;
+	dtrace_datadesc_t	*ddp;
+	dtrace_probedesc_t	*pdp;
+	char			*s;
+	size_t			len = 0;
+	int			i, j;
+
+	if (size < sizeof(tfe))
+		return dt_set_errno(dtp, EDT_TRACEFILE);
+
+	memcpy(&tfe, p, sizeof(tfe));
+	p += sizeof(tfe);
+
+	for (i = 0; i < 4; i++) {
+		size_t	n = strnlen(p, end - p);
+
+		if (n == end - p)
+			return dt_set_errno(dtp, EDT_TRACEFILE);
+
+		strs[i] = p;
+		p += n + 1;
+		len += n + 1;
+	}
+
+	/*
+	 * The probe description and its strings are allocated as one block.
+	 */
+	pdp = dt_zalloc(dtp, sizeof(dtrace_probedesc_t) + len);
+	if (pdp == NULL)
+		return -1;
+
+	s = (char *)(pdp + 1);
+	memcpy(s, strs[0], len);
+	pdp->id = tfe.prid;
+	pdp->prv = s;
+	pdp->mod = s + (strs[1] - strs[0]);
+	pdp->fun = s + (strs[2] - strs[0]);
+	pdp->prb = s + (strs[3] - strs[0]);
+
+	ddp = dt_datadesc_create(dtp);
+	if (ddp == NULL)
+		goto fail;
+
+	ddp->dtdd_size = tfe.size;
+	ddp->dtdd_recs = dt_calloc(dtp, tfe.nrecs, sizeof(dtrace_recdesc_t));
+	if (ddp->dtdd_recs == NULL && tfe.nrecs > 0)
+		goto fail;
+	ddp->dtdd_nrecs = tfe.nrecs;
+
+	for (i = 0; i < tfe.nrecs; i++) {
+		dtrace_recdesc_t	*rec = &ddp->dtdd_recs[i];
+		dt_pfargv_t		*pfv;
+		dt_pfargd_t		*pfd;
+		dt_tfrec_t		tfr;
+
+		if (end - p < sizeof(tfr))
+			goto corrupt;
+
+		memcpy(&tfr, p, sizeof(tfr));
+		p += sizeof(tfr);
+
+		/*
+		 * The record must lie within the trace data, and its alignment
+		 * must be a power of 2.
+		 */
+		if ((uint64_t)tfr.offset + tfr.size > tfe.size ||
+		    tfr.alignment == 0 ||
+		    (tfr.alignment & (tfr.alignment - 1)) != 0)
+			goto corrupt;
+
+		rec->dtrd_action = tfr.action;
+		rec->dtrd_size = tfr.size;
+		rec->dtrd_offset = tfr.offset;
+		rec->dtrd_alignment = tfr.alignment;
+		rec->dtrd_arg = tfr.arg;
+		rec->dtrd_uarg = tfr.uarg;
+
+		if (tfr.fmtlen == 0)
+			continue;
+
+		if (end - p < tfr.fmtlen + tfr.nargs * sizeof(dt_tfarg_t) ||
+		    p[tfr.fmtlen - 1] != '\0')
+			goto corrupt;
+
+		pfv = dt_printf_create(dtp, p);
+		if (pfv == NULL)
+			goto fail;
+
+		rec->dtrd_format = pfv;
+		p += tfr.fmtlen;
+
+		if (pfv->pfv_argc != tfr.nargs)
+			goto corrupt;
+
+		/*
+		 * Only aggregation formats (printa()) are used with aggregation
+		 * data.
+		 */
+		if (tfr.fmtflags & ~(DT_PRINTF_EXACTLEN | DT_PRINTF_AGGREGATION))
+			goto corrupt;
+		if ((tfr.fmtflags & DT_PRINTF_AGGREGATION) &&
+		    tfr.action != DTRACEACT_PRINTA)
+			goto corrupt;
+
+		pfv->pfv_flags = tfr.fmtflags;
+
+		/*
+		 * The conversions were parsed from the format string, so only
+		 * the output format that validation derived from the argument
+		 * types is taken from the trace file (if it is consistent with
+		 * the conversion).
+		 */
+		for (j = 0, pfd = pfv->pfv_argv; j < pfv->pfv_argc;
+		     j++, pfd = pfd->pfd_next) {
+			dt_tfarg_t	tfa;
+
+			memcpy(&tfa, p, sizeof(tfa));
+			p += sizeof(tfa);
+
+			tfa.fmt[sizeof(tfa.fmt) - 1] = '\0';
+			if (dt_printf_setfmt(pfd, tfa.fmt, tfa.flags) != 0)
+				goto corrupt;
+		}
+	}
+
+	if (dt_consume_plan(dtp, ddp) != 0 ||
+	    dt_tracefile_epid_add(dtp, tfe.epid, ddp, pdp) != 0)
+		goto fail;
+
+	return 0;
+
+corrupt:
+	dt_set_errno(dtp, EDT_TRACEFILE);
+fail:
+	if (ddp != NULL)
+		dt_datadesc_release(dtp, ddp);
+	dt_free(dtp, pdp);
+
+	return -1;
+}
+
+/*
+ * Options that were not set explicitly for this handle are taken from the
+ * trace file, so that trace data is processed in the same way as it would
+ * have been when it was recorded.
+ */
+static void
+dt_tracefile_read_options(dtrace_hdl_t *dtp, const char *p, uint32_t size)
+{
+	const dtrace_optval_t	*opts = (const dtrace_optval_t *)p;
+	int			i, n;
+
+	n = MIN(size / sizeof(dtrace_optval_t), DTRACEOPT_MAX);
+	for (i = 0; i < n; i++) {
+		if (dtp->dt_options[i] == DTRACEOPT_UNSET)
+			dtp->dt_options[i] = opts[i];
+	}
+}
+
+void
+dt_tracefile_close(dtrace_hdl_t *dtp)
+{
+	dt_tracefile_t	*tf = dtp->dt_tracefile;
+	uint32_t	i;
+
+	if (tf == NULL)
+		return;
+
+	if (tf->fp != NULL)
+		fclose(tf->fp);
+
+	/*
+	 * The data descriptions are released with the enabled probe IDs, but
+	 * the probe descriptions are ours to free.
+	 */
+	for (i = 0; i < tf->npdescs; i++)
+		dt_free(dtp, tf->pdescs[i]);
+
+	dt_free(dtp, tf->pdescs);
+	dt_free(dtp, tf->buf);
+	dt_free(dtp, tf);
+
+	dtp->dt_tracefile = NULL;
+}
+
+/*
+ * Write trace data to the given file rather than processing it.  This must be
+ * called before tracing is started.
+ */
+int
+dtrace_tracefile_create(dtrace_hdl_t *dtp, const char *path)
+{
+	dt_tracefile_t	*tf;
+	dt_tfhdr_t	hdr;
+
+	if (dtp->dt_active)
+		return dt_set_errno(dtp, EDT_ACTIVE);
+	if (dtp->dt_tracefile != NULL)
+		return dt_set_errno(dtp, EINVAL);
+
+	tf = dt_zalloc(dtp, sizeof(dt_tracefile_t));
+	if (tf == NULL)
+		return -1;
+
+	dtp->dt_tracefile = tf;
+
+	tf->fp = fopen(path, "w");
+	if (tf->fp == NULL) {
+		dt_set_errno(dtp, errno);
+		goto fail;
+	}
+
+	setvbuf(tf->fp, NULL, _IOFBF, DT_TF_BUFSIZE);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DT_TF_MAGIC, sizeof(hdr.magic));
+	hdr.version = DT_TF_VERSION;
+	hdr.order = DT_TF_ORDER;
+
+	if (dt_tracefile_write(dtp, &hdr, sizeof(hdr)) != 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	dt_tracefile_close(dtp);
+
+	return -1;
+}
+
+/*
+ * Open a trace file for processing with dtrace_tracefile_consume().  The
+ * options and the enabled probe descriptions are read from the file, so this
+ * cannot be used on a handle that has enabled probes of its own.
+ */
+int
+dtrace_tracefile_open(dtrace_hdl_t *dtp, const char *path)
+{
+	dt_tracefile_t	*tf;
+	dt_tfhdr_t	hdr;
+	dt_tfchunk_t	chunk;
+	char		*payload;
+	long		pos;
+	int		rval;
+
+	if (dtp->dt_active)
+		return dt_set_errno(dtp, EDT_ACTIVE);
+	if (dtp->dt_tracefile != NULL || dtp->dt_maxprobe != 0)
+		return dt_set_errno(dtp, EINVAL);
+
+	tf = dt_zalloc(dtp, sizeof(dt_tracefile_t));
+	if (tf == NULL)
+		return -1;
+
+	dtp->dt_tracefile = tf;
+	tf->replay = 1;
+
+	tf->fp = fopen(path, "r");
+	if (tf->fp == NULL) {
+		dt_set_errno(dtp, errno);
+		goto fail;
+	}
+
+	setvbuf(tf->fp, NULL, _IOFBF, DT_TF_BUFSIZE);
+
+	if (fread(&hdr, sizeof(hdr), 1, tf->fp) != 1 ||
+	    memcmp(hdr.magic, DT_TF_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != DT_TF_VERSION || hdr.order != DT_TF_ORDER) {
+		dt_set_errno(dtp, EDT_TRACEFILE);
+		goto fail;
+	}
+
+	/*
+	 * Read chunks up to the first trace data record.
+	 */
+	for (;;) {
+		pos = ftell(tf->fp);
+		rval = dt_tracefile_read(dtp, &chunk, &payload);
+		if (rval < 0)
+			goto fail;
+		if (rval == 0)
+			break;
+
+		if (chunk.type == DT_TF_OPTIONS)
+			dt_tracefile_read_options(dtp, payload, chunk.size);
+		else if (chunk.type == DT_TF_EPID) {
+			if (dt_tracefile_read_epid(dtp, payload,
+						   chunk.size) != 0)
+				goto fail;
+		} else {
+			if (fseek(tf->fp, pos, SEEK_SET) != 0) {
+				dt_set_errno(dtp, errno);
+				goto fail;
+			}
+			break;
+		}
+	}
+
+	return 0;
+
+fail:
+	dt_epid_destroy(dtp);
+	dt_tracefile_close(dtp);
+
+	return -1;
+}
@@ -0,0 +1,112 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#ifndef	_DT_TRACEFILE_H
+#define	_DT_TRACEFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <dt_impl.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Trace file.  Rather than being processed as it is consumed, trace data can
+ * be written to a trace file (dtrace_tracefile_create()) and be processed
+ * later, possibly on another system (dtrace_tracefile_open() and
+ * dtrace_tracefile_consume()).
+ *
+ * A trace file starts with a header, followed by a sequence of chunks.  Each
+ * chunk consists of a chunk header (type and payload size) and the payload.
+ * The options and the descriptions of all enabled probes are written when
+ * tracing is started, so they precede all trace data records.  All values are
+ * stored in the byte order of the system that wrote the file.
+ */
+#define	DT_TF_MAGIC	"\177DTF"
+#define	DT_TF_VERSION	1
+#define	DT_TF_ORDER	0x01020304
+
+typedef struct dt_tfhdr {
+	char		magic[4];	/* DT_TF_MAGIC */
+	uint32_t	version;	/* DT_TF_VERSION */
+	uint32_t	order;		/* DT_TF_ORDER (in file byte order) */
+	uint32_t	pad;
+} dt_tfhdr_t;
+
+#define	DT_TF_OPTIONS	1	/* option values */
+#define	DT_TF_EPID	2	/* enabled probe description */
+#define	DT_TF_DATA	3	/* trace data record */
+#define	DT_TF_DROP	4	/* dropped trace data records */
+
+typedef struct dt_tfchunk {
+	uint32_t	type;		/* chunk type (DT_TF_*) */
+	uint32_t	size;		/* size of the payload */
+} dt_tfchunk_t;
+
+/*
+ * The payload of a DT_TF_EPID chunk is a dt_tfepid_t, followed by the
+ * provider, module, function, and name of the probe (as consecutive strings),
+ * and a dt_tfrec_t for each record in the data description.  A record that
+ * has a printf-style format is immediately followed by the format string and
+ * a dt_tfarg_t for each of its argument descriptors.
+ */
+typedef struct dt_tfepid {
+	uint32_t	epid;		/* enabled probe ID */
+	uint32_t	prid;		/* probe ID */
+	uint32_t	size;		/* size of the trace data */
+	uint32_t	nrecs;		/* number of records */
+} dt_tfepid_t;
+
+typedef struct dt_tfrec {
+	uint32_t	action;		/* kind of action */
+	uint32_t	size;		/* size of the record */
+	uint32_t	offset;		/* offset in the trace data */
+	uint16_t	alignment;	/* required alignment */
+	uint16_t	nargs;		/* number of format arguments */
+	uint32_t	fmtlen;		/* size of format string (0 if none) */
+	uint32_t	fmtflags;	/* format validation flags */
+	uint64_t	arg;		/* action argument */
+	uint64_t	uarg;		/* user argument */
+} dt_tfrec_t;
+
+typedef struct dt_tfarg {
+	uint32_t	flags;		/* conversion flags */
+	char		fmt[8];		/* output format name */
+} dt_tfarg_t;
+
+/*
+ * The payload of a DT_TF_DATA chunk is the ID of the CPU that produced the
+ * record, 4 bytes of padding, and the trace data (starting with the EPID and
+ * the tag).  The payload of a DT_TF_DROP chunk is the ID of the CPU, 4 bytes
+ * of padding, and the number of dropped records (64 bits).
+ */
+#define	DT_TF_DATAHDRSZ	(2 * sizeof(uint32_t))
+
+typedef struct dt_tracefile {
+	FILE			*fp;		/* trace file */
+	int			replay;		/* file is being read */
+	char			*buf;		/* chunk payload (reading) */
+	size_t			buf_size;	/* allocated size of buf */
+	dtrace_probedesc_t	**pdescs;	/* probe descriptions */
+	uint32_t		npdescs;	/* number of pdescs */
+} dt_tracefile_t;
+
+extern int dt_tracefile_start(dtrace_hdl_t *);
+extern dtrace_workstatus_t dt_tracefile_write_rec(dtrace_hdl_t *, uint_t,
+						  const char *, uint32_t);
+extern int dt_tracefile_write_drop(dtrace_hdl_t *, uint_t, uint64_t);
+extern int dt_tracefile_read(dtrace_hdl_t *, dt_tfchunk_t *, char **);
+extern void dt_tracefile_close(dtrace_hdl_t *);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _DT_TRACEFILE_H */
@@ -1,18 +1,21 @@
 /*
  * Oracle Linux DTrace.
- * Copyright (c) 2006, 2020, Oracle and/or its affiliates. All rights reserved.
+ * Copyright (c) 2006, 2026, Oracle and/or its affiliates. All rights reserved.
  * Licensed under the Universal Permissive License v 1.0 as shown at
  * http://oss.oracle.com/licenses/upl.
  */
 
 #include <dt_impl.h>
 #include <dt_peb.h>
+#include <dt_ringbuf.h>
+#include <dt_tracefile.h>
 #include <dt_probe.h>
 #include <dt_bpf.h>
 #include <stddef.h>
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
+#include <sched.h>
 #include <libproc.h>
 #include <port.h>
 #include <linux/perf_event.h>
@@ -38,6 +41,36 @@ END_probe(void)
 {
 }
 
+/*
+ * Fire the BEGIN or END probe with the calling thread bound to the CPU it is
+ * running on, and return that CPU (or DTRACE_CPUALL if the thread could not
+ * be bound).  The trace data for the probe is written to the perf event
+ * buffer of that CPU (see dt_consume_bufs()).
+ */
+static processorid_t
+dt_probe_oncpu(void (*probe)(void))
+{
+	cpu_set_t	mask, omask;
+	int		cpu = sched_getcpu();
+
+	if (cpu < 0 || sched_getaffinity(0, sizeof(omask), &omask) != 0) {
+		probe();
+		return DTRACE_CPUALL;
+	}
+
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+		probe();
+		return DTRACE_CPUALL;
+	}
+
+	probe();
+	sched_setaffinity(0, sizeof(omask), &omask);
+
+	return cpu;
+}
+
 void
 dtrace_sleep(dtrace_hdl_t *dtp)
 {
@@ -120,6 +153,17 @@ dtrace_sleep(dtrace_hdl_t *dtp)
 	(void) pthread_mutex_unlock(&dph->dph_lock);
 }
 
+/*
+ * Fill in the status.  It is not obtained from the kernel: the only
+ * information we have is what the consumer has seen (i.e. lost trace records).
+ */
+static void
+dt_status_snap(dtrace_hdl_t *dtp, dtrace_status_t *stp)
+{
+	memset(stp, 0, sizeof(dtrace_status_t));
+	stp->dtst_drops = dtp->dt_drops;
+}
+
 int
 dtrace_status(dtrace_hdl_t *dtp)
 {
@@ -142,8 +186,11 @@ dtrace_status(dtrace_hdl_t *dtp)
 		dtp->dt_laststatus = now;
 	}
 
+#if 0
 	if (dt_ioctl(dtp, DTRACEIOC_STATUS, &dtp->dt_status[gen]) == -1)
 		return (dt_set_errno(dtp, errno));
+#endif
+	dt_status_snap(dtp, &dtp->dt_status[gen]);
 
 	dtp->dt_statusgen ^= 1;
 
@@ -172,6 +219,92 @@ dtrace_status(dtrace_hdl_t *dtp)
 	return (DTRACE_STATUS_FILLED);
 }
 
+int
+dtrace_stats(dtrace_hdl_t *dtp, dtrace_stats_t *stp)
+{
+	int	i;
+
+	if (dtp->dt_cpustats == NULL)
+		return dt_set_errno(dtp, EINVAL);
+
+	*stp = dtp->dt_stats;
+	stp->dtsts_nrecs = dtp->dt_nrecs;
+	stp->dtsts_drops = dtp->dt_drops;
+	for (i = 0; i <= dtp->dt_conf.max_cpuid; i++) {
+		stp->dtsts_bytes += dtp->dt_cpustats[i].dtcs_bytes;
+		stp->dtsts_wraps += dtp->dt_cpustats[i].dtcs_wraps;
+	}
+
+	return 0;
+}
+
+int
+dtrace_cpustats(dtrace_hdl_t *dtp, processorid_t cpu, dtrace_cpustats_t *csp)
+{
+	if (dtp->dt_cpustats == NULL || cpu < 0 ||
+	    cpu > dtp->dt_conf.max_cpuid)
+		return dt_set_errno(dtp, EINVAL);
+
+	*csp = dtp->dt_cpustats[cpu];
+
+	return 0;
+}
+
+static int
+dt_probestats_clause(dtrace_hdl_t *dtp, dt_ident_t *idp, void *arg)
+{
+	(*(uint64_t *)arg)++;
+
+	return 0;
+}
+
+/*
+ * Report the statistics of the BPF program of each enabled probe.  All clauses
+ * for a probe are executed by a single BPF program, so the kernel accounts for
+ * them together.
+ */
+int
+dtrace_probestats_iter(dtrace_hdl_t *dtp, dtrace_probestats_f *func,
+		       void *arg)
+{
+	dt_probe_t		*prp;
+	dtrace_probestats_t	ps;
+	uint64_t		cnt, ns;
+	int			runstats;
+	int			rc;
+
+	if (dtp->dt_cpustats == NULL)
+		return dt_set_errno(dtp, EINVAL);
+
+	runstats = dt_bpf_stats_enabled(dtp);
+
+	for (prp = dt_list_next(&dtp->dt_enablings); prp != NULL;
+	     prp = dt_list_next(prp)) {
+		if (prp->prog_fd == -1)
+			continue;
+
+		memset(&ps, 0, sizeof(ps));
+		if (runstats) {
+			if (dt_bpf_prog_stats(prp->prog_fd, &cnt, &ns) != 0)
+				return dt_set_errno(dtp, errno);
+
+			ps.dtps_runcnt = cnt;
+			ps.dtps_runtime = ns;
+		}
+		ps.dtps_load_time = prp->load_time;
+		ps.dtps_attach_time = prp->attach_time;
+
+		dt_probe_clause_iter(dtp, prp, dt_probestats_clause,
+				     &ps.dtps_nclauses);
+
+		rc = func(dtp, prp->desc, &ps, arg);
+		if (rc != 0)
+			return rc;
+	}
+
+	return 0;
+}
+
 int
 dtrace_go(dtrace_hdl_t *dtp, uint_t cflags)
 {
@@ -194,6 +327,21 @@ dtrace_go(dtrace_hdl_t *dtp, uint_t cflags)
 	    dtp->dt_errno != ENOTTY || dtp->dt_vector == NULL))
 		return (-1); /* dt_errno has been set for us */
 
+	/*
+	 * If requested, keep statistics about the consumption of trace data,
+	 * and have the kernel keep run-time statistics for the BPF programs.
+	 * The latter must be enabled before programs are attached, so that
+	 * every firing is accounted for.
+	 */
+	if (dtp->dt_options[DTRACEOPT_STATS] != DTRACEOPT_UNSET) {
+		dtp->dt_cpustats = dt_calloc(dtp, dtp->dt_conf.max_cpuid + 1,
+					     sizeof(dtrace_cpustats_t));
+		if (dtp->dt_cpustats == NULL)
+			return -1;
+
+		dt_bpf_stats_enable(dtp);
+	}
+
 	/*
 	 * Create the global BPF maps.  This is done only once regardless of
 	 * how many programs there are.
@@ -217,6 +365,19 @@ dtrace_go(dtrace_hdl_t *dtp, uint_t cflags)
 		return (dt_set_errno(dtp, errno));
 #endif
 
+	/*
+	 * Compile the printf() formats, now that all data descriptions are
+	 * known.
+	 */
+	dt_printf_compile_all(dtp);
+
+	/*
+	 * If trace data is being recorded, write the descriptions of the
+	 * enabled probes to the trace file.
+	 */
+	if (dt_tracefile_start(dtp) != 0)
+		return -1;
+
 	/*
 	 * Set up the event polling file descriptor.
 	 */
@@ -229,16 +390,35 @@ dtrace_go(dtrace_hdl_t *dtp, uint_t cflags)
 	 * 4-byte gap, and the largest trace data record we may be writing to
 	 * the buffer.  In other words, the buffer needs to be large enough to
 	 * hold at least one perf-encapsulated trace data record.
+	 *
+	 * If the events are merged in timestamp order, they also include a
+	 * 64-bit timestamp.
+	 *
+	 * The BPF ring buffer needs space for the ring buffer record header,
+	 * the CPU id, a 4-byte gap, and the largest trace data record.
 	 */
 	dtrace_getopt(dtp, "bufsize", &size);
-	if (size == 0 ||
-	    size < sizeof(struct perf_event_header) + sizeof(uint32_t) +
-		   dtp->dt_maxreclen)
-		return dt_set_errno(dtp, EDT_BUFTOOSMALL);
-	if (dt_pebs_init(dtp, size) == -1)
-		return dt_set_errno(dtp, EDT_NOMEM);
-
-	BEGIN_probe();
+	if (dt_ringbuf_enabled(dtp)) {
+		if (size == 0 ||
+		    size < BPF_RINGBUF_HDR_SZ + DT_RINGBUF_HDRSZ +
+			   dtp->dt_maxreclen)
+			return dt_set_errno(dtp, EDT_BUFTOOSMALL);
+		if (dt_ringbuf_init(dtp) != 0)
+			return dt_set_errno(dtp, EDT_NOMEM);
+	} else {
+		size_t	hdrsz = sizeof(struct perf_event_header) +
+				sizeof(uint32_t);
+
+		if (dt_consume_ordered(dtp))
+			hdrsz += sizeof(uint64_t);
+		if (size == 0 || size < hdrsz + dtp->dt_maxreclen)
+			return dt_set_errno(dtp, EDT_BUFTOOSMALL);
+		if (dt_pebs_init(dtp, size) == -1)
+			return dt_set_errno(dtp, EDT_NOMEM);
+	}
+
+	dtp->dt_endedon = DTRACE_CPUALL;
+	dtp->dt_beganon = dt_probe_oncpu(BEGIN_probe);
 #if 0
 	if (dt_ioctl(dtp, DTRACEIOC_GO, &dtp->dt_beganon) == -1) {
 		if (errno == EACCES)
@@ -265,11 +445,9 @@ dtrace_go(dtrace_hdl_t *dtp, uint_t cflags)
 #if 0
 	if (dt_options_load(dtp) == -1)
 		return (dt_set_errno(dtp, errno));
-
-	return (dt_aggregate_go(dtp));
-#else
-	return 0;
 #endif
+
+	return dt_aggregate_go(dtp);
 }
 
 int
@@ -285,17 +463,18 @@ dtrace_stop(dtrace_hdl_t *dtp)
 		return (dt_set_errno(dtp, errno));
 #endif
 
-	END_probe();
+	dtp->dt_endedon = dt_probe_oncpu(END_probe);
 
 	dtp->dt_stopped = 1;
 
-#if 0
 	/*
 	 * Now that we're stopped, we're going to get status one final time.
 	 */
+#if 0
 	if (dt_ioctl(dtp, DTRACEIOC_STATUS, &dtp->dt_status[gen]) == -1)
 		return (dt_set_errno(dtp, errno));
 #endif
+	dt_status_snap(dtp, &dtp->dt_status[gen]);
 
 	if (dt_handle_status(dtp, &dtp->dt_status[gen ^ 1],
 	    &dtp->dt_status[gen]) == -1)
@@ -363,6 +542,22 @@ dtrace_workstatus_t
 dtrace_work(dtrace_hdl_t *dtp, FILE *fp, dtrace_consume_probe_f *pfunc,
 	    dtrace_consume_rec_f *rfunc, void *arg)
 {
-	return dtrace_consume(dtp, fp, pfunc, rfunc, arg);
+	dtrace_workstatus_t	rval;
+
+	rval = dtrace_consume(dtp, fp, pfunc, rfunc, arg);
+	if (rval == DTRACE_WORKSTATUS_ERROR)
+		return rval;
+
+	/*
+	 * Once tracing is stopped, force a final aggregation snapshot
+	 * regardless of aggrate.
+	 */
+	if (dtp->dt_stopped)
+		dtp->dt_lastagg = 0;
+
+	if (dtrace_aggregate_snap(dtp) == -1)
+		return DTRACE_WORKSTATUS_ERROR;
+
+	return rval;
 }
 #endif
@@ -0,0 +1,404 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, 2026, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <dt_impl.h>
+#include <dt_writer.h>
+
+#define	DT_WRITER_NBATCHES	16		/* default queue depth */
+#define	DT_WRITER_BATCHSIZE	(256 * 1024)	/* default batch size */
+
+/*
+ * Write all data described by the given vector, retrying after partial
+ * writes.
+ */
+static int
+dt_writer_writev(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt > 0) {
+		ssize_t	n;
+
+		n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		while (cnt > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The writer thread writes out all queued batches at once, so the number of
+ * write system calls drops as the output falls behind.
+ */
+static void *
+dt_writer_thread(void *arg)
+{
+	dt_writer_t	*w = arg;
+	struct iovec	iov[MIN(DT_WRITER_NBATCHES * 4, IOV_MAX)];
+
+	for (;;) {
+		uint64_t	head, tail = w->tail;
+		int		i, cnt;
+
+		while (sem_wait(&w->sem) != 0 && errno == EINTR)
+			continue;
+
+		head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (__atomic_load_n(&w->done, __ATOMIC_ACQUIRE))
+				break;
+
+			continue;
+		}
+
+		cnt = MIN(head - tail, ARRAY_SIZE(iov));
+		for (i = 0; i < cnt; i++) {
+			dt_wbatch_t	*b;
+
+			b = &w->batches[(tail + i) % w->nbatches];
+			iov[i].iov_base = b->buf;
+			iov[i].iov_len = b->len;
+		}
+
+		/*
+		 * After a write error, the remaining output is discarded so
+		 * the producer never blocks.  The error is reported to the
+		 * producer.
+		 */
+		if (w->err == 0 && dt_writer_writev(w->fd, iov, cnt) != 0)
+			__atomic_store_n(&w->err, errno, __ATOMIC_RELEASE);
+
+		__atomic_store_n(&w->tail, tail + cnt, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/*
+ * Stop the writer thread once all queued batches have been written, and write
+ * out any partial line that was held back.
+ */
+static void
+dt_writer_stop(dt_writer_t *w)
+{
+	struct iovec	iov;
+
+	if (!w->started)
+		return;
+
+	__atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+	sem_post(&w->sem);
+	pthread_join(w->tid, NULL);
+	w->started = 0;
+
+	iov.iov_base = w->carry;
+	iov.iov_len = w->clen;
+	if (w->clen > 0 && w->err == 0 && dt_writer_writev(w->fd, &iov, 1) != 0)
+		w->err = errno;
+	w->clen = 0;
+}
+
+/*
+ * Report output that was dropped because the queue was full.
+ */
+static void
+dt_writer_drops(dt_writer_t *w)
+{
+	uint64_t	drops = w->drops;
+
+	if (drops == 0 || w->dtp == NULL)
+		return;
+
+	w->drops = 0;
+	dt_handle_outdrop(w->dtp, drops);
+}
+
+/*
+ * Queue the partial line that was held back followed by the given data, as
+ * consecutive batches.  Either all of it is queued, or (if the queue does not
+ * have enough free batches) none of it is.
+ */
+static int
+dt_writer_queue(dt_writer_t *w, const char *buf, size_t len)
+{
+	uint64_t	head = w->head;
+	uint64_t	tail = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+	const char	*cp = w->carry;
+	size_t		clen = w->clen;
+	size_t		left = clen + len;
+
+	if ((left + w->batch_size - 1) / w->batch_size >
+	    w->nbatches - (head - tail))
+		return -1;
+
+	while (left > 0) {
+		dt_wbatch_t	*b = &w->batches[head % w->nbatches];
+		size_t		off, n;
+
+		b->len = MIN(left, w->batch_size);
+		left -= b->len;
+		for (off = 0; off < b->len; off += n) {
+			if (clen > 0) {
+				n = MIN(clen, b->len - off);
+				memcpy(b->buf + off, cp, n);
+				cp += n;
+				clen -= n;
+			} else {
+				n = b->len - off;
+				memcpy(b->buf + off, buf, n);
+				buf += n;
+			}
+		}
+
+		__atomic_store_n(&w->head, ++head, __ATOMIC_RELEASE);
+		sem_post(&w->sem);
+	}
+
+	return 0;
+}
+
+static ssize_t
+dt_writer_write(void *cookie, const char *buf, size_t size)
+{
+	dt_writer_t	*w = cookie;
+	const char	*nl;
+	size_t		len;
+	int		err;
+
+	err = __atomic_load_n(&w->err, __ATOMIC_ACQUIRE);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	/*
+	 * Once the writer thread has been stopped, output is written directly.
+	 */
+	if (!w->started) {
+		struct iovec	iov;
+
+		iov.iov_base = (char *)buf;
+		iov.iov_len = size;
+		if (dt_writer_writev(w->fd, &iov, 1) != 0)
+			return -1;
+
+		return size;
+	}
+
+	/*
+	 * Queue everything up to the last newline, and hold back the partial
+	 * line that follows it.  A partial line that is longer than half a
+	 * batch is queued as is.
+	 */
+	nl = memrchr(buf, '\n', size);
+	len = nl != NULL ? nl - buf + 1 : 0;
+	if (len == 0 ? w->clen + size > w->batch_size / 2
+		     : size - len > w->batch_size / 2)
+		len = size;
+
+	/*
+	 * If the queue is full, the lines are dropped rather than waiting for
+	 * the writer thread to catch up.
+	 */
+	if (len > 0) {
+		if (dt_writer_queue(w, buf, len) != 0)
+			w->drops += w->clen + len;
+
+		w->clen = 0;
+	}
+
+	memcpy(w->carry + w->clen, buf + len, size - len);
+	w->clen += size - len;
+
+	dt_writer_drops(w);
+
+	return size;
+}
+
+static void
+dt_writer_destroy(dt_writer_t *w)
+{
+	uint32_t	i;
+
+	dt_writer_stop(w);
+	sem_destroy(&w->sem);
+
+	if (w->batches != NULL) {
+		for (i = 0; i < w->nbatches; i++)
+			free(w->batches[i].buf);
+	}
+
+	free(w->batches);
+	free(w->carry);
+	free(w);
+}
+
+static int
+dt_writer_close(void *cookie)
+{
+	dt_writer_t	*w = cookie;
+	int		err;
+
+	dt_writer_stop(w);
+	dt_writer_drops(w);
+
+	if (w->dtp != NULL)
+		w->dtp->dt_writer = NULL;
+
+	err = w->err;
+	dt_writer_destroy(w);
+
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Detach the writer (if any) from the handle that is being closed.  Any output
+ * that is still queued is written out, and further output to the stream is
+ * written directly.
+ */
+void
+dt_writer_fini(dtrace_hdl_t *dtp)
+{
+	dt_writer_t	*w = dtp->dt_writer;
+
+	if (w == NULL)
+		return;
+
+	dt_writer_stop(w);
+	dt_writer_drops(w);
+	w->dtp = NULL;
+	dtp->dt_writer = NULL;
+}
+
+/*
+ * Create a stream that writes to the given stream through a writer thread.
+ * Output is written to the file descriptor of the given stream (after any
+ * buffered output has been flushed) in large writes, and the thread writing
+ * to the returned stream never blocks on the output: if the writer thread
+ * falls too far behind, whole lines of output are dropped (and reported as a
+ * drop).  The
+ * 'outqueue' and 'outbatch' options set the number and size of the batches
+ * that can be queued.
+ *
+ * Closing the returned stream (with fclose()) writes out all queued output.
+ * The underlying stream is not closed.
+ */
+FILE *
+dtrace_writer_open(dtrace_hdl_t *dtp, FILE *fp)
+{
+	dtrace_optval_t		nbatches = dtp->dt_options[DTRACEOPT_OUTQUEUE];
+	dtrace_optval_t		size = dtp->dt_options[DTRACEOPT_OUTBATCH];
+	cookie_io_functions_t	funcs = {
+		.write = dt_writer_write,
+		.close = dt_writer_close,
+	};
+	sigset_t		mask, omask;
+	dt_writer_t		*w;
+	FILE			*wfp;
+	uint32_t		i;
+
+	if (dtp->dt_writer != NULL) {
+		dt_set_errno(dtp, EINVAL);
+		return NULL;
+	}
+
+	if (fflush(fp) == EOF) {
+		dt_set_errno(dtp, errno);
+		return NULL;
+	}
+
+	w = dt_zalloc(dtp, sizeof(dt_writer_t));
+	if (w == NULL)
+		return NULL;
+
+	w->dtp = dtp;
+	w->fp = fp;
+	w->fd = fileno(fp);
+	w->nbatches = nbatches == DTRACEOPT_UNSET || nbatches < 1 ?
+		      DT_WRITER_NBATCHES : nbatches;
+	w->batch_size = size == DTRACEOPT_UNSET || size < BUFSIZ ?
+			DT_WRITER_BATCHSIZE : size;
+	sem_init(&w->sem, 0, 0);
+
+	w->batches = dt_calloc(dtp, w->nbatches, sizeof(dt_wbatch_t));
+	if (w->batches == NULL)
+		goto fail;
+
+	for (i = 0; i < w->nbatches; i++) {
+		w->batches[i].buf = dt_alloc(dtp, w->batch_size);
+		if (w->batches[i].buf == NULL)
+			goto fail;
+	}
+
+	w->carry = dt_alloc(dtp, w->batch_size / 2);
+	if (w->carry == NULL)
+		goto fail;
+
+	wfp = fopencookie(w, "w", funcs);
+	if (wfp == NULL) {
+		dt_set_errno(dtp, errno);
+		goto fail;
+	}
+
+	/*
+	 * Output is collected in the stream buffer, and every flush of that
+	 * buffer queues it as (at most) one batch.  The buffer is half a batch,
+	 * so that a batch can also hold the partial line that was held back.
+	 */
+	setvbuf(wfp, NULL, _IOFBF, w->batch_size / 2);
+
+	/*
+	 * Block all signals in the writer thread, so they are delivered to the
+	 * thread that is consuming trace data.
+	 */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	if (pthread_create(&w->tid, NULL, dt_writer_thread, w) != 0) {
+		pthread_sigmask(SIG_SETMASK, &omask, NULL);
+		fclose(wfp);
+		dt_set_errno(dtp, EDT_NOMEM);
+		return NULL;
+	}
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+	w->started = 1;
+	dtp->dt_writer = w;
+
+	return wfp;
+
+fail:
+	dt_writer_destroy(w);
+
+	return NULL;
+}
@@ -0,0 +1,61 @@
+/*
+ * Oracle Linux DTrace.
+ * Copyright (c) 2020, 2026, Oracle and/or its affiliates. All rights reserved.
+ * Licensed under the Universal Permissive License v 1.0 as shown at
+ * http://oss.oracle.com/licenses/upl.
+ */
+
+#ifndef	_DT_WRITER_H
+#define	_DT_WRITER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+
+#include <dt_impl.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Asynchronous output writer (see dtrace_writer_open()).  Output is collected
+ * in batches that are passed to a writer thread through a bounded queue.  The
+ * queue is a ring of batches with a single producer (the thread writing to the
+ * stream) and a single consumer (the writer thread), so it needs no locking:
+ * the producer only ever advances 'head', and the writer thread only ever
+ * advances 'tail'.  Only complete lines are queued, so that output is dropped
+ * in whole lines: a trailing partial line is held back in 'carry' until the
+ * rest of it is written.
+ */
+typedef struct dt_wbatch {
+	char		*buf;		/* batch data */
+	size_t		len;		/* length of the data */
+} dt_wbatch_t;
+
+typedef struct dt_writer {
+	dtrace_hdl_t	*dtp;		/* handle (NULL once it is closed) */
+	FILE		*fp;		/* underlying stream */
+	int		fd;		/* file descriptor of output */
+	dt_wbatch_t	*batches;	/* ring of batches */
+	uint32_t	nbatches;	/* number of batches in the ring */
+	size_t		batch_size;	/* size of each batch */
+	uint64_t	head;		/* next batch to fill */
+	uint64_t	tail;		/* next batch to write */
+	sem_t		sem;		/* posted when a batch is queued */
+	pthread_t	tid;		/* writer thread */
+	int		started;	/* writer thread is running */
+	int		done;		/* writer thread must exit */
+	int		err;		/* error from the writer thread */
+	uint64_t	drops;		/* bytes dropped (queue full) */
+	char		*carry;		/* partial line not yet queued */
+	size_t		clen;		/* length of the partial line */
+} dt_writer_t;
+
+extern void dt_writer_fini(dtrace_hdl_t *);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _DT_WRITER_H */
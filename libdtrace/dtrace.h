@@ -101,7 +101,8 @@ typedef struct dtrace_proginfo {
 #define	DTRACE_C_DEFARG	0x0800	/* Use 0/"" as value for unspecified args */
 #define	DTRACE_C_NOLIBS	0x1000	/* Do not process D system libraries */
 #define	DTRACE_C_CTL	0x2000	/* Only process control directives */
-#define	DTRACE_C_MASK	0x3bff	/* mask of all valid flags to dtrace_*compile */
+#define	DTRACE_C_NOOPT	0x4000	/* Do not optimize the generated BPF code */
+#define	DTRACE_C_MASK	0x7bff	/* mask of all valid flags to dtrace_*compile */
 
 extern dtrace_prog_t *dtrace_program_strcompile(dtrace_hdl_t *dtp, const char *s,
     dtrace_probespec_t spec, uint_t cflags, int argc, char *const argv[]);
@@ -180,6 +181,15 @@ typedef struct dtrace_probedata {
 	int dtpda_indent;			/* recommended flow indent */
 } dtrace_probedata_t;
 
+/*
+ * The probe and record callbacks are only ever called from the thread that
+ * called dtrace_consume() or dtrace_work(), one record at a time, even when
+ * trace data is read from the buffers by multiple consumer threads (see the
+ * 'consumethreads' option).  They therefore need not be thread-safe, but they
+ * must not call dtrace_consume() or dtrace_work() on the same handle.  With
+ * multiple consumer threads, records from different CPUs are passed to the
+ * callbacks in timestamp order, unless the 'unordered' option is set.
+ */
 typedef int dtrace_consume_probe_f(const dtrace_probedata_t *data, void *arg);
 typedef int dtrace_consume_rec_f(const dtrace_probedata_t *data,
     const dtrace_recdesc_t *rec, void *arg);
@@ -252,6 +262,87 @@ typedef enum {
 extern dtrace_workstatus_t dtrace_work(dtrace_hdl_t *dtp, FILE *fp,
     dtrace_consume_probe_f *pfunc, dtrace_consume_rec_f *rfunc, void *arg);
 
+/*
+ * DTrace Output Writer Interface
+ *
+ * Output written to the stream returned by dtrace_writer_open() is written to
+ * the given stream by a separate thread (see the 'outqueue' and 'outbatch'
+ * options).  The returned stream must be closed with fclose() before the
+ * underlying stream is closed.
+ */
+extern FILE *dtrace_writer_open(dtrace_hdl_t *dtp, FILE *fp);
+
+/*
+ * DTrace Trace File Interface
+ *
+ * If a trace file is created (before tracing is started), trace data is
+ * written to the file as it is consumed, rather than being passed to the
+ * probe and record callbacks.  A trace file can later be opened on a handle
+ * that has no enabled probes, and its trace data can then be processed (using
+ * the descriptions and options stored in the file) as if it were being
+ * consumed.
+ */
+extern int dtrace_tracefile_create(dtrace_hdl_t *dtp, const char *path);
+extern int dtrace_tracefile_open(dtrace_hdl_t *dtp, const char *path);
+extern dtrace_workstatus_t dtrace_tracefile_consume(dtrace_hdl_t *dtp,
+    FILE *fp, dtrace_consume_probe_f *pfunc, dtrace_consume_rec_f *rfunc,
+    void *arg);
+
+/*
+ * DTrace Statistics Interface
+ *
+ * If the 'stats' option is set when tracing is started, the library keeps
+ * track of how much trace data it consumes and where it spends its time.
+ * dtrace_stats() retrieves the totals, and dtrace_cpustats() retrieves the
+ * amount of trace data consumed for a single CPU.  Times are in nanoseconds.
+ * The time spent loading and attaching programs is tracked regardless of the
+ * 'stats' option.
+ */
+typedef struct dtrace_stats {
+	uint64_t dtsts_nrecs;			/* trace data records consumed */
+	uint64_t dtsts_bytes;			/* trace data bytes consumed */
+	uint64_t dtsts_drops;			/* trace data records lost */
+	uint64_t dtsts_wraps;			/* records copied on wrap-around */
+	uint64_t dtsts_rounds;			/* rounds of consumption */
+	uint64_t dtsts_wakeups;			/* rounds started by a wakeup */
+	hrtime_t dtsts_consume_time;		/* time spent consuming */
+	hrtime_t dtsts_format_time;		/* time spent producing output */
+	uint64_t dtsts_aggsnaps;		/* aggregation snapshots */
+	hrtime_t dtsts_aggsnap_time;		/* time spent taking snapshots */
+	uint64_t dtsts_nprogs;			/* programs loaded and attached */
+	hrtime_t dtsts_load_time;		/* time spent loading programs */
+	hrtime_t dtsts_attach_time;		/* time spent attaching programs */
+} dtrace_stats_t;
+
+typedef struct dtrace_cpustats {
+	uint64_t dtcs_nrecs;			/* trace data records consumed */
+	uint64_t dtcs_bytes;			/* trace data bytes consumed */
+	uint64_t dtcs_wraps;			/* records copied on wrap-around */
+} dtrace_cpustats_t;
+
+extern int dtrace_stats(dtrace_hdl_t *dtp, dtrace_stats_t *stp);
+extern int dtrace_cpustats(dtrace_hdl_t *dtp, processorid_t cpu,
+    dtrace_cpustats_t *csp);
+
+/*
+ * The statistics for the BPF program of each enabled probe.  The kernel keeps
+ * run-time statistics while the 'stats' option is set (on kernels that support
+ * this); otherwise, the number of firings and the time in the program are 0.
+ */
+typedef struct dtrace_probestats {
+	uint64_t dtps_nclauses;			/* clauses run by the program */
+	uint64_t dtps_runcnt;			/* number of firings */
+	hrtime_t dtps_runtime;			/* total time in the program */
+	hrtime_t dtps_load_time;		/* time spent loading it */
+	hrtime_t dtps_attach_time;		/* time spent attaching it */
+} dtrace_probestats_t;
+
+typedef int dtrace_probestats_f(dtrace_hdl_t *dtp,
+    const dtrace_probedesc_t *pdp, const dtrace_probestats_t *psp, void *arg);
+
+extern int dtrace_probestats_iter(dtrace_hdl_t *dtp,
+    dtrace_probestats_f *func, void *arg);
+
 /*
  * DTrace Handler Interface
  */
@@ -284,7 +375,8 @@ typedef enum {
 	DTRACEDROP_SPECBUSY,			/* spec drop due to busy */
 	DTRACEDROP_SPECUNAVAIL,			/* spec drop due to unavail */
 	DTRACEDROP_STKSTROVERFLOW,		/* stack string tab overflow */
-	DTRACEDROP_DBLERROR			/* error in ERROR probe */
+	DTRACEDROP_DBLERROR,			/* error in ERROR probe */
+	DTRACEDROP_OUTPUT			/* output dropped by writer */
 } dtrace_dropkind_t;
 
 typedef struct dtrace_dropdata {
@@ -341,6 +433,7 @@ extern int dtrace_handle_setopt(dtrace_hdl_t *dtp,
 #define	DTRACE_A_PERCPU		0x0001
 #define	DTRACE_A_KEEPDELTA	0x0002
 #define	DTRACE_A_ANONYMOUS	0x0004
+#define	DTRACE_A_DBUF		0x0008
 
 #define	DTRACE_AGGWALK_ERROR		-1	/* error while processing */
 #define	DTRACE_AGGWALK_NEXT		0	/* proceed to next element */
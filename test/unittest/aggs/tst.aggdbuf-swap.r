@@ -0,0 +1,2 @@
+100000 100000
+
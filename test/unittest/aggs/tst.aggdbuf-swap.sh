@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 60
+
+#
+# ASSERTION: Double-buffered aggregations do not lose updates that are made
+#	     while the buffers are switched.
+#
+# SECTION: Aggregations/Aggregations
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+#
+# The child makes 100000 single-byte writes, while the aggregations are
+# snapshot (and the buffers are switched) every millisecond.
+#
+$dtrace $dt_flags -qs /dev/stdin -x aggdbuf -x aggrate=1ms -x switchrate=1ms \
+	-c '/bin/dd if=/dev/zero of=/dev/null bs=1 count=100000' <<EOF
+syscall::write:entry
+/pid == \$target && arg2 == 1/
+{
+	@n = count();
+	@s = sum(arg2);
+}
+
+END
+{
+	printa("%@d %@d\n", @n, @s);
+}
+EOF
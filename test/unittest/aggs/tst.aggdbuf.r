@@ -0,0 +1,3 @@
+
+        1               15
+        2               20
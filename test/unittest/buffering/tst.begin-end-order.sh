@@ -0,0 +1,111 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 30
+
+#
+# ASSERTION: When the perf event buffers of several CPUs are consumed (with
+#	     or without consumer threads), the records for BEGIN come before,
+#	     and the records for END come after, the records from all other
+#	     CPUs.
+#
+# SECTION: Program Structure/BEGIN and END
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+ncpus=`getconf _NPROCESSORS_ONLN`
+
+if [ $ncpus -lt 2 ]; then
+	echo "this test requires at least 2 CPUs"
+	exit 67
+fi
+
+out=$tmpdir/begin-end-order.out.$$
+
+#
+# The profile probe is enabled before BEGIN fires, and keeps firing on every
+# CPU until after END.  The buffers are drained every 100ms (by several
+# threads, if requested), so records from other CPUs are consumed together
+# with the ones for BEGIN and END.
+#
+check()
+{
+	local rc
+
+	$dtrace $dt_flags -qs /dev/stdin -x bufbackend=perf "$@" \
+		-x wakeup=timer -x switchrate=100ms > $out <<EOF
+BEGIN
+{
+	printf("begin %d\n", timestamp);
+}
+
+profile-997
+{
+	printf("profile %d\n", timestamp);
+}
+
+tick-1s
+{
+	exit(0);
+}
+
+END
+{
+	printf("end %d\n", timestamp);
+}
+EOF
+	rc=$?
+	if [ $rc -ne 0 ]; then
+		echo "$tst: dtrace $* failed"
+		return 1
+	fi
+
+	#
+	# The first line must be for BEGIN and the last one for END, with
+	# records for the profile probe in between.
+	#
+	if ! awk 'NR == 1 && $1 != "begin" {
+			printf "first record is for %s\n", $1;
+			exit 1;
+		  }
+		  NR > 1 && $1 == "begin" {
+			printf "record for BEGIN on line %d\n", NR;
+			exit 1;
+		  }
+		  seen_end {
+			printf "record for %s after END\n", $1;
+			exit 1;
+		  }
+		  $1 == "end" { seen_end = 1; }
+		  $1 == "profile" { n++; }
+		  END {
+			if (!seen_end) {
+				print "no record for END";
+				exit 1;
+			}
+			if (n == 0) {
+				print "no records for the profile probe";
+				exit 1;
+			}
+		  }' $out; then
+		echo "unexpected trace output ($*)"
+		return 1
+	fi
+
+	return 0
+}
+
+status=0
+check || status=1
+check -x consumethreads=4 || status=1
+
+exit $status
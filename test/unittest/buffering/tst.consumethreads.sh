@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 20
+
+#
+# ASSERTION: Trace data from the perf event buffers of several CPUs that is
+#	     consumed by multiple threads is merged in timestamp order.
+#
+# SECTION: Options and Tunables/consumethreads
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+ncpus=`getconf _NPROCESSORS_ONLN`
+
+if [ $ncpus -lt 2 ]; then
+	echo "this test requires at least 2 CPUs"
+	exit 67
+fi
+
+out=$tmpdir/consumethreads.out.$$
+
+#
+# The profile probe fires on every CPU.  The buffers are only drained every
+# 100ms, so without merging, records from different CPUs would be out of
+# order by up to that much.
+#
+$dtrace $dt_flags -s /dev/stdin -x bufbackend=perf -x consumethreads=4 \
+	-x wakeup=timer -x switchrate=100ms > $out <<EOF
+profile-499
+{
+	trace(timestamp);
+}
+
+tick-2s
+{
+	exit(0);
+}
+EOF
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo $tst: dtrace failed
+	exit $status
+fi
+
+#
+# The records of each CPU must be in order.  Across CPUs, the timestamps that
+# the records are merged on are taken slightly later than the one in the
+# record, so allow for records to be up to 1ms out of order.
+#
+if ! awk -v ncpus=$ncpus \
+	'$3 !~ /profile-499$/ { next; }
+	 $1 in last && $4 <= last[$1] {
+		printf "CPU %d: %d after %d\n", $1, $4, last[$1];
+		exit 1;
+	 }
+	 $4 < max - 1000000 {
+		printf "CPU %d: %d after %d (from another CPU)\n", $1, $4, max;
+		exit 1;
+	 }
+	 !($1 in last) { cpus++; }
+	 { last[$1] = $4; if ($4 > max) max = $4; }
+	 END {
+		if (cpus < 2) {
+			printf "records for %d of %d CPUs\n", cpus, ncpus;
+			exit 1;
+		}
+	 }' $out; then
+	echo "unexpected trace output"
+	status=1
+fi
+
+exit $status
@@ -0,0 +1,124 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 30
+
+#
+# ASSERTION: The output writer queue absorbs output while the reader of the
+#	     output stalls, and when the queue overflows whole lines of output
+#	     are dropped and reported (to the byte).
+#
+# SECTION: Options and Tunables/outqueue
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+out=$tmpdir/outqueue.out.$$
+err=$tmpdir/outqueue.err.$$
+exp=$tmpdir/outqueue.exp.$$
+
+#
+# Produce about 400KB of output, at 200 bytes per ms, while the reader of the
+# output does not read anything for the first 2 seconds.
+#
+script()
+{
+	$dtrace $dt_flags -qs /dev/stdin -x outqueue=$1 -x outbatch=$2 \
+		2> $err <<EOF | (sleep 2; cat > $out)
+	int n;
+
+	tick-1ms
+	/n < 64000/
+	{
+		printf("%d %d %d %d %d %d %d %d\n",
+		       n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7);
+		n += 8;
+	}
+
+	tick-1ms
+	/n < 64000/
+	{
+		printf("%d %d %d %d %d %d %d %d\n",
+		       n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7);
+		n += 8;
+	}
+
+	tick-1ms
+	/n < 64000/
+	{
+		printf("%d %d %d %d %d %d %d %d\n",
+		       n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7);
+		n += 8;
+	}
+
+	tick-1ms
+	/n < 64000/
+	{
+		printf("%d %d %d %d %d %d %d %d\n",
+		       n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7);
+		n += 8;
+	}
+
+	tick-1ms
+	/n >= 64000/
+	{
+		exit(0);
+	}
+EOF
+}
+
+seq 0 8 63999 | awk '{ print $1, $1 + 1, $1 + 2, $1 + 3, $1 + 4, $1 + 5,
+			    $1 + 6, $1 + 7; }' > $exp
+total=`wc -c < $exp`
+status=0
+
+#
+# A queue of 64 batches of 64KB holds all output, so nothing may be dropped.
+#
+script 64 64k
+if grep -q 'of output dropped' $err; then
+	echo "output was dropped with a large queue"
+	status=1
+elif ! cmp -s $exp $out; then
+	echo "output is incomplete with a large queue"
+	status=1
+fi
+
+#
+# A single batch of 8KB (and the pipe buffer) cannot hold all output.  Every
+# byte must be either written or reported as dropped, and every line that is
+# written must be complete.
+#
+script 1 8k
+dropped=`awk '/bytes? of output dropped/ { n += $2; } END { print n + 0; }' \
+	 $err`
+written=`wc -c < $out`
+if [ $dropped -eq 0 ]; then
+	echo "no output was dropped with a small queue"
+	status=1
+elif [ $((dropped + written)) -ne $total ]; then
+	echo "$written bytes written + $dropped bytes dropped != $total bytes"
+	status=1
+elif [ "`head -1 $out`" != "`head -1 $exp`" ]; then
+	echo "output does not start with the first record"
+	status=1
+elif ! awk 'NF != 8 { exit 1; }
+	    { for (i = 2; i <= 8; i++) if ($i != $1 + i - 1) exit 1; }' $out
+then
+	echo "output contains incomplete lines"
+	status=1
+fi
+
+if [ $status -ne 0 ]; then
+	cat $err
+fi
+
+exit $status
@@ -0,0 +1,84 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 20
+
+#
+# ASSERTION: When the BPF ring buffer is full, the records that do not fit
+#	     are reported as drops, and the records that are consumed are
+#	     intact.
+#
+# SECTION: Options and Tunables/bufbackend
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+pgsz=`getconf PAGESIZE`
+out=$tmpdir/ringbuf-drops.out.$$
+err=$tmpdir/ringbuf-drops.err.$$
+
+#
+# The ring buffer is a single page, and the consumer only polls it twice a
+# second, so the records that are produced every millisecond cannot all fit.
+#
+$dtrace $dt_flags -qs /dev/stdin -x bufbackend=ringbuf -x bufsize=$pgsz \
+	-x wakeup=timer -x switchrate=500ms > $out 2> $err <<EOF
+int n;
+
+tick-1ms
+/n < 24000/
+{
+	printf("%d %d %d %d %d %d %d %d\n",
+	       n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7);
+	n += 8;
+}
+
+tick-1ms
+/n < 24000/
+{
+	printf("%d %d %d %d %d %d %d %d\n",
+	       n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7);
+	n += 8;
+}
+
+tick-1ms
+/n >= 24000/
+{
+	exit(0);
+}
+EOF
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo $tst: dtrace failed
+	cat $err
+	exit $status
+fi
+
+if ! grep -q 'drops\{0,1\} on CPU' $err; then
+	echo "no drops were reported"
+	status=1
+fi
+
+if ! awk 'NF != 8 { exit 1; }
+	  { for (i = 2; i <= 8; i++) if ($i != $1 + i - 1) exit 1; }
+	  n > 0 && $1 <= last { exit 1; }
+	  { last = $1; n++; }
+	  END { if (n == 0 || n >= 24000 / 8) exit 1; }' $out; then
+	echo "unexpected trace output"
+	status=1
+fi
+
+if [ $status -ne 0 ]; then
+	cat $err
+fi
+
+exit $status
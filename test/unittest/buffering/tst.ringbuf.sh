@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 20
+
+#
+# ASSERTION: Records that are written to the shared BPF ring buffer on several
+#	     CPUs are all consumed, they are attributed to the CPU that
+#	     produced them, and the records of each CPU are consumed in the
+#	     order in which they were written.
+#
+# SECTION: Options and Tunables/bufbackend
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+ncpus=`getconf _NPROCESSORS_ONLN`
+
+if [ $ncpus -lt 2 ]; then
+	echo "this test requires at least 2 CPUs"
+	exit 67
+fi
+
+out=$tmpdir/ringbuf.out.$$
+
+#
+# The profile probe fires on every CPU.  The default output format reports
+# the CPU of each record in the first column.
+#
+$dtrace $dt_flags -s /dev/stdin -x bufbackend=ringbuf > $out <<EOF
+profile-199
+{
+	trace(timestamp);
+}
+
+tick-2s
+{
+	exit(0);
+}
+EOF
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo $tst: dtrace failed
+	exit $status
+fi
+
+#
+# Verify that records were consumed for more than one CPU, and that the
+# timestamps of the records of each CPU are increasing.
+#
+if ! awk -v ncpus=$ncpus \
+	'$3 !~ /profile-199$/ { next; }
+	 $1 in last && $4 <= last[$1] {
+		printf "CPU %d: %d after %d\n", $1, $4, last[$1];
+		exit 1;
+	 }
+	 !($1 in last) { cpus++; }
+	 { last[$1] = $4; }
+	 END {
+		if (cpus < 2) {
+			printf "records for %d of %d CPUs\n", cpus, ncpus;
+			exit 1;
+		}
+	 }' $out; then
+	echo "unexpected trace output"
+	status=1
+fi
+
+exit $status
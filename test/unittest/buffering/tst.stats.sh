@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION: The stats option reports consumer statistics at exit, including
+#	     the time spent loading and attaching the program of each probe,
+#	     and how often the program of each probe ran.
+#
+# SECTION: Options and Tunables/stats
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+out=$tmpdir/stats.out.$$
+err=$tmpdir/stats.err.$$
+
+$dtrace $dt_flags -qs /dev/stdin -x stats -x statusrate=1h \
+	> $out 2> $err <<EOF
+BEGIN
+{
+	printf("begin\n");
+}
+
+BEGIN
+{
+	exit(0);
+}
+
+END
+{
+	printf("end\n");
+}
+EOF
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo $tst: dtrace failed
+	cat $err
+	exit $status
+fi
+
+if [ "`cat $out`" != "`printf 'begin\nend\n'`" ]; then
+	echo "unexpected trace output"
+	cat $out
+	status=1
+fi
+
+#
+# Each summary line must be reported, and the programs for BEGIN and END must
+# have taken some time to load and attach.  The kernel must have counted at
+# least one run of a program.
+#
+if ! awk '/^dtrace: stats: [0-9]+ records, [0-9]+ bytes, [0-9]+ drops, [0-9]+ wrap copies$/ {
+		recs = 1;
+	  }
+	  /^dtrace: stats: [0-9]+ rounds \([0-9]+ wakeups\), consuming [0-9]+ us, formatting [0-9]+ us$/ {
+		rounds = 1;
+	  }
+	  /^dtrace: stats: [0-9]+ aggregation snapshots, [0-9]+ us$/ {
+		aggs = 1;
+	  }
+	  /^dtrace: stats: [0-9]+ programs, loading [0-9]+ us, attaching [0-9]+ us$/ {
+		progs = $3;
+		if ($6 == 0 || $9 == 0) {
+			print "no time spent loading or attaching programs";
+			exit 1;
+		}
+	  }
+	  /^dtrace: stats: probe dtrace:::(BEGIN|END): .* loading [0-9]+ us, attaching [0-9]+ us$/ {
+		if ($(NF - 4) + $(NF - 1) == 0) {
+			printf "no load or attach time for %s\n", $4;
+			exit 1;
+		}
+		probes++;
+	  }
+	  /^dtrace: stats: probe .*: [0-9]+ clauses, [1-9][0-9]* firings, / {
+		fired++;
+	  }
+	  END {
+		if (!recs || !rounds || !aggs || progs < 2) {
+			print "missing summary statistics";
+			exit 1;
+		}
+		if (probes != 2) {
+			printf "%d probes reported for BEGIN and END\n", probes;
+			exit 1;
+		}
+		if (!fired) {
+			print "no probe with a non-zero run count";
+			exit 1;
+		}
+	  }' $err; then
+	echo "unexpected statistics"
+	status=1
+fi
+
+if [ $status -ne 0 ]; then
+	cat $err
+fi
+
+exit $status
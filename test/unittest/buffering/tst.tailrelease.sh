@@ -0,0 +1,97 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 20
+
+#
+# ASSERTION: Trace data is consumed correctly when consumed space is released
+#	     to the kernel after every record, while the producer keeps
+#	     writing into the released space and events wrap around the end
+#	     of the perf event buffer many times.
+#
+# SECTION: Options and Tunables/tailrelease
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+out=$tmpdir/tailrelease.out.$$
+err=$tmpdir/tailrelease.err.$$
+
+#
+# About 200KB of trace data goes through a 2-page buffer, which the consumer
+# drains in batches of about 2KB every 10ms.  Each record is larger than the
+# 'tailrelease' size, so space is released after every record in a batch.
+#
+$dtrace $dt_flags -qs /dev/stdin -x bufbackend=perf -x bufsize=8k \
+	-x tailrelease=64 -x wakeup=timer -x switchrate=10ms -x stats \
+	> $out 2> $err <<EOF
+int n;
+
+tick-1ms
+/n < 16000/
+{
+	printf("%d %d %d %d %d %d %d %d\n",
+	       n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7);
+	n += 8;
+}
+
+tick-1ms
+/n < 16000/
+{
+	printf("%d %d %d %d %d %d %d %d\n",
+	       n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7);
+	n += 8;
+}
+
+tick-1ms
+/n >= 16000/
+{
+	exit(0);
+}
+EOF
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo $tst: dtrace failed
+	cat $err
+	exit $status
+fi
+
+#
+# Records that straddle the end of the buffer are counted as wrap copies.
+#
+if ! awk '/stats: .* wrap copies/ { found = 1; if ($(NF - 2) == 0) exit 1; }
+	  END { if (!found) exit 1; }' $err; then
+	echo "no records wrapped around the end of the buffer"
+	status=1
+fi
+
+if grep -q 'drops\{0,1\} on CPU' $err; then
+	echo "records were dropped"
+	status=1
+fi
+
+#
+# All records must be consumed, intact and in order.
+#
+if ! awk 'NF != 8 || $1 != n * 8 { exit 1; }
+	  { for (i = 2; i <= 8; i++) if ($i != $1 + i - 1) exit 1; }
+	  { n++; }
+	  END { if (n != 16000 / 8) exit 1; }' $out; then
+	echo "unexpected trace output"
+	status=1
+fi
+
+if [ $status -ne 0 ]; then
+	cat $err
+fi
+
+exit $status
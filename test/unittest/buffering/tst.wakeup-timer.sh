@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 30
+
+#
+# ASSERTION: With timer-driven wakeups, records that are produced at a low
+#	     rate are consumed at the switch rate rather than when the
+#	     buffers fill up (or tracing stops).
+#
+# SECTION: Options and Tunables/wakeup
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+#
+# Tag each line of output with the (wall clock) time in ms at which the
+# consumer emitted it.
+#
+stamp()
+{
+	while read line; do
+		echo "$((`date +%s%N` / 1000000)) $line"
+	done
+}
+
+script()
+{
+	$dtrace $dt_flags -qs /dev/stdin -x bufbackend=$1 -x wakeup=timer \
+		-x switchrate=100ms <<EOF | stamp
+	tick-1s
+	{
+		printf("%d\n", ++n);
+	}
+
+	tick-1s
+	/n == 5/
+	{
+		exit(0);
+	}
+EOF
+}
+
+#
+# One record is produced per second.  If the consumer only picked up data when
+# woken up by the producer (which never happens at this rate with a watermark)
+# or at exit, the records would arrive together.  With the timer, each record
+# must be consumed at least half a second after the previous one.
+#
+check()
+{
+	awk 'NR > 1 && $1 - last < 500 {
+		printf "record %d consumed %d ms after record %d\n",
+		       $2, $1 - last, $2 - 1;
+		exit 1;
+	     }
+	     { last = $1; n++; }
+	     END {
+		if (n != 5) {
+			printf "%d records consumed, expected 5\n", n;
+			exit 1;
+		}
+	     }'
+}
+
+status=0
+for backend in perf ringbuf; do
+	if ! script $backend | check; then
+		echo "timer-driven wakeups failed for the $backend backend"
+		status=1
+	fi
+done
+
+exit $status
@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION: Syscall probes that share the same list of clauses (and may share
+#	     a single loaded program) report data for the correct probe.
+#
+# SECTION: Program Structure / Probe Clauses and Declarations
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+out=`$dtrace $dt_flags -qs /dev/stdin -c /bin/true <<EOF
+syscall::execve:return,
+syscall::exit_group:entry
+/pid == \$target/
+{
+	@[probefunc, probename] = count();
+}
+
+END
+{
+	printa("%s:%s %@d\n", @);
+}
+EOF`
+if [ $? -ne 0 ]; then
+	echo "$out"
+	exit 1
+fi
+
+exp='execve:return 1
+exit_group:entry 1'
+out=`echo "$out" | grep . | sort`
+if [ "$out" != "$exp" ]; then
+	echo "unexpected output:"
+	echo "$out"
+	exit 1
+fi
+
+exit 0
@@ -0,0 +1,6 @@
+                   FUNCTION:NAME
+                          :BEGIN                    0
+                            :END                    1
+
+-- @@stderr --
+dtrace: script 'test/unittest/clauses/tst.shared.d' matched 2 probes
@@ -0,0 +1,5 @@
+                   FUNCTION:NAME
+                          :BEGIN                   43
+
+-- @@stderr --
+dtrace: script 'test/unittest/codegen/tst.assoc_tuple.d' matched 1 probe
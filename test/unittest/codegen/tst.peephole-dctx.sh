@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION: The peephole optimizer makes the code for a clause that loads
+#	     the DTrace context (and its members) repeatedly shorter, without
+#	     changing its result.
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+prog='BEGIN {
+	a = pid;
+	b = tid;
+	c = ppid;
+	d = uid;
+	printf("%d %d %d %d\n", a == pid, b == tid, c == ppid, d == uid);
+	exit(0);
+}'
+
+# Count the instructions in the disassembly of the clause.
+insns()
+{
+	$dtrace $dt_flags -Sq "$@" -n "$prog" 2>&1 >/dev/null | \
+		grep -cE '^[0-9]{3} [0-9]{4}: '
+}
+
+opt=`insns`
+noopt=`insns -x noopt`
+if [ "$opt" -ge "$noopt" ]; then
+	echo "optimized clause has $opt instructions, unoptimized $noopt"
+	exit 1
+fi
+
+out=`$dtrace $dt_flags -qn "$prog"`
+noout=`$dtrace $dt_flags -x noopt -qn "$prog"`
+if [ "$out" != "1 1 1 1" -o "$noout" != "$out" ]; then
+	echo "unexpected result: '$out' (unoptimized '$noout')"
+	exit 1
+fi
+
+exit 0
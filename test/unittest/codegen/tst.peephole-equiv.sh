@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION: Clauses with overwritten stores, code that is skipped by
+#	     predicates and conditional expressions, and context members that
+#	     are reloaded after helper calls produce the same output with and
+#	     without the peephole optimizer.
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+prog='BEGIN {
+	this->a = 1;
+	this->a = 2;
+	x = 3;
+	x = this->a + x;
+	y = pid > 0 ? x : 0;
+	z = pid < 0 ? 0 : y;
+	printf("%d %d %d\n", this->a, y, z);
+	s = strjoin("a", "b");
+	printf("%s %d\n", s, pid == $pid);
+	printf("%d\n", strlen(strjoin(s, "c")) + (tid > 0));
+}
+
+BEGIN
+/z == 0/
+{
+	printf("not reached\n");
+}
+
+BEGIN
+/z != 0/
+{
+	z = 0;
+	z = z + 1;
+	printf("%d\n", z);
+	exit(0);
+}'
+
+out=`$dtrace $dt_flags -qn "$prog" 2>&1`
+if [ $? -ne 0 ]; then
+	echo "$out"
+	exit 1
+fi
+
+noout=`$dtrace $dt_flags -x noopt -qn "$prog" 2>&1`
+if [ "$noout" != "$out" ]; then
+	echo "optimized output:"
+	echo "$out"
+	echo "unoptimized output:"
+	echo "$noout"
+	exit 1
+fi
+
+exp='2 5 5
+ab 1
+4
+1'
+if [ "$out" != "$exp" ]; then
+	echo "unexpected output:"
+	echo "$out"
+	exit 1
+fi
+
+exit 0
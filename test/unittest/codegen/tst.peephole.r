@@ -0,0 +1,5 @@
+                   FUNCTION:NAME
+                          :BEGIN                 1520
+
+-- @@stderr --
+dtrace: script 'test/unittest/codegen/tst.peephole.d' matched 1 probe
@@ -0,0 +1,96 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION:
+# The probes of a provider are written to the probe cache directory the first
+# time the provider is populated, and later invocations restore them from the
+# cache and list the same probes.  A corrupted cache file is not used.  The
+# sdt provider (which may gain events at runtime) is not cached.
+#
+# SECTION: dtrace Utility/-x Option
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+DIRNAME="$tmpdir/probe-cache.$$.$RANDOM"
+mkdir -p $DIRNAME
+trap "rm -rf $DIRNAME" EXIT
+
+#
+# List the syscall probes into the given file, with the debugging output
+# going to <file>.err.
+#
+list()
+{
+	DTRACE_DEBUG=t $dtrace $dt_flags -x pcachedir=$DIRNAME/cache \
+		-lP syscall > $DIRNAME/$1 2> $DIRNAME/$1.err
+	if [ $? -ne 0 ]; then
+		echo "$1 listing failed"
+		grep -v 'DEBUG' $DIRNAME/$1.err
+		exit 1
+	fi
+
+	if ! cmp -s $DIRNAME/first $DIRNAME/$1; then
+		echo "$1 probe listing differs"
+		diff $DIRNAME/first $DIRNAME/$1
+		exit 1
+	fi
+}
+
+list first
+
+if [ ! -s $DIRNAME/cache/syscall.pcache ]; then
+	echo "no cache file for the syscall provider"
+	exit 1
+fi
+if grep -q 'restored [0-9]* probes for syscall from cache' $DIRNAME/first.err
+then
+	echo "probes restored from an empty cache"
+	exit 1
+fi
+
+list second
+
+if ! grep -q 'restored [1-9][0-9]* probes for syscall from cache' \
+	  $DIRNAME/second.err; then
+	echo "probes not restored from the cache"
+	exit 1
+fi
+
+#
+# Truncating the cache file must cause the probes to be discovered again (and
+# the cache file to be rewritten).
+#
+truncate -s -1 $DIRNAME/cache/syscall.pcache
+
+list third
+
+if grep -q 'restored [0-9]* probes for syscall from cache' $DIRNAME/third.err
+then
+	echo "probes restored from a corrupted cache file"
+	exit 1
+fi
+if ! grep -q 'saved [1-9][0-9]* probes for syscall to cache' \
+	  $DIRNAME/third.err; then
+	echo "corrupted cache file not rewritten"
+	exit 1
+fi
+
+$dtrace $dt_flags -x pcachedir=$DIRNAME/cache -lP sdt > /dev/null 2>&1
+if [ -e $DIRNAME/cache/sdt.pcache ]; then
+	echo "cache file written for the sdt provider"
+	exit 1
+fi
+
+exit 0
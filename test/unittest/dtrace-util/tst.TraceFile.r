@@ -0,0 +1,2 @@
+hello 42 ff
+
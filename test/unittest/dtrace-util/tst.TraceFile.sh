@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION:
+# Trace data written to a trace file with -W is processed by -R as if it were
+# being consumed, using the options it was recorded with.
+#
+# SECTION: dtrace Utility/-W Option
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+file=$tmpdir/tracefile.$$
+
+$dtrace $dt_flags -q -W $file -n '
+BEGIN
+{
+	printf("%s %d %x\n", "hello", 42, 255);
+}
+
+BEGIN
+{
+	exit(0);
+}' > /dev/null
+if [ $? -ne 0 ]; then
+	echo "failed to record trace data"
+	exit 1
+fi
+
+$dtrace $dt_flags -R $file
+status=$?
+
+rm -f $file
+
+exit $status
@@ -0,0 +1,94 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 30
+
+#
+# ASSERTION: When the entry and return probes of functions that cannot be
+#	     traced through fentry/fexit programs are enabled with the same
+#	     clause, each probe gets the arguments of its own kind.
+#
+# SECTION: FBT Provider/Probe arguments
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+if [ ! -f /sys/kernel/btf/vmlinux ]; then
+	echo "this test requires kernel BTF data"
+	exit 67
+fi
+
+#
+# BPF tracing programs cannot be attached to these functions, so their probes
+# fall back to kprobes (unless kprobe_multi links are used).  Use the first
+# one that is available.
+#
+for func in migrate_disable migrate_enable __rcu_read_lock __rcu_read_unlock
+do
+	if $dtrace $dt_flags -ln fbt::$func:return > /dev/null 2>&1; then
+		break
+	fi
+	func=
+done
+
+if [ -z "$func" ]; then
+	echo "no suitable function is available"
+	exit 67
+fi
+
+#
+# Return probes that fall back from a fexit program report an unknown return
+# offset (-1) in arg0, like return probes that use fexit programs.
+#
+out=`$dtrace $dt_flags -qs /dev/stdin <<EOF
+fbt::$func:entry,
+fbt::$func:return
+{
+	@[probename, probename == "return" ? (long)arg0 : 0] = count();
+}
+
+tick-1s
+{
+	exit(0);
+}
+
+END
+{
+	printa("%s %d %@d\n", @);
+}
+EOF`
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo "$out"
+	exit $status
+fi
+
+if ! echo "$out" | awk 'NF == 0 { next; }
+			($1 == "entry" && $2 != 0) ||
+			($1 == "return" && $2 != -1) {
+				printf "unexpected record: %s\n", $0;
+				exit 1;
+			}
+			{ cnt[$1] += $3; }
+			END {
+				if (cnt["entry"] == 0 || cnt["return"] == 0) {
+					print "entry or return did not fire";
+					exit 1;
+				}
+			}'; then
+	echo "$func:"
+	echo "$out"
+	exit 1
+fi
+
+exit 0
@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 20
+
+#
+# ASSERTION: FBT probes on core kernel functions provide typed arguments
+#	     (through args[]), and return probes provide the return value in
+#	     arg1 (and args[1]).
+#
+# SECTION: FBT Provider/Probe arguments
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+out=$tmpdir/typedargs.out.$$
+
+if [ ! -f /sys/kernel/btf/vmlinux ]; then
+	echo "this test requires kernel BTF data"
+	exit 67
+fi
+
+#
+# The child writes a single block of 1234 bytes to /dev/null, so vfs_write()
+# is called with a count of 1234 and returns 1234.  The types of args[] are
+# checked by assigning them to variables of the expected type.
+#
+$dtrace $dt_flags -qs /dev/stdin \
+	-c '/bin/dd if=/dev/zero of=/dev/null bs=1234 count=1' > $out <<EOF
+size_t count;
+ssize_t ret;
+
+fbt::vfs_write:entry
+/pid == \$target && args[2] == 1234/
+{
+	count = args[2];
+	self->traced = 1;
+	printf("entry: count %d, file %d\n", count, args[0] != NULL);
+}
+
+fbt::vfs_write:return
+/self->traced/
+{
+	ret = args[1];
+	self->traced = 0;
+	printf("return: offset %d, arg1 %d, args[1] %d\n", arg0, arg1, ret);
+}
+EOF
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo $tst: dtrace failed
+	exit $status
+fi
+
+#
+# The return offset is not known for return probes on functions that are
+# traced through fexit or kprobe_multi programs, and is reported as -1.
+#
+if [ "`sed '/^$/d' $out`" != "entry: count 1234, file 1
+return: offset -1, arg1 1234, args[1] 1234" ]; then
+	echo "unexpected trace output"
+	cat $out
+	status=1
+fi
+
+exit $status
@@ -0,0 +1,92 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 30
+
+#
+# ASSERTION: When a wildcard enables FBT probes on several functions with the
+#	     same clauses (which may share a single program and link), each
+#	     firing is attributed to the function and probe that fired.
+#
+# SECTION: FBT Provider/Probe arguments
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+out=$tmpdir/fbt-wildcard.out.$$
+
+#
+# The child reads a single block of 1000 bytes, and writes it out as two
+# blocks of 500 bytes.  So vfs_read() is called once (and returns 1000), and
+# vfs_write() is called twice (and returns 500 each time).
+#
+$dtrace $dt_flags -s /dev/stdin \
+	-c '/bin/dd if=/dev/zero of=/dev/null ibs=1000 obs=500 count=1' \
+	> $out <<EOF
+fbt::vfs_[rw]*:entry
+/pid == \$target && (arg2 == 1000 || arg2 == 500)/
+{
+	self->traced = 1;
+	trace(arg2);
+}
+
+fbt::vfs_[rw]*:return
+/self->traced/
+{
+	self->traced = 0;
+	trace(arg1);
+}
+EOF
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo $tst: dtrace failed
+	exit $status
+fi
+
+#
+# Each record is reported with the function and probe name of the probe that
+# fired, followed by the traced value.
+#
+if ! awk '{
+		for (i = 1; i < NF; i++) {
+			if ($i ~ /^vfs_[a-z]*:(entry|return)$/)
+				break;
+		}
+		if (i == NF)
+			next;
+
+		if (($i ~ /^vfs_read:/ && $NF != 1000) ||
+		    ($i ~ /^vfs_write:/ && $NF != 500) ||
+		    $i !~ /^vfs_(read|write):/) {
+			printf "unexpected record: %s %s\n", $i, $NF;
+			exit 1;
+		}
+
+		cnt[$i]++;
+	  }
+	  END {
+		if (cnt["vfs_read:entry"] != 1 ||
+		    cnt["vfs_read:return"] != 1 ||
+		    cnt["vfs_write:entry"] != 2 ||
+		    cnt["vfs_write:return"] != 2) {
+			printf "records: vfs_read %d/%d, vfs_write %d/%d\n",
+			       cnt["vfs_read:entry"], cnt["vfs_read:return"],
+			       cnt["vfs_write:entry"], cnt["vfs_write:return"];
+			exit 1;
+		}
+	  }' $out; then
+	echo "unexpected trace output"
+	cat $out
+	status=1
+fi
+
+exit $status
@@ -0,0 +1,63 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+# @@timeout: 120
+
+#
+# ASSERTION: Programs for a wide enabling can be loaded and attached using
+#	     multiple threads, and the result (including any reported error)
+#	     does not depend on the number of threads.
+#
+# SECTION: Options and Tunables/Consumer Options
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+run()
+{
+	$dtrace $dt_flags -x loadthreads=$1 -s /dev/stdin 2>&1 <<EOF
+#pragma D option quiet
+
+syscall:::entry
+/pid == -1/
+{
+	trace(probefunc);
+}
+
+BEGIN
+{
+	printf("BEGIN\n");
+	exit(0);
+}
+EOF
+	echo "exit status $?"
+}
+
+exp=`run 1`
+for n in 2 4 16; do
+	out=`run $n`
+	if [ "$out" != "$exp" ]; then
+		echo "loadthreads=1:"
+		echo "$exp"
+		echo "loadthreads=$n:"
+		echo "$out"
+		exit 1
+	fi
+done
+
+if [ "$exp" != "BEGIN
+exit status 0" ]; then
+	echo "$exp"
+	exit 1
+fi
+
+exit 0
@@ -0,0 +1,3 @@
+dtrace:::BEGIN,42,-1,hello,"a ""quoted"" string","x=1
+"
+
@@ -0,0 +1 @@
+{"probe":"dtrace:::BEGIN","data":["10000 20000 30000 40000 50000 60000 70000 80000\n"]}
@@ -0,0 +1,31 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION:
+# With -x oformat=json, the output of printf() is not truncated to strsize.
+#
+# SECTION: Options and Tunables/oformat
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+$dtrace $dt_flags -x oformat=json -x strsize=16 -n '
+BEGIN
+{
+	printf("%d %d %d %d %d %d %d %d\n",
+	       10000, 20000, 30000, 40000, 50000, 60000, 70000, 80000);
+	exit(0);
+}' | sed 's/"cpu":[0-9]*,"id":[0-9]*,//'
+
+exit ${PIPESTATUS[0]}
@@ -0,0 +1 @@
+{"probe":"dtrace:::BEGIN","data":["café \u00ff \u00c3( \u00ed\u00a0\u0080\n"]}
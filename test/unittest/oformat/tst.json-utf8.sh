@@ -0,0 +1,31 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION:
+# With -x oformat=json, valid UTF-8 sequences in strings are written as is,
+# and bytes that are not part of a valid UTF-8 sequence are escaped.
+#
+# SECTION: Options and Tunables/oformat
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+$dtrace $dt_flags -x oformat=json -n '
+BEGIN
+{
+	printf("caf\303\251 \377 \303( \355\240\200\n");
+	exit(0);
+}' | sed 's/"cpu":[0-9]*,"id":[0-9]*,//'
+
+exit ${PIPESTATUS[0]}
@@ -0,0 +1,2 @@
+{"probe":"dtrace:::BEGIN","data":[42,-1,"hello","a \"quoted\" string","x=1\n"]}
+
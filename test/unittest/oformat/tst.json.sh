@@ -0,0 +1,34 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION:
+# With -x oformat=json, each probe firing is written as a JSON object on a line of its own.
+#
+# SECTION: Options and Tunables/oformat
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+
+$dtrace $dt_flags -x oformat=json -n '
+BEGIN
+{
+	trace(42);
+	trace(-1);
+	trace("hello");
+	trace("a \"quoted\" string");
+	printf("x=%d\n", 1);
+	exit(0);
+}' | sed 's/"cpu":[0-9]*,"id":[0-9]*,//'
+
+exit ${PIPESTATUS[0]}
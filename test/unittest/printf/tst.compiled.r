@@ -0,0 +1,9 @@
+no conversions
+-42 42 4294967295
+-1234567890123 1234567890123
+[    7] [7    ] [00007] [+7]
+ff FF 10 0xff
+hello|   hello|hello   |hel
+100% done 100%
+123
+
@@ -0,0 +1,7 @@
+1 2 three
+4
+five
+6
+seven
+8 9
+
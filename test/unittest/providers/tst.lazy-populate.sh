@@ -0,0 +1,60 @@
+#!/bin/bash
+#
+# Oracle Linux DTrace.
+# Copyright (c) 2026, Oracle and/or its affiliates. All rights reserved.
+# Licensed under the Universal Permissive License v 1.0 as shown at
+# http://oss.oracle.com/licenses/upl.
+#
+
+#
+# ASSERTION: Providers are only populated when a probe description may match
+#	     their probes, and probe ids are the same no matter which probes
+#	     were looked up first.
+#
+# SECTION: Providers
+#
+
+if [ $# != 1 ]; then
+	echo expected one argument: '<'dtrace-path'>'
+	exit 2
+fi
+
+dtrace=$1
+err=$tmpdir/lazy-populate.err.$$
+
+#
+# BEGIN (with an empty provider name) can only be offered by the dtrace
+# provider, so neither fbt nor sdt should be populated.
+#
+DTRACE_DEBUG=t $dtrace $dt_flags -qn 'BEGIN { exit(0); }' 2> $err
+status=$?
+
+if [ $status -ne 0 ]; then
+	echo $tst: dtrace failed
+	grep -v 'DEBUG' $err
+	exit $status
+fi
+
+if grep -E 'loaded [0-9-]+ probes for (fbt|sdt)$' $err; then
+	echo "providers populated for BEGIN"
+	status=1
+fi
+
+#
+# Looking up the last probe by id must report the same probe as the full
+# listing does for that id.
+#
+exp=`$dtrace $dt_flags -l | tail -1 | awk '{ $1 = $1; print }'`
+id=`echo "$exp" | awk '{ print $1 }'`
+if [ -z "$id" ]; then
+	echo "no probes listed"
+	exit 1
+fi
+
+act=`$dtrace $dt_flags -l -i $id | tail -1 | awk '{ $1 = $1; print }'`
+if [ "$act" != "$exp" ]; then
+	echo "probe $id listed as '$exp', looked up as '$act'"
+	status=1
+fi
+
+exit $status
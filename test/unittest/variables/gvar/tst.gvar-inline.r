@@ -0,0 +1,2 @@
+2 12 6 123456789abcde 9 0
+